@@ -0,0 +1,500 @@
+/*
+ *  ActorBVH.cpp
+ *  OpenGL SuperBible
+ *
+ *  Bounding volume hierarchy over GLFrame actors. See ActorBVH.h
+ */
+
+#include "ActorBVH.h"
+
+
+///////////////////////////////////////////////////////////
+// Constructor, set everything to zero or NULL
+CActorBVH::CActorBVH(void)
+    {
+    pActors = NULL;
+    pRadii = NULL;
+    nNumActors = 0;
+
+    pIndexes = NULL;
+    pCenters = NULL;
+    pNodes = NULL;
+    nNumNodes = 0;
+    pStack = NULL;
+    }
+
+///////////////////////////////////////////////////////////
+// Free any dynamically allocated memory
+CActorBVH::~CActorBVH(void)
+    {
+    delete [] pIndexes;
+    delete [] pCenters;
+    delete [] pNodes;
+    delete [] pStack;
+    }
+
+
+///////////////////////////////////////////////////////////
+// Where an actor is, and the box around its bounding sphere
+void CActorBVH::GetActorCenter(GLuint iActor, M3DVector3f vCenter)
+    {
+    pActors[iActor].GetOrigin(vCenter);
+    }
+
+void CActorBVH::GetActorBounds(GLuint iActor, M3DVector3f vMin, M3DVector3f vMax)
+    {
+    M3DVector3f vCenter;
+    pActors[iActor].GetOrigin(vCenter);
+
+    for(int j = 0; j < 3; j++)
+        {
+        vMin[j] = vCenter[j] - pRadii[iActor];
+        vMax[j] = vCenter[j] + pRadii[iActor];
+        }
+    }
+
+///////////////////////////////////////////////////////////
+// Make a node's box fit all of the actors it covers
+void CActorBVH::UpdateLeaf(BVHNODE *pNode)
+    {
+    M3DVector3f vMin, vMax;
+
+    for(GLuint i = 0; i < pNode->nCount; i++)
+        {
+        GetActorBounds(pIndexes[pNode->nFirst + i], vMin, vMax);
+        for(int j = 0; j < 3; j++)
+            {
+            if(i == 0 || vMin[j] < pNode->vMin[j])
+                pNode->vMin[j] = vMin[j];
+            if(i == 0 || vMax[j] > pNode->vMax[j])
+                pNode->vMax[j] = vMax[j];
+            }
+        }
+    }
+
+
+///////////////////////////////////////////////////////////
+// Surface area of a box, the chance of a random ray hitting it is
+// proportional to this
+static GLfloat BoxArea(const M3DVector3f vMin, const M3DVector3f vMax)
+    {
+    GLfloat x = vMax[0] - vMin[0];
+    GLfloat y = vMax[1] - vMin[1];
+    GLfloat z = vMax[2] - vMin[2];
+
+    return 2.0f * (x*y + y*z + z*x);
+    }
+
+static void GrowBox(M3DVector3f vMin, M3DVector3f vMax, const M3DVector3f vOtherMin, const M3DVector3f vOtherMax)
+    {
+    for(int j = 0; j < 3; j++)
+        {
+        if(vOtherMin[j] < vMin[j])
+            vMin[j] = vOtherMin[j];
+        if(vOtherMax[j] > vMax[j])
+            vMax[j] = vOtherMax[j];
+        }
+    }
+
+
+///////////////////////////////////////////////////////////
+// Build the tree over nCount actors. Nodes are split one at a time off
+// of a stack (instead of recursively), so even a badly lopsided tree
+// can't run out of call stack.
+void CActorBVH::Build(GLFrame *pActorFrames, const GLfloat *pActorRadii, GLuint nCount)
+    {
+    // Just in case this gets called more than once...
+    delete [] pIndexes;
+    delete [] pCenters;
+    delete [] pNodes;
+    delete [] pStack;
+    pIndexes = NULL;
+    pCenters = NULL;
+    pNodes = NULL;
+    pStack = NULL;
+    nNumNodes = 0;
+
+    pActors = pActorFrames;
+    pRadii = pActorRadii;
+    nNumActors = nCount;
+
+    if(nCount == 0)
+        return;
+
+    // A binary tree with n leaves never has more than 2n - 1 nodes
+    pIndexes = new GLuint[nCount];
+    pCenters = new M3DVector3f[nCount];
+    pNodes = new BVHNODE[nCount * 2];
+    pStack = new GLuint[nCount * 2 + 1];
+
+    for(GLuint i = 0; i < nCount; i++)
+        {
+        pIndexes[i] = i;
+        GetActorCenter(i, pCenters[i]);
+        }
+
+    // The root covers everybody
+    pNodes[0].nLeft = 0;
+    pNodes[0].nFirst = 0;
+    pNodes[0].nCount = nCount;
+    UpdateLeaf(&pNodes[0]);
+    nNumNodes = 1;
+
+    // The traversal stack doubles as the list of nodes still to split
+    GLuint nWork = 0;
+    pStack[nWork++] = 0;
+
+    while(nWork > 0)
+        {
+        GLuint iNode = pStack[--nWork];
+        Split(iNode, pStack, nWork);
+        }
+
+    // Centers are only needed for building
+    delete [] pCenters;
+    pCenters = NULL;
+    }
+
+
+///////////////////////////////////////////////////////////
+// Split one node in two (if it's worth it), and push the two new nodes
+// on the work stack so they get split too.
+void CActorBVH::Split(GLuint iNode, GLuint *pWork, GLuint &nWork)
+    {
+    BVHNODE *pNode = &pNodes[iNode];
+    GLuint i;
+    int j;
+
+    if(pNode->nCount <= BVH_MAX_LEAF_SIZE)
+        return;
+
+    // Split along the axis where the centers are most spread out
+    M3DVector3f vCenterMin, vCenterMax;
+    m3dCopyVector3(vCenterMin, pCenters[pIndexes[pNode->nFirst]]);
+    m3dCopyVector3(vCenterMax, vCenterMin);
+    for(i = 1; i < pNode->nCount; i++)
+        GrowBox(vCenterMin, vCenterMax, pCenters[pIndexes[pNode->nFirst + i]], pCenters[pIndexes[pNode->nFirst + i]]);
+
+    int iAxis = 0;
+    for(j = 1; j < 3; j++)
+        if(vCenterMax[j] - vCenterMin[j] > vCenterMax[iAxis] - vCenterMin[iAxis])
+            iAxis = j;
+
+    GLfloat fExtent = vCenterMax[iAxis] - vCenterMin[iAxis];
+    GLuint nLeftCount = 0;
+
+    if(fExtent > 0.0f)
+        {
+        // Drop each actor into a bin by its center
+        GLuint nBinCount[BVH_NUM_BINS];
+        M3DVector3f vBinMin[BVH_NUM_BINS], vBinMax[BVH_NUM_BINS];
+        GLfloat fBinScale = (GLfloat(BVH_NUM_BINS) * 0.9999f) / fExtent;
+
+        for(j = 0; j < BVH_NUM_BINS; j++)
+            nBinCount[j] = 0;
+
+        for(i = 0; i < pNode->nCount; i++)
+            {
+            GLuint iActor = pIndexes[pNode->nFirst + i];
+            int iBin = int((pCenters[iActor][iAxis] - vCenterMin[iAxis]) * fBinScale);
+
+            M3DVector3f vMin, vMax;
+            GetActorBounds(iActor, vMin, vMax);
+            if(nBinCount[iBin] == 0)
+                {
+                m3dCopyVector3(vBinMin[iBin], vMin);
+                m3dCopyVector3(vBinMax[iBin], vMax);
+                }
+            else
+                GrowBox(vBinMin[iBin], vBinMax[iBin], vMin, vMax);
+
+            nBinCount[iBin]++;
+            }
+
+        // Sweep from the right to get the area and count to the right of
+        // every split, then from the left to find the cheapest split.
+        // Cost is area times count on each side (the constant traversal
+        // cost and the divide by the parent's area don't change the winner).
+        GLfloat fRightArea[BVH_NUM_BINS];
+        GLuint nRightCount[BVH_NUM_BINS];
+        M3DVector3f vMin, vMax;
+        GLuint nCount = 0;
+
+        for(j = BVH_NUM_BINS - 1; j > 0; j--)
+            {
+            if(nBinCount[j] > 0)
+                {
+                if(nCount == 0)
+                    {
+                    m3dCopyVector3(vMin, vBinMin[j]);
+                    m3dCopyVector3(vMax, vBinMax[j]);
+                    }
+                else
+                    GrowBox(vMin, vMax, vBinMin[j], vBinMax[j]);
+                nCount += nBinCount[j];
+                }
+            fRightArea[j] = (nCount > 0) ? BoxArea(vMin, vMax) : 0.0f;
+            nRightCount[j] = nCount;
+            }
+
+        GLfloat fBestCost = 0.0f;
+        int iBestSplit = 0;         // Bins below this go left
+        nCount = 0;
+
+        for(j = 0; j < BVH_NUM_BINS - 1; j++)
+            {
+            if(nBinCount[j] > 0)
+                {
+                if(nCount == 0)
+                    {
+                    m3dCopyVector3(vMin, vBinMin[j]);
+                    m3dCopyVector3(vMax, vBinMax[j]);
+                    }
+                else
+                    GrowBox(vMin, vMax, vBinMin[j], vBinMax[j]);
+                nCount += nBinCount[j];
+                }
+
+            if(nCount == 0 || nRightCount[j + 1] == 0)
+                continue;
+
+            GLfloat fCost = BoxArea(vMin, vMax) * nCount + fRightArea[j + 1] * nRightCount[j + 1];
+            if(iBestSplit == 0 || fCost < fBestCost)
+                {
+                fBestCost = fCost;
+                iBestSplit = j + 1;
+                }
+            }
+
+        // Partition the actors, left side first
+        if(iBestSplit > 0)
+            {
+            GLuint *pFirst = &pIndexes[pNode->nFirst];
+            GLuint nLast = pNode->nCount;
+            i = 0;
+            while(i < nLast)
+                {
+                int iBin = int((pCenters[pFirst[i]][iAxis] - vCenterMin[iAxis]) * fBinScale);
+                if(iBin < iBestSplit)
+                    i++;
+                else
+                    {
+                    nLast--;
+                    GLuint iTemp = pFirst[i];
+                    pFirst[i] = pFirst[nLast];
+                    pFirst[nLast] = iTemp;
+                    }
+                }
+            nLeftCount = i;
+            }
+        }
+
+    // All the centers are (nearly) on top of each other, any split is as
+    // good as any other.
+    if(nLeftCount == 0 || nLeftCount == pNode->nCount)
+        nLeftCount = pNode->nCount / 2;
+
+    // Make the two children
+    GLuint iLeft = nNumNodes;
+    nNumNodes += 2;
+
+    pNodes[iLeft].nLeft = 0;
+    pNodes[iLeft].nFirst = pNode->nFirst;
+    pNodes[iLeft].nCount = nLeftCount;
+    UpdateLeaf(&pNodes[iLeft]);
+
+    pNodes[iLeft + 1].nLeft = 0;
+    pNodes[iLeft + 1].nFirst = pNode->nFirst + nLeftCount;
+    pNodes[iLeft + 1].nCount = pNode->nCount - nLeftCount;
+    UpdateLeaf(&pNodes[iLeft + 1]);
+
+    pNode->nLeft = iLeft;
+
+    pWork[nWork++] = iLeft;
+    pWork[nWork++] = iLeft + 1;
+    }
+
+
+///////////////////////////////////////////////////////////
+// Refit the boxes after the actors have moved. Children are always
+// stored after their parent, so walking the nodes backwards visits
+// every child before its parent.
+void CActorBVH::Refit(void)
+    {
+    for(GLuint i = nNumNodes; i > 0; i--)
+        {
+        BVHNODE *pNode = &pNodes[i - 1];
+
+        if(pNode->nLeft == 0)
+            UpdateLeaf(pNode);
+        else
+            {
+            BVHNODE *pLeft = &pNodes[pNode->nLeft];
+            BVHNODE *pRight = &pNodes[pNode->nLeft + 1];
+            m3dCopyVector3(pNode->vMin, pLeft->vMin);
+            m3dCopyVector3(pNode->vMax, pLeft->vMax);
+            GrowBox(pNode->vMin, pNode->vMax, pRight->vMin, pRight->vMax);
+            }
+        }
+    }
+
+
+///////////////////////////////////////////////////////////
+// Frustum query. A box that is entirely inside the frustum accepts all
+// of its actors without any more tests, a box that is entirely outside
+// throws them all away. Only boxes that straddle a plane are opened up.
+GLuint CActorBVH::QueryFrustum(M3DFrustum &frustum, GLuint *pResults, GLuint nMaxResults)
+    {
+    GLuint nFound = 0;
+    GLuint nStack = 0;
+
+    if(nNumNodes == 0)
+        return 0;
+
+    pStack[nStack++] = 0;
+    while(nStack > 0 && nFound < nMaxResults)
+        {
+        BVHNODE *pNode = &pNodes[pStack[--nStack]];
+        int nClass = frustum.ClassifyBox(pNode->vMin, pNode->vMax);
+
+        if(nClass == M3D_OUTSIDE)
+            continue;
+
+        if(nClass == M3D_INSIDE)
+            {
+            for(GLuint i = 0; i < pNode->nCount && nFound < nMaxResults; i++)
+                pResults[nFound++] = pIndexes[pNode->nFirst + i];
+            }
+        else if(pNode->nLeft == 0)
+            {
+            // Straddling leaf, test the actual spheres
+            for(GLuint i = 0; i < pNode->nCount && nFound < nMaxResults; i++)
+                {
+                GLuint iActor = pIndexes[pNode->nFirst + i];
+                M3DVector3f vCenter;
+                GetActorCenter(iActor, vCenter);
+                if(frustum.TestSphere(vCenter, pRadii[iActor]))
+                    pResults[nFound++] = iActor;
+                }
+            }
+        else
+            {
+            pStack[nStack++] = pNode->nLeft;
+            pStack[nStack++] = pNode->nLeft + 1;
+            }
+        }
+
+    return nFound;
+    }
+
+
+///////////////////////////////////////////////////////////
+// Slab test, where does the ray enter the box? Returns a negative number
+// if it misses, or if the box is farther away than fMaxDistance.
+static GLfloat RayBoxEntry(const M3DVector3f vOrigin, const M3DVector3f vInvDirection,
+                           const M3DVector3f vMin, const M3DVector3f vMax, GLfloat fMaxDistance)
+    {
+    GLfloat fNear = 0.0f;
+    GLfloat fFar = fMaxDistance;
+
+    for(int j = 0; j < 3; j++)
+        {
+        GLfloat t0 = (vMin[j] - vOrigin[j]) * vInvDirection[j];
+        GLfloat t1 = (vMax[j] - vOrigin[j]) * vInvDirection[j];
+        if(t0 > t1)
+            {
+            GLfloat fTemp = t0;
+            t0 = t1;
+            t1 = fTemp;
+            }
+
+        if(t0 > fNear)
+            fNear = t0;
+        if(t1 < fFar)
+            fFar = t1;
+        }
+
+    return (fNear <= fFar) ? fNear : -1.0f;
+    }
+
+
+///////////////////////////////////////////////////////////
+// Picking. Walk the tree nearest box first, and skip any box that
+// starts farther away than the closest hit so far.
+GLuint CActorBVH::PickRay(const M3DVector3f vOrigin, const M3DVector3f vDirection, GLfloat *pDistance)
+    {
+    GLuint iBest = BVH_NO_HIT;
+    GLfloat fBest = 1.0e30f;
+    GLuint nStack = 0;
+
+    if(nNumNodes == 0)
+        return BVH_NO_HIT;
+
+    // Division by zero gives infinity, which the slab test handles fine
+    M3DVector3f vInvDirection;
+    for(int j = 0; j < 3; j++)
+        vInvDirection[j] = 1.0f / vDirection[j];
+
+    if(RayBoxEntry(vOrigin, vInvDirection, pNodes[0].vMin, pNodes[0].vMax, fBest) >= 0.0f)
+        pStack[nStack++] = 0;
+
+    while(nStack > 0)
+        {
+        BVHNODE *pNode = &pNodes[pStack[--nStack]];
+
+        // Boxes are checked again here, fBest may have shrunk since this
+        // one was pushed.
+        if(RayBoxEntry(vOrigin, vInvDirection, pNode->vMin, pNode->vMax, fBest) < 0.0f)
+            continue;
+
+        if(pNode->nLeft == 0)
+            {
+            for(GLuint i = 0; i < pNode->nCount; i++)
+                {
+                GLuint iActor = pIndexes[pNode->nFirst + i];
+                M3DVector3f vCenter;
+                GetActorCenter(iActor, vCenter);
+
+                // m3dRaySphereTest() returns 0 for a tangent ray, but float
+                // round off also gives 0 for some clean misses, so only
+                // count real hits
+                GLfloat fDistance = m3dRaySphereTest(vOrigin, vDirection, vCenter, pRadii[iActor]);
+                if(fDistance > 0.0f && fDistance < fBest)
+                    {
+                    fBest = fDistance;
+                    iBest = iActor;
+                    }
+                }
+            }
+        else
+            {
+            // Push the far child first, so the near one is looked at first
+            GLuint iLeft = pNode->nLeft;
+            GLfloat fLeft = RayBoxEntry(vOrigin, vInvDirection, pNodes[iLeft].vMin, pNodes[iLeft].vMax, fBest);
+            GLfloat fRight = RayBoxEntry(vOrigin, vInvDirection, pNodes[iLeft + 1].vMin, pNodes[iLeft + 1].vMax, fBest);
+
+            if(fLeft >= 0.0f && fRight >= 0.0f)
+                {
+                if(fLeft < fRight)
+                    {
+                    pStack[nStack++] = iLeft + 1;
+                    pStack[nStack++] = iLeft;
+                    }
+                else
+                    {
+                    pStack[nStack++] = iLeft;
+                    pStack[nStack++] = iLeft + 1;
+                    }
+                }
+            else if(fLeft >= 0.0f)
+                pStack[nStack++] = iLeft;
+            else if(fRight >= 0.0f)
+                pStack[nStack++] = iLeft + 1;
+            }
+        }
+
+    if(pDistance != NULL && iBest != BVH_NO_HIT)
+        *pDistance = fBest;
+
+    return iBest;
+    }
@@ -0,0 +1,96 @@
+/*
+ *  ActorBVH.h
+ *  OpenGL SuperBible
+ *
+ *  A bounding volume hierarchy over a set of actors (GLFrame's), each with a
+ *  bounding sphere. Checking every actor against the frustum, or against a
+ *  picking ray, is fine for thirty spheres but not for thirty thousand. The
+ *  hierarchy lets whole groups of actors be accepted or thrown away with one
+ *  box test, so queries cost roughly log(n) instead of n.
+ *
+ *  Build() sorts the actors into a tree of axis aligned boxes, splitting each
+ *  box where the surface area heuristic (SAH) says a ray or frustum is least
+ *  likely to have to look at both halves. The SAH is evaluated over a fixed
+ *  number of bins rather than every possible split, which keeps the build
+ *  linear at each level.
+ *
+ *  When actors move, call Refit(). It keeps the tree as it is and just
+ *  recomputes the boxes, bottom up, which is far cheaper than a rebuild. The
+ *  tree gets less efficient as actors wander away from where they were at
+ *  build time, so Build() again every so often if they move a lot.
+ */
+
+#ifndef __ACTOR_BVH__
+#define __ACTOR_BVH__
+
+#include "gltools.h"
+#include "math3d.h"
+#include "glframe.h"
+#include "math3dfrustum.h"
+
+// Returned by PickRay() when nothing is hit
+#define BVH_NO_HIT          0xFFFFFFFF
+
+// Most actors in one leaf of the tree
+#define BVH_MAX_LEAF_SIZE   4
+
+// Number of bins used to evaluate the SAH at each split
+#define BVH_NUM_BINS        12
+
+class CActorBVH
+    {
+    public:
+        CActorBVH(void);
+        ~CActorBVH(void);
+
+        // Build the tree. The actors and radii are not copied, they must stay
+        // put for as long as the tree is used (Refit() reads them again).
+        void Build(GLFrame *pActors, const GLfloat *pRadii, GLuint nCount);
+
+        // Actors have moved, update the boxes to match
+        void Refit(void);
+
+        // Find the actors that are at least partly inside the frustum. Their
+        // indexes go in pResults (up to nMaxResults of them). Returns how
+        // many were found.
+        GLuint QueryFrustum(M3DFrustum &frustum, GLuint *pResults, GLuint nMaxResults);
+
+        // Find the closest actor hit by a ray. vDirection must be unit length.
+        // Returns the actor index, or BVH_NO_HIT. If pDistance is not NULL it
+        // receives the distance along the ray to the hit.
+        GLuint PickRay(const M3DVector3f vOrigin, const M3DVector3f vDirection, GLfloat *pDistance = NULL);
+
+        // Useful for statistics
+        inline GLuint GetActorCount(void) { return nNumActors; }
+        inline GLuint GetNodeCount(void) { return nNumNodes; }
+
+    protected:
+        // One box in the tree. Every node covers the actors in
+        // pIndexes[nFirst] to pIndexes[nFirst + nCount - 1], so a node that is
+        // entirely visible can be accepted without visiting its children.
+        // Children are always stored together, nLeft and nLeft + 1.
+        typedef struct
+            {
+            M3DVector3f vMin, vMax;     // Bounding box
+            GLuint nLeft;               // First child, 0 for a leaf
+            GLuint nFirst;              // First actor (in pIndexes)
+            GLuint nCount;              // Number of actors
+            } BVHNODE;
+
+        void GetActorBounds(GLuint iActor, M3DVector3f vMin, M3DVector3f vMax);
+        void GetActorCenter(GLuint iActor, M3DVector3f vCenter);
+        void UpdateLeaf(BVHNODE *pNode);
+        void Split(GLuint iNode, GLuint *pStack, GLuint &nStack);
+
+        GLFrame *pActors;           // The actors, not ours
+        const GLfloat *pRadii;      // Their radii, also not ours
+        GLuint nNumActors;
+
+        GLuint *pIndexes;           // Actor indexes, in tree order
+        M3DVector3f *pCenters;      // Actor centers, only valid during Build()
+        BVHNODE *pNodes;            // pNodes[0] is the root
+        GLuint nNumNodes;
+        GLuint *pStack;             // Traversal workspace
+    };
+
+#endif
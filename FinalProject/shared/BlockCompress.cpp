@@ -0,0 +1,514 @@
+/*
+ *  BlockCompress.cpp
+ *  OpenGL SuperBible
+ *
+ *  BC1 and BC3 compression, see BlockCompress.h
+ */
+
+#include "BlockCompress.h"
+#include <string.h>
+#include <math.h>
+
+#define BC_POWER_STEPS      4       // Power iterations to find a block's axis
+#define BC_JOB_ROWS         4       // Rows of blocks per job
+
+///////////////////////////////////////////////////////////////////////////////
+// A block, as 16 RGBA texels, left to right then top to bottom
+typedef GLubyte BCBLOCK[16][4];
+
+typedef struct
+    {
+    const GLubyte   *pPixels;
+    GLint           nWidth, nHeight;
+    GLint           nPixelSize;
+    bool            bBGR;           // Red and blue swapped
+    GLenum          eCompressed;
+    GLint           nBlockBytes;
+    GLint           nBlocksAcross;
+    GLubyte         *pBlocks;
+    } BCPASS;
+
+static GLint bcBlockBytes(GLenum eCompressed)
+    {
+    switch(eCompressed)
+        {
+        case GL_COMPRESSED_RGB_S3TC_DXT1_EXT:
+            return 8;
+        case GL_COMPRESSED_RGBA_S3TC_DXT5_EXT:
+            return 16;
+        }
+    return 0;
+    }
+
+GLuint bcGetCompressedSize(GLint nWidth, GLint nHeight, GLenum eCompressed)
+    {
+    GLuint nAcross = (nWidth + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+    GLuint nDown = (nHeight + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+    return nAcross * nDown * bcBlockBytes(eCompressed);
+    }
+
+GLenum bcChooseFormat(const GLubyte *pPixels, GLint nWidth, GLint nHeight, GLenum eFormat)
+    {
+    if(eFormat == GL_RGBA || eFormat == GL_BGRA_EXT)
+        {
+        const GLubyte *pEnd = pPixels + nWidth * nHeight * 4;
+        for(const GLubyte *pTexel = pPixels; pTexel < pEnd; pTexel += 4)
+            if(pTexel[3] != 255)
+                return GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+        }
+
+    return GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Copy out the block at (bx, by), repeating the edge texels past the edge
+static void bcGetBlock(const BCPASS *pPass, GLint bx, GLint by, BCBLOCK block)
+    {
+    for(GLint y = 0; y < 4; y++)
+        {
+        GLint iy = by * 4 + y;
+        if(iy >= pPass->nHeight)
+            iy = pPass->nHeight - 1;
+
+        const GLubyte *pRow = pPass->pPixels + iy * pPass->nWidth * pPass->nPixelSize;
+        for(GLint x = 0; x < 4; x++)
+            {
+            GLint ix = bx * 4 + x;
+            if(ix >= pPass->nWidth)
+                ix = pPass->nWidth - 1;
+
+            const GLubyte *pTexel = pRow + ix * pPass->nPixelSize;
+            GLubyte *pOut = block[y * 4 + x];
+            switch(pPass->nPixelSize)
+                {
+                case 1:
+                    pOut[0] = pOut[1] = pOut[2] = pTexel[0];
+                    pOut[3] = 255;
+                    break;
+                case 3:
+                case 4:
+                    pOut[0] = pTexel[pPass->bBGR ? 2 : 0];
+                    pOut[1] = pTexel[1];
+                    pOut[2] = pTexel[pPass->bBGR ? 0 : 2];
+                    pOut[3] = (pPass->nPixelSize == 4) ? pTexel[3] : 255;
+                    break;
+                }
+            }
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Colors are stored as 5:6:5, red in the top bits
+static GLushort bcTo565(const GLfloat vColor[3])
+    {
+    static const GLfloat fMax[3] = { 31.0f, 63.0f, 31.0f };
+    GLint n[3];
+
+    for(int c = 0; c < 3; c++)
+        {
+        n[c] = GLint(vColor[c] * fMax[c] / 255.0f + 0.5f);
+        n[c] = (n[c] < 0) ? 0 : ((n[c] > GLint(fMax[c])) ? GLint(fMax[c]) : n[c]);
+        }
+    return GLushort((n[0] << 11) | (n[1] << 5) | n[2]);
+    }
+
+static void bcFrom565(GLushort n565, GLint nColor[3])
+    {
+    GLint r = n565 >> 11, g = (n565 >> 5) & 63, b = n565 & 31;
+    nColor[0] = (r << 3) | (r >> 2);
+    nColor[1] = (g << 2) | (g >> 4);
+    nColor[2] = (b << 3) | (b >> 2);
+    }
+
+// The four colors a block's indexes choose from (the two ends, then the
+// points a third and two thirds of the way along)
+static void bcMakePalette(GLushort n0, GLushort n1, GLint nPalette[4][3])
+    {
+    bcFrom565(n0, nPalette[0]);
+    bcFrom565(n1, nPalette[1]);
+    for(int c = 0; c < 3; c++)
+        {
+        nPalette[2][c] = (2 * nPalette[0][c] + nPalette[1][c]) / 3;
+        nPalette[3][c] = (nPalette[0][c] + 2 * nPalette[1][c]) / 3;
+        }
+    }
+
+// Nearest palette color for each texel. Returns the indexes, two bits a
+// texel with the first in the lowest, and the total squared error.
+static GLuint bcFitIndexes(const BCBLOCK block, GLushort n0, GLushort n1, GLuint *pError)
+    {
+    GLint nPalette[4][3];
+    GLuint nIndexes = 0, nError = 0;
+
+    bcMakePalette(n0, n1, nPalette);
+    for(int i = 0; i < 16; i++)
+        {
+        GLuint nBest = 0xFFFFFFFF;
+        GLuint iBest = 0;
+
+        for(GLuint j = 0; j < 4; j++)
+            {
+            GLint dr = nPalette[j][0] - block[i][0];
+            GLint dg = nPalette[j][1] - block[i][1];
+            GLint db = nPalette[j][2] - block[i][2];
+            GLuint nDist = GLuint(dr * dr + dg * dg + db * db);
+            if(nDist < nBest)
+                {
+                nBest = nDist;
+                iBest = j;
+                }
+            }
+
+        nIndexes |= iBest << (i * 2);
+        nError += nBest;
+        }
+
+    *pError = nError;
+    return nIndexes;
+    }
+
+// The first color has to be the larger, or the block is decoded as three
+// colors and black. Two the same can only be that, so every texel gets the
+// first color.
+static GLuint bcOrderAndFit(const BCBLOCK block, GLushort *pn0, GLushort *pn1, GLuint *pError)
+    {
+    if(*pn0 < *pn1)
+        {
+        GLushort nTemp = *pn0;
+        *pn0 = *pn1;
+        *pn1 = nTemp;
+        }
+
+    if(*pn0 == *pn1)
+        {
+        GLint nColor[3];
+        bcFrom565(*pn0, nColor);
+
+        GLuint nError = 0;
+        for(int i = 0; i < 16; i++)
+            for(int c = 0; c < 3; c++)
+                nError += GLuint((nColor[c] - block[i][c]) * (nColor[c] - block[i][c]));
+
+        *pError = nError;
+        return 0;
+        }
+
+    return bcFitIndexes(block, *pn0, *pn1, pError);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Least squares end colors for a given set of indexes. Each texel is taken
+// to be w * end0 + (1 - w) * end1, w from its index. Returns false if the
+// indexes don't pin down two colors (all the same weight).
+static bool bcRefineEnds(const BCBLOCK block, GLuint nIndexes, GLfloat vEnd0[3], GLfloat vEnd1[3])
+    {
+    static const GLfloat fWeights[4] = { 1.0f, 0.0f, 2.0f / 3.0f, 1.0f / 3.0f };
+    GLfloat fAA = 0.0f, fAB = 0.0f, fBB = 0.0f;
+    GLfloat vAX[3] = { 0.0f, 0.0f, 0.0f }, vBX[3] = { 0.0f, 0.0f, 0.0f };
+
+    for(int i = 0; i < 16; i++, nIndexes >>= 2)
+        {
+        GLfloat a = fWeights[nIndexes & 3], b = 1.0f - a;
+        fAA += a * a;
+        fAB += a * b;
+        fBB += b * b;
+        for(int c = 0; c < 3; c++)
+            {
+            vAX[c] += a * block[i][c];
+            vBX[c] += b * block[i][c];
+            }
+        }
+
+    GLfloat fDet = fAA * fBB - fAB * fAB;
+    if(fDet < 1e-4f)
+        return false;
+
+    fDet = 1.0f / fDet;
+    for(int c = 0; c < 3; c++)
+        {
+        vEnd0[c] = (vAX[c] * fBB - vBX[c] * fAB) * fDet;
+        vEnd1[c] = (vBX[c] * fAA - vAX[c] * fAB) * fDet;
+        }
+    return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Eight bytes: the two colors, then the indexes
+static void bcEncodeColor(const BCBLOCK block, GLubyte *pOut)
+    {
+    GLfloat vMean[3] = { 0.0f, 0.0f, 0.0f };
+    GLint nMin[3] = { 255, 255, 255 }, nMax[3] = { 0, 0, 0 };
+    int i, c;
+
+    for(i = 0; i < 16; i++)
+        for(c = 0; c < 3; c++)
+            {
+            vMean[c] += block[i][c];
+            nMin[c] = (block[i][c] < nMin[c]) ? block[i][c] : nMin[c];
+            nMax[c] = (block[i][c] > nMax[c]) ? block[i][c] : nMax[c];
+            }
+    for(c = 0; c < 3; c++)
+        vMean[c] /= 16.0f;
+
+    GLushort n0, n1;
+    GLuint nIndexes = 0, nError;
+
+    if(nMin[0] == nMax[0] && nMin[1] == nMax[1] && nMin[2] == nMax[2])
+        {
+        // One color, nothing to fit
+        n0 = n1 = bcTo565(vMean);
+        }
+    else
+        {
+        // Covariance, then its principal axis by repeated multiplication,
+        // starting from the diagonal of the colors' bounding box
+        GLfloat vCentered[16][3];
+        GLfloat fCov[6] = { 0.0f, 0.0f, 0.0f, 0.0f, 0.0f, 0.0f };
+        for(i = 0; i < 16; i++)
+            {
+            GLfloat r = vCentered[i][0] = block[i][0] - vMean[0];
+            GLfloat g = vCentered[i][1] = block[i][1] - vMean[1];
+            GLfloat b = vCentered[i][2] = block[i][2] - vMean[2];
+            fCov[0] += r * r;
+            fCov[1] += r * g;
+            fCov[2] += r * b;
+            fCov[3] += g * g;
+            fCov[4] += g * b;
+            fCov[5] += b * b;
+            }
+
+        GLfloat vAxis[3] = { GLfloat(nMax[0] - nMin[0]), GLfloat(nMax[1] - nMin[1]), GLfloat(nMax[2] - nMin[2]) };
+        for(int k = 0; k < BC_POWER_STEPS; k++)
+            {
+            GLfloat x = vAxis[0] * fCov[0] + vAxis[1] * fCov[1] + vAxis[2] * fCov[2];
+            GLfloat y = vAxis[0] * fCov[1] + vAxis[1] * fCov[3] + vAxis[2] * fCov[4];
+            GLfloat z = vAxis[0] * fCov[2] + vAxis[1] * fCov[4] + vAxis[2] * fCov[5];
+            GLfloat fLargest = (fabsf(x) > fabsf(y)) ? fabsf(x) : fabsf(y);
+            fLargest = (fabsf(z) > fLargest) ? fabsf(z) : fLargest;
+            if(fLargest < 1e-6f)
+                break;          // Keep the last one
+
+            fLargest = 1.0f / fLargest;
+            vAxis[0] = x * fLargest;
+            vAxis[1] = y * fLargest;
+            vAxis[2] = z * fLargest;
+            }
+        GLfloat fLength = sqrtf(vAxis[0] * vAxis[0] + vAxis[1] * vAxis[1] + vAxis[2] * vAxis[2]);
+        for(c = 0; c < 3; c++)
+            vAxis[c] /= fLength;
+
+        // The ends are the furthest texels along it, pulled in a little as
+        // the extremes are usually lone texels
+        GLfloat fLow = 1e30f, fHigh = -1e30f;
+        for(i = 0; i < 16; i++)
+            {
+            GLfloat t = vCentered[i][0] * vAxis[0] + vCentered[i][1] * vAxis[1] + vCentered[i][2] * vAxis[2];
+            fLow = (t < fLow) ? t : fLow;
+            fHigh = (t > fHigh) ? t : fHigh;
+            }
+        GLfloat fInset = (fHigh - fLow) / 16.0f;
+        fLow += fInset;
+        fHigh -= fInset;
+
+        GLfloat vEnd0[3], vEnd1[3];
+        for(c = 0; c < 3; c++)
+            {
+            vEnd0[c] = vMean[c] + vAxis[c] * fHigh;
+            vEnd1[c] = vMean[c] + vAxis[c] * fLow;
+            }
+        n0 = bcTo565(vEnd0);
+        n1 = bcTo565(vEnd1);
+        nIndexes = bcOrderAndFit(block, &n0, &n1, &nError);
+
+        // Once more, with the ends fitted to those indexes
+        if(nError != 0 && n0 != n1 && bcRefineEnds(block, nIndexes, vEnd0, vEnd1))
+            {
+            GLushort m0 = bcTo565(vEnd0), m1 = bcTo565(vEnd1);
+            GLuint nNewError;
+            GLuint nNewIndexes = bcOrderAndFit(block, &m0, &m1, &nNewError);
+            if(nNewError < nError)
+                {
+                n0 = m0;
+                n1 = m1;
+                nIndexes = nNewIndexes;
+                }
+            }
+        }
+
+    pOut[0] = GLubyte(n0 & 0xFF);
+    pOut[1] = GLubyte(n0 >> 8);
+    pOut[2] = GLubyte(n1 & 0xFF);
+    pOut[3] = GLubyte(n1 >> 8);
+    pOut[4] = GLubyte(nIndexes & 0xFF);
+    pOut[5] = GLubyte((nIndexes >> 8) & 0xFF);
+    pOut[6] = GLubyte((nIndexes >> 16) & 0xFF);
+    pOut[7] = GLubyte(nIndexes >> 24);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Eight bytes: the largest and smallest alpha, then 3 bit indexes into the
+// eight steps from one to the other. Index 0 is the first, 1 the second,
+// 2 to 7 the six in between starting from the first end.
+static void bcEncodeAlpha(const BCBLOCK block, GLubyte *pOut)
+    {
+    GLint nMin = 255, nMax = 0;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        {
+        nMin = (block[i][3] < nMin) ? block[i][3] : nMin;
+        nMax = (block[i][3] > nMax) ? block[i][3] : nMax;
+        }
+
+    pOut[0] = GLubyte(nMax);
+    pOut[1] = GLubyte(nMin);
+
+    unsigned long long nIndexes = 0;
+    GLint nRange = nMax - nMin;
+    if(nRange > 0)
+        for(i = 0; i < 16; i++)
+            {
+            // Steps up from the smallest, rounded
+            GLint nStep = ((block[i][3] - nMin) * 14 + nRange) / (2 * nRange);
+            unsigned long long iIndex = (nStep == 7) ? 0 : ((nStep == 0) ? 1 : 8 - nStep);
+            nIndexes |= iIndex << (i * 3);
+            }
+
+    for(i = 0; i < 6; i++)
+        pOut[2 + i] = GLubyte((nIndexes >> (i * 8)) & 0xFF);
+    }
+
+static void bcCompressRows(void *pData, GLuint nFirst, GLuint nLast)
+    {
+    BCPASS *pPass = (BCPASS *)pData;
+    BCBLOCK block;
+
+    for(GLuint by = nFirst; by < nLast; by++)
+        {
+        GLubyte *pOut = pPass->pBlocks + by * pPass->nBlocksAcross * pPass->nBlockBytes;
+        for(GLint bx = 0; bx < pPass->nBlocksAcross; bx++, pOut += pPass->nBlockBytes)
+            {
+            bcGetBlock(pPass, bx, GLint(by), block);
+            if(pPass->eCompressed == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+                {
+                bcEncodeAlpha(block, pOut);
+                bcEncodeColor(block, pOut + 8);
+                }
+            else
+                bcEncodeColor(block, pOut);
+            }
+        }
+    }
+
+bool bcCompressImage(const GLubyte *pPixels, GLint nWidth, GLint nHeight, GLenum eFormat, GLenum eCompressed,
+                     GLubyte *pBlocks, CJobScheduler *pJobs)
+    {
+    BCPASS pass;
+
+    switch(eFormat)
+        {
+        case GL_LUMINANCE:
+            pass.nPixelSize = 1;
+            break;
+        case GL_RGB:
+        case GL_BGR_EXT:
+            pass.nPixelSize = 3;
+            break;
+        case GL_RGBA:
+        case GL_BGRA_EXT:
+            pass.nPixelSize = 4;
+            break;
+        default:
+            return false;
+        }
+
+    pass.nBlockBytes = bcBlockBytes(eCompressed);
+    if(pass.nBlockBytes == 0 || pPixels == NULL || nWidth <= 0 || nHeight <= 0)
+        return false;
+
+    pass.pPixels = pPixels;
+    pass.nWidth = nWidth;
+    pass.nHeight = nHeight;
+    pass.bBGR = (eFormat == GL_BGR_EXT || eFormat == GL_BGRA_EXT);
+    pass.eCompressed = eCompressed;
+    pass.nBlocksAcross = (nWidth + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+    pass.pBlocks = pBlocks;
+
+    GLuint nBlocksDown = (nHeight + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+    if(pJobs != NULL)
+        pJobs->ParallelFor(bcCompressRows, &pass, nBlocksDown, BC_JOB_ROWS);
+    else
+        bcCompressRows(&pass, 0, nBlocksDown);
+
+    return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+bool bcDecompressImage(const GLubyte *pBlocks, GLint nWidth, GLint nHeight, GLenum eCompressed, GLubyte *pRGBA)
+    {
+    GLint nBlockBytes = bcBlockBytes(eCompressed);
+    if(nBlockBytes == 0)
+        return false;
+
+    GLint nAcross = (nWidth + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+    GLint nDown = (nHeight + BC_BLOCK_SIZE - 1) / BC_BLOCK_SIZE;
+
+    for(GLint by = 0; by < nDown; by++)
+        for(GLint bx = 0; bx < nAcross; bx++, pBlocks += nBlockBytes)
+            {
+            const GLubyte *pColor = pBlocks;
+            GLint nAlpha[8];
+            unsigned long long nAlphaIndexes = 0;
+
+            if(eCompressed == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT)
+                {
+                nAlpha[0] = pBlocks[0];
+                nAlpha[1] = pBlocks[1];
+                for(int k = 1; k < 7; k++)
+                    nAlpha[k + 1] = (nAlpha[0] > nAlpha[1]) ? ((7 - k) * nAlpha[0] + k * nAlpha[1]) / 7 : 0;
+
+                // Six steps only when the first is the smaller, then 0 and 255
+                if(nAlpha[0] <= nAlpha[1])
+                    {
+                    for(int k = 1; k < 5; k++)
+                        nAlpha[k + 1] = ((5 - k) * nAlpha[0] + k * nAlpha[1]) / 5;
+                    nAlpha[6] = 0;
+                    nAlpha[7] = 255;
+                    }
+
+                for(int k = 0; k < 6; k++)
+                    nAlphaIndexes |= (unsigned long long)pBlocks[2 + k] << (k * 8);
+                pColor = pBlocks + 8;
+                }
+
+            GLushort n0 = GLushort(pColor[0] | (pColor[1] << 8));
+            GLushort n1 = GLushort(pColor[2] | (pColor[3] << 8));
+            GLuint nIndexes = pColor[4] | (pColor[5] << 8) | (pColor[6] << 16) | (GLuint(pColor[7]) << 24);
+            GLint nPalette[4][3];
+
+            bcMakePalette(n0, n1, nPalette);
+            if(n0 <= n1 && eCompressed == GL_COMPRESSED_RGB_S3TC_DXT1_EXT)
+                for(int c = 0; c < 3; c++)
+                    {
+                    nPalette[2][c] = (nPalette[0][c] + nPalette[1][c]) / 2;
+                    nPalette[3][c] = 0;
+                    }
+
+            for(GLint i = 0; i < 16; i++)
+                {
+                GLint x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+                if(x >= nWidth || y >= nHeight)
+                    continue;
+
+                GLubyte *pOut = pRGBA + (y * nWidth + x) * 4;
+                GLint iColor = (nIndexes >> (i * 2)) & 3;
+                pOut[0] = GLubyte(nPalette[iColor][0]);
+                pOut[1] = GLubyte(nPalette[iColor][1]);
+                pOut[2] = GLubyte(nPalette[iColor][2]);
+                pOut[3] = (eCompressed == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT) ?
+                          GLubyte(nAlpha[(nAlphaIndexes >> (i * 3)) & 7]) : 255;
+                }
+            }
+
+    return true;
+    }
@@ -0,0 +1,51 @@
+/*
+ *  BlockCompress.h
+ *  OpenGL SuperBible
+ *
+ *  S3TC block compression. Every 4x4 block of texels is stored as two
+ *  colors and a 2 bit index per texel choosing one of four points on the
+ *  line between them (plus, for BC3, the same again for alpha with eight
+ *  points, 3 bit indexes). The card decodes it as it samples, so a texture
+ *  takes a fraction of the memory, and of the bandwidth, it otherwise would:
+ *
+ *      BC1     GL_COMPRESSED_RGB_S3TC_DXT1_EXT, 8 bytes a block, half a
+ *              byte a texel. For anything opaque.
+ *      BC3     GL_COMPRESSED_RGBA_S3TC_DXT5_EXT, 16 bytes a block, one
+ *              byte a texel. For anything with an alpha channel that is
+ *              actually used.
+ *
+ *  The two colors are found from the line the block's colors lie closest
+ *  to (the principal axis), then improved by a least squares fit to the
+ *  indexes that line gave. Quality is in between the quick and the best
+ *  offline compressors, at ten to twenty megatexels a second on one core.
+ *
+ *  Images whose sides aren't a multiple of four have their last blocks
+ *  filled out with the edge texels, as is done for the small mipmap levels.
+ */
+
+#ifndef __BLOCK_COMPRESS__
+#define __BLOCK_COMPRESS__
+
+#include "gltools.h"
+#include "JobSystem.h"
+
+#define BC_BLOCK_SIZE       4               // Texels across and down
+
+// Bytes for an image in eCompressed (one of the two above), or 0
+GLuint bcGetCompressedSize(GLint nWidth, GLint nHeight, GLenum eCompressed);
+
+// BC1 unless some texel of an image in eFormat is not fully opaque
+GLenum bcChooseFormat(const GLubyte *pPixels, GLint nWidth, GLint nHeight, GLenum eFormat);
+
+// Compress an image, as gltLoadTGA() returns them (tightly packed rows,
+// GL_BGR_EXT, GL_BGRA_EXT, GL_LUMINANCE, GL_RGB or GL_RGBA), into
+// bcGetCompressedSize() bytes at pBlocks. Given a job scheduler, the rows
+// of blocks are shared out between the threads. Returns false for a
+// format it doesn't know.
+bool bcCompressImage(const GLubyte *pPixels, GLint nWidth, GLint nHeight, GLenum eFormat, GLenum eCompressed,
+                     GLubyte *pBlocks, CJobScheduler *pJobs = NULL);
+
+// And back to GL_RGBA, to see how much was lost
+bool bcDecompressImage(const GLubyte *pBlocks, GLint nWidth, GLint nHeight, GLenum eCompressed, GLubyte *pRGBA);
+
+#endif
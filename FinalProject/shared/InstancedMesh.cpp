@@ -0,0 +1,373 @@
+/*
+ *  InstancedMesh.cpp
+ *  OpenGL SuperBible
+ *
+ *  Draws a mesh once per actor, with one draw call where the hardware
+ *  allows it. See InstancedMesh.h.
+ */
+
+#include "InstancedMesh.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// The instance matrices come out of a texture buffer, four RGBA texels each.
+// Lighting is the fixed pipeline's for GL_LIGHT0 (non-local viewer, no
+// attenuation or spotlight), with ambient and diffuse taken from the
+// current color when color material is on.
+static const char *szInstanceVP =
+    "#version 120\n"
+    "#extension GL_EXT_gpu_shader4 : require\n"
+    "uniform samplerBuffer instanceMatrices;\n"
+    "uniform bool bLighting;\n"
+    "uniform bool bColorMaterial;\n"
+    "void main(void)\n"
+    "    {\n"
+    "    int i = gl_InstanceID * 4;\n"
+    "    mat4 mInstance = mat4(texelFetchBuffer(instanceMatrices, i),\n"
+    "                          texelFetchBuffer(instanceMatrices, i + 1),\n"
+    "                          texelFetchBuffer(instanceMatrices, i + 2),\n"
+    "                          texelFetchBuffer(instanceMatrices, i + 3));\n"
+    "    vec4 vEye = gl_ModelViewMatrix * (mInstance * gl_Vertex);\n"
+    "    gl_Position = gl_ProjectionMatrix * vEye;\n"
+    "    gl_TexCoord[0] = gl_TextureMatrix[0] * gl_MultiTexCoord0;\n"
+    "    if(!bLighting)\n"
+    "        {\n"
+    "        gl_FrontColor = gl_Color;\n"
+    "        return;\n"
+    "        }\n"
+    "    vec4 vAmbient = bColorMaterial ? gl_Color : gl_FrontMaterial.ambient;\n"
+    "    vec4 vDiffuse = bColorMaterial ? gl_Color : gl_FrontMaterial.diffuse;\n"
+    "    vec3 vNormal = normalize(gl_NormalMatrix * (mat3(mInstance) * gl_Normal));\n"
+    "    vec3 vLight = normalize(gl_LightSource[0].position.xyz - vEye.xyz * gl_LightSource[0].position.w);\n"
+    "    float fDiffuse = max(dot(vNormal, vLight), 0.0);\n"
+    "    vec4 vColor = gl_FrontMaterial.emission + vAmbient * (gl_LightModel.ambient + gl_LightSource[0].ambient);\n"
+    "    vColor += vDiffuse * gl_LightSource[0].diffuse * fDiffuse;\n"
+    "    if(fDiffuse > 0.0)\n"
+    "        {\n"
+    "        vec3 vHalf = normalize(vLight + vec3(0.0, 0.0, 1.0));\n"
+    "        float fSpecular = pow(max(dot(vNormal, vHalf), 0.0), gl_FrontMaterial.shininess);\n"
+    "        vColor += gl_FrontMaterial.specular * gl_LightSource[0].specular * fSpecular;\n"
+    "        }\n"
+    "    gl_FrontColor = vec4(vColor.rgb, vDiffuse.a);\n"
+    "    }\n";
+
+// GL_MODULATE, when texturing is on
+static const char *szInstanceFP =
+    "#version 120\n"
+    "uniform sampler2D textureUnit0;\n"
+    "uniform bool bTexture;\n"
+    "void main(void)\n"
+    "    {\n"
+    "    if(bTexture)\n"
+    "        gl_FragColor = gl_Color * texture2D(textureUnit0, gl_TexCoord[0].st);\n"
+    "    else\n"
+    "        gl_FragColor = gl_Color;\n"
+    "    }\n";
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Constructor, nothing happens until the first draw
+CInstancedMesh::CInstancedMesh(void)
+    {
+    bInitialized = false;
+    bForceFallback = false;
+    pMatrices = NULL;
+    nMaxMatrices = 0;
+
+    hProgram = 0;
+    meshBuffers[0] = meshBuffers[1] = 0;
+    instanceBuffer = 0;
+    instanceTexture = 0;
+    nMaxPerDraw = 0;
+
+    pLocalVerts = NULL;
+    pLocalNorms = NULL;
+    pBatchVerts = NULL;
+    pBatchNorms = NULL;
+    pBatchTexCoords = NULL;
+    pBatchIndexes = NULL;
+    eBatchIndexType = GL_UNSIGNED_SHORT;
+    nPerBatch = 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// The GL objects should already be gone (FreeGL()), the memory isn't
+CInstancedMesh::~CInstancedMesh(void)
+    {
+    delete [] pMatrices;
+    delete [] pLocalVerts;
+    delete [] pLocalNorms;
+    delete [] pBatchVerts;
+    delete [] pBatchNorms;
+    delete [] pBatchTexCoords;
+    if(eBatchIndexType == GL_UNSIGNED_SHORT)
+        delete [] (GLushort *)pBatchIndexes;
+    else
+        delete [] (GLuint *)pBatchIndexes;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Delete the buffers, texture, and shader. The next DrawInstances() will
+// make them again, so this is also the way to pick up a rebuilt mesh.
+void CInstancedMesh::FreeGL(void)
+    {
+    if(hProgram != 0)
+        {
+        glDeleteObjectARB(hProgram);
+        glDeleteBuffers(2, meshBuffers);
+        glDeleteBuffers(1, &instanceBuffer);
+        glDeleteTextures(1, &instanceTexture);
+        hProgram = 0;
+        }
+
+    bInitialized = false;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Make room for at least nCount matrices
+void CInstancedMesh::GrowMatrices(GLuint nCount)
+    {
+    if(nCount <= nMaxMatrices)
+        return;
+
+    while(nMaxMatrices < nCount)
+        nMaxMatrices = (nMaxMatrices == 0) ? 256 : nMaxMatrices * 2;
+
+    delete [] pMatrices;
+    pMatrices = new GLfloat[nMaxMatrices * 16];
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Set up for whichever path we are going to use. Returns true for the
+// hardware path.
+bool CInstancedMesh::InitGL(void)
+    {
+    GLuint i, j;
+
+    bInitialized = true;
+
+    // Everything it takes to do it all on the GPU
+    if(!bForceFallback && GLEE_EXT_draw_instanced && GLEE_EXT_texture_buffer_object &&
+       GLEE_EXT_gpu_shader4 && GLEE_ARB_texture_float && GLEE_ARB_shader_objects)
+        hProgram = gltLoadShaderPairSrc(szInstanceVP, szInstanceFP);
+
+    if(hProgram != 0)
+        {
+        // Samplers never change, the flags are set every draw
+        glUseProgramObjectARB(hProgram);
+        glUniform1iARB(glGetUniformLocationARB(hProgram, "instanceMatrices"), 1);
+        glUniform1iARB(glGetUniformLocationARB(hProgram, "textureUnit0"), 0);
+        iLighting = glGetUniformLocationARB(hProgram, "bLighting");
+        iTexture = glGetUniformLocationARB(hProgram, "bTexture");
+        iColorMaterial = glGetUniformLocationARB(hProgram, "bColorMaterial");
+        glUseProgramObjectARB(0);
+
+        // The mesh goes into buffer objects, always interleaved
+        glGenBuffers(2, meshBuffers);
+        glBindBuffer(GL_ARRAY_BUFFER, meshBuffers[0]);
+        if(pInterleaved != NULL)
+            glBufferData(GL_ARRAY_BUFFER, MESH_VERTEX_STRIDE*nNumVerts, pInterleaved, GL_STATIC_DRAW);
+        else
+            {
+            GLfloat *pTemp = new GLfloat[nNumVerts * MESH_VERTEX_FLOATS];
+            meshInterleave(pTemp, pVerts, pNorms, pTexCoords, nNumVerts);
+            glBufferData(GL_ARRAY_BUFFER, MESH_VERTEX_STRIDE*nNumVerts, pTemp, GL_STATIC_DRAW);
+            delete [] pTemp;
+            }
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuffers[1]);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, nNumIndexes * meshGetIndexSize(eIndexType), GetIndexPointer(), GL_STATIC_DRAW);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+        // Matrices are four texels each, and the texture can only be so big
+        GLint nMaxTexels;
+        glGetIntegerv(GL_MAX_TEXTURE_BUFFER_SIZE_EXT, &nMaxTexels);
+        nMaxPerDraw = nMaxTexels / 4;
+
+        glGenBuffers(1, &instanceBuffer);
+        glGenTextures(1, &instanceTexture);
+        return true;
+        }
+
+    // The CPU path needs its own copy of the vertices, split up the way
+    // m3dTransformVectors3() likes them
+    delete [] pLocalVerts;
+    delete [] pLocalNorms;
+    pLocalVerts = new M3DVector3f[nNumVerts];
+    pLocalNorms = new M3DVector3f[nNumVerts];
+    for(i = 0; i < nNumVerts; i++)
+        {
+        if(pInterleaved != NULL)
+            {
+            m3dCopyVector3(pLocalVerts[i], &pInterleaved[i * MESH_VERTEX_FLOATS]);
+            m3dCopyVector3(pLocalNorms[i], &pInterleaved[i * MESH_VERTEX_FLOATS + MESH_NORMAL_OFFSET]);
+            }
+        else
+            {
+            m3dCopyVector3(pLocalVerts[i], pVerts[i]);
+            m3dCopyVector3(pLocalNorms[i], pNorms[i]);
+            }
+        }
+
+    // As many actors as will fit in a batch, at least one
+    nPerBatch = (nNumVerts > 0) ? INSTANCE_BATCH_VERTS / nNumVerts : 1;
+    if(nPerBatch == 0)
+        nPerBatch = 1;
+
+    delete [] pBatchVerts;
+    delete [] pBatchNorms;
+    delete [] pBatchTexCoords;
+    pBatchVerts = new M3DVector3f[nPerBatch * nNumVerts];
+    pBatchNorms = new M3DVector3f[nPerBatch * nNumVerts];
+    pBatchTexCoords = new M3DVector2f[nPerBatch * nNumVerts];
+
+    // Texture coordinates are the same for every actor, fill them in once
+    for(i = 0; i < nPerBatch; i++)
+        for(j = 0; j < nNumVerts; j++)
+            {
+            GLfloat *pTex = (pInterleaved != NULL) ? &pInterleaved[j * MESH_VERTEX_FLOATS + MESH_TEXCOORD_OFFSET] : pTexCoords[j];
+            pBatchTexCoords[i * nNumVerts + j][0] = pTex[0];
+            pBatchTexCoords[i * nNumVerts + j][1] = pTex[1];
+            }
+
+    // And so are the indexes, each copy offset to its own vertices
+    if(eBatchIndexType == GL_UNSIGNED_SHORT)
+        delete [] (GLushort *)pBatchIndexes;
+    else
+        delete [] (GLuint *)pBatchIndexes;
+
+    GLuint *pAllIndexes = new GLuint[nPerBatch * nNumIndexes];
+    const GLvoid *pMeshIndexes = GetIndexPointer();
+    for(i = 0; i < nPerBatch; i++)
+        for(j = 0; j < nNumIndexes; j++)
+            {
+            GLuint nIndex = (eIndexType == GL_UNSIGNED_SHORT) ? ((const GLushort *)pMeshIndexes)[j] : ((const GLuint *)pMeshIndexes)[j];
+            pAllIndexes[i * nNumIndexes + j] = i * nNumVerts + nIndex;
+            }
+
+    eBatchIndexType = meshGetIndexType(nPerBatch * nNumVerts);
+    if(eBatchIndexType == GL_UNSIGNED_SHORT)
+        {
+        GLushort *pShort = new GLushort[nPerBatch * nNumIndexes];
+        meshPackIndexes(pShort, pAllIndexes, nPerBatch * nNumIndexes);
+        delete [] pAllIndexes;
+        pBatchIndexes = pShort;
+        }
+    else
+        pBatchIndexes = pAllIndexes;
+
+    return false;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// One draw call for every nMaxPerDraw actors (which is usually all of them)
+void CInstancedMesh::DrawInstanced(GLuint nCount)
+    {
+    GLhandleARB hOldProgram = glGetHandleARB(GL_PROGRAM_OBJECT_ARB);
+    GLint iOldUnit;
+    glGetIntegerv(GL_ACTIVE_TEXTURE, &iOldUnit);
+
+    // Match the fixed pipeline state the caller has set up
+    glUseProgramObjectARB(hProgram);
+    glUniform1iARB(iLighting, glIsEnabled(GL_LIGHTING));
+    glUniform1iARB(iTexture, glIsEnabled(GL_TEXTURE_2D));
+    glUniform1iARB(iColorMaterial, glIsEnabled(GL_COLOR_MATERIAL));
+
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+
+    glBindBuffer(GL_ARRAY_BUFFER, meshBuffers[0]);
+    glVertexPointer(3, GL_FLOAT, MESH_VERTEX_STRIDE, 0);
+    glNormalPointer(GL_FLOAT, MESH_VERTEX_STRIDE, (GLvoid *)(sizeof(GLfloat) * MESH_NORMAL_OFFSET));
+    glTexCoordPointer(2, GL_FLOAT, MESH_VERTEX_STRIDE, (GLvoid *)(sizeof(GLfloat) * MESH_TEXCOORD_OFFSET));
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshBuffers[1]);
+
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_BUFFER_EXT, instanceTexture);
+
+    for(GLuint nFirst = 0; nFirst < nCount; nFirst += nMaxPerDraw)
+        {
+        GLuint nThisDraw = nCount - nFirst;
+        if(nThisDraw > nMaxPerDraw)
+            nThisDraw = nMaxPerDraw;
+
+        // A new data store each time, so the driver never has to wait for
+        // the last draw to finish with the old one
+        glBindBuffer(GL_TEXTURE_BUFFER_EXT, instanceBuffer);
+        glBufferData(GL_TEXTURE_BUFFER_EXT, nThisDraw * 16 * sizeof(GLfloat), &pMatrices[nFirst * 16], GL_STREAM_DRAW);
+        glTexBufferEXT(GL_TEXTURE_BUFFER_EXT, GL_RGBA32F_ARB, instanceBuffer);
+
+        glDrawElementsInstancedEXT(GL_TRIANGLES, nNumIndexes, eIndexType, 0, nThisDraw);
+        }
+
+    // Put it all back
+    glBindBuffer(GL_TEXTURE_BUFFER_EXT, 0);
+    glBindTexture(GL_TEXTURE_BUFFER_EXT, 0);
+    glActiveTexture(iOldUnit);
+    glPopClientAttrib();
+    glUseProgramObjectARB(hOldProgram);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform a batch of actors into world space, draw them, repeat
+void CInstancedMesh::DrawFallback(GLuint nCount)
+    {
+    glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    glDisableClientState(GL_COLOR_ARRAY);
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glVertexPointer(3, GL_FLOAT, 0, pBatchVerts);
+    glNormalPointer(GL_FLOAT, 0, pBatchNorms);
+    glTexCoordPointer(2, GL_FLOAT, 0, pBatchTexCoords);
+
+    for(GLuint nFirst = 0; nFirst < nCount; nFirst += nPerBatch)
+        {
+        GLuint nThisBatch = nCount - nFirst;
+        if(nThisBatch > nPerBatch)
+            nThisBatch = nPerBatch;
+
+        for(GLuint i = 0; i < nThisBatch; i++)
+            {
+            GLfloat *pMatrix = &pMatrices[(nFirst + i) * 16];
+            m3dTransformVectors3(&pBatchVerts[i * nNumVerts], pLocalVerts, nNumVerts, pMatrix);
+
+            // Actors don't scale, so normals just need the rotation
+            M3DMatrix44f mRotation;
+            m3dCopyMatrix44(mRotation, pMatrix);
+            mRotation[12] = mRotation[13] = mRotation[14] = 0.0f;
+            m3dTransformVectors3(&pBatchNorms[i * nNumVerts], pLocalNorms, nNumVerts, mRotation);
+            }
+
+        glDrawElements(GL_TRIANGLES, nThisBatch * nNumIndexes, eBatchIndexType, pBatchIndexes);
+        }
+
+    glPopClientAttrib();
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw the mesh once for every actor
+void CInstancedMesh::DrawInstances(GLFrame *pActors, GLuint nCount)
+    {
+    if(nCount == 0 || nNumIndexes == 0)
+        return;
+
+    if(!bInitialized)
+        InitGL();
+
+    // Both paths start from the same matrices
+    GrowMatrices(nCount);
+    for(GLuint i = 0; i < nCount; i++)
+        pActors[i].GetMatrix(&pMatrices[i * 16]);
+
+    if(hProgram != 0)
+        DrawInstanced(nCount);
+    else
+        DrawFallback(nCount);
+    }
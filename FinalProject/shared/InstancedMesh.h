@@ -0,0 +1,89 @@
+/*
+ *  InstancedMesh.h
+ *  OpenGL SuperBible
+ *
+ *  A CTriangleMesh that can draw many copies of itself at once, one for each
+ *  actor (GLFrame) in an array. Drawing thirty spheres with a push, a
+ *  multiply, and a draw call each is fine, drawing a hundred thousand that
+ *  way is not... the CPU spends all its time talking to the driver.
+ *
+ *  Where the hardware can do it (EXT_draw_instanced, EXT_texture_buffer_object
+ *  and EXT_gpu_shader4), every actor's matrix is packed into one buffer
+ *  object that the vertex shader reads as a texture, indexed by gl_InstanceID,
+ *  and all of the copies go down in a single draw call. The shader does the
+ *  same lighting the fixed pipeline would for GL_LIGHT0 with color material
+ *  tracking, which is how SphereWorld is set up.
+ *
+ *  Everywhere else, the vertices are transformed into world space on the CPU,
+ *  a batch of actors at a time, and each batch is one ordinary draw. The
+ *  fixed pipeline does the lighting, so it is exact, just slower.
+ *
+ *  Either way, the mesh draws under the current modelview matrix, exactly as
+ *  if each actor had been drawn with ApplyActorTransform(), and all the
+ *  client array and texture state it touches is put back afterwards.
+ */
+
+#ifndef __INSTANCED_MESH__
+#define __INSTANCED_MESH__
+
+#include "gltools.h"
+#include "math3d.h"
+#include "glframe.h"
+#include "TriangleMesh.h"
+
+// Most vertices in one batch on the CPU path (small enough for short indexes)
+#define INSTANCE_BATCH_VERTS    65536
+
+class CInstancedMesh : public CTriangleMesh
+    {
+    public:
+        CInstancedMesh(void);
+        ~CInstancedMesh(void);
+
+        // Draw one copy of the mesh for every actor. Build (or load) the mesh
+        // first, the buffers and shaders are made on the first call.
+        void DrawInstances(GLFrame *pActors, GLuint nCount);
+
+        // Is the single draw call path being used
+        inline bool IsHardwareInstanced(void) { return (hProgram != 0); }
+
+        // Use the CPU path even if the hardware one is available (for
+        // comparing the two). Call before the first DrawInstances().
+        inline void ForceFallback(bool bForce) { bForceFallback = bForce; }
+
+        // Delete the GL objects. The rendering context has to be current,
+        // so don't leave it to the destructor if it is going away first.
+        void FreeGL(void);
+
+    protected:
+        bool InitGL(void);
+        void GrowMatrices(GLuint nCount);
+        void DrawInstanced(GLuint nCount);
+        void DrawFallback(GLuint nCount);
+
+        bool        bInitialized;       // InitGL() has been called
+        bool        bForceFallback;
+
+        GLfloat     *pMatrices;         // One column major matrix per actor
+        GLuint      nMaxMatrices;
+
+        // Hardware path
+        GLhandleARB hProgram;           // 0 when not available
+        GLuint      meshBuffers[2];     // Interleaved vertices, indexes
+        GLuint      instanceBuffer;     // Copy of pMatrices
+        GLuint      instanceTexture;    // instanceBuffer as a texture
+        GLuint      nMaxPerDraw;        // Texture buffer size limit, in actors
+        GLint       iLighting, iTexture, iColorMaterial;   // Uniform locations
+
+        // CPU path
+        M3DVector3f *pLocalVerts;       // Untransformed copy of the mesh
+        M3DVector3f *pLocalNorms;
+        M3DVector3f *pBatchVerts;       // A batch of actors, in world space
+        M3DVector3f *pBatchNorms;
+        M3DVector2f *pBatchTexCoords;   // These never change
+        GLvoid      *pBatchIndexes;     // The mesh indexes repeated for each actor in a batch
+        GLenum      eBatchIndexType;
+        GLuint      nPerBatch;          // Actors in a full batch
+    };
+
+#endif
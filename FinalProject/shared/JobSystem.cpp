@@ -0,0 +1,402 @@
+/*
+ *  JobSystem.cpp
+ *  OpenGL SuperBible
+ *
+ *  Work stealing job scheduler, see JobSystem.h
+ */
+
+#include "JobSystem.h"
+
+#ifndef WIN32
+#include <sched.h>
+#include <unistd.h>
+#endif
+
+// The few atomic operations we need
+#ifdef WIN32
+#define JobAtomicIncrement(p)   InterlockedIncrement(p)
+#define JobAtomicDecrement(p)   InterlockedDecrement(p)
+#define JobAtomicSwap(p, n)     InterlockedExchange(p, n)
+#define JobMemoryBarrier()      MemoryBarrier()
+#define JobYield()              SwitchToThread()
+#else
+#define JobAtomicIncrement(p)   __sync_add_and_fetch(p, 1)
+#define JobAtomicDecrement(p)   __sync_sub_and_fetch(p, 1)
+#define JobAtomicSwap(p, n)     __sync_lock_test_and_set(p, n)
+#define JobMemoryBarrier()      __sync_synchronize()
+#define JobYield()              sched_yield()
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Spin lock on a queue. The swap is a full barrier on both platforms, so
+// whatever was written under the lock is seen by the next one to take it.
+static inline void LockQueue(volatile long *pLock)
+    {
+    while(JobAtomicSwap(pLock, 1) != 0)
+        while(*pLock != 0)
+            ;
+    }
+
+static inline void UnlockQueue(volatile long *pLock)
+    {
+    JobAtomicSwap(pLock, 0);
+    }
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Nothing happens until Start()
+CJobScheduler::CJobScheduler(void)
+    {
+    pQueues = NULL;
+    nNumThreads = 1;
+    nPending = 0;
+    nSteals = 0;
+    bRunning = false;
+    bQuit = false;
+    }
+
+CJobScheduler::~CJobScheduler(void)
+    {
+    Stop();
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// How many cores there are to spread the work over
+int CJobScheduler::GetCoreCount(void)
+    {
+#ifdef WIN32
+    SYSTEM_INFO sysInfo;
+    GetSystemInfo(&sysInfo);
+    int nCores = int(sysInfo.dwNumberOfProcessors);
+#else
+    int nCores = int(sysconf(_SC_NPROCESSORS_ONLN));
+#endif
+
+    return (nCores < 1) ? 1 : nCores;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Start up the worker threads. Thread 0 is whoever calls ParallelFor(), so
+// one fewer is started than asked for.
+bool CJobScheduler::Start(int nThreads)
+    {
+    Stop();
+
+    if(nThreads <= 0)
+        nThreads = GetCoreCount();
+    if(nThreads > JOB_MAX_THREADS)
+        nThreads = JOB_MAX_THREADS;
+
+    pQueues = new JOBQUEUE[nThreads];
+    for(int i = 0; i < nThreads; i++)
+        {
+        pQueues[i].nLock = 0;
+        pQueues[i].nTop = pQueues[i].nBottom = 0;
+        pQueues[i].nSeed = 2166136261u ^ (unsigned int)(i * 16777619);
+        }
+
+    nPending = 0;
+    nSteals = 0;
+    bRunning = false;
+    bQuit = false;
+
+#ifdef WIN32
+    InitializeCriticalSection(&wakeLock);
+    InitializeConditionVariable(&wakeCondition);
+#else
+    pthread_mutex_init(&wakeLock, NULL);
+    pthread_cond_init(&wakeCondition, NULL);
+#endif
+
+    // If we can't get them all, make do with what we got. The workers read
+    // nNumThreads, so it is counted here and only set once they are all
+    // going (see WorkerLoop()).
+    int nStarted = 1;
+    for(int i = 1; i < nThreads; i++)
+        {
+        workerInfo[i].pScheduler = this;
+        workerInfo[i].iThread = i;
+
+#ifdef WIN32
+        threads[i] = CreateThread(NULL, 0, WorkerThread, &workerInfo[i], 0, NULL);
+        if(threads[i] == NULL)
+            break;
+#else
+        if(pthread_create(&threads[i], NULL, WorkerThread, &workerInfo[i]) != 0)
+            break;
+#endif
+        nStarted++;
+        }
+
+    nNumThreads = nStarted;
+    return (nNumThreads == nThreads || nNumThreads > 1);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Wake everybody up to tell them to go home, and wait until they have
+void CJobScheduler::Stop(void)
+    {
+    if(pQueues == NULL)
+        return;
+
+#ifdef WIN32
+    EnterCriticalSection(&wakeLock);
+    bQuit = true;
+    WakeAllConditionVariable(&wakeCondition);
+    LeaveCriticalSection(&wakeLock);
+
+    for(int i = 1; i < nNumThreads; i++)
+        {
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+        }
+
+    DeleteCriticalSection(&wakeLock);
+#else
+    pthread_mutex_lock(&wakeLock);
+    bQuit = true;
+    pthread_cond_broadcast(&wakeCondition);
+    pthread_mutex_unlock(&wakeLock);
+
+    for(int i = 1; i < nNumThreads; i++)
+        pthread_join(threads[i], NULL);
+
+    pthread_cond_destroy(&wakeCondition);
+    pthread_mutex_destroy(&wakeLock);
+#endif
+
+    delete [] pQueues;
+    pQueues = NULL;
+    nNumThreads = 1;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Put a job on the back of our own queue. Fails if the queue is full.
+bool CJobScheduler::Push(int iThread, const JOB &job)
+    {
+    JOBQUEUE *pQueue = &pQueues[iThread];
+    bool bPushed = false;
+
+    LockQueue(&pQueue->nLock);
+    if(pQueue->nBottom - pQueue->nTop < JOB_QUEUE_SIZE)
+        {
+        pQueue->jobs[pQueue->nBottom & (JOB_QUEUE_SIZE - 1)] = job;
+        pQueue->nBottom++;
+        bPushed = true;
+        }
+    UnlockQueue(&pQueue->nLock);
+
+    return bPushed;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Take the newest job off the back of our own queue, it's the smallest and
+// the most likely to still be in the cache
+bool CJobScheduler::Pop(int iThread, JOB &job)
+    {
+    JOBQUEUE *pQueue = &pQueues[iThread];
+    bool bPopped = false;
+
+    if(pQueue->nBottom == pQueue->nTop)     // Don't bother locking an empty queue
+        return false;
+
+    LockQueue(&pQueue->nLock);
+    if(pQueue->nBottom != pQueue->nTop)
+        {
+        pQueue->nBottom--;
+        job = pQueue->jobs[pQueue->nBottom & (JOB_QUEUE_SIZE - 1)];
+        bPopped = true;
+        }
+    UnlockQueue(&pQueue->nLock);
+
+    return bPopped;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Take the oldest (and so biggest) job off the front of somebody else's
+// queue. Starts with a random thread, so the thieves don't all queue up on
+// the same victim.
+bool CJobScheduler::Steal(int iThread, JOB &job)
+    {
+    if(nNumThreads < 2)
+        return false;
+
+    unsigned int &nSeed = pQueues[iThread].nSeed;
+    nSeed = nSeed * 1664525u + 1013904223u;
+    int iVictim = int((nSeed >> 16) % (unsigned int)(nNumThreads - 1));
+
+    for(int i = 0; i < nNumThreads - 1; i++)
+        {
+        // Skip over ourselves
+        int iOther = (iThread + 1 + (iVictim + i) % (nNumThreads - 1)) % nNumThreads;
+        JOBQUEUE *pQueue = &pQueues[iOther];
+
+        if(pQueue->nBottom == pQueue->nTop)
+            continue;
+
+        bool bStolen = false;
+        LockQueue(&pQueue->nLock);
+        if(pQueue->nBottom != pQueue->nTop)
+            {
+            job = pQueue->jobs[pQueue->nTop & (JOB_QUEUE_SIZE - 1)];
+            pQueue->nTop++;
+            bStolen = true;
+            }
+        UnlockQueue(&pQueue->nLock);
+
+        if(bStolen)
+            {
+            JobAtomicIncrement(&nSteals);
+            return true;
+            }
+        }
+
+    return false;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Our own work first, then anyone else's
+bool CJobScheduler::FindJob(int iThread, JOB &job)
+    {
+    return Pop(iThread, job) || Steal(iThread, job);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Run a job. While it's more than one grain, split off the right half for
+// somebody else (or ourselves, later) and keep the left. The pending count
+// goes up before the half is pushed, so it can't touch zero while there is
+// still work in a queue.
+void CJobScheduler::Execute(int iThread, JOB &job)
+    {
+    while(job.nLast - job.nFirst > job.nGrain)
+        {
+        JOB right = job;
+        right.nFirst = job.nFirst + (job.nLast - job.nFirst) / 2;
+
+        JobAtomicIncrement(&nPending);
+        if(!Push(iThread, right))
+            {
+            // Queue full, just do the lot here
+            JobAtomicDecrement(&nPending);
+            break;
+            }
+
+        job.nLast = right.nFirst;
+        }
+
+    job.pFunc(job.pData, job.nFirst, job.nLast);
+    JobAtomicDecrement(&nPending);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Sleep while there's nothing going on. Returns false when it's time to quit.
+// With bLock it goes through the lock even if there is work already.
+bool CJobScheduler::WaitForWork(bool bLock)
+    {
+    if(bRunning && !bLock)
+        return !bQuit;
+
+#ifdef WIN32
+    EnterCriticalSection(&wakeLock);
+    while(!bRunning && !bQuit)
+        SleepConditionVariableCS(&wakeCondition, &wakeLock, INFINITE);
+    LeaveCriticalSection(&wakeLock);
+#else
+    pthread_mutex_lock(&wakeLock);
+    while(!bRunning && !bQuit)
+        pthread_cond_wait(&wakeCondition, &wakeLock);
+    pthread_mutex_unlock(&wakeLock);
+#endif
+
+    return !bQuit;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// What the worker threads do all day
+void CJobScheduler::WorkerLoop(int iThread)
+    {
+    // The first wait always takes the lock, and ParallelFor() sets bRunning
+    // under it, so by the time we look for a job we see everything Start()
+    // set, nNumThreads included, even if this thread began before it was
+    // finished counting.
+    bool bFirst = true;
+    while(WaitForWork(bFirst))
+        {
+        JOB job;
+        bFirst = false;
+
+        if(FindJob(iThread, job))
+            Execute(iThread, job);
+        else
+            JobYield();
+        }
+    }
+
+#ifdef WIN32
+DWORD WINAPI CJobScheduler::WorkerThread(LPVOID pParam)
+    {
+    WORKERINFO *pInfo = (WORKERINFO *)pParam;
+    pInfo->pScheduler->WorkerLoop(pInfo->iThread);
+    return 0;
+    }
+#else
+void *CJobScheduler::WorkerThread(void *pParam)
+    {
+    WORKERINFO *pInfo = (WORKERINFO *)pParam;
+    pInfo->pScheduler->WorkerLoop(pInfo->iThread);
+    return NULL;
+    }
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Hand out the range, and help out until it's all done. Without any worker
+// threads this is just a function call.
+void CJobScheduler::ParallelFor(JOBFUNC pFunc, void *pData, GLuint nCount, GLuint nGrain)
+    {
+    if(nCount == 0)
+        return;
+
+    if(pQueues == NULL || nNumThreads < 2 || nCount <= nGrain)
+        {
+        pFunc(pData, 0, nCount);
+        return;
+        }
+
+    JOB job;
+    job.pFunc = pFunc;
+    job.pData = pData;
+    job.nFirst = 0;
+    job.nLast = nCount;
+    job.nGrain = (nGrain < 1) ? 1 : nGrain;
+
+    nPending = 1;
+
+    // Get the workers going
+#ifdef WIN32
+    EnterCriticalSection(&wakeLock);
+    bRunning = true;
+    WakeAllConditionVariable(&wakeCondition);
+    LeaveCriticalSection(&wakeLock);
+#else
+    pthread_mutex_lock(&wakeLock);
+    bRunning = true;
+    pthread_cond_broadcast(&wakeCondition);
+    pthread_mutex_unlock(&wakeLock);
+#endif
+
+    // Start on the first half ourselves, the splits are there for the taking
+    Execute(0, job);
+
+    while(nPending != 0)
+        {
+        if(FindJob(0, job))
+            Execute(0, job);
+        else
+            JobYield();
+        }
+
+    // Back to sleep. Make sure we see everything the workers wrote.
+    bRunning = false;
+    JobMemoryBarrier();
+    }
@@ -0,0 +1,133 @@
+/*
+ *  JobSystem.h
+ *  OpenGL SuperBible
+ *
+ *  A small work stealing job scheduler, for spreading per-frame work (moving
+ *  actors, culling them, building the list of what to draw) over all of the
+ *  CPU's cores. OpenGL itself stays on the thread that owns the context,
+ *  only the work leading up to the draw calls runs on the other threads.
+ *
+ *  There is one worker thread per core, less one for the thread that calls
+ *  ParallelFor(), which works too rather than sitting and waiting. Each
+ *  thread has its own queue of jobs. A thread works from the back of its own
+ *  queue, and when that runs dry it steals from the front of somebody
+ *  else's. Ranges are split in half lazily, only when a thread actually
+ *  starts on them, so a thread that is stolen from has given away the
+ *  biggest piece of work it had, and nobody fights over tiny jobs.
+ *
+ *  Usage:
+ *
+ *      void MoveActors(void *pData, GLuint nFirst, GLuint nLast)
+ *          {
+ *          GLFrame *pActors = (GLFrame *)pData;
+ *          for(GLuint i = nFirst; i < nLast; i++)
+ *              pActors[i].MoveForward(0.1f);
+ *          }
+ *
+ *      CJobScheduler jobs;
+ *      jobs.Start();
+ *      ...
+ *      jobs.ParallelFor(MoveActors, pActors, nNumActors, 256);
+ *
+ *  Job functions run on any thread, so they must not call OpenGL, and must
+ *  only write to their own part of the data.
+ */
+
+#ifndef __JOB_SYSTEM__
+#define __JOB_SYSTEM__
+
+#include "gltools.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#define JOB_MAX_THREADS     64      // Including the calling thread
+#define JOB_QUEUE_SIZE      256     // Jobs waiting per thread (must be a power of 2)
+
+// Work on items nFirst to nLast - 1
+typedef void (*JOBFUNC)(void *pData, GLuint nFirst, GLuint nLast);
+
+class CJobScheduler
+    {
+    public:
+        CJobScheduler(void);
+        ~CJobScheduler(void);
+
+        // Start the workers. nThreads counts the calling thread, 0 means one
+        // per core. Returns false if no worker could be started, but
+        // ParallelFor() still works (on the calling thread alone).
+        bool Start(int nThreads = 0);
+        void Stop(void);
+
+        // Run pFunc over the whole range, in pieces of at least nGrain items,
+        // and return when it is all done. Only one thread may call this.
+        void ParallelFor(JOBFUNC pFunc, void *pData, GLuint nCount, GLuint nGrain);
+
+        // Threads working, counting the caller
+        inline int GetThreadCount(void) { return nNumThreads; }
+
+        // How many cores there are
+        static int GetCoreCount(void);
+
+        // Pieces of work that were taken from another thread's queue, since
+        // Start(). A rough measure of how busy everyone has been kept.
+        inline long GetStealCount(void) { return nSteals; }
+
+    protected:
+        typedef struct
+            {
+            JOBFUNC pFunc;
+            void    *pData;
+            GLuint  nFirst, nLast;
+            GLuint  nGrain;
+            } JOB;
+
+        // One per thread. The owner pushes and pops at nBottom, thieves take
+        // from nTop. A spin lock is plenty, nobody holds it for long.
+        typedef struct
+            {
+            volatile long   nLock;
+            volatile unsigned int nTop, nBottom;
+            unsigned int    nSeed;              // For picking who to steal from
+            JOB             jobs[JOB_QUEUE_SIZE];
+            } JOBQUEUE;
+
+        typedef struct
+            {
+            CJobScheduler   *pScheduler;
+            int             iThread;
+            } WORKERINFO;
+
+        bool Push(int iThread, const JOB &job);
+        bool Pop(int iThread, JOB &job);
+        bool Steal(int iThread, JOB &job);
+        bool FindJob(int iThread, JOB &job);
+        void Execute(int iThread, JOB &job);
+        void WorkerLoop(int iThread);
+
+        // Sleep until there is work, or we are stopping
+        bool WaitForWork(bool bLock);
+
+#ifdef WIN32
+        static DWORD WINAPI WorkerThread(LPVOID pParam);
+        HANDLE              threads[JOB_MAX_THREADS];
+        CRITICAL_SECTION    wakeLock;
+        CONDITION_VARIABLE  wakeCondition;
+#else
+        static void *WorkerThread(void *pParam);
+        pthread_t           threads[JOB_MAX_THREADS];
+        pthread_mutex_t     wakeLock;
+        pthread_cond_t      wakeCondition;
+#endif
+
+        JOBQUEUE        *pQueues;               // One for each thread, 0 is the caller's
+        WORKERINFO      workerInfo[JOB_MAX_THREADS];
+        int             nNumThreads;
+        volatile long   nPending;               // Jobs pushed but not finished
+        volatile long   nSteals;
+        volatile bool   bRunning;               // A ParallelFor() is going, workers look for jobs
+        volatile bool   bQuit;
+    };
+
+#endif
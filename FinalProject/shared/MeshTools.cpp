@@ -0,0 +1,440 @@
+/*
+ *  MeshTools.cpp
+ *  OpenGL SuperBible
+ *
+ *  Helpers shared by CTriangleMesh and CVBOMesh while a mesh is being
+ *  assembled. See MeshTools.h
+ */
+
+#include "MeshTools.h"
+
+
+///////////////////////////////////////////////////////////
+// Constructor, nothing is allocated until Begin()
+CVertexHash::CVertexHash(void)
+    {
+    pBuckets = NULL;
+    pNext = NULL;
+    nBucketMask = 0;
+    nMaxVerts = 0;
+
+    fEpsilon = 0.0f;
+    fCellSize = 0.0f;
+    fInvCellSize = 0.0f;
+    }
+
+CVertexHash::~CVertexHash(void)
+    {
+    End();
+    }
+
+////////////////////////////////////////////////////////////
+// Allocate the buckets. There are at least as many buckets as
+// vertices, so the chains stay short.
+void CVertexHash::Begin(GLuint nMax, GLfloat fEps)
+    {
+    End();
+
+    nMaxVerts = nMax;
+    nBucketMask = m3dIsPOW2(nMaxVerts < 16 ? 16 : nMaxVerts) - 1;
+
+    pBuckets = new GLuint[nBucketMask + 1];
+    pNext = new GLuint[nMaxVerts];
+    memset(pBuckets, 0xFF, sizeof(GLuint) * (nBucketMask + 1));
+
+    // The cell must be wider than two epsilons, that way a vertex is never
+    // more than one cell away (per axis) from anything it could match.
+    fEpsilon = fEps;
+    fCellSize = fEps * 64.0f;
+    fInvCellSize = 1.0f / fCellSize;
+    }
+
+////////////////////////////////////////////////////////////
+// Free the workspace
+void CVertexHash::End(void)
+    {
+    delete [] pBuckets;
+    delete [] pNext;
+    pBuckets = NULL;
+    pNext = NULL;
+    nBucketMask = 0;
+    nMaxVerts = 0;
+    }
+
+////////////////////////////////////////////////////////////
+// Which cell (along one axis) does this value fall in
+long long CVertexHash::GetCell(GLfloat fValue)
+    {
+    double dCell = floor(double(fValue) * double(fInvCellSize));
+
+    // Keep absurd coordinates from overflowing the integer
+    if(dCell > 1.0e17)
+        dCell = 1.0e17;
+    else if(dCell < -1.0e17)
+        dCell = -1.0e17;
+
+    return (long long)dCell;
+    }
+
+////////////////////////////////////////////////////////////
+// Mix the three cell coordinates into a bucket number
+GLuint CVertexHash::HashCell(long long x, long long y, long long z)
+    {
+    unsigned long long h = (unsigned long long)x * 73856093ULL;
+    h ^= (unsigned long long)y * 19349663ULL;
+    h ^= (unsigned long long)z * 83492791ULL;
+    h ^= (h >> 32);
+
+    return GLuint(h) & nBucketMask;
+    }
+
+/////////////////////////////////////////////////////////////////
+// Look for an existing vertex that is close enough to this one. Only the
+// cells within epsilon of the position are searched. If more than one vertex
+// matches, the one added first is returned, just like the linear search.
+GLuint CVertexHash::Find(const M3DVector3f vVert, const M3DVector3f vNorm, const M3DVector2f vTexCoord,
+                         const M3DVector3f *pVerts, const M3DVector3f *pNorms, const M3DVector2f *pTexCoords)
+    {
+    const float e = fEpsilon;
+    GLuint iBest = MESH_NO_MATCH;
+    long long xMin = GetCell(vVert[0] - e), xMax = GetCell(vVert[0] + e);
+    long long yMin = GetCell(vVert[1] - e), yMax = GetCell(vVert[1] + e);
+    long long zMin = GetCell(vVert[2] - e), zMax = GetCell(vVert[2] + e);
+
+    for(long long x = xMin; x <= xMax; x++)
+        for(long long y = yMin; y <= yMax; y++)
+            for(long long z = zMin; z <= zMax; z++)
+                {
+                GLuint iMatch = pBuckets[HashCell(x, y, z)];
+                while(iMatch != MESH_NO_MATCH)
+                    {
+                    if(iMatch < iBest &&
+                       m3dCloseEnough(pVerts[iMatch][0], vVert[0], e) &&
+                       m3dCloseEnough(pVerts[iMatch][1], vVert[1], e) &&
+                       m3dCloseEnough(pVerts[iMatch][2], vVert[2], e) &&
+
+                       m3dCloseEnough(pNorms[iMatch][0], vNorm[0], e) &&
+                       m3dCloseEnough(pNorms[iMatch][1], vNorm[1], e) &&
+                       m3dCloseEnough(pNorms[iMatch][2], vNorm[2], e) &&
+
+                       m3dCloseEnough(pTexCoords[iMatch][0], vTexCoord[0], e) &&
+                       m3dCloseEnough(pTexCoords[iMatch][1], vTexCoord[1], e))
+                        iBest = iMatch;
+
+                    iMatch = pNext[iMatch];
+                    }
+                }
+
+    return iBest;
+    }
+
+/////////////////////////////////////////////////////////////////
+// Link a new vertex into the bucket for its cell
+void CVertexHash::Insert(GLuint iVertex, const M3DVector3f vVert)
+    {
+    GLuint iBucket = HashCell(GetCell(vVert[0]), GetCell(vVert[1]), GetCell(vVert[2]));
+
+    pNext[iVertex] = pBuckets[iBucket];
+    pBuckets[iBucket] = iVertex;
+    }
+
+
+/////////////////////////////////////////////////////////////////
+// Narrow indexes down to 16 bits
+void meshPackIndexes(GLushort *pOut, const GLuint *pIn, GLuint nCount)
+    {
+    for(GLuint i = 0; i < nCount; i++)
+        pOut[i] = GLushort(pIn[i]);
+    }
+
+/////////////////////////////////////////////////////////////////
+// Pack separate attribute arrays into one interleaved array
+void meshInterleave(GLfloat *pOut, const M3DVector3f *pVerts, const M3DVector3f *pNorms,
+                    const M3DVector2f *pTexCoords, GLuint nNumVerts)
+    {
+    for(GLuint i = 0; i < nNumVerts; i++)
+        {
+        m3dCopyVector3(pOut, pVerts[i]);
+        m3dCopyVector3(pOut + MESH_NORMAL_OFFSET, pNorms[i]);
+        m3dCopyVector2(pOut + MESH_TEXCOORD_OFFSET, pTexCoords[i]);
+        pOut += MESH_VERTEX_FLOATS;
+        }
+    }
+
+/////////////////////////////////////////////////////////////////
+// Score a vertex for the cache optimizer. Vertices that are already in the
+// cache score high, as do vertices with few triangles left (so the optimizer
+// finishes off lone triangles instead of leaving them for later).
+static GLfloat ForsythVertexScore(int iCachePos, GLuint nRemainingTris)
+    {
+    GLfloat fScore = 0.0f;
+
+    // No triangles left, nobody cares about this vertex anymore
+    if(nRemainingTris == 0)
+        return -1.0f;
+
+    if(iCachePos >= 0 && iCachePos < MESH_CACHE_SIZE)
+        {
+        // The three vertices of the last triangle get a fixed score, otherwise
+        // they would favor triangles that are all but guaranteed to hit anyway
+        if(iCachePos < 3)
+            fScore = 0.75f;
+        else
+            {
+            GLfloat fScaler = 1.0f - float(iCachePos - 3) / float(MESH_CACHE_SIZE - 3);
+            fScore = float(pow(fScaler, 1.5));
+            }
+        }
+
+    // Valence boost
+    fScore += 2.0f / float(sqrt(double(nRemainingTris)));
+    return fScore;
+    }
+
+/////////////////////////////////////////////////////////////////
+// Recalculate the score of a vertex and pass the change on to the
+// triangles that still use it
+static void ForsythRescore(GLuint v, const int *pCachePos, const GLuint *pTriCount, const GLuint *pTriOffset,
+                           const GLuint *pTriList, GLfloat *pVertScore, GLfloat *pTriScore)
+    {
+    GLfloat fScore = ForsythVertexScore(pCachePos[v], pTriCount[v]);
+    GLfloat fDelta = fScore - pVertScore[v];
+    pVertScore[v] = fScore;
+
+    for(GLuint j = 0; j < pTriCount[v]; j++)
+        pTriScore[pTriList[pTriOffset[v] + j]] += fDelta;
+    }
+
+/////////////////////////////////////////////////////////////////
+// Reorder triangles for the post-transform vertex cache. Greedy: always emit
+// the highest scoring triangle that touches the (simulated) cache, and only
+// when none is left jump to the next triangle not yet emitted.
+void meshOptimizeVertexCache(GLuint *pIndexes, GLuint nNumIndexes, GLuint nNumVerts)
+    {
+    GLuint nNumTris = nNumIndexes / 3;
+    GLuint i, j, k;
+
+    if(nNumTris == 0 || nNumVerts == 0)
+        return;
+
+    // Workspace
+    GLuint *pTriCount = new GLuint[nNumVerts];      // Triangles not yet emitted, per vertex
+    GLuint *pTriOffset = new GLuint[nNumVerts];     // Start of each vertex's list in pTriList
+    GLuint *pTriList = new GLuint[nNumTris * 3];    // Triangles that use each vertex
+    int *pCachePos = new int[nNumVerts];
+    GLfloat *pVertScore = new GLfloat[nNumVerts];
+    GLfloat *pTriScore = new GLfloat[nNumTris];
+    bool *pTriAdded = new bool[nNumTris];
+    GLuint *pNewIndexes = new GLuint[nNumTris * 3];
+    GLuint cache[MESH_CACHE_SIZE + 3];
+    GLuint newCache[MESH_CACHE_SIZE + 3];
+    GLuint nCache = 0;
+
+    // Build the vertex to triangle adjacency
+    memset(pTriCount, 0, sizeof(GLuint) * nNumVerts);
+    for(i = 0; i < nNumTris * 3; i++)
+        pTriCount[pIndexes[i]]++;
+
+    for(i = 0, j = 0; i < nNumVerts; i++)
+        {
+        pTriOffset[i] = j;
+        j += pTriCount[i];
+        pTriCount[i] = 0;
+        }
+
+    for(i = 0; i < nNumTris * 3; i++)
+        {
+        GLuint v = pIndexes[i];
+        pTriList[pTriOffset[v] + pTriCount[v]] = i / 3;
+        pTriCount[v]++;
+        }
+
+    // Initial scores
+    for(i = 0; i < nNumVerts; i++)
+        {
+        pCachePos[i] = -1;
+        pVertScore[i] = ForsythVertexScore(-1, pTriCount[i]);
+        }
+
+    for(i = 0; i < nNumTris; i++)
+        {
+        pTriAdded[i] = false;
+        pTriScore[i] = pVertScore[pIndexes[i*3]] + pVertScore[pIndexes[i*3+1]] + pVertScore[pIndexes[i*3+2]];
+        }
+
+    // Start with the best triangle overall
+    GLuint iBest = 0;
+    for(i = 1; i < nNumTris; i++)
+        if(pTriScore[i] > pTriScore[iBest])
+            iBest = i;
+
+    GLuint iScan = 0;   // Everything before this has been emitted
+    for(GLuint nOut = 0; nOut < nNumTris; nOut++)
+        {
+        // Dead end, fall back to the next triangle in the original order
+        if(iBest == MESH_NO_MATCH)
+            {
+            while(pTriAdded[iScan])
+                iScan++;
+            iBest = iScan;
+            }
+
+        // Emit the triangle
+        GLuint *pTri = &pIndexes[iBest * 3];
+        memcpy(&pNewIndexes[nOut * 3], pTri, sizeof(GLuint) * 3);
+        pTriAdded[iBest] = true;
+
+        // Take it out of the lists of its vertices
+        for(k = 0; k < 3; k++)
+            {
+            GLuint v = pTri[k];
+            GLuint *pList = &pTriList[pTriOffset[v]];
+            for(j = 0; j < pTriCount[v]; j++)
+                if(pList[j] == iBest)
+                    {
+                    pList[j] = pList[pTriCount[v] - 1];
+                    break;
+                    }
+            pTriCount[v]--;
+            }
+
+        // Push its vertices to the front of the cache. The cache is allowed to
+        // run three over so the vertices that fall out can be rescored.
+        GLuint nNewCache = 0;
+        for(k = 0; k < 3; k++)
+            if(k == 0 || (pTri[k] != pTri[0] && pTri[k] != pTri[k-1]))
+                newCache[nNewCache++] = pTri[k];
+
+        for(i = 0; i < nCache; i++)
+            {
+            GLuint v = cache[i];
+            if(v == pTri[0] || v == pTri[1] || v == pTri[2])
+                continue;
+
+            if(nNewCache < MESH_CACHE_SIZE + 3)
+                newCache[nNewCache++] = v;
+            else
+                {
+                // Fell out of the cache
+                pCachePos[v] = -1;
+                ForsythRescore(v, pCachePos, pTriCount, pTriOffset, pTriList, pVertScore, pTriScore);
+                }
+            }
+
+        // Rescore everything in the cache
+        for(i = 0; i < nNewCache; i++)
+            {
+            GLuint v = newCache[i];
+            cache[i] = v;
+            pCachePos[v] = (i < MESH_CACHE_SIZE) ? int(i) : -1;
+            ForsythRescore(v, pCachePos, pTriCount, pTriOffset, pTriList, pVertScore, pTriScore);
+            }
+        nCache = nNewCache;
+
+        // The next triangle is the best one that uses a cached vertex
+        iBest = MESH_NO_MATCH;
+        GLfloat fBestScore = -1.0f;
+        for(i = 0; i < nCache; i++)
+            {
+            GLuint v = cache[i];
+            for(j = 0; j < pTriCount[v]; j++)
+                {
+                GLuint t = pTriList[pTriOffset[v] + j];
+                if(pTriScore[t] > fBestScore)
+                    {
+                    fBestScore = pTriScore[t];
+                    iBest = t;
+                    }
+                }
+            }
+        }
+
+    memcpy(pIndexes, pNewIndexes, sizeof(GLuint) * nNumTris * 3);
+
+    delete [] pTriCount;
+    delete [] pTriOffset;
+    delete [] pTriList;
+    delete [] pCachePos;
+    delete [] pVertScore;
+    delete [] pTriScore;
+    delete [] pTriAdded;
+    delete [] pNewIndexes;
+    }
+
+/////////////////////////////////////////////////////////////////
+// Renumber vertices in first use order
+void meshOptimizeVertexFetch(GLuint *pRemap, GLuint *pIndexes, GLuint nNumIndexes, GLuint nNumVerts)
+    {
+    GLuint i, nNext = 0;
+
+    for(i = 0; i < nNumVerts; i++)
+        pRemap[i] = MESH_NO_MATCH;
+
+    for(i = 0; i < nNumIndexes; i++)
+        {
+        GLuint v = pIndexes[i];
+        if(pRemap[v] == MESH_NO_MATCH)
+            pRemap[v] = nNext++;
+
+        pIndexes[i] = pRemap[v];
+        }
+
+    // Anything never referenced goes on the end
+    for(i = 0; i < nNumVerts; i++)
+        if(pRemap[i] == MESH_NO_MATCH)
+            pRemap[i] = nNext++;
+    }
+
+/////////////////////////////////////////////////////////////////
+// Move the vertex data to match a remap table
+void meshRemapVertices(M3DVector3f *pDstVerts, M3DVector3f *pDstNorms, M3DVector2f *pDstTexCoords,
+                       const M3DVector3f *pSrcVerts, const M3DVector3f *pSrcNorms, const M3DVector2f *pSrcTexCoords,
+                       const GLuint *pRemap, GLuint nNumVerts)
+    {
+    if(pRemap == NULL)
+        {
+        memcpy(pDstVerts, pSrcVerts, sizeof(M3DVector3f)*nNumVerts);
+        memcpy(pDstNorms, pSrcNorms, sizeof(M3DVector3f)*nNumVerts);
+        memcpy(pDstTexCoords, pSrcTexCoords, sizeof(M3DVector2f)*nNumVerts);
+        return;
+        }
+
+    for(GLuint i = 0; i < nNumVerts; i++)
+        {
+        m3dCopyVector3(pDstVerts[pRemap[i]], pSrcVerts[i]);
+        m3dCopyVector3(pDstNorms[pRemap[i]], pSrcNorms[i]);
+        m3dCopyVector2(pDstTexCoords[pRemap[i]], pSrcTexCoords[i]);
+        }
+    }
+
+/////////////////////////////////////////////////////////////////
+// Run the index array through a simulated FIFO cache. A vertex is still in
+// the cache if fewer than nCacheSize misses have happened since it was loaded.
+GLfloat meshGetCacheStats(const GLvoid *pIndexes, GLenum eIndexType, GLuint nNumIndexes, GLuint nNumVerts,
+                          GLuint nCacheSize, GLfloat *pATVR)
+    {
+    GLuint *pLoadedAt = new GLuint[nNumVerts];
+    GLuint nTime = nCacheSize + 1;
+    GLuint nMisses = 0;
+
+    memset(pLoadedAt, 0, sizeof(GLuint) * nNumVerts);
+
+    for(GLuint i = 0; i < nNumIndexes; i++)
+        {
+        GLuint v = (eIndexType == GL_UNSIGNED_SHORT) ? ((const GLushort *)pIndexes)[i] : ((const GLuint *)pIndexes)[i];
+
+        if(nTime - pLoadedAt[v] > nCacheSize)
+            {
+            pLoadedAt[v] = nTime;
+            nTime++;
+            nMisses++;
+            }
+        }
+
+    delete [] pLoadedAt;
+
+    if(pATVR != NULL)
+        *pATVR = (nNumVerts > 0) ? float(nMisses) / float(nNumVerts) : 0.0f;
+
+    return (nNumIndexes >= 3) ? float(nMisses) / float(nNumIndexes / 3) : 0.0f;
+    }
@@ -0,0 +1,122 @@
+/*
+ *  MeshTools.h
+ *  OpenGL SuperBible
+ *
+ *  Helpers shared by CTriangleMesh and CVBOMesh while a mesh is being
+ *  assembled.
+ *
+ *  CVertexHash replaces the linear "search every vertex so far" loop in
+ *  AddTriangle() with a spatial hash on the vertex position. Positions are
+ *  bucketed into cells much larger than the welding epsilon, so a vertex
+ *  only has to be compared against the handful of vertices that share its
+ *  cell (and a neighbouring cell when it sits within epsilon of a cell wall).
+ *  The comparison itself is still m3dCloseEnough() on position, normal and
+ *  texture coordinate, and the lowest matching index wins, exactly as the
+ *  old linear search did.
+ */
+
+#ifndef __MESH_TOOLS__
+#define __MESH_TOOLS__
+
+#include "gltools.h"
+#include "math3d.h"
+
+// Returned by CVertexHash::Find() when there is no match
+#define MESH_NO_MATCH   0xFFFFFFFF
+
+// How small a difference to equate when welding vertices
+#define MESH_WELD_EPSILON   0.000001f
+
+// Options for EndMesh()
+#define MESH_INTERLEAVED        0x0001  // Pack position/normal/texcoord into one array
+#define MESH_OPTIMIZE_CACHE     0x0002  // Reorder triangles for the post-transform cache
+#define MESH_OPTIMIZE_FETCH     0x0004  // Renumber vertices in the order they are used
+#define MESH_OPTIMIZE           (MESH_OPTIMIZE_CACHE | MESH_OPTIMIZE_FETCH)
+
+// Post-transform cache size assumed by the optimizer and the statistics
+#define MESH_CACHE_SIZE         32
+
+// Interleaved vertex layout, one vertex is x,y,z, nx,ny,nz, s,t. Keeping all
+// the attributes of a vertex together means one cache line fetch per vertex
+// instead of three, and only one buffer object to bind.
+#define MESH_VERTEX_FLOATS      8
+#define MESH_VERTEX_STRIDE      (MESH_VERTEX_FLOATS * sizeof(GLfloat))
+#define MESH_NORMAL_OFFSET      3
+#define MESH_TEXCOORD_OFFSET    6
+
+// Build the interleaved array from separate ones. pOut must hold
+// nNumVerts * MESH_VERTEX_FLOATS floats.
+void meshInterleave(GLfloat *pOut, const M3DVector3f *pVerts, const M3DVector3f *pNorms,
+                    const M3DVector2f *pTexCoords, GLuint nNumVerts);
+
+// Pick the smallest index type that can address nNumVerts vertices. 16 bit
+// indexes save bandwidth, but silently wrap past 65,535.
+inline GLenum meshGetIndexType(GLuint nNumVerts)
+    { return (nNumVerts <= 65536) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT; }
+
+// Size in bytes of one index of the given type
+inline GLuint meshGetIndexSize(GLenum eIndexType)
+    { return (eIndexType == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint); }
+
+// Copy 32 bit indexes into a 16 bit array. Only valid if every index is < 65536
+void meshPackIndexes(GLushort *pOut, const GLuint *pIn, GLuint nCount);
+
+// Reorder the triangles (Tom Forsyth's linear-speed vertex cache optimisation)
+// so that vertices get reused while they are still in the post-transform
+// cache. Only the order of the triangles changes, not the vertices.
+void meshOptimizeVertexCache(GLuint *pIndexes, GLuint nNumIndexes, GLuint nNumVerts);
+
+// Renumber the vertices in the order the index array first uses them, so the
+// vertex fetch walks memory front to back. pRemap receives the new index of
+// every old vertex, use meshRemapVertices() to move the vertex data to match.
+void meshOptimizeVertexFetch(GLuint *pRemap, GLuint *pIndexes, GLuint nNumIndexes, GLuint nNumVerts);
+
+// Copy vertex arrays from pSrc* to pDst*, moving vertex i to pRemap[i]. With a
+// NULL pRemap this is a straight copy.
+void meshRemapVertices(M3DVector3f *pDstVerts, M3DVector3f *pDstNorms, M3DVector2f *pDstTexCoords,
+                       const M3DVector3f *pSrcVerts, const M3DVector3f *pSrcNorms, const M3DVector2f *pSrcTexCoords,
+                       const GLuint *pRemap, GLuint nNumVerts);
+
+// Simulate a FIFO post-transform cache of nCacheSize entries over the index
+// array. Returns the ACMR (average cache miss ratio, transformed vertices per
+// triangle: 0.5 is ideal for a big regular grid, 3.0 is the worst case). If
+// pATVR is not NULL it receives the ATVR (transformed vertices per unique
+// vertex: 1.0 is ideal).
+GLfloat meshGetCacheStats(const GLvoid *pIndexes, GLenum eIndexType, GLuint nNumIndexes, GLuint nNumVerts,
+                          GLuint nCacheSize, GLfloat *pATVR);
+
+class CVertexHash
+    {
+    public:
+        CVertexHash(void);
+        ~CVertexHash(void);
+
+        // Reserve room for nMaxVerts vertices. fEpsilon is the welding tolerance
+        void Begin(GLuint nMaxVerts, GLfloat fEpsilon);
+
+        // Free the table, it is only needed while the mesh is being built
+        void End(void);
+
+        // Search the already added vertices for a match. Returns the index of the
+        // matching vertex, or MESH_NO_MATCH.
+        GLuint Find(const M3DVector3f vVert, const M3DVector3f vNorm, const M3DVector2f vTexCoord,
+                    const M3DVector3f *pVerts, const M3DVector3f *pNorms, const M3DVector2f *pTexCoords);
+
+        // Add vertex iVertex (already stored in the callers arrays) to the table
+        void Insert(GLuint iVertex, const M3DVector3f vVert);
+
+    protected:
+        GLuint HashCell(long long x, long long y, long long z);
+        long long GetCell(GLfloat fValue);
+
+        GLuint *pBuckets;           // First vertex in each bucket
+        GLuint *pNext;              // Next vertex in the same bucket
+        GLuint nBucketMask;         // Number of buckets - 1 (power of two)
+        GLuint nMaxVerts;           // Size of pNext
+
+        GLfloat fEpsilon;           // How small a difference to equate
+        GLfloat fCellSize;          // Edge length of a hash cell
+        GLfloat fInvCellSize;
+    };
+
+#endif
@@ -0,0 +1,704 @@
+/*
+ *  MipChain.cpp
+ *  OpenGL SuperBible
+ *
+ *  CPU mipmap building, see MipChain.h
+ */
+
+#include "MipChain.h"
+#include "BlockCompress.h"
+#include "math3d.h"         // For M3D_USE_SSE
+#include <math.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef M3D_USE_SSE
+#include <xmmintrin.h>
+#endif
+
+#define MIP_KAISER_RADIUS   2.0     // In texels of the smaller image
+#define MIP_KAISER_ALPHA    4.0
+#define MIP_JOB_ROWS        8       // Rows per job when sharing out a level
+#define MIP_ENCODE_SIZE     4096    // Entries in the linear to sRGB table
+
+///////////////////////////////////////////////////////////////////////////////
+// Bytes to 0..1, sRGB to linear light and back. Filled in before main()
+// runs, so the texture loading threads never race to do it.
+static GLfloat mipToUnit[256];
+static GLfloat mipToLinear[256];
+static GLubyte mipToSRGB[MIP_ENCODE_SIZE];
+
+static struct MIPTABLES
+    {
+    MIPTABLES(void)
+        {
+        for(int i = 0; i < 256; i++)
+            {
+            double c = double(i) / 255.0;
+            mipToUnit[i] = GLfloat(c);
+            mipToLinear[i] = GLfloat((c <= 0.04045) ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+            }
+
+        for(int i = 0; i < MIP_ENCODE_SIZE; i++)
+            {
+            double l = double(i) / double(MIP_ENCODE_SIZE - 1);
+            double c = (l <= 0.0031308) ? l * 12.92 : 1.055 * pow(l, 1.0 / 2.4) - 0.055;
+            mipToSRGB[i] = GLubyte(c * 255.0 + 0.5);
+            }
+        }
+    } mipTables;
+
+///////////////////////////////////////////////////////////////////////////////
+// Which source texels make up each texel of the smaller image, and how much
+// of each. Texel i's taps are pIndexes/pWeights[pStart[i] .. pStart[i+1]-1].
+typedef struct
+    {
+    GLint   *pStart;
+    GLint   *pIndexes;
+    GLfloat *pWeights;
+    } MIPTAPS;
+
+// Modified Bessel function of the first kind, order zero
+static double mipBesselI0(double x)
+    {
+    double dSum = 1.0, dTerm = 1.0;
+    for(int k = 1; k < 32; k++)
+        {
+        dTerm *= (x * 0.5 / k) * (x * 0.5 / k);
+        dSum += dTerm;
+        if(dTerm < dSum * 1e-12)
+            break;
+        }
+    return dSum;
+    }
+
+// Kaiser windowed sinc, t in texels of the smaller image
+static double mipKaiser(double t)
+    {
+    t = fabs(t);
+    if(t >= MIP_KAISER_RADIUS)
+        return 0.0;
+
+    double dSinc = (t < 1e-6) ? 1.0 : sin(M3D_PI * t) / (M3D_PI * t);
+    double r = t / MIP_KAISER_RADIUS;
+    return dSinc * mipBesselI0(MIP_KAISER_ALPHA * sqrt(1.0 - r * r)) / mipBesselI0(MIP_KAISER_ALPHA);
+    }
+
+static void mipMakeTaps(GLint nSrc, GLint nDst, bool bKaiser, MIPTAPS *pTaps)
+    {
+    double dScale = double(nSrc) / double(nDst);
+    double dStretch = (dScale > 1.0) ? dScale : 1.0;
+    double dSupport = bKaiser ? MIP_KAISER_RADIUS * dStretch : ((dScale > 1.0) ? dScale * 0.5 : 1.0);
+    GLint nMaxTaps = GLint(ceil(dSupport * 2.0)) + 2;
+
+    pTaps->pStart = new GLint[nDst + 1];
+    pTaps->pIndexes = new GLint[nDst * nMaxTaps];
+    pTaps->pWeights = new GLfloat[nDst * nMaxTaps];
+
+    GLint nTaps = 0;
+    for(GLint i = 0; i < nDst; i++)
+        {
+        double dCenter = (i + 0.5) * dScale;
+        GLint jFirst = GLint(floor(dCenter - dSupport));
+        GLint jLast = GLint(ceil(dCenter + dSupport));
+        GLint nFirstTap = nTaps;
+        double dTotal = 0.0;
+
+        pTaps->pStart[i] = nTaps;
+        for(GLint j = jFirst; j <= jLast && nTaps - nFirstTap < nMaxTaps; j++)
+            {
+            double dWeight;
+            if(bKaiser)
+                dWeight = mipKaiser((j + 0.5 - dCenter) / dStretch);
+            else if(dScale > 1.0)
+                {
+                // How much of texel j the new texel covers
+                double dLeft = dCenter - dScale * 0.5, dRight = dCenter + dScale * 0.5;
+                dWeight = ((dRight < j + 1) ? dRight : j + 1) - ((dLeft > j) ? dLeft : j);
+                }
+            else
+                dWeight = 1.0 - fabs(j + 0.5 - dCenter);    // Growing, interpolate
+
+            if(dWeight == 0.0 || (!bKaiser && dWeight < 0.0))
+                continue;
+
+            // Off the edge is the edge texel again
+            pTaps->pIndexes[nTaps] = (j < 0) ? 0 : ((j >= nSrc) ? nSrc - 1 : j);
+            pTaps->pWeights[nTaps] = GLfloat(dWeight);
+            dTotal += dWeight;
+            nTaps++;
+            }
+
+        // Weights add up to one, so flat areas stay flat
+        if(dTotal <= 0.0)
+            {
+            GLint j = GLint(dCenter);
+            pTaps->pIndexes[nTaps] = (j >= nSrc) ? nSrc - 1 : j;
+            pTaps->pWeights[nTaps++] = 1.0f;
+            }
+        else
+            for(GLint k = nFirstTap; k < nTaps; k++)
+                pTaps->pWeights[k] = GLfloat(pTaps->pWeights[k] / dTotal);
+        }
+    pTaps->pStart[nDst] = nTaps;
+    }
+
+static void mipFreeTaps(MIPTAPS *pTaps)
+    {
+    delete [] pTaps->pStart;
+    delete [] pTaps->pIndexes;
+    delete [] pTaps->pWeights;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// One step down the chain, shared out by rows. Every texel is four floats
+// whatever the format, so the filters can do all four channels at once.
+typedef struct
+    {
+    const GLubyte   *pBytes;        // Source level as bytes, for the top one
+    const GLfloat   *pSrc;          // Or as floats
+    GLint           nSrcWidth;
+    GLfloat         *pTemp;         // Source rows, filtered across
+    GLfloat         *pDst;
+    GLint           nDstWidth;
+    MIPTAPS         columns, rows;
+    GLubyte         *pOut;          // Where the level's bytes go
+    GLint           nPixelSize;
+    bool            bSRGB;
+    } MIPPASS;
+
+// A row of bytes to linear floats, a table lookup per channel
+static void mipConvertRow(const GLubyte *pIn, GLint nWidth, GLint nPixelSize, bool bSRGB, GLfloat *pOut)
+    {
+    const GLfloat *pColor = bSRGB ? mipToLinear : mipToUnit;
+    GLint x;
+
+    switch(nPixelSize)
+        {
+        case 1:
+            for(x = 0; x < nWidth; x++, pIn++, pOut += 4)
+                {
+                pOut[0] = pColor[pIn[0]];
+                pOut[1] = pOut[2] = pOut[3] = 0.0f;
+                }
+            break;
+        case 3:
+            for(x = 0; x < nWidth; x++, pIn += 3, pOut += 4)
+                {
+                pOut[0] = pColor[pIn[0]];
+                pOut[1] = pColor[pIn[1]];
+                pOut[2] = pColor[pIn[2]];
+                pOut[3] = 0.0f;
+                }
+            break;
+        case 4:
+            for(x = 0; x < nWidth; x++, pIn += 4, pOut += 4)
+                {
+                pOut[0] = pColor[pIn[0]];
+                pOut[1] = pColor[pIn[1]];
+                pOut[2] = pColor[pIn[2]];
+                pOut[3] = mipToUnit[pIn[3]];
+                }
+            break;
+        }
+    }
+
+// Filter source rows across to the new width. Starting from the image's
+// bytes, each row is made into floats just before it's used, rather than
+// making a float copy of the whole (biggest) level first.
+static void mipFilterColumns(void *pData, GLuint nFirst, GLuint nLast)
+    {
+    MIPPASS *pPass = (MIPPASS *)pData;
+    const MIPTAPS *pTaps = &pPass->columns;
+    GLfloat *pRow = (pPass->pBytes != NULL) ? new GLfloat[pPass->nSrcWidth * 4] : NULL;
+
+    for(GLuint y = nFirst; y < nLast; y++)
+        {
+        const GLfloat *pIn = pPass->pSrc + y * pPass->nSrcWidth * 4;
+        if(pRow != NULL)
+            {
+            mipConvertRow(pPass->pBytes + y * pPass->nSrcWidth * pPass->nPixelSize, pPass->nSrcWidth,
+                          pPass->nPixelSize, pPass->bSRGB, pRow);
+            pIn = pRow;
+            }
+
+        GLfloat *pOut = pPass->pTemp + y * pPass->nDstWidth * 4;
+
+        for(GLint x = 0; x < pPass->nDstWidth; x++, pOut += 4)
+            {
+#ifdef M3D_USE_SSE
+            __m128 vSum = _mm_setzero_ps();
+            for(GLint k = pTaps->pStart[x]; k < pTaps->pStart[x + 1]; k++)
+                vSum = _mm_add_ps(vSum, _mm_mul_ps(_mm_set1_ps(pTaps->pWeights[k]), _mm_loadu_ps(pIn + pTaps->pIndexes[k] * 4)));
+            _mm_storeu_ps(pOut, vSum);
+#else
+            pOut[0] = pOut[1] = pOut[2] = pOut[3] = 0.0f;
+            for(GLint k = pTaps->pStart[x]; k < pTaps->pStart[x + 1]; k++)
+                {
+                const GLfloat *pTexel = pIn + pTaps->pIndexes[k] * 4;
+                GLfloat fWeight = pTaps->pWeights[k];
+                pOut[0] += fWeight * pTexel[0];
+                pOut[1] += fWeight * pTexel[1];
+                pOut[2] += fWeight * pTexel[2];
+                pOut[3] += fWeight * pTexel[3];
+                }
+#endif
+            }
+        }
+
+    delete [] pRow;
+    }
+
+// Filter down to the new height, and store the rows as bytes
+static void mipFilterRows(void *pData, GLuint nFirst, GLuint nLast)
+    {
+    MIPPASS *pPass = (MIPPASS *)pData;
+    const MIPTAPS *pTaps = &pPass->rows;
+    GLint nRowFloats = pPass->nDstWidth * 4;
+    GLint nPixelSize = pPass->nPixelSize;
+
+    for(GLuint y = nFirst; y < nLast; y++)
+        {
+        GLfloat *pOut = pPass->pDst + y * nRowFloats;
+        GLint i;
+
+        memset(pOut, 0, sizeof(GLfloat) * nRowFloats);
+        for(GLint k = pTaps->pStart[y]; k < pTaps->pStart[y + 1]; k++)
+            {
+            const GLfloat *pIn = pPass->pTemp + pTaps->pIndexes[k] * nRowFloats;
+            GLfloat fWeight = pTaps->pWeights[k];
+#ifdef M3D_USE_SSE
+            __m128 vWeight = _mm_set1_ps(fWeight);
+            for(i = 0; i < nRowFloats; i += 4)
+                _mm_storeu_ps(pOut + i, _mm_add_ps(_mm_loadu_ps(pOut + i), _mm_mul_ps(vWeight, _mm_loadu_ps(pIn + i))));
+#else
+            for(i = 0; i < nRowFloats; i++)
+                pOut[i] += fWeight * pIn[i];
+#endif
+            }
+
+        // Sharp filters overshoot, clamp on the way out
+        GLubyte *pBytes = pPass->pOut + y * pPass->nDstWidth * nPixelSize;
+        for(GLint x = 0; x < pPass->nDstWidth; x++, pBytes += nPixelSize)
+            for(GLint c = 0; c < nPixelSize; c++)
+                {
+                GLfloat f = pOut[x * 4 + c];
+                f = (f < 0.0f) ? 0.0f : ((f > 1.0f) ? 1.0f : f);
+                if(pPass->bSRGB && c != 3)
+                    pBytes[c] = mipToSRGB[GLint(f * GLfloat(MIP_ENCODE_SIZE - 1) + 0.5f)];
+                else
+                    pBytes[c] = GLubyte(f * 255.0f + 0.5f);
+                }
+        }
+    }
+
+static void mipRun(CJobScheduler *pJobs, JOBFUNC pFunc, MIPPASS *pPass, GLuint nRows)
+    {
+    if(pJobs != NULL)
+        pJobs->ParallelFor(pFunc, pPass, nRows, MIP_JOB_ROWS);
+    else
+        pFunc(pPass, 0, nRows);
+    }
+
+// Resize pPass->pSrc to nDstWidth x nDstHeight, returning the new floats
+static GLfloat *mipResample(MIPPASS *pPass, GLint nSrcHeight, GLint nDstWidth, GLint nDstHeight, bool bKaiser,
+                            CJobScheduler *pJobs)
+    {
+    pPass->nDstWidth = nDstWidth;
+    pPass->pTemp = new GLfloat[nSrcHeight * nDstWidth * 4];
+    pPass->pDst = new GLfloat[nDstWidth * nDstHeight * 4];
+    mipMakeTaps(pPass->nSrcWidth, nDstWidth, bKaiser, &pPass->columns);
+    mipMakeTaps(nSrcHeight, nDstHeight, bKaiser, &pPass->rows);
+
+    mipRun(pJobs, mipFilterColumns, pPass, nSrcHeight);
+    mipRun(pJobs, mipFilterRows, pPass, nDstHeight);
+
+    mipFreeTaps(&pPass->columns);
+    mipFreeTaps(&pPass->rows);
+    delete [] pPass->pTemp;
+    return pPass->pDst;
+    }
+
+static GLint mipNearestPowerOfTwo(GLint n)
+    {
+    GLint nPower = 1;
+    while(nPower < n)
+        nPower *= 2;
+
+    // Whichever is closer, rounding up on a tie
+    return (nPower - n > n - nPower / 2) ? nPower / 2 : nPower;
+    }
+
+static GLint mipPixelSize(GLenum eFormat)
+    {
+    switch(eFormat)
+        {
+        case GL_LUMINANCE:
+            return 1;
+        case GL_BGR_EXT:
+        case GL_RGB:
+            return 3;
+        case GL_BGRA_EXT:
+        case GL_RGBA:
+            return 4;
+        }
+    return 0;
+    }
+
+static bool mipIsCompressed(GLenum eFormat)
+    {
+    return eFormat == GL_COMPRESSED_RGB_S3TC_DXT1_EXT || eFormat == GL_COMPRESSED_RGBA_S3TC_DXT5_EXT;
+    }
+
+
+///////////////////////////////////////////////////////////////////////////////
+CMipChain::CMipChain(void)
+    {
+    nNumLevels = 0;
+    eFormat = GL_RGBA;
+    nPixelSize = 0;
+    nBuildFlags = 0;
+    pData = NULL;
+    nDataSize = 0;
+    pMapping = NULL;
+    nMappingSize = 0;
+    }
+
+CMipChain::~CMipChain(void)
+    {
+    Free();
+    }
+
+void CMipChain::Free(void)
+    {
+    if(pMapping != NULL)
+        gltUnmapFile(pMapping, nMappingSize);
+    else
+        delete [] pData;
+
+    pMapping = NULL;
+    nMappingSize = 0;
+    pData = NULL;
+    nDataSize = 0;
+    nNumLevels = 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Work out the size and place of every level, down to 1x1
+bool CMipChain::SetLayout(GLint nWidth, GLint nHeight, GLenum eNewFormat)
+    {
+    nPixelSize = mipPixelSize(eNewFormat);
+    if((nPixelSize == 0 && !mipIsCompressed(eNewFormat)) || nWidth <= 0 || nHeight <= 0)
+        return false;
+
+    eFormat = eNewFormat;
+    nNumLevels = 0;
+    nDataSize = 0;
+    for(;;)
+        {
+        if(nNumLevels == MIP_MAX_LEVELS)
+            return false;
+
+        levels[nNumLevels].nWidth = nWidth;
+        levels[nNumLevels].nHeight = nHeight;
+        levels[nNumLevels].nOffset = nDataSize;
+        if(nPixelSize == 0)
+            levels[nNumLevels].nSize = bcGetCompressedSize(nWidth, nHeight, eNewFormat);
+        else
+            levels[nNumLevels].nSize = nWidth * nHeight * nPixelSize;
+        nDataSize += levels[nNumLevels].nSize;
+        nNumLevels++;
+
+        if(nWidth == 1 && nHeight == 1)
+            return true;
+
+        nWidth = (nWidth > 1) ? nWidth / 2 : 1;
+        nHeight = (nHeight > 1) ? nHeight / 2 : 1;
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Build the chain, each level from the one before
+bool CMipChain::Build(const GLbyte *pBits, GLint iWidth, GLint iHeight, GLenum eImageFormat, GLuint nFlags,
+                      CJobScheduler *pJobs)
+    {
+    Free();
+
+    if(pBits == NULL)
+        return false;
+
+    GLint nTopWidth = iWidth, nTopHeight = iHeight;
+    if(nFlags & MIP_POWER_OF_TWO)
+        {
+        nTopWidth = mipNearestPowerOfTwo(iWidth);
+        nTopHeight = mipNearestPowerOfTwo(iHeight);
+        }
+
+    if(!SetLayout(nTopWidth, nTopHeight, eImageFormat))
+        {
+        nNumLevels = 0;
+        nDataSize = 0;
+        return false;
+        }
+    pData = new GLubyte[nDataSize];
+    nBuildFlags = nFlags;
+
+    bool bKaiser = (nFlags & MIP_KAISER) != 0;
+    MIPPASS pass;
+    pass.nPixelSize = nPixelSize;
+    pass.bSRGB = (nFlags & MIP_SRGB) != 0;
+
+    // Into the right size if it isn't already. The top level is read as
+    // bytes, every one after that from the floats of the one before.
+    GLfloat *pLevel = NULL;
+    pass.pBytes = (const GLubyte *)pBits;
+    pass.pSrc = NULL;
+    pass.nSrcWidth = iWidth;
+    if(nTopWidth != iWidth || nTopHeight != iHeight)
+        {
+        pass.pOut = pData;
+        pLevel = mipResample(&pass, iHeight, nTopWidth, nTopHeight, bKaiser, pJobs);
+        pass.pBytes = NULL;
+        }
+    else
+        memcpy(pData, pBits, levels[0].nWidth * levels[0].nHeight * nPixelSize);
+
+    for(int i = 1; i < nNumLevels; i++)
+        {
+        pass.pSrc = pLevel;
+        pass.nSrcWidth = levels[i - 1].nWidth;
+        pass.pOut = pData + levels[i].nOffset;
+        GLfloat *pNext = mipResample(&pass, levels[i - 1].nHeight, levels[i].nWidth, levels[i].nHeight, bKaiser, pJobs);
+        delete [] pLevel;
+        pLevel = pNext;
+        pass.pBytes = NULL;
+        }
+
+    delete [] pLevel;
+
+    if(nFlags & MIP_COMPRESS)
+        return Compress(pJobs);
+
+    return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Replace the levels with their compressed blocks. BC3 only if the top
+// level has some alpha to keep, the smaller ones can't have any more.
+bool CMipChain::Compress(CJobScheduler *pJobs)
+    {
+    MIPLEVEL rawLevels[MIP_MAX_LEVELS];
+    GLubyte *pRaw = pData;
+    GLenum eRawFormat = eFormat;
+    int nRawLevels = nNumLevels;
+
+    memcpy(rawLevels, levels, sizeof(levels));
+
+    GLenum eCompressed = bcChooseFormat(pRaw, levels[0].nWidth, levels[0].nHeight, eRawFormat);
+    SetLayout(levels[0].nWidth, levels[0].nHeight, eCompressed);
+    pData = new GLubyte[nDataSize];
+
+    for(int i = 0; i < nRawLevels; i++)
+        bcCompressImage(pRaw + rawLevels[i].nOffset, rawLevels[i].nWidth, rawLevels[i].nHeight, eRawFormat,
+                        eCompressed, pData + levels[i].nOffset, pJobs);
+
+    delete [] pRaw;
+    return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Every level, into whatever texture is bound
+void CMipChain::Upload(bool bFromPixelBuffer)
+    {
+    if(nNumLevels == 0)
+        return;
+
+    GLint iInternal = (nPixelSize == 1) ? GL_LUMINANCE8 : ((nPixelSize == 3) ? GL_RGB8 : GL_RGBA8);
+    const GLubyte *pBase = bFromPixelBuffer ? NULL : pData;
+
+    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    for(int i = 0; i < nNumLevels; i++)
+        if(nPixelSize == 0)
+            glCompressedTexImage2D(GL_TEXTURE_2D, i, eFormat, levels[i].nWidth, levels[i].nHeight, 0,
+                                   levels[i].nSize, pBase + levels[i].nOffset);
+        else
+            glTexImage2D(GL_TEXTURE_2D, i, iInternal, levels[i].nWidth, levels[i].nHeight, 0, eFormat,
+                         GL_UNSIGNED_BYTE, pBase + levels[i].nOffset);
+    glPopClientAttrib();
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, nNumLevels - 1);
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// A .mip file is this header, then the levels exactly as they are in
+// memory. The .tga it came from is identified by its size and a 64 bit
+// FNV-1a hash of its bytes, if either changes the .mip is out of date.
+// Stored in the byte order of the machine that wrote it, like the mesh
+// files.
+#define MIP_FILE_MAGIC      0x4350494D      // "MIPC" on little endian
+
+typedef struct
+    {
+    GLuint  nMagic;             // MIP_FILE_MAGIC
+    GLuint  nVersion;           // MIP_FILE_VERSION
+    GLuint  nFlags;             // As built
+    GLuint  eFormat;
+    GLint   nWidth, nHeight;    // Of level 0
+    GLuint  nNumLevels;
+    GLuint  nDataSize;
+    GLuint  nSourceSize;
+    GLuint  nSourceHash[2];     // Low half first
+    } MIPFILEHEADER;
+
+static bool mipGetSourceStamp(const char *szSourceFile, GLuint *pSize, GLuint nHash[2])
+    {
+    unsigned long nSize;
+    const GLubyte *pFile = (const GLubyte *)gltMapFile(szSourceFile, &nSize);
+    if(pFile == NULL)
+        return false;
+
+    unsigned long long nFNV = 14695981039346656037ULL;
+    for(unsigned long i = 0; i < nSize; i++)
+        {
+        nFNV ^= pFile[i];
+        nFNV *= 1099511628211ULL;
+        }
+    gltUnmapFile((void *)pFile, nSize);
+
+    *pSize = GLuint(nSize);
+    nHash[0] = GLuint(nFNV & 0xFFFFFFFF);
+    nHash[1] = GLuint(nFNV >> 32);
+    return true;
+    }
+
+void CMipChain::GetCacheName(const char *szFileName, char *szCacheName, int nMaxLength)
+    {
+    int nLength = int(strlen(szFileName));
+    int iDot = nLength;
+
+    for(int i = nLength - 1; i >= 0 && szFileName[i] != '/' && szFileName[i] != '\\'; i--)
+        if(szFileName[i] == '.')
+            {
+            iDot = i;
+            break;
+            }
+
+    if(iDot + 5 > nMaxLength)
+        {
+        szCacheName[0] = '\0';
+        return;
+        }
+
+    memcpy(szCacheName, szFileName, iDot);
+    strcpy(szCacheName + iDot, ".mip");
+    }
+
+//////////////////////////////////////////////////////////////////
+// Returns false if the file could not be written
+bool CMipChain::Save(const char *szFileName, const char *szSourceFile)
+    {
+    MIPFILEHEADER mipHeader;
+
+    if(nNumLevels == 0 || !mipGetSourceStamp(szSourceFile, &mipHeader.nSourceSize, mipHeader.nSourceHash))
+        return false;
+
+    mipHeader.nMagic = MIP_FILE_MAGIC;
+    mipHeader.nVersion = MIP_FILE_VERSION;
+    mipHeader.nFlags = nBuildFlags;
+    mipHeader.eFormat = eFormat;
+    mipHeader.nWidth = levels[0].nWidth;
+    mipHeader.nHeight = levels[0].nHeight;
+    mipHeader.nNumLevels = nNumLevels;
+    mipHeader.nDataSize = nDataSize;
+
+    FILE *pFile = fopen(szFileName, "wb");
+    if(pFile == NULL)
+        return false;
+
+    bool bOK = (fwrite(&mipHeader, sizeof(MIPFILEHEADER), 1, pFile) == 1);
+    bOK = bOK && (fwrite(pData, nDataSize, 1, pFile) == 1);
+
+    if(fclose(pFile) != 0)
+        bOK = false;
+
+    // Don't leave half a file to be found next time
+    if(!bOK)
+        remove(szFileName);
+
+    return bOK;
+    }
+
+//////////////////////////////////////////////////////////////////
+// Map a .mip file and use the levels in place. Returns false, and leaves
+// the chain empty, if it's missing, doesn't add up, or is out of date.
+bool CMipChain::Load(const char *szFileName, const char *szSourceFile, GLuint nFlags)
+    {
+    Free();
+
+    GLuint nSourceSize, nSourceHash[2];
+    if(!mipGetSourceStamp(szSourceFile, &nSourceSize, nSourceHash))
+        return false;
+
+    unsigned long nSize;
+    GLubyte *pFile = (GLubyte *)gltMapFile(szFileName, &nSize);
+    if(pFile == NULL)
+        return false;
+
+    const MIPFILEHEADER *pHeader = (const MIPFILEHEADER *)pFile;
+    bool bOK = (nSize >= sizeof(MIPFILEHEADER));
+    bOK = bOK && pHeader->nMagic == MIP_FILE_MAGIC && pHeader->nVersion == MIP_FILE_VERSION;
+    bOK = bOK && pHeader->nFlags == nFlags;
+    bOK = bOK && pHeader->nSourceSize == nSourceSize;
+    bOK = bOK && pHeader->nSourceHash[0] == nSourceHash[0] && pHeader->nSourceHash[1] == nSourceHash[1];
+
+    // The layout has to come out the same as it did for whoever wrote it
+    bOK = bOK && SetLayout(pHeader->nWidth, pHeader->nHeight, pHeader->eFormat);
+    bOK = bOK && GLuint(nNumLevels) == pHeader->nNumLevels && nDataSize == pHeader->nDataSize;
+    bOK = bOK && (unsigned long long)sizeof(MIPFILEHEADER) + nDataSize <= nSize;
+
+    if(!bOK)
+        {
+        gltUnmapFile(pFile, nSize);
+        nNumLevels = 0;
+        nDataSize = 0;
+        return false;
+        }
+
+    pMapping = pFile;
+    nMappingSize = nSize;
+    pData = pFile + sizeof(MIPFILEHEADER);
+    nBuildFlags = nFlags;
+    return true;
+    }
+
+//////////////////////////////////////////////////////////////////
+// Load and build, or take it from the cache
+bool CMipChain::BuildFromTGA(const char *szFileName, GLuint nFlags, bool bUseCache, CJobScheduler *pJobs)
+    {
+    char szCacheName[512];
+
+    if(bUseCache)
+        {
+        GetCacheName(szFileName, szCacheName, sizeof(szCacheName));
+        if(szCacheName[0] != '\0' && Load(szCacheName, szFileName, nFlags))
+            return true;
+        }
+
+    GLTIMAGE image;
+    if(!gltLoadTGAImage(szFileName, &image))
+        {
+        Free();
+        return false;
+        }
+
+    bool bOK = Build(image.pBits, image.iWidth, image.iHeight, image.eFormat, nFlags, pJobs);
+    gltFreeImage(&image);
+
+    // Not being able to write the cache doesn't stop us using the chain
+    if(bOK && bUseCache && szCacheName[0] != '\0')
+        Save(szCacheName, szFileName);
+
+    return bOK;
+    }
@@ -0,0 +1,129 @@
+/*
+ *  MipChain.h
+ *  OpenGL SuperBible
+ *
+ *  Builds a texture's whole mipmap chain on the CPU, in place of
+ *  gluBuild2DMipmaps(). Each level is made from the one above it with a
+ *  separable filter, working in floating point throughout (the levels are
+ *  only rounded to bytes for storing, never for making the next one):
+ *
+ *      Box         The average of the texels each new texel covers. This
+ *                  is what GLU does, and the fastest.
+ *      Kaiser      A Kaiser windowed sinc, four texels either side. Keeps
+ *                  the smaller levels a good deal sharper than the box
+ *                  filter does, for a little under twice the time.
+ *
+ *  Texture images are sRGB, so with MIP_SRGB the color channels are turned
+ *  into linear light before filtering and back again after. Otherwise a
+ *  checkerboard of black and white turns into a gray that is much too dark
+ *  (alpha is always filtered as it is). An image that isn't a power of two
+ *  in size is kept as it is, unless MIP_POWER_OF_TWO asks for it to be
+ *  resized to the nearest one first, as GLU always does.
+ *
+ *  Given a job scheduler, each level's rows are shared out between the
+ *  threads. Texture loading threads that each build their own chain should
+ *  leave it out, they are already keeping the cores busy.
+ *
+ *  Building the chain for a big texture every time the program starts is a
+ *  waste, so BuildFromTGA() can keep it in a .mip file next to the .tga,
+ *  and use that instead for as long as the .tga doesn't change. The .mip
+ *  file knows its .tga by a hash of the .tga's contents, so copying or
+ *  touching the .tga doesn't throw the chain away, but editing it does.
+ *
+ *  With MIP_COMPRESS the finished levels are block compressed, BC1 or (for
+ *  images with some alpha) BC3, see BlockCompress.h. That takes longer than
+ *  building the chain, which is where the .mip file earns its keep, but
+ *  the texture then needs a quarter to an eighth of the memory. Only ask
+ *  for it when GL_EXT_texture_compression_s3tc is there to upload it.
+ *
+ *      CMipChain mips;
+ *      mips.BuildFromTGA("stone.tga", MIP_KAISER | MIP_SRGB, true);
+ *      glBindTexture(GL_TEXTURE_2D, nStone);
+ *      mips.Upload();
+ */
+
+#ifndef __MIP_CHAIN__
+#define __MIP_CHAIN__
+
+#include "gltools.h"
+#include "JobSystem.h"
+
+#define MIP_MAX_LEVELS      16
+
+// Build flags
+#define MIP_KAISER          0x01    // Otherwise box
+#define MIP_SRGB            0x02    // Filter color in linear light
+#define MIP_POWER_OF_TWO    0x04    // Resize the top level to a power of two
+#define MIP_COMPRESS        0x08    // Store the levels as BC1 or BC3
+
+#define MIP_FILE_VERSION    2
+
+class CMipChain
+    {
+    public:
+        CMipChain(void);
+        ~CMipChain(void);
+
+        // Make the chain for an image, as gltLoadTGA() returns them
+        // (tightly packed rows, GL_BGR_EXT, GL_BGRA_EXT, GL_LUMINANCE,
+        // GL_RGB or GL_RGBA). Returns false for anything else.
+        bool Build(const GLbyte *pBits, GLint iWidth, GLint iHeight, GLenum eFormat, GLuint nFlags,
+                   CJobScheduler *pJobs = NULL);
+
+        // Load a .tga and build its chain. With bUseCache, a .mip file
+        // beside it is used if it was made from the same .tga with the
+        // same flags, and written if not. Returns false if the .tga won't
+        // load (a cache file can't stand in for a missing .tga).
+        bool BuildFromTGA(const char *szFileName, GLuint nFlags, bool bUseCache, CJobScheduler *pJobs = NULL);
+
+        // Read and write .mip files. Load() maps the file and the levels
+        // are used in place. It fails if the file is from a different
+        // version, different flags or a .tga whose contents have changed.
+        bool Save(const char *szFileName, const char *szSourceFile);
+        bool Load(const char *szFileName, const char *szSourceFile, GLuint nFlags);
+
+        // Every level into the bound texture. With bFromPixelBuffer, the
+        // chain (GetData()) has already been copied to the start of the
+        // bound GL_PIXEL_UNPACK_BUFFER.
+        void Upload(bool bFromPixelBuffer = false);
+
+        void Free(void);
+
+        // "name.tga" to "name.mip"
+        static void GetCacheName(const char *szFileName, char *szCacheName, int nMaxLength);
+
+        // All the levels, one after another with no padding
+        inline const GLubyte *GetData(void) { return pData; }
+        inline GLuint GetDataSize(void) { return nDataSize; }
+
+        inline int GetLevelCount(void) { return nNumLevels; }
+        inline GLint GetWidth(int iLevel) { return levels[iLevel].nWidth; }
+        inline GLint GetHeight(int iLevel) { return levels[iLevel].nHeight; }
+        inline const GLubyte *GetLevel(int iLevel) { return pData + levels[iLevel].nOffset; }
+        inline GLuint GetLevelSize(int iLevel) { return levels[iLevel].nSize; }
+        inline GLenum GetFormat(void) { return eFormat; }
+        inline bool IsCompressed(void) { return nPixelSize == 0 && nNumLevels != 0; }
+
+    protected:
+        typedef struct
+            {
+            GLint   nWidth, nHeight;
+            GLuint  nOffset;                // From the start of pData
+            GLuint  nSize;                  // Bytes
+            } MIPLEVEL;
+
+        bool SetLayout(GLint nWidth, GLint nHeight, GLenum eNewFormat);
+        bool Compress(CJobScheduler *pJobs);
+
+        MIPLEVEL    levels[MIP_MAX_LEVELS];
+        int         nNumLevels;
+        GLenum      eFormat;
+        GLint       nPixelSize;             // Bytes, 0 when compressed
+        GLuint      nBuildFlags;            // MIP_KAISER, etc.
+        GLubyte     *pData;
+        GLuint      nDataSize;
+        void        *pMapping;              // Load() file mapping pData points into
+        unsigned long nMappingSize;
+    };
+
+#endif
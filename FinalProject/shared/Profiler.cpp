@@ -0,0 +1,297 @@
+/*
+ *  Profiler.cpp
+ *  OpenGL SuperBible
+ *
+ *  Frame time instrumentation, see Profiler.h
+ */
+
+#include "Profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Start with just the frame zone
+CProfiler::CProfiler(void)
+    {
+    nNumZones = 0;
+    nFrame = 0;
+    bGPUTimers = false;
+    bQueryRunning = false;
+
+    AddZone("frame");
+    }
+
+CProfiler::~CProfiler(void)
+    {
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// GPU timers, if we have them. The queries for zone 0 are never used.
+void CProfiler::InitGL(void)
+    {
+    if(bGPUTimers || !GLEE_EXT_timer_query)
+        return;
+
+    bGPUTimers = true;
+    for(int i = 0; i < nNumZones; i++)
+        {
+        glGenQueries(PROFILER_QUERY_FRAMES, zones[i].queries);
+        memset(zones[i].bQueryIssued, 0, sizeof(zones[i].bQueryIssued));
+        }
+    }
+
+void CProfiler::FreeGL(void)
+    {
+    if(!bGPUTimers)
+        return;
+
+    for(int i = 0; i < nNumZones; i++)
+        glDeleteQueries(PROFILER_QUERY_FRAMES, zones[i].queries);
+
+    bGPUTimers = false;
+    bQueryRunning = false;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Add a zone, or find the one that already has this name
+int CProfiler::AddZone(const char *szName)
+    {
+    for(int i = 0; i < nNumZones; i++)
+        if(strcmp(zones[i].szName, szName) == 0)
+            return i;
+
+    if(nNumZones == PROFILER_MAX_ZONES)
+        return -1;
+
+    PROFILEZONE *pZone = &zones[nNumZones];
+    strncpy(pZone->szName, szName, sizeof(pZone->szName) - 1);
+    pZone->szName[sizeof(pZone->szName) - 1] = '\0';
+    pZone->nStart = 0;
+    pZone->bQueryActive = false;
+    memset(pZone->bQueryIssued, 0, sizeof(pZone->bQueryIssued));
+    for(int i = 0; i < PROFILER_HISTORY; i++)
+        pZone->fCPU[i] = pZone->fGPU[i] = PROFILER_NO_DATA;
+
+    if(bGPUTimers)
+        glGenQueries(PROFILER_QUERY_FRAMES, pZone->queries);
+
+    return nNumZones++;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Read back the GPU times from the queries in one slot, which were issued
+// during nIssuedFrame. That was PROFILER_QUERY_FRAMES ago, so the results
+// should be long since ready and this won't stall.
+void CProfiler::CollectQueries(unsigned int nSlot, unsigned int nIssuedFrame)
+    {
+    for(int i = 1; i < nNumZones; i++)
+        {
+        if(!zones[i].bQueryIssued[nSlot])
+            continue;
+
+        GLuint64EXT nNanoseconds = 0;
+        glGetQueryObjectui64vEXT(zones[i].queries[nSlot], GL_QUERY_RESULT, &nNanoseconds);
+        zones[i].fGPU[nIssuedFrame % PROFILER_HISTORY] = float(double(nNanoseconds) * 0.000001);
+        zones[i].bQueryIssued[nSlot] = false;
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Pick up all the outstanding GPU times, waiting for them if need be
+void CProfiler::Flush(void)
+    {
+    if(!bGPUTimers)
+        return;
+
+    for(unsigned int i = 1; i <= PROFILER_QUERY_FRAMES && i <= nFrame; i++)
+        CollectQueries((nFrame - i) % PROFILER_QUERY_FRAMES, nFrame - i);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// A new frame. Pick up the GPU times that have come in, and clear out the
+// oldest frame in the history to make room for this one.
+void CProfiler::BeginFrame(void)
+    {
+    unsigned int nSlot = nFrame % PROFILER_QUERY_FRAMES;
+    unsigned int nHistory = nFrame % PROFILER_HISTORY;
+
+    if(bGPUTimers && nFrame >= PROFILER_QUERY_FRAMES)
+        CollectQueries(nSlot, nFrame - PROFILER_QUERY_FRAMES);
+
+    for(int i = 0; i < nNumZones; i++)
+        zones[i].fCPU[nHistory] = zones[i].fGPU[nHistory] = PROFILER_NO_DATA;
+
+    zones[PROFILER_FRAME].nStart = stopWatch.GetTimeNanoseconds();
+    }
+
+void CProfiler::EndFrame(void)
+    {
+    long long nElapsed = stopWatch.GetTimeNanoseconds() - zones[PROFILER_FRAME].nStart;
+    zones[PROFILER_FRAME].fCPU[nFrame % PROFILER_HISTORY] = float(double(nElapsed) * 0.000001);
+    nFrame++;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Start timing a zone. It gets the GPU timer if nobody else has it, and it
+// hasn't already had it this frame (there's only one query per frame).
+void CProfiler::BeginZone(int iZone)
+    {
+    if(iZone <= PROFILER_FRAME || iZone >= nNumZones)
+        return;
+
+    PROFILEZONE *pZone = &zones[iZone];
+    unsigned int nSlot = nFrame % PROFILER_QUERY_FRAMES;
+
+    if(bGPUTimers && !bQueryRunning && !pZone->bQueryIssued[nSlot])
+        {
+        glBeginQuery(GL_TIME_ELAPSED_EXT, pZone->queries[nSlot]);
+        pZone->bQueryActive = true;
+        bQueryRunning = true;
+        }
+
+    pZone->nStart = stopWatch.GetTimeNanoseconds();
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Stop timing a zone. A zone entered more than once in a frame adds up its
+// CPU times.
+void CProfiler::EndZone(int iZone)
+    {
+    if(iZone <= PROFILER_FRAME || iZone >= nNumZones)
+        return;
+
+    PROFILEZONE *pZone = &zones[iZone];
+    float fMilliseconds = float(double(stopWatch.GetTimeNanoseconds() - pZone->nStart) * 0.000001);
+    float *pCPU = &pZone->fCPU[nFrame % PROFILER_HISTORY];
+
+    if(*pCPU < 0.0f)
+        *pCPU = fMilliseconds;
+    else
+        *pCPU += fMilliseconds;
+
+    if(pZone->bQueryActive)
+        {
+        glEndQuery(GL_TIME_ELAPSED_EXT);
+        pZone->bQueryActive = false;
+        pZone->bQueryIssued[nFrame % PROFILER_QUERY_FRAMES] = true;
+        bQueryRunning = false;
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// For qsort()
+static int CompareFloats(const void *pA, const void *pB)
+    {
+    float a = *(const float *)pA;
+    float b = *(const float *)pB;
+
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Percentiles by the nearest rank method, the smallest sample that at least
+// that percentage of the samples are less than or equal to.
+int CProfiler::GetStats(int iZone, bool bGPU, float *pP50, float *pP95, float *pP99)
+    {
+    float fSorted[PROFILER_HISTORY];
+    int nSamples = 0;
+
+    if(iZone >= 0 && iZone < nNumZones)
+        {
+        const float *pHistory = bGPU ? zones[iZone].fGPU : zones[iZone].fCPU;
+        for(int i = 0; i < PROFILER_HISTORY; i++)
+            if(pHistory[i] >= 0.0f)
+                fSorted[nSamples++] = pHistory[i];
+        }
+
+    float fPercentiles[3] = { PROFILER_NO_DATA, PROFILER_NO_DATA, PROFILER_NO_DATA };
+    if(nSamples > 0)
+        {
+        static const float fRanks[3] = { 0.50f, 0.95f, 0.99f };
+
+        qsort(fSorted, nSamples, sizeof(float), CompareFloats);
+        for(int i = 0; i < 3; i++)
+            {
+            int iRank = int(ceil(fRanks[i] * nSamples)) - 1;
+            fPercentiles[i] = fSorted[(iRank < 0) ? 0 : iRank];
+            }
+        }
+
+    if(pP50 != NULL)
+        *pP50 = fPercentiles[0];
+    if(pP95 != NULL)
+        *pP95 = fPercentiles[1];
+    if(pP99 != NULL)
+        *pP99 = fPercentiles[2];
+
+    return nSamples;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// One line per zone, times in milliseconds. Missing GPU times are left empty.
+bool CProfiler::WriteCSV(const char *szFileName)
+    {
+    Flush();
+
+    FILE *pFile = fopen(szFileName, "w");
+    if(pFile == NULL)
+        return false;
+
+    fprintf(pFile, "zone,cpu_samples,cpu_p50_ms,cpu_p95_ms,cpu_p99_ms,gpu_samples,gpu_p50_ms,gpu_p95_ms,gpu_p99_ms\n");
+    for(int i = 0; i < nNumZones; i++)
+        {
+        float p50, p95, p99;
+
+        int nSamples = GetStats(i, false, &p50, &p95, &p99);
+        fprintf(pFile, "%s,%d,", zones[i].szName, nSamples);
+        if(nSamples > 0)
+            fprintf(pFile, "%.4f,%.4f,%.4f,", p50, p95, p99);
+        else
+            fprintf(pFile, ",,,");
+
+        nSamples = GetStats(i, true, &p50, &p95, &p99);
+        fprintf(pFile, "%d,", nSamples);
+        if(nSamples > 0)
+            fprintf(pFile, "%.4f,%.4f,%.4f\n", p50, p95, p99);
+        else
+            fprintf(pFile, ",,\n");
+        }
+
+    fclose(pFile);
+    return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// The same, as JSON. Missing GPU times are null.
+bool CProfiler::WriteJSON(const char *szFileName)
+    {
+    Flush();
+
+    FILE *pFile = fopen(szFileName, "w");
+    if(pFile == NULL)
+        return false;
+
+    fprintf(pFile, "{\n  \"frames\": %u,\n  \"gpu_timers\": %s,\n  \"zones\": [\n", nFrame, bGPUTimers ? "true" : "false");
+    for(int i = 0; i < nNumZones; i++)
+        {
+        fprintf(pFile, "    { \"name\": \"%s\"", zones[i].szName);
+        for(int j = 0; j < 2; j++)
+            {
+            float p50, p95, p99;
+            int nSamples = GetStats(i, j == 1, &p50, &p95, &p99);
+
+            fprintf(pFile, ", \"%s\": ", (j == 1) ? "gpu" : "cpu");
+            if(nSamples > 0)
+                fprintf(pFile, "{ \"samples\": %d, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f }", nSamples, p50, p95, p99);
+            else
+                fprintf(pFile, "null");
+            }
+        fprintf(pFile, " }%s\n", (i + 1 < nNumZones) ? "," : "");
+        }
+    fprintf(pFile, "  ]\n}\n");
+
+    fclose(pFile);
+    return true;
+    }
@@ -0,0 +1,132 @@
+/*
+ *  Profiler.h
+ *  OpenGL SuperBible
+ *
+ *  Frame time instrumentation. The frame is split up into named zones
+ *  (drawing the ground, the room, the shadows...), and every frame the
+ *  profiler records how long each zone took, both on the CPU (CStopWatch)
+ *  and, where EXT_timer_query is supported, on the GPU. The GPU time is
+ *  the interesting one for draw calls, the CPU only queues them up.
+ *
+ *  Only the last PROFILER_HISTORY frames are kept, in a ring, so it can be
+ *  left running forever. From those, GetStats() works out the median and
+ *  the 95th and 99th percentiles, which say far more about stutter than an
+ *  average does, and WriteCSV()/WriteJSON() save them for comparing one
+ *  build against another.
+ *
+ *  Use it like this:
+ *
+ *      int iGround = profiler.AddZone("ground");
+ *      ...
+ *      profiler.BeginFrame();
+ *          {
+ *          CProfileZone zone(profiler, iGround);
+ *          DrawGround();
+ *          }
+ *      profiler.EndFrame();
+ *
+ *  Zone 0 is always the whole frame, and is CPU only. GPU timer queries
+ *  can't be nested, so a zone that starts inside another zone that already
+ *  has one going just gets CPU times too. So does a zone entered a second
+ *  time in the same frame (its CPU times are added up).
+ */
+
+#ifndef __PROFILER__
+#define __PROFILER__
+
+#include "gltools.h"
+#include "stopwatch.h"
+
+// Limits
+#define PROFILER_MAX_ZONES      16
+#define PROFILER_HISTORY        512     // Frames kept for statistics
+#define PROFILER_QUERY_FRAMES   4       // Frames to wait for GPU results
+
+// Zone 0 is the whole frame
+#define PROFILER_FRAME          0
+
+// Returned by GetStats() for a zone with no samples
+#define PROFILER_NO_DATA        -1.0f
+
+class CProfiler
+    {
+    public:
+        CProfiler(void);
+        ~CProfiler(void);
+
+        // Creates the timer queries if the GPU can do them. Call once there
+        // is a rendering context, before the first BeginFrame(). Without it,
+        // everything is CPU time only.
+        void InitGL(void);
+        void FreeGL(void);
+
+        // Name a zone, returns its index (or -1 if there are too many).
+        // Adding the same name again returns the same zone.
+        int AddZone(const char *szName);
+
+        // Bracket every frame with these, and each zone with BeginZone() and
+        // EndZone() (or a CProfileZone)
+        void BeginFrame(void);
+        void EndFrame(void);
+        void BeginZone(int iZone);
+        void EndZone(int iZone);
+
+        // Percentiles over the frames in the history, in milliseconds. Any
+        // of the pointers may be NULL. Returns the number of samples, 0 if
+        // there were none (and the results are set to PROFILER_NO_DATA).
+        int GetStats(int iZone, bool bGPU, float *pP50, float *pP95, float *pP99);
+
+        // Wait for the GPU times still in flight. The writers do this for you.
+        void Flush(void);
+
+        // Save the statistics of every zone. Both return false if the file
+        // can't be written.
+        bool WriteCSV(const char *szFileName);
+        bool WriteJSON(const char *szFileName);
+
+        // Useful for statistics
+        inline int GetZoneCount(void) { return nNumZones; }
+        inline const char *GetZoneName(int iZone) { return zones[iZone].szName; }
+        inline unsigned int GetFrameCount(void) { return nFrame; }
+        inline bool HasGPUTimers(void) { return bGPUTimers; }
+
+    protected:
+        typedef struct
+            {
+            char        szName[32];
+            long long   nStart;                         // CPU clock at BeginZone()
+            bool        bQueryActive;                   // This zone owns the running query
+            GLuint      queries[PROFILER_QUERY_FRAMES]; // One per frame in flight
+            bool        bQueryIssued[PROFILER_QUERY_FRAMES];
+            float       fCPU[PROFILER_HISTORY];         // Milliseconds, < 0 if not timed
+            float       fGPU[PROFILER_HISTORY];
+            } PROFILEZONE;
+
+        void CollectQueries(unsigned int nSlot, unsigned int nIssuedFrame);
+
+        PROFILEZONE     zones[PROFILER_MAX_ZONES];
+        int             nNumZones;
+        CStopWatch      stopWatch;
+        unsigned int    nFrame;                         // Frames begun so far
+        bool            bGPUTimers;
+        bool            bQueryRunning;                  // Only one at a time
+    };
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Times whatever is in the same scope
+class CProfileZone
+    {
+    public:
+        CProfileZone(CProfiler &profiler, int iZone) : rProfiler(profiler), iZone(iZone)
+            { rProfiler.BeginZone(iZone); }
+
+        ~CProfileZone(void)
+            { rProfiler.EndZone(iZone); }
+
+    protected:
+        CProfiler &rProfiler;
+        int iZone;
+    };
+
+#endif
@@ -0,0 +1,386 @@
+/*
+ *  RenderQueue.cpp
+ *  OpenGL SuperBible
+ *
+ *  State sorted drawing, see RenderQueue.h
+ */
+
+#include "RenderQueue.h"
+
+// Nothing is bound we know of
+#define RQ_NO_TEXTURE   0xFFFFFFFF
+
+// The GL switches behind the state flags
+static const struct
+    {
+    GLuint  nFlag;
+    GLenum  eCap;
+    } rqCaps[] = { { RQ_LIGHTING, GL_LIGHTING }, { RQ_TEXTURE, GL_TEXTURE_2D }, { RQ_BLEND, GL_BLEND },
+                   { RQ_DEPTH_TEST, GL_DEPTH_TEST }, { RQ_STENCIL_TEST, GL_STENCIL_TEST } };
+
+static const GLfloat fSpecularOn[4] = { 1.0f, 1.0f, 1.0f, 1.0f };
+static const GLfloat fSpecularOff[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Empty, with the usual fixed function defaults
+CRenderQueue::CRenderQueue(void)
+    {
+    pItems = NULL;
+    pKeys = pKeysTemp = NULL;
+    pOrder = pOrderTemp = NULL;
+    nMaxItems = nNumItems = nNextItem = 0;
+    bSorted = false;
+    bSorting = true;
+    bCountOverdraw = false;
+    fDepthRange = 100.0f;
+    ResetStats();
+
+    RENDERSTATE state;
+    state.nPass = 0;
+    state.hShader = 0;
+    state.nTexture = 0;
+    state.nFlags = RQ_LIGHTING | RQ_TEXTURE | RQ_DEPTH_TEST;
+    state.fColor[0] = state.fColor[1] = state.fColor[2] = state.fColor[3] = 1.0f;
+    SetDefaultState(state);
+    }
+
+CRenderQueue::~CRenderQueue(void)
+    {
+    delete [] pItems;
+    delete [] pKeys;
+    delete [] pKeysTemp;
+    delete [] pOrder;
+    delete [] pOrderTemp;
+    }
+
+void CRenderQueue::SetDefaultState(const RENDERSTATE &state)
+    {
+    defaultState = state;
+    currentState = state;
+    currentState.nTexture = RQ_NO_TEXTURE;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Make room for at least nNeeded items, doubling so a frame's worth of
+// submits only grows it a handful of times, ever
+void CRenderQueue::Grow(GLuint nNeeded)
+    {
+    if(nNeeded <= nMaxItems)
+        return;
+
+    GLuint nNewMax = (nMaxItems < 64) ? 64 : nMaxItems;
+    while(nNewMax < nNeeded)
+        nNewMax *= 2;
+
+    RENDERITEM *pNewItems = new RENDERITEM[nNewMax];
+    GLuint *pNewOrder = new GLuint[nNewMax];
+    if(nNumItems > 0)
+        {
+        memcpy(pNewItems, pItems, sizeof(RENDERITEM) * nNumItems);
+        memcpy(pNewOrder, pOrder, sizeof(GLuint) * nNumItems);
+        }
+
+    delete [] pItems;
+    delete [] pOrder;
+    delete [] pKeys;
+    delete [] pKeysTemp;
+    delete [] pOrderTemp;
+
+    pItems = pNewItems;
+    pOrder = pNewOrder;
+    pKeys = new unsigned long long[nNewMax];
+    pKeysTemp = new unsigned long long[nNewMax];
+    pOrderTemp = new GLuint[nNewMax];
+    nMaxItems = nNewMax;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue up one draw
+void CRenderQueue::Submit(const RENDERSTATE &state, const M3DMatrix44f mModelView, RENDERFUNC pFunc,
+                          const void *pData, GLint iParam)
+    {
+    SubmitAt(Reserve(1), state, mModelView, pFunc, pData, iParam);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Room for items that are filled in later, maybe on other threads. Only the
+// item itself is written by SubmitAt(), the order is set up here.
+GLuint CRenderQueue::Reserve(GLuint nCount)
+    {
+    GLuint iFirst = nNumItems;
+
+    Grow(nNumItems + nCount);
+    for(GLuint i = 0; i < nCount; i++)
+        pOrder[iFirst + i] = iFirst + i;
+
+    nNumItems += nCount;
+    bSorted = false;
+    return iFirst;
+    }
+
+void CRenderQueue::SubmitAt(GLuint iItem, const RENDERSTATE &state, const M3DMatrix44f mModelView, RENDERFUNC pFunc,
+                            const void *pData, GLint iParam)
+    {
+    RENDERITEM *pItem = &pItems[iItem];
+    pItem->state = state;
+    pItem->pFunc = pFunc;
+    pItem->pData = pData;
+    pItem->iParam = iParam;
+    m3dCopyMatrix44(pItem->mModelView, mModelView);
+    }
+
+void CRenderQueue::Clear(void)
+    {
+    nNumItems = nNextItem = 0;
+    bSorted = false;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// pass | shader | flags | texture | depth. With sorting off, just the pass.
+unsigned long long CRenderQueue::MakeKey(const RENDERITEM &item)
+    {
+    const RENDERSTATE &state = item.state;
+    unsigned long long nKey = (unsigned long long)(state.nPass & 0xF) << 60;
+
+    if(!bSorting)
+        return nKey;
+
+    nKey |= (unsigned long long)((size_t)state.hShader & 0xFFF) << 48;
+    nKey |= (unsigned long long)(state.nFlags & 0xFF) << 40;
+    if(state.nFlags & RQ_TEXTURE)
+        nKey |= (unsigned long long)(state.nTexture & 0xFFFF) << 24;
+
+    // Distance in front of the eye, of the origin of whatever it is
+    GLfloat fDepth = -item.mModelView[14] / fDepthRange;
+    if(fDepth < 0.0f)
+        fDepth = 0.0f;
+    if(fDepth > 1.0f)
+        fDepth = 1.0f;
+
+    GLuint nDepth = GLuint(fDepth * float(0xFFFFFF));
+    if(state.nFlags & RQ_BLEND)
+        nDepth = 0xFFFFFF - nDepth;
+
+    return nKey | nDepth;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Least significant byte first radix sort of what hasn't been drawn yet. All
+// eight histograms are counted in one pass over the keys, and any byte that
+// is the same in every key (most of them, with only a few passes, shaders
+// and textures) is skipped.
+void CRenderQueue::Sort(void)
+    {
+    GLuint nCount = nNumItems - nNextItem;
+    GLuint nCounts[8][256];
+    GLuint i;
+    int iByte;
+
+    unsigned long long *pSrcKeys = pKeys + nNextItem;
+    unsigned long long *pDstKeys = pKeysTemp + nNextItem;
+    GLuint *pSrcOrder = pOrder + nNextItem;
+    GLuint *pDstOrder = pOrderTemp + nNextItem;
+
+    memset(nCounts, 0, sizeof(nCounts));
+    for(i = 0; i < nCount; i++)
+        {
+        pSrcKeys[i] = MakeKey(pItems[pSrcOrder[i]]);
+        for(iByte = 0; iByte < 8; iByte++)
+            nCounts[iByte][(pSrcKeys[i] >> (iByte * 8)) & 0xFF]++;
+        }
+
+    for(iByte = 0; iByte < 8; iByte++)
+        {
+        GLuint *pCounts = nCounts[iByte];
+        int nShift = iByte * 8;
+
+        if(pCounts[(pSrcKeys[0] >> nShift) & 0xFF] == nCount)
+            continue;
+
+        // Counts to starting offsets
+        GLuint nTotal = 0;
+        for(i = 0; i < 256; i++)
+            {
+            GLuint nThis = pCounts[i];
+            pCounts[i] = nTotal;
+            nTotal += nThis;
+            }
+
+        for(i = 0; i < nCount; i++)
+            {
+            GLuint iDst = pCounts[(pSrcKeys[i] >> nShift) & 0xFF]++;
+            pDstKeys[iDst] = pSrcKeys[i];
+            pDstOrder[iDst] = pSrcOrder[i];
+            }
+
+        unsigned long long *pSwapKeys = pSrcKeys; pSrcKeys = pDstKeys; pDstKeys = pSwapKeys;
+        GLuint *pSwapOrder = pSrcOrder; pSrcOrder = pDstOrder; pDstOrder = pSwapOrder;
+        }
+
+    // Only the order is needed from here on
+    if(pSrcOrder != pOrder + nNextItem)
+        memcpy(pOrder + nNextItem, pSrcOrder, sizeof(GLuint) * nCount);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Change whatever is different from what the GL already has. Putting the
+// defaults back (bRestore) is not a draw, so isn't counted as one.
+void CRenderQueue::ApplyState(const RENDERSTATE &state, bool bRestore)
+    {
+    GLuint nFlags = state.nFlags;
+
+    // Counting takes the stencil test over, on wherever color is written
+    if(bCountOverdraw && !bRestore)
+        {
+        if(nFlags & RQ_DEPTH_ONLY)
+            nFlags &= ~RQ_STENCIL_TEST;
+        else
+            nFlags |= RQ_STENCIL_TEST;
+        }
+
+    GLuint nChanged = nFlags ^ currentState.nFlags;
+
+    for(int i = 0; i < int(sizeof(rqCaps) / sizeof(rqCaps[0])); i++)
+        {
+        if(nChanged & rqCaps[i].nFlag)
+            {
+            if(nFlags & rqCaps[i].nFlag)
+                glEnable(rqCaps[i].eCap);
+            else
+                glDisable(rqCaps[i].eCap);
+            stats.nStateChanges++;
+            }
+        else
+            stats.nSkipped++;
+        }
+
+    if(nChanged & RQ_SPECULAR)
+        {
+        glMaterialfv(GL_FRONT, GL_SPECULAR, (nFlags & RQ_SPECULAR) ? fSpecularOn : fSpecularOff);
+        stats.nStateChanges++;
+        }
+    else
+        stats.nSkipped++;
+
+    if(nChanged & RQ_DEPTH_ONLY)
+        {
+        GLboolean bColor = (nFlags & RQ_DEPTH_ONLY) ? GL_FALSE : GL_TRUE;
+        glColorMask(bColor, bColor, bColor, bColor);
+        stats.nStateChanges++;
+        }
+    else
+        stats.nSkipped++;
+
+    if(nChanged & RQ_DEPTH_LEQUAL)
+        {
+        if(nFlags & RQ_DEPTH_LEQUAL)
+            {
+            glDepthFunc(GL_LEQUAL);
+            glDepthMask(GL_FALSE);
+            }
+        else
+            {
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+            }
+        stats.nStateChanges++;
+        }
+    else
+        stats.nSkipped++;
+    currentState.nFlags = nFlags;
+
+    if(state.hShader != currentState.hShader)
+        {
+        glUseProgramObjectARB(state.hShader);
+        currentState.hShader = state.hShader;
+        stats.nShaderBinds++;
+        }
+    else
+        stats.nSkipped++;
+
+    // The binding is left alone while texturing is off, nobody would see it
+    if(state.nFlags & RQ_TEXTURE)
+        {
+        if(state.nTexture != currentState.nTexture)
+            {
+            glBindTexture(GL_TEXTURE_2D, state.nTexture);
+            currentState.nTexture = state.nTexture;
+            stats.nTextureBinds++;
+            }
+        else
+            stats.nSkipped++;
+        }
+
+    if(memcmp(state.fColor, currentState.fColor, sizeof(state.fColor)) != 0)
+        {
+        glColor4fv(state.fColor);
+        memcpy(currentState.fColor, state.fColor, sizeof(state.fColor));
+        stats.nStateChanges++;
+        }
+    else
+        stats.nSkipped++;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw everything queued up to nLastPass, in key order. Expects to be in
+// GL_MODELVIEW matrix mode, and leaves the modelview matrix as it found it.
+void CRenderQueue::Flush(GLuint nLastPass)
+    {
+    if(nNextItem == nNumItems)
+        return;
+
+    // Somebody else may have bound a texture since last time
+    if(nNextItem == 0)
+        currentState.nTexture = RQ_NO_TEXTURE;
+
+    if(!bSorted)
+        {
+        Sort();
+        bSorted = true;
+        }
+
+    // Every item loads its own matrix, put back what was there before
+    M3DMatrix44f mSaved;
+    glGetFloatv(GL_MODELVIEW_MATRIX, mSaved);
+
+    // Every fragment that gets through the depth test adds one
+    GLuint nStencilWas = currentState.nFlags & RQ_STENCIL_TEST;
+    if(bCountOverdraw)
+        {
+        glPushAttrib(GL_STENCIL_BUFFER_BIT);
+        glStencilFunc(GL_ALWAYS, 0, ~0u);
+        glStencilOp(GL_KEEP, GL_KEEP, GL_INCR);
+        }
+
+    while(nNextItem < nNumItems)
+        {
+        RENDERITEM *pItem = &pItems[pOrder[nNextItem]];
+        if(pItem->state.nPass > nLastPass)
+            break;
+
+        ApplyState(pItem->state);
+        glLoadMatrixf(pItem->mModelView);
+        pItem->pFunc(pItem->pData, pItem->iParam);
+        stats.nDraws++;
+        nNextItem++;
+        }
+
+    glLoadMatrixf(mSaved);
+
+    // Popping puts the stencil test back on or off as well
+    if(bCountOverdraw)
+        {
+        glPopAttrib();
+        currentState.nFlags = (currentState.nFlags & ~RQ_STENCIL_TEST) | nStencilWas;
+        }
+
+    // All done, back to the defaults (but leave the texture bound)
+    if(nNextItem == nNumItems)
+        {
+        RENDERSTATE restore = defaultState;
+        restore.nTexture = currentState.nTexture;
+        ApplyState(restore, true);
+        Clear();
+        }
+    }
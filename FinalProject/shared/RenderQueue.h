@@ -0,0 +1,180 @@
+/*
+ *  RenderQueue.h
+ *  OpenGL SuperBible
+ *
+ *  A render queue. Instead of drawing things as it goes, the scene code
+ *  submits them, each with the state it wants (which pass it belongs to, the
+ *  shader, the texture, lighting/blending/etc.) and a function that does the
+ *  actual drawing, and the modelview matrix to draw it with. The caller
+ *  works that out for itself (GLFrame and math3d will do it), the queue
+ *  never asks the GL for anything until Flush(), so the list can be built
+ *  away from the thread that owns the context. Flush() sorts the lot on a 64 bit key, so that everything sharing
+ *  a texture is drawn together, and only changes the GL state that actually
+ *  differs from one draw to the next. Binding the same texture three times
+ *  in a row for three walls, or binding textures at all while texturing is
+ *  switched off, stops happening.
+ *
+ *  The sort key is, from the top bit down:
+ *
+ *      pass (4 bits) | shader (12) | state flags (8) | texture (16) | depth (24)
+ *
+ *  Passes are drawn strictly in order, use them for anything that has to go
+ *  before something else (shadows that are blended over the ground, for
+ *  instance). Within a pass, opaque things are drawn front to back, and
+ *  blended things back to front. The sort is a radix sort, which is stable,
+ *  so items with the same key are drawn in the order they were submitted.
+ *  Shader and texture names only go into the key to group like with like,
+ *  a name too big for its bits just sorts in with some other name.
+ *
+ *  Between Flush() calls the GL is expected to be in the default state (see
+ *  SetDefaultState(), the defaults are lighting, texturing and depth testing
+ *  on, white, no shader), and the queue puts it back that way when it's done.
+ *  Blending is whatever glBlendFunc() was set to, the stencil test likewise.
+ *
+ *      queue.Submit(state, mModelView, DrawSomething, pSomething, 0);
+ *      ...
+ *      queue.Flush();
+ *
+ *  To fill the queue from several threads (CJobScheduler jobs), Reserve()
+ *  room for them all on one thread first, then each one fills in its own
+ *  items with SubmitAt(). Nothing else may touch the queue meanwhile.
+ *
+ *  Flush(nLastPass) only draws up to and including that pass, the rest stay
+ *  queued for the next Flush(), which is handy for timing the passes apart.
+ *
+ *  For a depth pre-pass, submit the opaque things once more in an earlier
+ *  pass with RQ_DEPTH_ONLY (and nothing else that costs, so they sort on
+ *  distance alone, front to back), then draw them for real with
+ *  RQ_DEPTH_LEQUAL. Only the nearest fragment of each pixel gets lit and
+ *  textured. The depth function is expected to be GL_LESS otherwise.
+ *
+ *  SetOverdrawCounting() turns the stencil buffer into a counter of the
+ *  fragments that were written to the color buffer: the stencil test is
+ *  on for every draw that writes color, always passing and incrementing
+ *  where the depth test passes. Read the stencil buffer back afterwards to
+ *  see how many times each pixel was drawn. It takes the stencil buffer
+ *  over, so anything that uses it for itself (the planar shadows) won't
+ *  look right meanwhile.
+ */
+
+#ifndef __RENDER_QUEUE__
+#define __RENDER_QUEUE__
+
+#include "gltools.h"
+#include "math3d.h"
+#include <string.h>
+
+// State flags, what is switched on for a draw
+#define RQ_LIGHTING         0x01
+#define RQ_TEXTURE          0x02    // GL_TEXTURE_2D
+#define RQ_BLEND            0x04    // Also means back to front
+#define RQ_DEPTH_TEST       0x08
+#define RQ_STENCIL_TEST     0x10
+#define RQ_SPECULAR         0x20    // White specular material, otherwise none
+#define RQ_DEPTH_ONLY       0x40    // No color writes
+#define RQ_DEPTH_LEQUAL     0x80    // GL_LEQUAL and no depth writes, over a depth pre-pass
+
+#define RQ_MAX_PASSES       16
+#define RQ_LAST_PASS        (RQ_MAX_PASSES - 1)
+
+// Draws one thing. The texture, state and modelview matrix are all set up.
+typedef void (*RENDERFUNC)(const void *pData, GLint iParam);
+
+typedef struct
+    {
+    GLuint      nPass;
+    GLhandleARB hShader;                // 0 for fixed function
+    GLuint      nTexture;               // Only bound if RQ_TEXTURE is set
+    GLuint      nFlags;                 // RQ_LIGHTING, etc.
+    GLfloat     fColor[4];
+    } RENDERSTATE;
+
+// What it took to draw everything since ResetStats()
+typedef struct
+    {
+    GLuint      nDraws;
+    GLuint      nTextureBinds;
+    GLuint      nShaderBinds;
+    GLuint      nStateChanges;          // glEnable/glDisable, color, material
+    GLuint      nSkipped;               // Binds and changes that weren't needed
+    } RENDERSTATS;
+
+class CRenderQueue
+    {
+    public:
+        CRenderQueue(void);
+        ~CRenderQueue(void);
+
+        // Queue up a draw, to be made with mModelView loaded. No GL calls.
+        void Submit(const RENDERSTATE &state, const M3DMatrix44f mModelView, RENDERFUNC pFunc,
+                    const void *pData, GLint iParam);
+
+        // Make room for nCount more items, and return the first one's
+        // number. They must all be filled in by SubmitAt() before Flush().
+        GLuint Reserve(GLuint nCount);
+
+        // Fill in an item from Reserve(). Safe to call on different items
+        // from different threads at once.
+        void SubmitAt(GLuint iItem, const RENDERSTATE &state, const M3DMatrix44f mModelView, RENDERFUNC pFunc,
+                      const void *pData, GLint iParam);
+
+        // Sort what's queued and draw it, up to and including nLastPass
+        void Flush(GLuint nLastPass = RQ_LAST_PASS);
+
+        // Throw away anything not yet drawn
+        void Clear(void);
+
+        // The state the GL is left in between flushes
+        void SetDefaultState(const RENDERSTATE &state);
+
+        // Eye space distance that maps to the far end of the depth bits
+        inline void SetDepthRange(GLfloat fFar) { fDepthRange = fFar; }
+
+        // Draw in the order things were submitted (still skipping redundant
+        // state), for seeing what the sort is worth
+        inline void SetSorting(bool bSort) { bSorting = bSort; }
+
+        // Count color writes per pixel in the stencil buffer
+        inline void SetOverdrawCounting(bool bCount) { bCountOverdraw = bCount; }
+
+        // Counters for binds and state changes
+        inline void ResetStats(void) { memset(&stats, 0, sizeof(stats)); }
+        inline void GetStats(RENDERSTATS *pStats) { *pStats = stats; }
+
+        // Useful for statistics
+        inline GLuint GetItemCount(void) { return nNumItems - nNextItem; }
+
+    protected:
+        typedef struct
+            {
+            RENDERSTATE     state;
+            RENDERFUNC      pFunc;
+            const void      *pData;
+            GLint           iParam;
+            M3DMatrix44f    mModelView;
+            } RENDERITEM;
+
+        unsigned long long MakeKey(const RENDERITEM &item);
+        void Grow(GLuint nNeeded);
+        void Sort(void);
+        void ApplyState(const RENDERSTATE &state, bool bRestore = false);
+
+        RENDERITEM          *pItems;
+        unsigned long long  *pKeys;         // Sort keys, and the items they go with
+        GLuint              *pOrder;
+        unsigned long long  *pKeysTemp;     // Radix sort workspace
+        GLuint              *pOrderTemp;
+        GLuint              nMaxItems;
+        GLuint              nNumItems;
+        GLuint              nNextItem;      // Flushed up to here (in sorted order)
+        bool                bSorted;
+        bool                bSorting;
+        bool                bCountOverdraw;
+
+        RENDERSTATE         defaultState;
+        RENDERSTATE         currentState;   // What the GL is set to right now
+        GLfloat             fDepthRange;
+        RENDERSTATS         stats;
+    };
+
+#endif
@@ -0,0 +1,385 @@
+/*
+ *  ShadowMap.cpp
+ *  OpenGL SuperBible
+ *
+ *  Cascaded shadow maps, see ShadowMap.h
+ */
+
+#include "ShadowMap.h"
+#include <math.h>
+
+// Depth is pushed back a little as the maps are drawn, or surfaces shadow
+// themselves in stripes ("shadow acne")
+#define SHADOW_OFFSET_FACTOR    2.0f
+#define SHADOW_OFFSET_UNITS     4.0f
+
+// Texels kept spare round each cascade, so the filter taps at its edges
+// don't reach into the next one
+#define SHADOW_BORDER_TEXELS    2.0f
+
+///////////////////////////////////////////////////////////////////////////////
+// The lighting is worked out per vertex, as the fixed function pipeline
+// does it, but split in two: what the light adds directly, which shadows
+// take away, and the ambient, which they don't. Written for three cascades.
+static const char *szShadowVertex =
+    "varying vec4 vAmbient;\n"
+    "varying vec4 vDirect;\n"
+    "varying vec4 vEyePos;\n"
+    "\n"
+    "void main(void)\n"
+    "    {\n"
+    "    vEyePos = gl_ModelViewMatrix * gl_Vertex;\n"
+    "    vec3 vNormal = normalize(gl_NormalMatrix * gl_Normal);\n"
+    "    vec3 vLight = normalize(gl_LightSource[0].position.xyz - vEyePos.xyz * gl_LightSource[0].position.w);\n"
+    "    float fDiffuse = max(dot(vNormal, vLight), 0.0);\n"
+    "\n"
+    "    vAmbient = gl_Color * gl_LightSource[0].ambient;\n"
+    "    vDirect = gl_Color * gl_LightSource[0].diffuse * fDiffuse;\n"
+    "    if(fDiffuse > 0.0)\n"
+    "        {\n"
+    "        vec3 vHalf = normalize(vLight + vec3(0.0, 0.0, 1.0));\n"
+    "        float fSpecular = pow(max(dot(vNormal, vHalf), 0.0), gl_FrontMaterial.shininess);\n"
+    "        vDirect += gl_FrontMaterial.specular * gl_LightSource[0].specular * fSpecular;\n"
+    "        }\n"
+    "    vAmbient.a = gl_Color.a;\n"
+    "    vDirect.a = 0.0;\n"
+    "\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "    gl_Position = ftransform();\n"
+    "    }\n";
+
+static const char *szShadowFragment =
+    "uniform sampler2D tColor;\n"
+    "uniform sampler2DShadow tShadow;\n"
+    "uniform mat4 mShadow[3];\n"
+    "uniform vec3 vSplits;\n"
+    "uniform vec2 vTexelSize;\n"
+    "varying vec4 vAmbient;\n"
+    "varying vec4 vDirect;\n"
+    "varying vec4 vEyePos;\n"
+    "\n"
+    "// How much of the light gets here, 3x3 filtered comparisons\n"
+    "float Lit(vec4 vCoord)\n"
+    "    {\n"
+    "    vec3 vMap = vCoord.xyz / vCoord.w;\n"
+    "    float fLit = 0.0;\n"
+    "    for(int y = -1; y <= 1; y++)\n"
+    "        for(int x = -1; x <= 1; x++)\n"
+    "            fLit += shadow2D(tShadow, vec3(vMap.xy + vec2(float(x), float(y)) * vTexelSize, vMap.z)).r;\n"
+    "    return fLit / 9.0;\n"
+    "    }\n"
+    "\n"
+    "void main(void)\n"
+    "    {\n"
+    "    float fDistance = -vEyePos.z;\n"
+    "    float fLit;\n"
+    "    if(fDistance < vSplits.x)\n"
+    "        fLit = Lit(mShadow[0] * vEyePos);\n"
+    "    else if(fDistance < vSplits.y)\n"
+    "        fLit = Lit(mShadow[1] * vEyePos);\n"
+    "    else\n"
+    "        fLit = Lit(mShadow[2] * vEyePos);\n"
+    "\n"
+    "    vec4 vColor = clamp(vAmbient + vDirect * fLit, 0.0, 1.0);\n"
+    "    gl_FragColor = vColor * texture2D(tColor, gl_TexCoord[0].st);\n"
+    "    }\n";
+
+
+///////////////////////////////////////////////////////////////////////////////
+CShadowMap::CShadowMap(void)
+    {
+    nMapSize = 0;
+    nTexture = 0;
+    nFramebuffer = 0;
+    hProgram = 0;
+    iShadowMatrices = iSplits = iTexelSize = -1;
+    nSavedFramebuffer = 0;
+
+    m3dLoadIdentity44(mLightView);
+    for(int i = 0; i < SHADOW_CASCADES; i++)
+        {
+        m3dLoadIdentity44(mProjections[i]);
+        m3dLoadIdentity44(mEyeToShadow[i]);
+        fSplits[i] = 0.0f;
+        }
+    }
+
+CShadowMap::~CShadowMap(void)
+    {
+    // FreeGL() is the caller's, the context may be gone by now
+    }
+
+bool CShadowMap::IsSupported(void)
+    {
+    return GLEE_EXT_framebuffer_object && GLEE_ARB_depth_texture && GLEE_ARB_shadow &&
+           GLEE_ARB_shader_objects && GLEE_ARB_vertex_shader && GLEE_ARB_fragment_shader &&
+           GLEE_ARB_multitexture;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+bool CShadowMap::InitGL(GLint nSize)
+    {
+    FreeGL();
+
+    if(!IsSupported())
+        return false;
+
+    // The cascades go side by side, they have to fit
+    GLint nMaxSize;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &nMaxSize);
+    while(nSize * SHADOW_CASCADES > nMaxSize)
+        nSize /= 2;
+    nMapSize = nSize;
+
+    glGenTextures(1, &nTexture);
+    glBindTexture(GL_TEXTURE_2D, nTexture);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, nMapSize * SHADOW_CASCADES, nMapSize, 0,
+                 GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, NULL);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE_ARB, GL_COMPARE_R_TO_TEXTURE_ARB);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC_ARB, GL_LEQUAL);
+    glTexParameteri(GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE_ARB, GL_LUMINANCE);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    // Depth only, no color to draw to
+    GLint nPrevious;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &nPrevious);
+    glGenFramebuffersEXT(1, &nFramebuffer);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, nFramebuffer);
+    glFramebufferTexture2DEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_TEXTURE_2D, nTexture, 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    bool bComplete = (glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, nPrevious);
+
+    hProgram = bComplete ? gltLoadShaderPairSrc(szShadowVertex, szShadowFragment) : 0;
+    if(hProgram == 0)
+        {
+        FreeGL();
+        return false;
+        }
+
+    // The samplers never change
+    glUseProgramObjectARB(hProgram);
+    glUniform1iARB(glGetUniformLocationARB(hProgram, "tColor"), 0);
+    glUniform1iARB(glGetUniformLocationARB(hProgram, "tShadow"), SHADOW_TEXTURE_UNIT - GL_TEXTURE0_ARB);
+    iShadowMatrices = glGetUniformLocationARB(hProgram, "mShadow");
+    iSplits = glGetUniformLocationARB(hProgram, "vSplits");
+    iTexelSize = glGetUniformLocationARB(hProgram, "vTexelSize");
+    glUseProgramObjectARB(0);
+
+    return true;
+    }
+
+void CShadowMap::FreeGL(void)
+    {
+    if(hProgram != 0)
+        glDeleteObjectARB(hProgram);
+    if(nFramebuffer != 0)
+        glDeleteFramebuffersEXT(1, &nFramebuffer);
+    if(nTexture != 0)
+        glDeleteTextures(1, &nTexture);
+
+    hProgram = 0;
+    nFramebuffer = 0;
+    nTexture = 0;
+    nMapSize = 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// A point in light eye space as seen from the light, x and y divided by
+// the distance in front of it (so a frustum is a rectangle), and that
+// distance
+static void shadowProject(const M3DMatrix44f mLightView, const M3DVector3f vWorld, GLfloat vOut[3])
+    {
+    M3DVector3f vLight;
+    m3dTransformVector3(vLight, vWorld, mLightView);
+    vOut[2] = -vLight[2];
+    vOut[0] = vLight[0] / vOut[2];
+    vOut[1] = vLight[1] / vOut[2];
+    }
+
+// glFrustum() as a matrix, with the sides given at distance one
+static void shadowMakeFrustum(M3DMatrix44f m, GLfloat fLeft, GLfloat fRight, GLfloat fBottom, GLfloat fTop,
+                              GLfloat fNear, GLfloat fFar)
+    {
+    for(int i = 0; i < 16; i++)
+        m[i] = 0.0f;
+
+    m[0] = 2.0f / (fRight - fLeft);
+    m[5] = 2.0f / (fTop - fBottom);
+    m[8] = (fRight + fLeft) / (fRight - fLeft);
+    m[9] = (fTop + fBottom) / (fTop - fBottom);
+    m[10] = -(fFar + fNear) / (fFar - fNear);
+    m[11] = -1.0f;
+    m[14] = -2.0f * fFar * fNear / (fFar - fNear);
+    }
+
+void CShadowMap::Fit(const M3DMatrix44f mCamera, GLfloat fFovY, GLfloat fAspect, GLfloat fNear, GLfloat fFar,
+                     const M3DVector3f vLight, const M3DVector3f vMin, const M3DVector3f vMax)
+    {
+    M3DVector3f vForward, vSide, vUp, vCorner;
+    GLfloat vPoint[3];
+    int i, j;
+
+    // Look from the light at the middle of the scene
+    for(i = 0; i < 3; i++)
+        vForward[i] = (vMin[i] + vMax[i]) * 0.5f - vLight[i];
+    m3dNormalizeVector(vForward);
+
+    m3dLoadVector3(vUp, 0.0f, 1.0f, 0.0f);
+    if(fabs(vForward[1]) > 0.99f)
+        m3dLoadVector3(vUp, 0.0f, 0.0f, 1.0f);
+    m3dCrossProduct(vSide, vForward, vUp);
+    m3dNormalizeVector(vSide);
+    m3dCrossProduct(vUp, vSide, vForward);
+
+    for(i = 0; i < 3; i++)
+        {
+        mLightView[i * 4 + 0] = vSide[i];
+        mLightView[i * 4 + 1] = vUp[i];
+        mLightView[i * 4 + 2] = -vForward[i];
+        mLightView[i * 4 + 3] = 0.0f;
+        }
+    mLightView[12] = -m3dDotProduct(vSide, vLight);
+    mLightView[13] = -m3dDotProduct(vUp, vLight);
+    mLightView[14] = m3dDotProduct(vForward, vLight);
+    mLightView[15] = 1.0f;
+
+    // How much of the light's view the scene takes up, and how far away
+    GLfloat fSceneBounds[4] = { 1e30f, -1e30f, 1e30f, -1e30f };    // Left, right, bottom, top
+    GLfloat fLightNear = 1e30f, fLightFar = 0.0f;
+    for(i = 0; i < 8; i++)
+        {
+        m3dLoadVector3(vCorner, (i & 1) ? vMax[0] : vMin[0], (i & 2) ? vMax[1] : vMin[1], (i & 4) ? vMax[2] : vMin[2]);
+        shadowProject(mLightView, vCorner, vPoint);
+        fSceneBounds[0] = (vPoint[0] < fSceneBounds[0]) ? vPoint[0] : fSceneBounds[0];
+        fSceneBounds[1] = (vPoint[0] > fSceneBounds[1]) ? vPoint[0] : fSceneBounds[1];
+        fSceneBounds[2] = (vPoint[1] < fSceneBounds[2]) ? vPoint[1] : fSceneBounds[2];
+        fSceneBounds[3] = (vPoint[1] > fSceneBounds[3]) ? vPoint[1] : fSceneBounds[3];
+        fLightNear = (vPoint[2] < fLightNear) ? vPoint[2] : fLightNear;
+        fLightFar = (vPoint[2] > fLightFar) ? vPoint[2] : fLightFar;
+        }
+    if(fLightNear < fLightFar * 0.01f)
+        fLightNear = fLightFar * 0.01f;         // The light is in the box
+
+    // Split the view, somewhere between evenly and logarithmically
+    GLfloat fDistances[SHADOW_CASCADES + 1];
+    for(i = 0; i <= SHADOW_CASCADES; i++)
+        {
+        GLfloat fPart = GLfloat(i) / GLfloat(SHADOW_CASCADES);
+        GLfloat fLog = fNear * GLfloat(pow(fFar / fNear, fPart));
+        GLfloat fEven = fNear + (fFar - fNear) * fPart;
+        fDistances[i] = SHADOW_SPLIT_LAMBDA * fLog + (1.0f - SHADOW_SPLIT_LAMBDA) * fEven;
+        }
+
+    M3DMatrix44f mEyeToWorld, mEyeToLight, mTemp;
+    m3dInvertMatrix44(mEyeToWorld, mCamera);
+    GLfloat fTanY = GLfloat(tan(m3dDegToRad(fFovY) * 0.5));
+    GLfloat fTanX = fTanY * fAspect;
+
+    for(int iCascade = 0; iCascade < SHADOW_CASCADES; iCascade++)
+        {
+        // Around the corners of this piece of the view...
+        GLfloat fBounds[4] = { 1e30f, -1e30f, 1e30f, -1e30f };
+        for(i = 0; i < 8; i++)
+            {
+            GLfloat fDistance = fDistances[iCascade + (i >> 2)];
+            M3DVector3f vEye;
+            m3dLoadVector3(vEye, ((i & 1) ? fTanX : -fTanX) * fDistance, ((i & 2) ? fTanY : -fTanY) * fDistance, -fDistance);
+            m3dTransformVector3(vCorner, vEye, mEyeToWorld);
+            shadowProject(mLightView, vCorner, vPoint);
+            fBounds[0] = (vPoint[0] < fBounds[0]) ? vPoint[0] : fBounds[0];
+            fBounds[1] = (vPoint[0] > fBounds[1]) ? vPoint[0] : fBounds[1];
+            fBounds[2] = (vPoint[1] < fBounds[2]) ? vPoint[1] : fBounds[2];
+            fBounds[3] = (vPoint[1] > fBounds[3]) ? vPoint[1] : fBounds[3];
+            }
+
+        // ...but not past the scene
+        for(j = 0; j < 4; j += 2)
+            {
+            fBounds[j] = (fSceneBounds[j] > fBounds[j]) ? fSceneBounds[j] : fBounds[j];
+            fBounds[j + 1] = (fSceneBounds[j + 1] < fBounds[j + 1]) ? fSceneBounds[j + 1] : fBounds[j + 1];
+            if(fBounds[j] >= fBounds[j + 1])
+                {
+                fBounds[j] = fSceneBounds[j];
+                fBounds[j + 1] = fSceneBounds[j + 1];
+                }
+
+            GLfloat fBorder = (fBounds[j + 1] - fBounds[j]) * SHADOW_BORDER_TEXELS / GLfloat(nMapSize > 0 ? nMapSize : 1024);
+            fBounds[j] -= fBorder;
+            fBounds[j + 1] += fBorder;
+            }
+
+        shadowMakeFrustum(mProjections[iCascade], fBounds[0], fBounds[1], fBounds[2], fBounds[3], fLightNear, fLightFar);
+        fSplits[iCascade] = fDistances[iCascade + 1];
+
+        // Camera eye space, to world, to the light's clip space, to this
+        // cascade's part of the texture
+        M3DMatrix44f mTile;
+        m3dLoadIdentity44(mTile);
+        mTile[0] = 0.5f / GLfloat(SHADOW_CASCADES);
+        mTile[12] = (0.5f + GLfloat(iCascade)) / GLfloat(SHADOW_CASCADES);
+        mTile[5] = mTile[10] = 0.5f;
+        mTile[13] = mTile[14] = 0.5f;
+
+        m3dMatrixMultiply44(mEyeToLight, mLightView, mEyeToWorld);
+        m3dMatrixMultiply44(mTemp, mProjections[iCascade], mEyeToLight);
+        m3dMatrixMultiply44(mEyeToShadow[iCascade], mTile, mTemp);
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+void CShadowMap::Begin(void)
+    {
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &nSavedFramebuffer);
+    glGetIntegerv(GL_VIEWPORT, nSavedViewport);
+
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, nFramebuffer);
+    glViewport(0, 0, nMapSize * SHADOW_CASCADES, nMapSize);
+    glClear(GL_DEPTH_BUFFER_BIT);
+
+    glPolygonOffset(SHADOW_OFFSET_FACTOR, SHADOW_OFFSET_UNITS);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+
+    glMatrixMode(GL_PROJECTION);
+    glPushMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    }
+
+void CShadowMap::SetCascade(int iCascade)
+    {
+    glViewport(iCascade * nMapSize, 0, nMapSize, nMapSize);
+
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(mProjections[iCascade]);
+    glMatrixMode(GL_MODELVIEW);
+    }
+
+void CShadowMap::End(void)
+    {
+    glMatrixMode(GL_PROJECTION);
+    glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, nSavedFramebuffer);
+    glViewport(nSavedViewport[0], nSavedViewport[1], nSavedViewport[2], nSavedViewport[3]);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+void CShadowMap::Bind(void)
+    {
+    glActiveTextureARB(SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, nTexture);
+    glActiveTextureARB(GL_TEXTURE0_ARB);
+
+    glUseProgramObjectARB(hProgram);
+    glUniformMatrix4fvARB(iShadowMatrices, SHADOW_CASCADES, GL_FALSE, mEyeToShadow[0]);
+    glUniform3fvARB(iSplits, 1, fSplits);
+    glUniform2fARB(iTexelSize, 1.0f / GLfloat(nMapSize * SHADOW_CASCADES), 1.0f / GLfloat(nMapSize));
+    glUseProgramObjectARB(0);
+    }
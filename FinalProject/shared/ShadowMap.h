@@ -0,0 +1,113 @@
+/*
+ *  ShadowMap.h
+ *  OpenGL SuperBible
+ *
+ *  Cascaded shadow maps for one point light. The shadow casters are drawn
+ *  from the light into a depth texture, depth only, and everything lit
+ *  looks itself up in that to see whether the light reaches it. Unlike a
+ *  planar shadow matrix, that puts shadows on whatever they fall on, walls
+ *  and other objects included, not just on one plane.
+ *
+ *  One map spread over a big ground gives blocky shadows up close, so the
+ *  camera's view is split by distance into SHADOW_CASCADES pieces, nearest
+ *  smallest, and each gets its own map with the light's frustum fitted
+ *  tightly around it (and around the scene, there's no point covering
+ *  empty space). The maps sit side by side in the one depth texture. Each
+ *  lookup is a 3x3 grid of filtered comparisons (percentage closer
+ *  filtering), so shadow edges come out soft rather than jagged.
+ *
+ *  GetProgram() lights, textures and shadows in one go. It is GL_LIGHT0 as
+ *  the fixed function pipeline does it (point light, no attenuation, color
+ *  material for ambient and diffuse, the material's specular), modulated
+ *  by the texture on unit 0, except that the diffuse and specular parts
+ *  are left out where the light is blocked.
+ *
+ *      shadows.InitGL();
+ *      ...
+ *      // Every frame, with the camera transform on the modelview matrix
+ *      shadows.Fit(mCamera, 35.0f, fAspect, 1.0f, 50.0f, vLight, vSceneMin, vSceneMax);
+ *      shadows.Begin();
+ *      for(int i = 0; i < SHADOW_CASCADES; i++)
+ *          {
+ *          shadows.SetCascade(i);
+ *          glLoadMatrixf(shadows.GetLightView());
+ *          DrawCasters();
+ *          }
+ *      shadows.End();
+ *      shadows.Bind();
+ *      glUseProgramObjectARB(shadows.GetProgram());
+ *      DrawScene();
+ *
+ *  Needs framebuffer objects, depth textures with comparison, and GLSL.
+ *  IsSupported() says whether they're all there, if not fall back to
+ *  something else.
+ */
+
+#ifndef __SHADOW_MAP__
+#define __SHADOW_MAP__
+
+#include "gltools.h"
+#include "math3d.h"
+
+#define SHADOW_CASCADES         3
+#define SHADOW_TEXTURE_UNIT     GL_TEXTURE1_ARB
+#define SHADOW_SPLIT_LAMBDA     0.75f   // 1 for all logarithmic splits, 0 for all even
+
+class CShadowMap
+    {
+    public:
+        CShadowMap(void);
+        ~CShadowMap(void);
+
+        static bool IsSupported(void);
+
+        // Make the depth texture, each cascade nSize texels square, its
+        // framebuffer and the program. Returns false if any of it fails.
+        bool InitGL(GLint nSize = 1024);
+        void FreeGL(void);
+
+        // Work out the cascades for this frame. mCamera is the camera's
+        // transform (world to eye), the rest are as gluPerspective() was
+        // given them. The light is in world space, and everything that
+        // casts or receives a shadow is inside the box vMin to vMax.
+        void Fit(const M3DMatrix44f mCamera, GLfloat fFovY, GLfloat fAspect, GLfloat fNear, GLfloat fFar,
+                 const M3DVector3f vLight, const M3DVector3f vMin, const M3DVector3f vMax);
+
+        // Draw into the maps, Begin() clears them all. SetCascade() sets
+        // the viewport and projection, the modelview matrix is left to the
+        // caller (GetLightView() and then the object's own transform).
+        // End() puts the framebuffer, viewport and projection back.
+        void Begin(void);
+        void SetCascade(int iCascade);
+        void End(void);
+
+        // The light's view, world to light eye space
+        inline const GLfloat *GetLightView(void) { return mLightView; }
+
+        // Bind the maps to SHADOW_TEXTURE_UNIT and hand this frame's
+        // cascades to the program. Leaves texture unit 0 active and no
+        // program in use.
+        void Bind(void);
+
+        inline GLhandleARB GetProgram(void) { return hProgram; }
+        inline GLuint GetTexture(void) { return nTexture; }
+
+    protected:
+        GLint           nMapSize;
+        GLuint          nTexture;
+        GLuint          nFramebuffer;
+        GLhandleARB     hProgram;
+        GLint           iShadowMatrices;        // Uniform locations
+        GLint           iSplits;
+        GLint           iTexelSize;
+
+        M3DMatrix44f    mLightView;
+        M3DMatrix44f    mProjections[SHADOW_CASCADES];
+        M3DMatrix44f    mEyeToShadow[SHADOW_CASCADES];  // Camera eye space to map coordinates
+        GLfloat         fSplits[SHADOW_CASCADES];       // Far end of each, distance from the eye
+
+        GLint           nSavedFramebuffer;
+        GLint           nSavedViewport[4];
+    };
+
+#endif
@@ -0,0 +1,406 @@
+/*
+ *  TextureAtlas.cpp
+ *  OpenGL SuperBible
+ *
+ *  Packs small textures into one, see TextureAtlas.h
+ */
+
+#include "TextureAtlas.h"
+#include <string.h>
+
+///////////////////////////////////////////////////////////////////////////////
+// Half the size, each texel the average of four. An odd last row or column
+// is averaged with itself.
+static GLubyte *HalveImage(const GLubyte *pSrc, GLint nWidth, GLint nHeight, GLint *pNewWidth, GLint *pNewHeight)
+    {
+    GLint nNewWidth = (nWidth > 1) ? nWidth / 2 : 1;
+    GLint nNewHeight = (nHeight > 1) ? nHeight / 2 : 1;
+    GLubyte *pDst = new GLubyte[nNewWidth * nNewHeight * 4];
+
+    for(GLint y = 0; y < nNewHeight; y++)
+        {
+        const GLubyte *pRow0 = pSrc + (y * 2) * nWidth * 4;
+        const GLubyte *pRow1 = pSrc + ((y * 2 + 1 < nHeight) ? y * 2 + 1 : y * 2) * nWidth * 4;
+
+        for(GLint x = 0; x < nNewWidth; x++)
+            {
+            GLint x0 = x * 2 * 4;
+            GLint x1 = ((x * 2 + 1 < nWidth) ? x * 2 + 1 : x * 2) * 4;
+
+            for(int c = 0; c < 4; c++)
+                pDst[(y * nNewWidth + x) * 4 + c] = GLubyte((pRow0[x0 + c] + pRow0[x1 + c] + pRow1[x0 + c] + pRow1[x1 + c] + 2) / 4);
+            }
+        }
+
+    *pNewWidth = nNewWidth;
+    *pNewHeight = nNewHeight;
+    return pDst;
+    }
+
+// Round up to a multiple of nAlign (a power of two)
+static inline GLint AlignUp(GLint n, GLint nAlign)
+    {
+    return (n + nAlign - 1) & ~(nAlign - 1);
+    }
+
+
+///////////////////////////////////////////////////////////////////////////////
+CTextureAtlas::CTextureAtlas(void)
+    {
+    nNumImages = 0;
+    nPadding = 0;
+    nScaleDown = 0;
+    pAtlas = NULL;
+    nAtlasWidth = nAtlasHeight = 0;
+    }
+
+CTextureAtlas::~CTextureAtlas(void)
+    {
+    Free();
+    }
+
+void CTextureAtlas::Free(void)
+    {
+    for(int i = 0; i < nNumImages; i++)
+        {
+        if(images[i].pScaled != images[i].pRGBA)
+            delete [] images[i].pScaled;
+        delete [] images[i].pRGBA;
+        }
+    nNumImages = 0;
+
+    delete [] pAtlas;
+    pAtlas = NULL;
+    nAtlasWidth = nAtlasHeight = 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Copy an image in, as RGBA
+int CTextureAtlas::AddImage(const GLbyte *pBits, GLint iWidth, GLint iHeight, GLenum eFormat)
+    {
+    if(nNumImages == ATLAS_MAX_IMAGES)
+        return -1;
+
+    ATLASIMAGE *pImage = &images[nNumImages];
+    const GLubyte *pSrc = (const GLubyte *)pBits;
+    int nComponents;
+
+    switch(eFormat)
+        {
+        case GL_LUMINANCE:
+            nComponents = 1;
+            break;
+        case GL_BGR_EXT:
+        case GL_RGB:
+            nComponents = 3;
+            break;
+        case GL_BGRA_EXT:
+        case GL_RGBA:
+            nComponents = 4;
+            break;
+        default:
+            pSrc = NULL;        // Don't know what it is, so it's missing
+            nComponents = 0;
+            break;
+        }
+
+    if(pSrc == NULL || iWidth <= 0 || iHeight <= 0)
+        {
+        pImage->nWidth = pImage->nHeight = ATLAS_MISSING_SIZE;
+        pImage->pRGBA = new GLubyte[ATLAS_MISSING_SIZE * ATLAS_MISSING_SIZE * 4];
+        memset(pImage->pRGBA, 255, ATLAS_MISSING_SIZE * ATLAS_MISSING_SIZE * 4);
+        }
+    else
+        {
+        bool bBGR = (eFormat == GL_BGR_EXT || eFormat == GL_BGRA_EXT);
+        GLint nTexels = iWidth * iHeight;
+
+        pImage->nWidth = iWidth;
+        pImage->nHeight = iHeight;
+        pImage->pRGBA = new GLubyte[nTexels * 4];
+
+        GLubyte *pDst = pImage->pRGBA;
+        for(GLint i = 0; i < nTexels; i++, pSrc += nComponents, pDst += 4)
+            {
+            if(nComponents == 1)
+                pDst[0] = pDst[1] = pDst[2] = pSrc[0];
+            else
+                {
+                pDst[0] = pSrc[bBGR ? 2 : 0];
+                pDst[1] = pSrc[1];
+                pDst[2] = pSrc[bBGR ? 0 : 2];
+                }
+            pDst[3] = (nComponents == 4) ? pSrc[3] : 255;
+            }
+        }
+
+    pImage->pScaled = pImage->pRGBA;
+    pImage->nScaledWidth = pImage->nWidth;
+    pImage->nScaledHeight = pImage->nHeight;
+    pImage->x = pImage->y = 0;
+
+    return nNumImages++;
+    }
+
+int CTextureAtlas::AddTGA(const char *szFileName)
+    {
+    GLTIMAGE image;
+
+    // Still takes up a (white) place if it won't load
+    if(!gltLoadTGAImage(szFileName, &image))
+        return AddImage(NULL, 0, 0, GL_RGBA);
+
+    int iImage = AddImage(image.pBits, image.iWidth, image.iHeight, image.eFormat);
+    gltFreeImage(&image);
+
+    return iImage;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Bring every image down to its size at nScaleDown
+void CTextureAtlas::ScaleImages(void)
+    {
+    for(int i = 0; i < nNumImages; i++)
+        {
+        ATLASIMAGE *pImage = &images[i];
+
+        if(pImage->pScaled != pImage->pRGBA)
+            delete [] pImage->pScaled;
+
+        pImage->pScaled = pImage->pRGBA;
+        pImage->nScaledWidth = pImage->nWidth;
+        pImage->nScaledHeight = pImage->nHeight;
+
+        for(int j = 0; j < nScaleDown; j++)
+            {
+            GLint nWidth, nHeight;
+            GLubyte *pHalf = HalveImage(pImage->pScaled, pImage->nScaledWidth, pImage->nScaledHeight, &nWidth, &nHeight);
+
+            if(pImage->pScaled != pImage->pRGBA)
+                delete [] pImage->pScaled;
+            pImage->pScaled = pHalf;
+            pImage->nScaledWidth = nWidth;
+            pImage->nScaledHeight = nHeight;
+            }
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Shelf packing, tallest cells first. Each shelf is as tall as the first
+// (tallest) cell on it, and cells go left to right until one doesn't fit.
+bool CTextureAtlas::Pack(GLint nWidth, GLint nHeight)
+    {
+    int order[ATLAS_MAX_IMAGES];
+    int i, j;
+
+    // Insertion sort on cell height, there are only a few
+    for(i = 0; i < nNumImages; i++)
+        {
+        GLint nCellHeight = AlignUp(images[i].nScaledHeight + nPadding * 2, nPadding);
+        for(j = i; j > 0 && AlignUp(images[order[j - 1]].nScaledHeight + nPadding * 2, nPadding) < nCellHeight; j--)
+            order[j] = order[j - 1];
+        order[j] = i;
+        }
+
+    GLint x = 0, y = 0, nShelfHeight = 0;
+    for(i = 0; i < nNumImages; i++)
+        {
+        ATLASIMAGE *pImage = &images[order[i]];
+        GLint nCellWidth = AlignUp(pImage->nScaledWidth + nPadding * 2, nPadding);
+        GLint nCellHeight = AlignUp(pImage->nScaledHeight + nPadding * 2, nPadding);
+
+        if(x + nCellWidth > nWidth)
+            {
+            x = 0;
+            y += nShelfHeight;
+            nShelfHeight = 0;
+            }
+
+        if(nCellWidth > nWidth || y + nCellHeight > nHeight)
+            return false;
+
+        pImage->x = x + nPadding;
+        pImage->y = y + nPadding;
+        x += nCellWidth;
+        if(nCellHeight > nShelfHeight)
+            nShelfHeight = nCellHeight;
+        }
+
+    return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Copy the images into place, and stretch their edges out to the edges of
+// their cells
+void CTextureAtlas::Compose(void)
+    {
+    delete [] pAtlas;
+    pAtlas = new GLubyte[nAtlasWidth * nAtlasHeight * 4];
+    memset(pAtlas, 0, nAtlasWidth * nAtlasHeight * 4);
+
+    for(int i = 0; i < nNumImages; i++)
+        {
+        ATLASIMAGE *pImage = &images[i];
+        GLint nCellX = pImage->x - nPadding;
+        GLint nCellY = pImage->y - nPadding;
+        GLint nCellWidth = AlignUp(pImage->nScaledWidth + nPadding * 2, nPadding);
+        GLint nCellHeight = AlignUp(pImage->nScaledHeight + nPadding * 2, nPadding);
+
+        for(GLint y = 0; y < nCellHeight; y++)
+            {
+            GLint ySrc = y - nPadding;
+            if(ySrc < 0)
+                ySrc = 0;
+            if(ySrc >= pImage->nScaledHeight)
+                ySrc = pImage->nScaledHeight - 1;
+
+            const GLubyte *pSrcRow = pImage->pScaled + ySrc * pImage->nScaledWidth * 4;
+            GLubyte *pDst = pAtlas + ((nCellY + y) * nAtlasWidth + nCellX) * 4;
+
+            for(GLint x = 0; x < nCellWidth; x++, pDst += 4)
+                {
+                GLint xSrc = x - nPadding;
+                if(xSrc < 0)
+                    xSrc = 0;
+                if(xSrc >= pImage->nScaledWidth)
+                    xSrc = pImage->nScaledWidth - 1;
+
+                memcpy(pDst, pSrcRow + xSrc * 4, 4);
+                }
+            }
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Find the smallest power of two atlas the images pack into, starting from
+// one just big enough to hold their area. If even nMaxSize square won't do,
+// halve the images and try again.
+bool CTextureAtlas::Build(GLint nMaxSize, GLint nPadding)
+    {
+    if(nNumImages == 0 || nPadding < 1 || (nPadding & (nPadding - 1)) != 0)
+        return false;
+
+    this->nPadding = nPadding;
+    delete [] pAtlas;
+    pAtlas = NULL;
+    nAtlasWidth = nAtlasHeight = 0;
+
+    for(nScaleDown = 0; nScaleDown < 16; nScaleDown++)
+        {
+        ScaleImages();
+
+        double dArea = 0.0;
+        for(int i = 0; i < nNumImages; i++)
+            dArea += double(AlignUp(images[i].nScaledWidth + nPadding * 2, nPadding)) *
+                     double(AlignUp(images[i].nScaledHeight + nPadding * 2, nPadding));
+
+        GLint nWidth = 1, nHeight = 1;
+        while(double(nWidth) * double(nHeight) < dArea)
+            {
+            if(nWidth <= nHeight)
+                nWidth *= 2;
+            else
+                nHeight *= 2;
+            }
+
+        while(nWidth <= nMaxSize && nHeight <= nMaxSize)
+            {
+            if(Pack(nWidth, nHeight))
+                {
+                nAtlasWidth = nWidth;
+                nAtlasHeight = nHeight;
+                Compose();
+                return true;
+                }
+
+            if(nWidth <= nHeight)
+                nWidth *= 2;
+            else
+                nHeight *= 2;
+            }
+        }
+
+    return false;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Mip levels below this one no longer have a gutter between images
+GLint CTextureAtlas::GetMaxLevel(void)
+    {
+    GLint nMaxLevel = 0;
+    while((nPadding >> (nMaxLevel + 1)) > 0 && (nAtlasWidth >> (nMaxLevel + 1)) > 0 && (nAtlasHeight >> (nMaxLevel + 1)) > 0)
+        nMaxLevel++;
+
+    return nMaxLevel;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Upload the atlas and as many mip levels as the gutters are good for. The
+// new texture is left bound.
+GLuint CTextureAtlas::CreateTexture(void)
+    {
+    if(pAtlas == NULL)
+        return 0;
+
+    GLint nMaxLevel = GetMaxLevel();
+
+    GLuint nTexture;
+    glGenTextures(1, &nTexture);
+    glBindTexture(GL_TEXTURE_2D, nTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+    const GLubyte *pLevel = pAtlas;
+    GLint nWidth = nAtlasWidth, nHeight = nAtlasHeight;
+    for(GLint iLevel = 0; iLevel <= nMaxLevel; iLevel++)
+        {
+        glTexImage2D(GL_TEXTURE_2D, iLevel, GL_RGBA8, nWidth, nHeight, 0, GL_RGBA, GL_UNSIGNED_BYTE, pLevel);
+
+        if(iLevel < nMaxLevel)
+            {
+            GLubyte *pNext = HalveImage(pLevel, nWidth, nHeight, &nWidth, &nHeight);
+            if(pLevel != pAtlas)
+                delete [] pLevel;
+            pLevel = pNext;
+            }
+        }
+    if(pLevel != pAtlas)
+        delete [] pLevel;
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, nMaxLevel);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    return nTexture;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Where an image ended up. Before Build() works, that's the whole texture.
+void CTextureAtlas::GetRemap(int iImage, GLfloat fRemap[4])
+    {
+    if(pAtlas == NULL || iImage < 0 || iImage >= nNumImages)
+        {
+        fRemap[0] = fRemap[1] = 1.0f;
+        fRemap[2] = fRemap[3] = 0.0f;
+        return;
+        }
+
+    const ATLASIMAGE *pImage = &images[iImage];
+    fRemap[0] = GLfloat(pImage->nScaledWidth) / GLfloat(nAtlasWidth);
+    fRemap[1] = GLfloat(pImage->nScaledHeight) / GLfloat(nAtlasHeight);
+    fRemap[2] = GLfloat(pImage->x) / GLfloat(nAtlasWidth);
+    fRemap[3] = GLfloat(pImage->y) / GLfloat(nAtlasHeight);
+    }
+
+void CTextureAtlas::RemapTexCoords(int iImage, M3DVector2f *pTexCoords, GLuint nCount)
+    {
+    GLfloat fRemap[4];
+    GetRemap(iImage, fRemap);
+
+    for(GLuint i = 0; i < nCount; i++)
+        {
+        pTexCoords[i][0] = pTexCoords[i][0] * fRemap[0] + fRemap[2];
+        pTexCoords[i][1] = pTexCoords[i][1] * fRemap[1] + fRemap[3];
+        }
+    }
@@ -0,0 +1,110 @@
+/*
+ *  TextureAtlas.h
+ *  OpenGL SuperBible
+ *
+ *  Packs a handful of small textures into one big one, so that something
+ *  drawn with several textures (a sofa with a different one for the back,
+ *  the arms, the seat and the feet) can be drawn with one binding. Each
+ *  image gets its own rectangle of the atlas, and texture coordinates that
+ *  went from 0 to 1 over the image are remapped to that rectangle with
+ *
+ *      s' = s * sScale + sOffset,  t' = t * tScale + tOffset
+ *
+ *  Mipmaps are the tricky part. Filtered down, neighbouring images would
+ *  bleed into each other, so each image sits in a cell with a gutter of
+ *  nPadding texels all round, filled with copies of its edge texels (which
+ *  also makes texture coordinates of exactly 0 and 1 behave like
+ *  GL_CLAMP_TO_EDGE did). Cells start and end on multiples of nPadding, so
+ *  while nPadding >> level is still at least one texel, every mip level
+ *  still has a gutter between any two images. The mipmap chain stops
+ *  there (GL_TEXTURE_MAX_LEVEL), with nPadding = 8 that's three levels
+ *  below the full size one.
+ *
+ *  Images that don't fit in nMaxSize x nMaxSize are all halved, and halved
+ *  again, until they do. Only texture coordinates in 0..1 work, anything
+ *  that repeats a texture needs to keep its own.
+ *
+ *      CTextureAtlas atlas;
+ *      int iSofa = atlas.AddTGA("sofa1.tga");
+ *      ...
+ *      atlas.Build();
+ *      GLuint nTexture = atlas.CreateTexture();
+ *      atlas.GetRemap(iSofa, fRemap);
+ */
+
+#ifndef __TEXTURE_ATLAS__
+#define __TEXTURE_ATLAS__
+
+#include "gltools.h"
+#include "math3d.h"
+
+#define ATLAS_MAX_IMAGES    32
+#define ATLAS_MISSING_SIZE  4       // A white square stands in for an image that won't load
+
+class CTextureAtlas
+    {
+    public:
+        CTextureAtlas(void);
+        ~CTextureAtlas(void);
+
+        // Add an image, as gltLoadTGA() returns them (tightly packed rows,
+        // GL_BGR_EXT, GL_BGRA_EXT, GL_LUMINANCE, GL_RGB or GL_RGBA). It is
+        // copied. A NULL image is a blank white one, which looks the same as
+        // the texture that failed to load did. Returns the image's index, or
+        // -1 if there are too many.
+        int AddImage(const GLbyte *pBits, GLint iWidth, GLint iHeight, GLenum eFormat);
+        int AddTGA(const char *szFileName);
+
+        // Pack the images. nPadding must be a power of two. Returns false
+        // if it can't be done (no images, or nothing fits).
+        bool Build(GLint nMaxSize = 2048, GLint nPadding = 8);
+
+        // Make a texture object out of it, mipmapped as far as the gutters
+        // allow. Returns 0 if Build() hasn't worked.
+        GLuint CreateTexture(void);
+
+        // Or do it yourself: the packed RGBA image (GetWidth() by
+        // GetHeight(), NULL until Build() works) and the last mip level
+        // the gutters are good for, with box filtered, uncompressed mipmaps
+        inline const GLubyte *GetPixels(void) { return pAtlas; }
+        GLint GetMaxLevel(void);
+
+        // fRemap gets sScale, tScale, sOffset, tOffset for one image
+        void GetRemap(int iImage, GLfloat fRemap[4]);
+
+        // Or just do it, for a mesh
+        void RemapTexCoords(int iImage, M3DVector2f *pTexCoords, GLuint nCount);
+
+        // Free the images and the atlas (not the texture object). Get the
+        // remaps first, they go too.
+        void Free(void);
+
+        // Useful for statistics
+        inline GLint GetWidth(void) { return nAtlasWidth; }
+        inline GLint GetHeight(void) { return nAtlasHeight; }
+        inline int GetImageCount(void) { return nNumImages; }
+        inline int GetScaleDown(void) { return nScaleDown; }   // Times the images were halved
+
+    protected:
+        typedef struct
+            {
+            GLubyte *pRGBA;                 // As added
+            GLint   nWidth, nHeight;
+            GLubyte *pScaled;               // Halved nScaleDown times (or pRGBA)
+            GLint   nScaledWidth, nScaledHeight;
+            GLint   x, y;                   // Where the image (not its cell) went
+            } ATLASIMAGE;
+
+        bool Pack(GLint nWidth, GLint nHeight);
+        void ScaleImages(void);
+        void Compose(void);
+
+        ATLASIMAGE  images[ATLAS_MAX_IMAGES];
+        int         nNumImages;
+        GLint       nPadding;
+        int         nScaleDown;
+        GLubyte     *pAtlas;                // RGBA
+        GLint       nAtlasWidth, nAtlasHeight;
+    };
+
+#endif
@@ -0,0 +1,434 @@
+/*
+ *  TextureStream.cpp
+ *  OpenGL SuperBible
+ *
+ *  Background texture loading, see TextureStream.h
+ */
+
+#include "TextureStream.h"
+#include <string.h>
+#include <stdlib.h>
+
+static const GLubyte placeholderTexel[4] = { 255, 255, 255, 255 };
+
+
+CTextureStreamer::CTextureStreamer(void)
+    {
+    pAssets = NULL;
+    nNumAssets = nNextDecode = nNumDecoding = nNumDecoded = nNumDone = 0;
+    nNumThreads = 0;
+    bStarted = false;
+    bQuit = false;
+    nMipFlags = MIP_SRGB;
+    bMipCache = false;
+    bPowerOfTwo = false;
+    bNoCompression = false;
+    pixelBuffers[0] = 0;
+    iNextBuffer = 0;
+    }
+
+CTextureStreamer::~CTextureStreamer(void)
+    {
+    Stop();
+    }
+
+void CTextureStreamer::Lock(void)
+    {
+#ifdef WIN32
+    EnterCriticalSection(&queueLock);
+#else
+    pthread_mutex_lock(&queueLock);
+#endif
+    }
+
+void CTextureStreamer::Unlock(void)
+    {
+#ifdef WIN32
+    LeaveCriticalSection(&queueLock);
+#else
+    pthread_mutex_unlock(&queueLock);
+#endif
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Get the decoders going
+bool CTextureStreamer::Start(int nThreads)
+    {
+    Stop();
+
+    if(nThreads < 0)
+        nThreads = 0;
+    if(nThreads > STREAM_MAX_THREADS)
+        nThreads = STREAM_MAX_THREADS;
+
+    pAssets = new STREAMASSET[STREAM_MAX_ASSETS];
+    nNumAssets = nNextDecode = nNumDecoding = nNumDecoded = nNumDone = 0;
+    bQuit = false;
+    clock.Reset();
+
+    // The decoders can't ask the GL
+    bPowerOfTwo = !GLEE_ARB_texture_non_power_of_two;
+    bNoCompression = !GLEE_EXT_texture_compression_s3tc;
+
+#ifdef WIN32
+    InitializeCriticalSection(&queueLock);
+    InitializeConditionVariable(&workCondition);
+    InitializeConditionVariable(&doneCondition);
+#else
+    pthread_mutex_init(&queueLock, NULL);
+    pthread_cond_init(&workCondition, NULL);
+    pthread_cond_init(&doneCondition, NULL);
+#endif
+    bStarted = true;
+
+    // If we can't get them all, make do with what we got
+    nNumThreads = 0;
+    for(int i = 0; i < nThreads; i++)
+        {
+#ifdef WIN32
+        threads[i] = CreateThread(NULL, 0, DecoderThread, this, 0, NULL);
+        if(threads[i] == NULL)
+            break;
+#else
+        if(pthread_create(&threads[i], NULL, DecoderThread, this) != 0)
+            break;
+#endif
+        nNumThreads++;
+        }
+
+    return (nNumThreads == nThreads);
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Send the decoders home, and drop whatever hasn't made it to a texture
+void CTextureStreamer::Stop(void)
+    {
+    if(!bStarted)
+        return;
+
+    Lock();
+    bQuit = true;
+#ifdef WIN32
+    WakeAllConditionVariable(&workCondition);
+#else
+    pthread_cond_broadcast(&workCondition);
+#endif
+    Unlock();
+
+    for(int i = 0; i < nNumThreads; i++)
+        {
+#ifdef WIN32
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#else
+        pthread_join(threads[i], NULL);
+#endif
+        }
+    nNumThreads = 0;
+
+#ifdef WIN32
+    DeleteCriticalSection(&queueLock);
+#else
+    pthread_cond_destroy(&workCondition);
+    pthread_cond_destroy(&doneCondition);
+    pthread_mutex_destroy(&queueLock);
+#endif
+
+    for(int i = 0; i < nNumAssets; i++)
+        {
+        gltFreeImage(&pAssets[i].image);
+        pAssets[i].mips.Free();
+        }
+    delete [] pAssets;
+    pAssets = NULL;
+    nNumAssets = nNextDecode = nNumDecoding = nNumDecoded = nNumDone = 0;
+
+    if(pixelBuffers[0] != 0)
+        {
+        glDeleteBuffersARB(STREAM_PBO_COUNT, pixelBuffers);
+        pixelBuffers[0] = 0;
+        }
+
+    bStarted = false;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Queue up a texture, and give it something to show in the meantime
+int CTextureStreamer::Request(const char *szFileName, GLuint nTexture, GLenum eWrap, GLuint nMipFlags)
+    {
+    return RequestCustom(szFileName, NULL, NULL, NULL, nTexture, eWrap, nMipFlags);
+    }
+
+int CTextureStreamer::RequestCustom(const char *szName, STREAMLOADFUNC pLoad, STREAMREADYFUNC pReady, void *pData,
+                                    GLuint nTexture, GLenum eWrap, GLuint nMipFlags)
+    {
+    if(!bStarted || nNumAssets == STREAM_MAX_ASSETS)
+        return -1;
+
+    glBindTexture(GL_TEXTURE_2D, nTexture);
+    glPushClientAttrib(GL_CLIENT_PIXEL_STORE_BIT);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, placeholderTexel);
+    glPopClientAttrib();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+
+    int iAsset = nNumAssets;
+    STREAMASSET *pAsset = &pAssets[iAsset];
+    strncpy(pAsset->szName, szName, STREAM_MAX_PATH - 1);
+    pAsset->szName[STREAM_MAX_PATH - 1] = '\0';
+    pAsset->pLoad = pLoad;
+    pAsset->pReady = pReady;
+    pAsset->pData = pData;
+    pAsset->nTexture = nTexture;
+    pAsset->eWrap = eWrap;
+    pAsset->nMipFlags = nMipFlags;
+    pAsset->nState = STREAM_QUEUED;
+    memset(&pAsset->image, 0, sizeof(GLTIMAGE));
+    pAsset->nBytes = 0;
+    pAsset->nRequested = clock.GetElapsedNanoseconds();
+    pAsset->nStarted = pAsset->nDecoded = pAsset->nReady = pAsset->nRequested;
+
+    // Nobody to hand it to, do it now
+    if(nNumThreads == 0)
+        {
+        nNumAssets++;
+        nNextDecode++;
+        Decode(pAsset);
+        pAsset->nState = STREAM_DECODED;
+        nNumDecoded++;
+        return iAsset;
+        }
+
+    Lock();
+    nNumAssets++;
+#ifdef WIN32
+    WakeConditionVariable(&workCondition);
+#else
+    pthread_cond_signal(&workCondition);
+#endif
+    Unlock();
+
+    return iAsset;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Read the file (or whatever the custom loader does) and build its mipmaps.
+// Runs on a decoder thread, without the lock. If it goes wrong the chain
+// is left empty.
+void CTextureStreamer::Decode(STREAMASSET *pAsset)
+    {
+    GLuint nFlags = (pAsset->nMipFlags == STREAM_MIP_DEFAULT) ? nMipFlags : pAsset->nMipFlags;
+    nFlags |= bPowerOfTwo ? MIP_POWER_OF_TWO : 0;
+    if(bNoCompression)
+        nFlags &= ~MIP_COMPRESS;
+    GLTIMAGE *pImage = &pAsset->image;
+
+    pAsset->nStarted = clock.GetElapsedNanoseconds();
+
+    if(pAsset->pLoad == NULL)
+        pAsset->mips.BuildFromTGA(pAsset->szName, nFlags, bMipCache);
+    else if(pAsset->pLoad(pAsset->pData, pImage))
+        pAsset->mips.Build(pImage->pBits, pImage->iWidth, pImage->iHeight, pImage->eFormat, nFlags);
+    gltFreeImage(pImage);
+
+    pAsset->nDecoded = clock.GetElapsedNanoseconds();
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// What the decoder threads do: take the oldest request, decode it, repeat
+void CTextureStreamer::DecoderLoop(void)
+    {
+    Lock();
+    for(;;)
+        {
+        while(!bQuit && nNextDecode == nNumAssets)
+#ifdef WIN32
+            SleepConditionVariableCS(&workCondition, &queueLock, INFINITE);
+#else
+            pthread_cond_wait(&workCondition, &queueLock);
+#endif
+        if(bQuit)
+            break;
+
+        STREAMASSET *pAsset = &pAssets[nNextDecode++];
+        pAsset->nState = STREAM_DECODING;
+        nNumDecoding++;
+        Unlock();
+
+        Decode(pAsset);
+
+        Lock();
+        pAsset->nState = STREAM_DECODED;
+        nNumDecoding--;
+        nNumDecoded++;
+#ifdef WIN32
+        WakeAllConditionVariable(&doneCondition);
+#else
+        pthread_cond_broadcast(&doneCondition);
+#endif
+        }
+    Unlock();
+    }
+
+#ifdef WIN32
+DWORD WINAPI CTextureStreamer::DecoderThread(LPVOID pParam)
+    {
+    ((CTextureStreamer *)pParam)->DecoderLoop();
+    return 0;
+    }
+#else
+void *CTextureStreamer::DecoderThread(void *pParam)
+    {
+    ((CTextureStreamer *)pParam)->DecoderLoop();
+    return NULL;
+    }
+#endif
+
+///////////////////////////////////////////////////////////////////////////////
+// Put a decoded chain in its texture. Returns false if there wasn't one,
+// which leaves the placeholder.
+bool CTextureStreamer::Upload(STREAMASSET *pAsset)
+    {
+    CMipChain *pMips = &pAsset->mips;
+    if(pMips->GetLevelCount() == 0)
+        return false;
+
+    GLuint nSize = pMips->GetDataSize();
+    bool bFromPixelBuffer = false;
+
+    glBindTexture(GL_TEXTURE_2D, pAsset->nTexture);
+
+    // Copy it into the next pixel buffer, orphaning whatever was there so
+    // we don't wait for the last upload from it to finish
+    if(GLEE_ARB_pixel_buffer_object)
+        {
+        if(pixelBuffers[0] == 0)
+            glGenBuffersARB(STREAM_PBO_COUNT, pixelBuffers);
+
+        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, pixelBuffers[iNextBuffer]);
+        iNextBuffer = (iNextBuffer + 1) % STREAM_PBO_COUNT;
+        glBufferDataARB(GL_PIXEL_UNPACK_BUFFER_ARB, nSize, NULL, GL_STREAM_DRAW_ARB);
+        void *pBuffer = glMapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, GL_WRITE_ONLY_ARB);
+        if(pBuffer != NULL)
+            {
+            memcpy(pBuffer, pMips->GetData(), nSize);
+            bFromPixelBuffer = (glUnmapBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB) == GL_TRUE);
+            }
+
+        // Trouble, fall back on the client's memory
+        if(!bFromPixelBuffer)
+            glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+        }
+
+    pMips->Upload(bFromPixelBuffer);
+
+    if(bFromPixelBuffer)
+        glBindBufferARB(GL_PIXEL_UNPACK_BUFFER_ARB, 0);
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, pAsset->eWrap);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, pAsset->eWrap);
+
+    pAsset->nBytes = nSize;
+    return true;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Upload what's arrived, oldest request first, until the budget runs out.
+// Only assets seen decoded while holding the lock are touched, the lock is
+// what makes the decoder's writes to them visible here.
+int CTextureStreamer::Update(GLuint nByteBudget)
+    {
+    if(!bStarted)
+        return 0;
+
+    int decoded[STREAM_MAX_ASSETS];
+    int nNumToUpload = 0;
+
+    Lock();
+    if(nNumDecoded > 0)
+        for(int i = 0; i < nNumAssets; i++)
+            if(pAssets[i].nState == STREAM_DECODED)
+                decoded[nNumToUpload++] = i;
+    Unlock();
+
+    GLuint nUploaded = 0;
+    int nFinished = 0;
+    int nTaken = 0;
+
+    for(int i = 0; i < nNumToUpload; i++)
+        {
+        STREAMASSET *pAsset = &pAssets[decoded[i]];
+
+        if(nByteBudget != 0 && nUploaded >= nByteBudget)
+            break;
+
+        bool bUploaded = Upload(pAsset);
+        pAsset->mips.Free();
+
+        pAsset->nReady = clock.GetElapsedNanoseconds();
+        pAsset->nState = bUploaded ? STREAM_READY : STREAM_FAILED;
+        nUploaded += pAsset->nBytes;
+
+        if(bUploaded && pAsset->pReady != NULL)
+            pAsset->pReady(pAsset->pData, pAsset->nTexture);
+
+        nTaken++;
+        nNumDone++;
+        if(bUploaded)
+            nFinished++;
+        }
+
+    if(nTaken > 0)
+        {
+        Lock();
+        nNumDecoded -= nTaken;
+        Unlock();
+        }
+
+    return nFinished;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Wait for all of it
+void CTextureStreamer::Finish(void)
+    {
+    if(!bStarted)
+        return;
+
+    while(GetPendingCount() > 0)
+        {
+        Update(0);
+
+        Lock();
+        while(nNumDecoded == 0 && (nNextDecode < nNumAssets || nNumDecoding > 0))
+#ifdef WIN32
+            SleepConditionVariableCS(&doneCondition, &queueLock, INFINITE);
+#else
+            pthread_cond_wait(&doneCondition, &queueLock);
+#endif
+        Unlock();
+        }
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// How long things took, so far
+void CTextureStreamer::GetInfo(int iAsset, STREAMINFO *pInfo)
+    {
+    memset(pInfo, 0, sizeof(STREAMINFO));
+    if(iAsset < 0 || iAsset >= nNumAssets)
+        return;
+
+    const STREAMASSET *pAsset = &pAssets[iAsset];
+    pInfo->szName = pAsset->szName;
+    pInfo->nState = pAsset->nState;
+    pInfo->nBytes = pAsset->nBytes;
+    if(pAsset->nState >= STREAM_DECODING)
+        pInfo->fStartMs = float(double(pAsset->nStarted - pAsset->nRequested) * 0.000001);
+    if(pAsset->nState >= STREAM_DECODED)
+        pInfo->fDecodedMs = float(double(pAsset->nDecoded - pAsset->nRequested) * 0.000001);
+    if(pAsset->nState >= STREAM_READY)
+        pInfo->fReadyMs = float(double(pAsset->nReady - pAsset->nRequested) * 0.000001);
+    }
@@ -0,0 +1,184 @@
+/*
+ *  TextureStream.h
+ *  OpenGL SuperBible
+ *
+ *  Loads textures in the background, so the first frame doesn't have to wait
+ *  for every texture in the scene to be read, decoded and uploaded. Asking
+ *  for a texture gives its texture object a 1x1 white image straight away,
+ *  which is what gets drawn until the real one arrives. Decoder threads read
+ *  the files. Update(), called once a frame on the thread that owns the
+ *  context, uploads whatever has been decoded since last time, but no more
+ *  than a budget of bytes per frame, so a pile of textures arriving at once
+ *  doesn't make for one long frame.
+ *
+ *  The decoder threads build the mipmaps too (see MipChain.h, SetMipFlags()
+ *  picks the filter and whether to keep them in .mip files). Uploads go
+ *  through a pixel buffer object when there is one: the whole chain is
+ *  copied into the buffer and glTexImage2D() returns without waiting for it
+ *  to get to the card. An upload is a whole chain, the budget just stops
+ *  any more being started in the same frame, so there is always at least
+ *  one per Update().
+ *
+ *      CTextureStreamer streamer;
+ *      streamer.Start();
+ *      streamer.Request("stone.tga", nStoneTexture, GL_REPEAT);
+ *      ...
+ *      // Every frame
+ *      streamer.Update(2 * 1024 * 1024);
+ *
+ *  Anything that needs more than loading one file (packing an atlas, say)
+ *  can supply its own loader, which runs on a decoder thread, and a function
+ *  that is called on the GL thread once the texture is uploaded.
+ */
+
+#ifndef __TEXTURE_STREAM__
+#define __TEXTURE_STREAM__
+
+#include "gltools.h"
+#include "stopwatch.h"
+#include "MipChain.h"
+
+#ifndef WIN32
+#include <pthread.h>
+#endif
+
+#define STREAM_MAX_ASSETS       256
+#define STREAM_MAX_THREADS      8
+#define STREAM_MAX_PATH         256
+#define STREAM_PBO_COUNT        2       // Upload buffers, used in turn
+
+// Where a texture has got to
+#define STREAM_QUEUED           0
+#define STREAM_DECODING         1
+#define STREAM_DECODED          2       // Waiting for Update()
+#define STREAM_READY            3
+#define STREAM_FAILED           4       // The placeholder stays
+
+// Build an asset's mipmaps with the flags given to SetMipFlags()
+#define STREAM_MIP_DEFAULT      0xFFFFFFFF
+
+// Fill in pImage on a decoder thread, no GL allowed. Whatever is set up
+// is freed with gltFreeImage() once its mipmaps are built.
+typedef bool (*STREAMLOADFUNC)(void *pData, GLTIMAGE *pImage);
+
+// Called on the GL thread, with the new texture bound
+typedef void (*STREAMREADYFUNC)(void *pData, GLuint nTexture);
+
+// How one texture's loading went, in milliseconds from Request()
+typedef struct
+    {
+    const char  *szName;
+    int         nState;
+    GLuint      nBytes;             // Of the uploaded mipmap chain
+    float       fStartMs;           // A decoder got to it
+    float       fDecodedMs;
+    float       fReadyMs;           // Uploaded (or failed)
+    } STREAMINFO;
+
+class CTextureStreamer
+    {
+    public:
+        CTextureStreamer(void);
+        ~CTextureStreamer(void);
+
+        // Start the decoder threads. With none, or if none will start,
+        // Request() decodes on the spot (but still leaves the upload to
+        // Update()).
+        bool Start(int nThreads = 2);
+
+        // Wait for the decoders to finish what they are doing and go, and
+        // throw away anything not uploaded. The texture objects are the
+        // caller's, they are left alone.
+        void Stop(void);
+
+        // How to build the mipmaps, MIP_KAISER, MIP_SRGB (the default) and
+        // MIP_COMPRESS (ignored if the card can't take it), and whether to
+        // use .mip files. Set it before asking for anything.
+        inline void SetMipFlags(GLuint nFlags, bool bUseCache) { nMipFlags = nFlags; bMipCache = bUseCache; }
+
+        // Load a .tga into nTexture, with the usual linear mipmap filtering.
+        // Returns an id for GetInfo(), or -1 if there are too many. nMipFlags
+        // is for anything that needs its mipmaps built some other way than
+        // the rest (an atlas, say, whose gutters are only good for a box
+        // filter and no compression).
+        int Request(const char *szFileName, GLuint nTexture, GLenum eWrap = GL_CLAMP_TO_EDGE,
+                    GLuint nMipFlags = STREAM_MIP_DEFAULT);
+
+        // The same, with a loader of your own. pReady may be NULL.
+        int RequestCustom(const char *szName, STREAMLOADFUNC pLoad, STREAMREADYFUNC pReady, void *pData,
+                          GLuint nTexture, GLenum eWrap = GL_CLAMP_TO_EDGE, GLuint nMipFlags = STREAM_MIP_DEFAULT);
+
+        // Upload what has been decoded, up to nByteBudget bytes' worth (0
+        // for no limit). Returns how many textures became ready.
+        int Update(GLuint nByteBudget);
+
+        // Upload everything, waiting for the decoders as needed
+        void Finish(void);
+
+        // Textures not yet ready (or failed)
+        inline int GetPendingCount(void) { return nNumAssets - nNumDone; }
+
+        inline int GetAssetCount(void) { return nNumAssets; }
+        void GetInfo(int iAsset, STREAMINFO *pInfo);
+
+    protected:
+        typedef struct
+            {
+            char            szName[STREAM_MAX_PATH];
+            STREAMLOADFUNC  pLoad;          // NULL for a plain .tga
+            STREAMREADYFUNC pReady;
+            void            *pData;
+            GLuint          nTexture;
+            GLenum          eWrap;
+            GLuint          nMipFlags;      // Or STREAM_MIP_DEFAULT
+            volatile int    nState;
+            GLTIMAGE        image;          // From a custom loader
+            CMipChain       mips;
+            GLuint          nBytes;
+            long long       nRequested;     // Stopwatch times, in nanoseconds
+            long long       nStarted;
+            long long       nDecoded;
+            long long       nReady;
+            } STREAMASSET;
+
+        void Lock(void);
+        void Unlock(void);
+        void Decode(STREAMASSET *pAsset);
+        bool Upload(STREAMASSET *pAsset);
+        void DecoderLoop(void);
+
+#ifdef WIN32
+        static DWORD WINAPI DecoderThread(LPVOID pParam);
+        HANDLE              threads[STREAM_MAX_THREADS];
+        CRITICAL_SECTION    queueLock;
+        CONDITION_VARIABLE  workCondition;      // Something to decode, or quitting
+        CONDITION_VARIABLE  doneCondition;      // Something decoded
+#else
+        static void *DecoderThread(void *pParam);
+        pthread_t           threads[STREAM_MAX_THREADS];
+        pthread_mutex_t     queueLock;
+        pthread_cond_t      workCondition;
+        pthread_cond_t      doneCondition;
+#endif
+
+        STREAMASSET     *pAssets;
+        int             nNumAssets;
+        int             nNextDecode;            // Assets are decoded in the order asked for
+        int             nNumDecoding;
+        int             nNumDecoded;            // Not yet uploaded
+        int             nNumDone;
+        int             nNumThreads;
+        bool            bStarted;
+        volatile bool   bQuit;
+
+        GLuint          nMipFlags;
+        bool            bMipCache;
+        bool            bPowerOfTwo;            // No ARB_texture_non_power_of_two
+        bool            bNoCompression;         // No EXT_texture_compression_s3tc
+
+        GLuint          pixelBuffers[STREAM_PBO_COUNT];
+        int             iNextBuffer;
+        CStopWatch      clock;
+    };
+
+#endif
@@ -9,12 +9,20 @@
  *  When finished, call EndMesh() to free up extra unneeded memory that is reserved
  *  as workspace when you call BeginMesh().
  *
- *  This class can easily be extended to contain other vertex attributes, and to 
- *  save itself and load itself from disk (thus forming the beginnings of a custom
- *  model file format).
+ *  This class can easily be extended to contain other vertex attributes.
+ *
+ *  Welding a big mesh every time the program starts adds up, so a finished
+ *  mesh can be cached on disk. SaveMesh() writes a .mesh file: a small header
+ *  (magic number, MESH_FILE_VERSION, vertex and index counts, index type,
+ *  bounding box, and where each array starts) followed by the arrays just as
+ *  EndMesh() left them in memory. LoadMesh() maps the file with gltMapFile()
+ *  and points the arrays straight into the mapping, after checking the header,
+ *  the offsets and every index, so loading copies and rebuilds nothing. A file
+ *  that fails any check is refused, and the caller builds the mesh again.
  */
 
 #include "TriangleMesh.h"
+#include <stdio.h>
 
 
 ///////////////////////////////////////////////////////////
@@ -22,13 +30,21 @@
 CTriangleMesh::CTriangleMesh(void)
     {
     pIndexes = NULL;
+    pShortIndexes = NULL;
+    eIndexType = GL_UNSIGNED_INT;
     pVerts = NULL;
     pNorms = NULL;
     pTexCoords = NULL;
+    pInterleaved = NULL;
+    pMapping = NULL;
+    nMappingSize = 0;
     
     nMaxIndexes = 0;
     nNumIndexes = 0;
     nNumVerts = 0;
+
+    m3dLoadVector3(vMin, 0.0f, 0.0f, 0.0f);
+    m3dLoadVector3(vMax, 0.0f, 0.0f, 0.0f);
     }
     
 ////////////////////////////////////////////////////////////
@@ -36,10 +52,36 @@ CTriangleMesh::CTriangleMesh(void)
 // coming to C++, it is perfectly valid to delete a NULL pointer.
 CTriangleMesh::~CTriangleMesh(void)
     {
-    delete [] pIndexes;
-    delete [] pVerts;
-    delete [] pNorms;
-    delete [] pTexCoords;
+    FreeMesh();
+    }
+
+////////////////////////////////////////////////////////////
+// Release the arrays, however they were created. A mesh that came from
+// LoadMesh() points into a file mapping, and that is not ours to delete.
+void CTriangleMesh::FreeMesh(void)
+    {
+    if(pMapping != NULL)
+        {
+        gltUnmapFile(pMapping, nMappingSize);
+        pMapping = NULL;
+        nMappingSize = 0;
+        }
+    else
+        {
+        delete [] pIndexes;
+        delete [] pShortIndexes;
+        delete [] pVerts;
+        delete [] pNorms;
+        delete [] pTexCoords;
+        delete [] pInterleaved;
+        }
+
+    pIndexes = NULL;
+    pShortIndexes = NULL;
+    pVerts = NULL;
+    pNorms = NULL;
+    pTexCoords = NULL;
+    pInterleaved = NULL;
     }
     
 ////////////////////////////////////////////////////////////
@@ -50,31 +92,32 @@ CTriangleMesh::~CTriangleMesh(void)
 void CTriangleMesh::BeginMesh(GLuint nMaxVerts)
     {
     // Just in case this gets called more than once...
-    delete [] pIndexes;
-    delete [] pVerts;
-    delete [] pNorms;
-    delete [] pTexCoords;
+    FreeMesh();
+    eIndexType = GL_UNSIGNED_INT;
     
     nMaxIndexes = nMaxVerts;
     nNumIndexes = 0;
     nNumVerts = 0;
     
-    // Allocate new blocks
-    pIndexes = new GLushort[nMaxIndexes];
+    // Allocate new blocks. Indexes are always 32 bit while building,
+    // EndMesh() narrows them if they fit.
+    pIndexes = new GLuint[nMaxIndexes];
     pVerts = new M3DVector3f[nMaxIndexes];
     pNorms = new M3DVector3f[nMaxIndexes];
     pTexCoords = new M3DVector2f[nMaxIndexes];
+
+    // Workspace for finding duplicate vertices
+    vertexHash.Begin(nMaxIndexes, MESH_WELD_EPSILON);
     }
   
 /////////////////////////////////////////////////////////////////
 // Add a triangle to the mesh. This searches the current list for identical
 // (well, almost identical - these are floats you know...) verts. If one is found, it
 // is added to the index array. If not, it is added to both the index array and the vertex
-// array grows by one as well.
+// array grows by one as well. The search goes through a spatial hash, so building
+// a mesh is roughly linear in the number of triangles instead of quadratic.
 void CTriangleMesh::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVector2f vTexCoords[3])
     {
-    const  float e = 0.000001; // How small a difference to equate
-
     // First thing we do is make sure the normals are unit length!
     // It's almost always a good idea to work with pre-normalized normals
     m3dNormalizeVector(vNorms[0]);
@@ -82,39 +125,26 @@ void CTriangleMesh::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3D
     m3dNormalizeVector(vNorms[2]);
 
 
-    // Search for match - triangle consists of three verts
+    // Search for match - triangle consists of three verts. The hash only
+    // looks at vertices that are spatially close to this one.
     for(GLuint iVertex = 0; iVertex < 3; iVertex++)
         {
-        GLuint iMatch = 0;
-        for(iMatch = 0; iMatch < nNumVerts; iMatch++)
+        GLuint iMatch = vertexHash.Find(verts[iVertex], vNorms[iVertex], vTexCoords[iVertex],
+                                        pVerts, pNorms, pTexCoords);
+
+        if(iMatch != MESH_NO_MATCH)
             {
-            // If the vertex positions are the same
-            if(m3dCloseEnough(pVerts[iMatch][0], verts[iVertex][0], e) &&
-               m3dCloseEnough(pVerts[iMatch][1], verts[iVertex][1], e) &&
-               m3dCloseEnough(pVerts[iMatch][2], verts[iVertex][2], e) &&
-                   
-               // AND the Normal is the same...
-               m3dCloseEnough(pNorms[iMatch][0], vNorms[iVertex][0], e) &&
-               m3dCloseEnough(pNorms[iMatch][1], vNorms[iVertex][1], e) &&
-               m3dCloseEnough(pNorms[iMatch][2], vNorms[iVertex][2], e) &&
-                   
-                // And Texture is the same...
-                m3dCloseEnough(pTexCoords[iMatch][0], vTexCoords[iVertex][0], e) &&
-                m3dCloseEnough(pTexCoords[iMatch][1], vTexCoords[iVertex][1], e))
-                {
-                // Then add the index only
-                pIndexes[nNumIndexes] = iMatch;
-                nNumIndexes++;
-                break;
-                }
+            // Then add the index only
+            pIndexes[nNumIndexes] = iMatch;
+            nNumIndexes++;
             }
-            
-        // No match for this vertex, add to end of list
-        if(iMatch == nNumVerts)
+        else
             {
+            // No match for this vertex, add to end of list
             memcpy(pVerts[nNumVerts], verts[iVertex], sizeof(M3DVector3f));
             memcpy(pNorms[nNumVerts], vNorms[iVertex], sizeof(M3DVector3f));
             memcpy(pTexCoords[nNumVerts], &vTexCoords[iVertex], sizeof(M3DVector2f));
+            vertexHash.Insert(nNumVerts, verts[iVertex]);
             pIndexes[nNumIndexes] = nNumVerts;
             nNumIndexes++; 
             nNumVerts++;
@@ -127,31 +157,298 @@ void CTriangleMesh::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3D
 //////////////////////////////////////////////////////////////////
 // Compact the data. This is a nice utility, but you should really
 // save the results of the indexing for future use if the model data
-// is static (doesn't change).
-void CTriangleMesh::EndMesh(void)
+// is static (doesn't change). See SaveMesh() and LoadMesh().
+// Pass MESH_INTERLEAVED to store the vertices as one interleaved array
+// instead of three separate ones. MESH_OPTIMIZE_CACHE and MESH_OPTIMIZE_FETCH
+// reorder the triangles and vertices for the post-transform cache and for
+// vertex fetch, use GetCacheStats() to see how much they helped.
+void CTriangleMesh::EndMesh(GLuint nOptions)
     {
+    // Done looking for duplicates
+    vertexHash.End();
+
+    // Optional passes to make the GPU's life easier. These work on the
+    // 32 bit indexes, before they are packed.
+    if(nOptions & MESH_OPTIMIZE_CACHE)
+        meshOptimizeVertexCache(pIndexes, nNumIndexes, nNumVerts);
+
+    GLuint *pRemap = NULL;
+    if(nOptions & MESH_OPTIMIZE_FETCH)
+        {
+        pRemap = new GLuint[nNumVerts];
+        meshOptimizeVertexFetch(pRemap, pIndexes, nNumIndexes, nNumVerts);
+        }
+
     // Allocate smaller arrays
-    GLushort *pPackedIndexes = new GLushort[nNumIndexes];
     M3DVector3f *pPackedVerts = new M3DVector3f[nNumVerts];
     M3DVector3f *pPackedNorms = new M3DVector3f[nNumVerts];
     M3DVector2f *pPackedTex = new M3DVector2f[nNumVerts];
     
-    // Copy data to smaller arrays
-    memcpy(pPackedIndexes, pIndexes, sizeof(GLushort)*nNumIndexes);
-    memcpy(pPackedVerts, pVerts, sizeof(M3DVector3f)*nNumVerts);
-    memcpy(pPackedNorms, pNorms, sizeof(M3DVector3f)*nNumVerts);
-    memcpy(pPackedTex, pTexCoords, sizeof(M3DVector2f)*nNumVerts);
+    // Copy data to smaller arrays (in the new order if there is one)
+    meshRemapVertices(pPackedVerts, pPackedNorms, pPackedTex, pVerts, pNorms, pTexCoords, pRemap, nNumVerts);
+    delete [] pRemap;
+
+    // Indexes stay 32 bit only if there are too many vertices for 16
+    eIndexType = meshGetIndexType(nNumVerts);
+    if(eIndexType == GL_UNSIGNED_SHORT)
+        {
+        pShortIndexes = new GLushort[nNumIndexes];
+        meshPackIndexes(pShortIndexes, pIndexes, nNumIndexes);
+        delete [] pIndexes;
+        pIndexes = NULL;
+        }
+    else
+        {
+        GLuint *pPackedIndexes = new GLuint[nNumIndexes];
+        memcpy(pPackedIndexes, pIndexes, sizeof(GLuint)*nNumIndexes);
+        delete [] pIndexes;
+        pIndexes = pPackedIndexes;
+        }
     
     // Free older, larger arrays
-    delete [] pIndexes;
     delete [] pVerts;
     delete [] pNorms;
     delete [] pTexCoords;
 
     // Reasign pointers
-    pIndexes = pPackedIndexes;
     pVerts = pPackedVerts;
     pNorms = pPackedNorms;
     pTexCoords = pPackedTex;
+
+    // Axis aligned bounding box, saved with the mesh
+    m3dLoadVector3(vMin, 0.0f, 0.0f, 0.0f);
+    m3dLoadVector3(vMax, 0.0f, 0.0f, 0.0f);
+    for(GLuint i = 0; i < nNumVerts; i++)
+        {
+        for(int j = 0; j < 3; j++)
+            {
+            if(i == 0 || pVerts[i][j] < vMin[j])
+                vMin[j] = pVerts[i][j];
+            if(i == 0 || pVerts[i][j] > vMax[j])
+                vMax[j] = pVerts[i][j];
+            }
+        }
+
+    // The separate arrays are not needed once they are interleaved
+    if(nOptions & MESH_INTERLEAVED)
+        {
+        pInterleaved = new GLfloat[nNumVerts * MESH_VERTEX_FLOATS];
+        meshInterleave(pInterleaved, pVerts, pNorms, pTexCoords, nNumVerts);
+
+        delete [] pVerts;
+        delete [] pNorms;
+        delete [] pTexCoords;
+        pVerts = NULL;
+        pNorms = NULL;
+        pTexCoords = NULL;
+        }
     }
 
+
+//////////////////////////////////////////////////////////////////
+// Post-transform cache statistics for the current index order. See
+// meshGetCacheStats() for what ACMR and ATVR mean.
+GLfloat CTriangleMesh::GetCacheStats(GLfloat *pATVR, GLuint nCacheSize)
+    {
+    return meshGetCacheStats(GetIndexPointer(), eIndexType, nNumIndexes, nNumVerts, nCacheSize, pATVR);
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// The mesh file is the header below followed by the arrays, exactly as
+// they sit in memory after EndMesh(): either the three separate vertex
+// arrays or the one interleaved array, then the indexes (16 or 32 bit).
+// Offsets are in bytes from the start of the file, and are all multiples
+// of four so the arrays can be used straight out of a file mapping.
+// Everything is stored in the byte order of the machine that wrote it,
+// a file from the other kind of machine fails the magic number check.
+#define MESH_FILE_MAGIC     0x4853454D      // "MESH" on little endian
+
+typedef struct
+    {
+    GLuint  nMagic;             // MESH_FILE_MAGIC
+    GLuint  nVersion;           // MESH_FILE_VERSION
+    GLuint  nFlags;             // MESH_INTERLEAVED or 0
+    GLuint  eIndexType;         // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    GLuint  nNumVerts;
+    GLuint  nNumIndexes;
+    GLfloat vMin[3];            // Bounding box
+    GLfloat vMax[3];
+    GLuint  nVertexOffset;      // Positions, or the interleaved array
+    GLuint  nNormalOffset;      // 0 when interleaved
+    GLuint  nTexCoordOffset;    // 0 when interleaved
+    GLuint  nIndexOffset;
+    } MESHFILEHEADER;
+
+
+//////////////////////////////////////////////////////////////////
+// Write the finished mesh to disk. Call this after EndMesh().
+// Returns false if there is no mesh to save, or the file could not be
+// written.
+bool CTriangleMesh::SaveMesh(const char *szFileName)
+    {
+    MESHFILEHEADER meshHeader;
+
+    // LoadMesh() would only give back an empty mesh
+    if(nNumVerts == 0 || nNumIndexes == 0)
+        return false;
+
+    GLuint nVertexBytes = nNumVerts * sizeof(M3DVector3f);
+    GLuint nTexCoordBytes = nNumVerts * sizeof(M3DVector2f);
+    GLuint nIndexBytes = nNumIndexes * meshGetIndexSize(eIndexType);
+
+    meshHeader.nMagic = MESH_FILE_MAGIC;
+    meshHeader.nVersion = MESH_FILE_VERSION;
+    meshHeader.nFlags = IsInterleaved() ? MESH_INTERLEAVED : 0;
+    meshHeader.eIndexType = eIndexType;
+    meshHeader.nNumVerts = nNumVerts;
+    meshHeader.nNumIndexes = nNumIndexes;
+    memcpy(meshHeader.vMin, vMin, sizeof(M3DVector3f));
+    memcpy(meshHeader.vMax, vMax, sizeof(M3DVector3f));
+
+    meshHeader.nVertexOffset = sizeof(MESHFILEHEADER);
+    if(IsInterleaved())
+        {
+        meshHeader.nNormalOffset = 0;
+        meshHeader.nTexCoordOffset = 0;
+        meshHeader.nIndexOffset = meshHeader.nVertexOffset + nNumVerts * MESH_VERTEX_STRIDE;
+        }
+    else
+        {
+        meshHeader.nNormalOffset = meshHeader.nVertexOffset + nVertexBytes;
+        meshHeader.nTexCoordOffset = meshHeader.nNormalOffset + nVertexBytes;
+        meshHeader.nIndexOffset = meshHeader.nTexCoordOffset + nTexCoordBytes;
+        }
+
+    FILE *pFile = fopen(szFileName, "wb");
+    if(pFile == NULL)
+        return false;
+
+    bool bOK = (fwrite(&meshHeader, sizeof(MESHFILEHEADER), 1, pFile) == 1);
+
+    if(IsInterleaved())
+        bOK = bOK && (fwrite(pInterleaved, MESH_VERTEX_STRIDE, nNumVerts, pFile) == nNumVerts);
+    else
+        {
+        bOK = bOK && (fwrite(pVerts, nVertexBytes, 1, pFile) == 1);
+        bOK = bOK && (fwrite(pNorms, nVertexBytes, 1, pFile) == 1);
+        bOK = bOK && (fwrite(pTexCoords, nTexCoordBytes, 1, pFile) == 1);
+        }
+
+    bOK = bOK && (fwrite(GetIndexPointer(), nIndexBytes, 1, pFile) == 1);
+
+    if(fclose(pFile) != 0)
+        bOK = false;
+
+    return bOK;
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Does an array of nBytes at nOffset fit in the file, and is it aligned
+// well enough to be used in place? Empty arrays always fit.
+static bool MeshFileRangeOK(GLuint nOffset, unsigned long long nBytes, unsigned long nFileSize)
+    {
+    if(nBytes == 0)
+        return true;
+
+    if(nOffset < sizeof(MESHFILEHEADER) || (nOffset % 4) != 0)
+        return false;
+
+    return (nOffset + nBytes <= nFileSize);
+    }
+
+
+//////////////////////////////////////////////////////////////////
+// Load a mesh written by SaveMesh(). Nothing is copied or rebuilt, the
+// file is mapped into memory and the arrays point straight into it, so
+// there is no welding cost and the pages are only read when the mesh is
+// first drawn. The mesh is ready to Draw(), there is no need to call
+// EndMesh(). Returns false if the file is missing, from an older version,
+// or doesn't add up, and the mesh is left empty.
+bool CTriangleMesh::LoadMesh(const char *szFileName)
+    {
+    // Throw away whatever we had
+    FreeMesh();
+    nMaxIndexes = 0;
+    nNumIndexes = 0;
+    nNumVerts = 0;
+    eIndexType = GL_UNSIGNED_INT;
+
+    unsigned long nSize;
+    GLubyte *pFile = (GLubyte *)gltMapFile(szFileName, &nSize);
+    if(pFile == NULL)
+        return false;
+
+    // Sanity check everything before pointing into the file
+    const MESHFILEHEADER *pHeader = (const MESHFILEHEADER *)pFile;
+    bool bOK = (nSize >= sizeof(MESHFILEHEADER));
+    bOK = bOK && pHeader->nMagic == MESH_FILE_MAGIC && pHeader->nVersion == MESH_FILE_VERSION;
+    bOK = bOK && (pHeader->eIndexType == GL_UNSIGNED_SHORT || pHeader->eIndexType == GL_UNSIGNED_INT);
+    bOK = bOK && (pHeader->nNumIndexes % 3) == 0;
+
+    // 64 bit math so a corrupt count can't wrap around
+    unsigned long long nVertexBytes = 0, nNormalBytes = 0, nTexCoordBytes = 0, nIndexBytes = 0;
+    if(bOK)
+        {
+        nIndexBytes = (unsigned long long)pHeader->nNumIndexes * meshGetIndexSize(pHeader->eIndexType);
+        if(pHeader->nFlags & MESH_INTERLEAVED)
+            nVertexBytes = (unsigned long long)pHeader->nNumVerts * MESH_VERTEX_STRIDE;
+        else
+            {
+            nVertexBytes = (unsigned long long)pHeader->nNumVerts * sizeof(M3DVector3f);
+            nNormalBytes = nVertexBytes;
+            nTexCoordBytes = (unsigned long long)pHeader->nNumVerts * sizeof(M3DVector2f);
+            }
+        }
+
+    bOK = bOK && MeshFileRangeOK(pHeader->nVertexOffset, nVertexBytes, nSize);
+    bOK = bOK && MeshFileRangeOK(pHeader->nNormalOffset, nNormalBytes, nSize);
+    bOK = bOK && MeshFileRangeOK(pHeader->nTexCoordOffset, nTexCoordBytes, nSize);
+    bOK = bOK && MeshFileRangeOK(pHeader->nIndexOffset, nIndexBytes, nSize);
+
+    // A bad index would have OpenGL reading past the end of the vertex arrays
+    if(bOK)
+        {
+        const GLvoid *pFileIndexes = pFile + pHeader->nIndexOffset;
+        for(GLuint i = 0; i < pHeader->nNumIndexes && bOK; i++)
+            {
+            GLuint iIndex = (pHeader->eIndexType == GL_UNSIGNED_SHORT) ?
+                            ((const GLushort *)pFileIndexes)[i] : ((const GLuint *)pFileIndexes)[i];
+            bOK = (iIndex < pHeader->nNumVerts);
+            }
+        }
+
+    if(!bOK)
+        {
+        gltUnmapFile(pFile, nSize);
+        return false;
+        }
+
+    // Everything checks out, point at the data
+    pMapping = pFile;
+    nMappingSize = nSize;
+
+    nNumVerts = pHeader->nNumVerts;
+    nNumIndexes = pHeader->nNumIndexes;
+    nMaxIndexes = nNumIndexes;
+    eIndexType = pHeader->eIndexType;
+    memcpy(vMin, pHeader->vMin, sizeof(M3DVector3f));
+    memcpy(vMax, pHeader->vMax, sizeof(M3DVector3f));
+
+    if(pHeader->nFlags & MESH_INTERLEAVED)
+        pInterleaved = (GLfloat *)(pFile + pHeader->nVertexOffset);
+    else
+        {
+        pVerts = (M3DVector3f *)(pFile + pHeader->nVertexOffset);
+        pNorms = (M3DVector3f *)(pFile + pHeader->nNormalOffset);
+        pTexCoords = (M3DVector2f *)(pFile + pHeader->nTexCoordOffset);
+        }
+
+    if(eIndexType == GL_UNSIGNED_SHORT)
+        pShortIndexes = (GLushort *)(pFile + pHeader->nIndexOffset);
+    else
+        pIndexes = (GLuint *)(pFile + pHeader->nIndexOffset);
+
+    return true;
+    }
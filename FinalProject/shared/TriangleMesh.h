@@ -10,14 +10,22 @@
  *  When finished, call EndMesh() to free up extra unneeded memory that is reserved
  *  as workspace when you call BeginMesh().
  *
- *  This class can easily be extended to contain other vertex attributes, and to 
- *  save itself and load itself from disk (thus forming the beginnings of a custom
+ *  This class can easily be extended to contain other vertex attributes.
+ *  SaveMesh() writes the finished mesh to disk, and LoadMesh() maps it back
+ *  in without rebuilding anything (thus forming the beginnings of a custom
  *  model file format).
  */
  
+#ifndef __TRIANGLE_MESH__
+#define __TRIANGLE_MESH__
+
 #include "gltools.h"
 #include "math3d.h"
+#include "MeshTools.h"
 
+// Bump this whenever the layout of a saved mesh changes. Files with any
+// other version are refused, rebuild the mesh and save it again.
+#define MESH_FILE_VERSION   1
 
 class CTriangleMesh
     {
@@ -28,36 +36,92 @@ class CTriangleMesh
         // Use these three functions to add triangles
         void BeginMesh(GLuint nMaxVerts);
         void AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVector2f vTexCoords[3]);
-        void EndMesh(void);
+        void EndMesh(GLuint nOptions = 0);     // MESH_INTERLEAVED, etc.
+
+        // Save the finished mesh, and load it back without rebuilding it.
+        // Both return false on failure. A mesh with no triangles isn't
+        // saved, SaveMesh() returns false for it.
+        bool SaveMesh(const char *szFileName);
+        bool LoadMesh(const char *szFileName);
+
+        // Axis aligned bounding box, found by EndMesh() or read by LoadMesh()
+        inline void GetBoundingBox(M3DVector3f vBoxMin, M3DVector3f vBoxMax)
+            { m3dCopyVector3(vBoxMin, vMin); m3dCopyVector3(vBoxMax, vMax); }
 
         // Useful for statistics
         inline GLuint GetIndexCount(void) { return nNumIndexes; }
         inline GLuint GetVertexCount(void) { return nNumVerts; }
+
+        // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, chosen by EndMesh()
+        inline GLenum GetIndexType(void) { return eIndexType; }
+        inline const GLvoid *GetIndexPointer(void)
+            { return (eIndexType == GL_UNSIGNED_SHORT) ? (const GLvoid *)pShortIndexes : (const GLvoid *)pIndexes; }
+        
+        // Simulated post-transform cache efficiency, returns the ACMR
+        GLfloat GetCacheStats(GLfloat *pATVR = NULL, GLuint nCacheSize = MESH_CACHE_SIZE);
+
+        // Was EndMesh() asked to interleave the vertex data
+        inline bool IsInterleaved(void) { return (pInterleaved != NULL); }
         
         // In place scale of the vertices
         void Scale(GLfloat fScaleValue) {
-            for(int i = 0; i < nNumVerts; i++)
-                m3dScaleVector3(pVerts[i], fScaleValue);
+            if(pInterleaved != NULL)
+                {
+                for(GLuint i = 0; i < nNumVerts; i++)
+                    m3dScaleVector3(&pInterleaved[i * MESH_VERTEX_FLOATS], fScaleValue);
+                }
+            else
+                {
+                for(GLuint i = 0; i < nNumVerts; i++)
+                    m3dScaleVector3(pVerts[i], fScaleValue);
                 }
+
+            // A negative scale turns the box inside out
+            m3dScaleVector3(vMin, fScaleValue);
+            m3dScaleVector3(vMax, fScaleValue);
+            for(int j = 0; j < 3; j++)
+                if(vMin[j] > vMax[j])
+                    { GLfloat fTemp = vMin[j]; vMin[j] = vMax[j]; vMax[j] = fTemp; }
+            }
         
         // Draw - make sure you call glEnableClientState for these arrays
         void Draw(void) {
                 // Here's where the data is now
-            glVertexPointer(3, GL_FLOAT,0, pVerts);
-            glNormalPointer(GL_FLOAT, 0, pNorms);
-            glTexCoordPointer(2, GL_FLOAT, 0, pTexCoords);
+            if(pInterleaved != NULL)
+                {
+                glVertexPointer(3, GL_FLOAT, MESH_VERTEX_STRIDE, pInterleaved);
+                glNormalPointer(GL_FLOAT, MESH_VERTEX_STRIDE, pInterleaved + MESH_NORMAL_OFFSET);
+                glTexCoordPointer(2, GL_FLOAT, MESH_VERTEX_STRIDE, pInterleaved + MESH_TEXCOORD_OFFSET);
+                }
+            else
+                {
+                glVertexPointer(3, GL_FLOAT,0, pVerts);
+                glNormalPointer(GL_FLOAT, 0, pNorms);
+                glTexCoordPointer(2, GL_FLOAT, 0, pTexCoords);
+                }
 
             // Draw them
-            glDrawElements(GL_TRIANGLES, nNumIndexes, GL_UNSIGNED_SHORT, pIndexes);
+            glDrawElements(GL_TRIANGLES, nNumIndexes, eIndexType, GetIndexPointer());
             }
         
     protected:
-        GLushort  *pIndexes;          // Array of indexes
+        void FreeMesh(void);
+
+        GLuint    *pIndexes;          // Array of indexes (32 bit)
+        GLushort  *pShortIndexes;     // Packed 16 bit indexes, when they fit
+        GLenum    eIndexType;         // Which of the two arrays is in use
         M3DVector3f *pVerts;        // Array of vertices
         M3DVector3f *pNorms;        // Array of normals
         M3DVector2f *pTexCoords;    // Array of texture coordinates
+        GLfloat     *pInterleaved;  // All of the above in one array (MESH_INTERLEAVED)
+        CVertexHash vertexHash;     // Finds duplicate vertices while building
+        M3DVector3f vMin, vMax;     // Bounding box
+        void        *pMapping;      // LoadMesh() file mapping the arrays point into
+        unsigned long nMappingSize;
         
         GLuint nMaxIndexes;         // Maximum workspace
         GLuint nNumIndexes;         // Number of indexes currently used
         GLuint nNumVerts;           // 
     };
+
+#endif
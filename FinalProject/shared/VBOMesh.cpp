@@ -27,6 +27,10 @@
 CVBOMesh::CVBOMesh(void)
     {
     pIndexes = NULL;
+    eIndexType = GL_UNSIGNED_INT;
+    bInterleaved = false;
+    fACMR = 0.0f;
+    fATVR = 0.0f;
     pVerts = NULL;
     pNorms = NULL;
     pTexCoords = NULL;
@@ -34,6 +38,9 @@ CVBOMesh::CVBOMesh(void)
     nMaxIndexes = 0;
     nNumIndexes = 0;
     nNumVerts = 0;
+
+    // Zero is silently ignored by glDeleteBuffers
+    memset(bufferObjects, 0, sizeof(bufferObjects));
     }
     
 ////////////////////////////////////////////////////////////
@@ -68,22 +75,25 @@ void CVBOMesh::BeginMesh(GLuint nMaxVerts)
     nNumIndexes = 0;
     nNumVerts = 0;
     
-    // Allocate new blocks
-    pIndexes = new GLushort[nMaxIndexes];
+    // Allocate new blocks. Indexes are always 32 bit while building,
+    // EndMesh() narrows them if they fit.
+    pIndexes = new GLuint[nMaxIndexes];
     pVerts = new M3DVector3f[nMaxIndexes];
     pNorms = new M3DVector3f[nMaxIndexes];
     pTexCoords = new M3DVector2f[nMaxIndexes];
+
+    // Workspace for finding duplicate vertices
+    vertexHash.Begin(nMaxIndexes, MESH_WELD_EPSILON);
     }
   
 /////////////////////////////////////////////////////////////////
 // Add a triangle to the mesh. This searches the current list for identical
 // (well, almost identical - these are floats you know...) verts. If one is found, it
 // is added to the index array. If not, it is added to both the index array and the vertex
-// array grows by one as well.
+// array grows by one as well. The search goes through a spatial hash, so building
+// a mesh is roughly linear in the number of triangles instead of quadratic.
 void CVBOMesh::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVector2f vTexCoords[3])
     {
-    const  float e = 0.000001; // How small a difference to equate
-
     // First thing we do is make sure the normals are unit length!
     // It's almost always a good idea to work with pre-normalized normals
     m3dNormalizeVector(vNorms[0]);
@@ -91,39 +101,26 @@ void CVBOMesh::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVecto
     m3dNormalizeVector(vNorms[2]);
 
 
-    // Search for match - triangle consists of three verts
+    // Search for match - triangle consists of three verts. The hash only
+    // looks at vertices that are spatially close to this one.
     for(GLuint iVertex = 0; iVertex < 3; iVertex++)
         {
-        GLuint iMatch = 0;
-        for(iMatch = 0; iMatch < nNumVerts; iMatch++)
+        GLuint iMatch = vertexHash.Find(verts[iVertex], vNorms[iVertex], vTexCoords[iVertex],
+                                        pVerts, pNorms, pTexCoords);
+
+        if(iMatch != MESH_NO_MATCH)
             {
-            // If the vertex positions are the same
-            if(m3dCloseEnough(pVerts[iMatch][0], verts[iVertex][0], e) &&
-               m3dCloseEnough(pVerts[iMatch][1], verts[iVertex][1], e) &&
-               m3dCloseEnough(pVerts[iMatch][2], verts[iVertex][2], e) &&
-                   
-               // AND the Normal is the same...
-               m3dCloseEnough(pNorms[iMatch][0], vNorms[iVertex][0], e) &&
-               m3dCloseEnough(pNorms[iMatch][1], vNorms[iVertex][1], e) &&
-               m3dCloseEnough(pNorms[iMatch][2], vNorms[iVertex][2], e) &&
-                   
-                // And Texture is the same...
-                m3dCloseEnough(pTexCoords[iMatch][0], vTexCoords[iVertex][0], e) &&
-                m3dCloseEnough(pTexCoords[iMatch][1], vTexCoords[iVertex][1], e))
-                {
-                // Then add the index only
-                pIndexes[nNumIndexes] = iMatch;
-                nNumIndexes++;
-                break;
-                }
+            // Then add the index only
+            pIndexes[nNumIndexes] = iMatch;
+            nNumIndexes++;
             }
-            
-        // No match for this vertex, add to end of list
-        if(iMatch == nNumVerts)
+        else
             {
+            // No match for this vertex, add to end of list
             memcpy(pVerts[nNumVerts], verts[iVertex], sizeof(M3DVector3f));
             memcpy(pNorms[nNumVerts], vNorms[iVertex], sizeof(M3DVector3f));
             memcpy(pTexCoords[nNumVerts], &vTexCoords[iVertex], sizeof(M3DVector2f));
+            vertexHash.Insert(nNumVerts, verts[iVertex]);
             pIndexes[nNumIndexes] = nNumVerts;
             nNumIndexes++; 
             nNumVerts++;
@@ -137,27 +134,87 @@ void CVBOMesh::AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVecto
 // Compact the data. This is a nice utility, but you should really
 // save the results of the indexing for future use if the model data
 // is static (doesn't change).
-void CVBOMesh::EndMesh(void)
+// Pass MESH_INTERLEAVED to upload the vertices as one interleaved buffer
+// object instead of three. MESH_OPTIMIZE_CACHE and MESH_OPTIMIZE_FETCH
+// reorder the triangles and vertices before they are uploaded.
+void CVBOMesh::EndMesh(GLuint nOptions)
     {
+    // Done looking for duplicates
+    vertexHash.End();
+
+    // Optional passes to make the GPU's life easier
+    if(nOptions & MESH_OPTIMIZE_CACHE)
+        meshOptimizeVertexCache(pIndexes, nNumIndexes, nNumVerts);
+
+    if(nOptions & MESH_OPTIMIZE_FETCH)
+        {
+        GLuint *pRemap = new GLuint[nNumVerts];
+        M3DVector3f *pNewVerts = new M3DVector3f[nNumVerts];
+        M3DVector3f *pNewNorms = new M3DVector3f[nNumVerts];
+        M3DVector2f *pNewTex = new M3DVector2f[nNumVerts];
+
+        meshOptimizeVertexFetch(pRemap, pIndexes, nNumIndexes, nNumVerts);
+        meshRemapVertices(pNewVerts, pNewNorms, pNewTex, pVerts, pNorms, pTexCoords, pRemap, nNumVerts);
+
+        delete [] pRemap;
+        delete [] pVerts;
+        delete [] pNorms;
+        delete [] pTexCoords;
+        pVerts = pNewVerts;
+        pNorms = pNewNorms;
+        pTexCoords = pNewTex;
+        }
+
+    // The indexes don't stay in client memory, so measure them now
+    fACMR = meshGetCacheStats(pIndexes, GL_UNSIGNED_INT, nNumIndexes, nNumVerts, MESH_CACHE_SIZE, &fATVR);
+
     // Create the buffer objects
     glGenBuffers(4, bufferObjects);
     
     // Copy data to video memory
-    // Vertex data
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pVerts, GL_STATIC_DRAW);
+    bInterleaved = ((nOptions & MESH_INTERLEAVED) != 0);
+    if(bInterleaved)
+        {
+        // Everything goes in the vertex buffer, the normal and texture
+        // buffers are not needed
+        GLfloat *pInterleaved = new GLfloat[nNumVerts * MESH_VERTEX_FLOATS];
+        meshInterleave(pInterleaved, pVerts, pNorms, pTexCoords, nNumVerts);
+
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, MESH_VERTEX_STRIDE*nNumVerts, pInterleaved, GL_STATIC_DRAW);
+        delete [] pInterleaved;
+
+        glDeleteBuffers(2, &bufferObjects[NORMAL_DATA]);
+        bufferObjects[NORMAL_DATA] = 0;
+        bufferObjects[TEXTURE_DATA] = 0;
+        }
+    else
+        {
+        // Vertex data
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pVerts, GL_STATIC_DRAW);
     
-    // Normal data
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pNorms, GL_STATIC_DRAW);
+        // Normal data
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*3, pNorms, GL_STATIC_DRAW);
     
-    // Texture coordinates
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*2, pTexCoords, GL_STATIC_DRAW);
+        // Texture coordinates
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
+        glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat)*nNumVerts*2, pTexCoords, GL_STATIC_DRAW);
+        }
     
-    // Indexes
+    // Indexes. Only use 32 bit indexes if there are too many vertices for 16
+    eIndexType = meshGetIndexType(nNumVerts);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObjects[INDEX_DATA]);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort)*nNumIndexes, pIndexes, GL_STATIC_DRAW);
+    if(eIndexType == GL_UNSIGNED_SHORT)
+        {
+        GLushort *pShortIndexes = new GLushort[nNumIndexes];
+        meshPackIndexes(pShortIndexes, pIndexes, nNumIndexes);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort)*nNumIndexes, pShortIndexes, GL_STATIC_DRAW);
+        delete [] pShortIndexes;
+        }
+    else
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLuint)*nNumIndexes, pIndexes, GL_STATIC_DRAW);
     
     // Free older, larger arrays
     delete [] pIndexes;
@@ -177,19 +234,30 @@ void CVBOMesh::EndMesh(void)
 void CVBOMesh::Draw(void) {
     // Here's where the data is now
     glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
-    glVertexPointer(3, GL_FLOAT,0,  0);
+
+    if(bInterleaved)
+        {
+        // One buffer, one bind
+        glVertexPointer(3, GL_FLOAT, MESH_VERTEX_STRIDE, 0);
+        glNormalPointer(GL_FLOAT, MESH_VERTEX_STRIDE, (GLvoid *)(sizeof(GLfloat) * MESH_NORMAL_OFFSET));
+        glTexCoordPointer(2, GL_FLOAT, MESH_VERTEX_STRIDE, (GLvoid *)(sizeof(GLfloat) * MESH_TEXCOORD_OFFSET));
+        }
+    else
+        {
+        glVertexPointer(3, GL_FLOAT,0,  0);
     
-    // Normal data
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
-    glNormalPointer(GL_FLOAT, 0, 0);
+        // Normal data
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[NORMAL_DATA]);
+        glNormalPointer(GL_FLOAT, 0, 0);
            
-    // Texture coordinates
-    glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
-    glTexCoordPointer(2, GL_FLOAT, 0, 0);
+        // Texture coordinates
+        glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[TEXTURE_DATA]);
+        glTexCoordPointer(2, GL_FLOAT, 0, 0);
+        }
 
     // Indexes
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, bufferObjects[INDEX_DATA]);
-    glDrawElements(GL_TRIANGLES, nNumIndexes, GL_UNSIGNED_SHORT, 0);
+    glDrawElements(GL_TRIANGLES, nNumIndexes, eIndexType, 0);
     }
 
 ///////////////////////////////////////////////////////////////////////////
@@ -198,12 +266,13 @@ void CVBOMesh::Draw(void) {
 void CVBOMesh::Scale(GLfloat fScaleValue) 
     {
     glBindBuffer(GL_ARRAY_BUFFER, bufferObjects[VERTEX_DATA]);
-    M3DVector3f *pVertexData = (M3DVector3f *)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
+    GLfloat *pVertexData = (GLfloat *)glMapBuffer(GL_ARRAY_BUFFER, GL_READ_WRITE);
+    GLuint nStride = bInterleaved ? MESH_VERTEX_FLOATS : 3;
     
     if(pVertexData != NULL)
         {
-        for(int i = 0; i < nNumVerts; i++)
-            m3dScaleVector3(pVertexData[i], fScaleValue);
+        for(GLuint i = 0; i < nNumVerts; i++)
+            m3dScaleVector3(&pVertexData[i * nStride], fScaleValue);
     
         glUnmapBuffer(GL_ARRAY_BUFFER);
         }
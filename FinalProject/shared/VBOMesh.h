@@ -22,6 +22,7 @@
  
 #include "gltools.h"
 #include "math3d.h"
+#include "MeshTools.h"
 
 #define VERTEX_DATA     0
 #define NORMAL_DATA     1
@@ -37,11 +38,22 @@ class CVBOMesh
         // Use these three functions to add triangles
         void BeginMesh(GLuint nMaxVerts);
         void AddTriangle(M3DVector3f verts[3], M3DVector3f vNorms[3], M3DVector2f vTexCoords[3]);
-        void EndMesh(void);
+        void EndMesh(GLuint nOptions = 0);     // MESH_INTERLEAVED, etc.
 
         // Useful for statistics
         inline GLuint GetIndexCount(void) { return nNumIndexes; }
         inline GLuint GetVertexCount(void) { return nNumVerts; }
+
+        // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT, chosen by EndMesh()
+        inline GLenum GetIndexType(void) { return eIndexType; }
+
+        // Simulated post-transform cache efficiency (MESH_CACHE_SIZE entries)
+        // of the uploaded indexes. Returns the ACMR.
+        inline GLfloat GetCacheStats(GLfloat *pATVR = NULL)
+            { if(pATVR != NULL) *pATVR = fATVR; return fACMR; }
+
+        // Was EndMesh() asked to interleave the vertex data
+        inline bool IsInterleaved(void) { return bInterleaved; }
         
         // In place scale of the vertices
         void Scale(GLfloat fScaleValue);
@@ -50,14 +62,18 @@ class CVBOMesh
         void Draw(void);
         
     protected:
-        GLushort  *pIndexes;          // Array of indexes
+        GLuint    *pIndexes;          // Array of indexes (32 bit while building)
+        GLenum    eIndexType;         // Type of the indexes in the buffer object
         M3DVector3f *pVerts;        // Array of vertices
         M3DVector3f *pNorms;        // Array of normals
         M3DVector2f *pTexCoords;    // Array of texture coordinates
+        CVertexHash vertexHash;     // Finds duplicate vertices while building
         
         GLuint nMaxIndexes;         // Maximum workspace
         GLuint nNumIndexes;         // Number of indexes currently used
         GLuint nNumVerts;           // Number of vertices actually used
         
         GLuint bufferObjects[4];
+        bool   bInterleaved;        // Everything is in bufferObjects[VERTEX_DATA]
+        GLfloat fACMR, fATVR;       // Measured by EndMesh()
     };
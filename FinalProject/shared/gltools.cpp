@@ -12,6 +12,15 @@
 #include <stdio.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 ///////////////////////////////////////////////////////////////////////////////
 // Get the OpenGL version number
@@ -243,105 +252,338 @@ void gltDrawUnitAxes(void)
 	}
 
 
-// For best results, put this in a display list
-// Draw a torus (doughnut)  at z = fZVal... torus is in xy plane
-void gltDrawTorus(GLfloat majorRadius, GLfloat minorRadius, GLint numMajor, GLint numMinor)
+///////////////////////////////////////////////////////////////////////////////
+// The primitive cache. gltDrawSphere() and gltDrawTorus() used to work out
+// every vertex (two sin's and two cos's each) and send them one at a time
+// on every call. Now the first call for a given shape builds an indexed
+// mesh in a pair of buffer objects, and every call after that with the same
+// parameters just draws it. Shapes are looked up by their exact parameters,
+// and when the cache is full the one that has gone longest without being
+// drawn is thrown out.
+#define GLT_PRIMITIVE_SPHERE	0
+#define GLT_PRIMITIVE_TORUS		1
+
+typedef struct
 	{
-    M3DVector3f vNormal;
-    double majorStep = 2.0f*M3D_PI / numMajor;
-    double minorStep = 2.0f*M3D_PI / numMinor;
-    int i, j;
-	
-    for (i=0; i<numMajor; ++i) 
-		{
-		double a0 = i * majorStep;
-		double a1 = a0 + majorStep;
-		GLfloat x0 = (GLfloat) cos(a0);
-		GLfloat y0 = (GLfloat) sin(a0);
-		GLfloat x1 = (GLfloat) cos(a1);
-		GLfloat y1 = (GLfloat) sin(a1);
-		
-		glBegin(GL_TRIANGLE_STRIP);
-		for (j=0; j<=numMinor; ++j) 
+	GLint		nType;				// Sphere or torus
+	GLfloat		fParams[2];			// Radius, or major and minor radius
+	GLint		iParams[2];			// Slices and stacks, or major and minor steps
+	GLuint		bufferObjects[2];	// Vertices and indexes
+	GLsizei		nNumIndexes;
+	GLenum		eIndexType;			// GL_UNSIGNED_SHORT if it fits
+	GLuint		nLastUsed;			// For throwing out the least recently used
+	} GLTPRIMITIVE;
+
+static GLTPRIMITIVE primitiveCache[GLT_PRIMITIVE_CACHE_SIZE];
+static GLint nNumPrimitives = 0;
+static GLuint nPrimitiveClock = 0;
+static GLuint nPrimitiveHits = 0;
+static GLuint nPrimitiveMisses = 0;
+
+// Vertices are GL_T2F_N3F_V3F, ready for glInterleavedArrays()
+#define GLT_PRIMITIVE_VERTEX_SIZE	8
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Both shapes are a grid of (nColumns + 1) x (nRows + 1) vertices, the extra
+// row and column being the seam where the texture coordinates wrap. Each
+// grid square becomes two triangles, wound the same way the old triangle
+// strips were. The grid is small enough to use short indexes in just about
+// every case.
+static GLsizei gltBuildGridIndexes(GLint nColumns, GLint nRows, GLenum *pIndexType, void **ppIndexes)
+	{
+	GLsizei nNumIndexes = nColumns * nRows * 6;
+	GLint nRowLength = nColumns + 1;
+	GLuint *pIndexes = new GLuint[nNumIndexes];
+	GLuint *pIndex = pIndexes;
+
+	for(GLint i = 0; i < nRows; i++)
+		for(GLint j = 0; j < nColumns; j++)
 			{
-			double b = j * minorStep;
-			GLfloat c = (GLfloat) cos(b);
-			GLfloat r = minorRadius * c + majorRadius;
-			GLfloat z = minorRadius * (GLfloat) sin(b);
+			GLuint a = i * nRowLength + j;		// This row
+			GLuint b = a + nRowLength;			// Next row
 			
-			// First point
-			glTexCoord2f((float)(i)/(float)(numMajor), (float)(j)/(float)(numMinor));
-			vNormal[0] = x0*c;
-			vNormal[1] = y0*c;
-			vNormal[2] = z/minorRadius;
-			m3dNormalizeVector(vNormal);
-			glNormal3fv(vNormal);
-			glVertex3f(x0*r, y0*r, z);
+			*pIndex++ = a;
+			*pIndex++ = b;
+			*pIndex++ = a + 1;
 			
-			glTexCoord2f((float)(i+1)/(float)(numMajor), (float)(j)/(float)(numMinor));
-			vNormal[0] = x1*c;
-			vNormal[1] = y1*c;
-			vNormal[2] = z/minorRadius;
-			m3dNormalizeVector(vNormal);
-			glNormal3fv(vNormal);
-			glVertex3f(x1*r, y1*r, z);
+			*pIndex++ = a + 1;
+			*pIndex++ = b;
+			*pIndex++ = b + 1;
 			}
-		glEnd();
+
+	if(nRowLength * (nRows + 1) <= 65536)
+		{
+		GLushort *pShortIndexes = new GLushort[nNumIndexes];
+		for(GLsizei i = 0; i < nNumIndexes; i++)
+			pShortIndexes[i] = (GLushort)pIndexes[i];
+
+		delete [] pIndexes;
+		*pIndexType = GL_UNSIGNED_SHORT;
+		*ppIndexes = pShortIndexes;
 		}
+	else
+		{
+		*pIndexType = GL_UNSIGNED_INT;
+		*ppIndexes = pIndexes;
+		}
+
+	return nNumIndexes;
 	}
 
-// For best results, put this in a display list
-// Draw a sphere at the origin
-void gltDrawSphere(GLfloat fRadius, GLint iSlices, GLint iStacks)
+
+///////////////////////////////////////////////////////////////////////////////
+// Sphere vertices, stack by stack from the +Z pole down. The sin and cos of
+// each angle are worked out once up front, not once per vertex.
+static void gltBuildSphereVertices(GLfloat *pVerts, GLfloat fRadius, GLint iSlices, GLint iStacks)
 	{
-    GLfloat drho = (GLfloat)(3.141592653589) / (GLfloat) iStacks;
-    GLfloat dtheta = 2.0f * (GLfloat)(3.141592653589) / (GLfloat) iSlices;
+	GLfloat drho = (GLfloat)(3.141592653589) / (GLfloat) iStacks;
+	GLfloat dtheta = 2.0f * (GLfloat)(3.141592653589) / (GLfloat) iSlices;
 	GLfloat ds = 1.0f / (GLfloat) iSlices;
 	GLfloat dt = 1.0f / (GLfloat) iStacks;
-	GLfloat t = 1.0f;	
-	GLfloat s = 0.0f;
-    GLint i, j;     // Looping variables
-	
-	for (i = 0; i < iStacks; i++) 
+	GLint i, j;
+
+	GLfloat *pSinTheta = new GLfloat[(iSlices + 1) * 2];
+	GLfloat *pCosTheta = pSinTheta + iSlices + 1;
+	for(j = 0; j <= iSlices; j++)
+		{
+		GLfloat theta = (j == iSlices) ? 0.0f : j * dtheta;
+		pSinTheta[j] = (GLfloat)(-sin(theta));
+		pCosTheta[j] = (GLfloat)(cos(theta));
+		}
+
+	for(i = 0; i <= iStacks; i++)
 		{
 		GLfloat rho = (GLfloat)i * drho;
 		GLfloat srho = (GLfloat)(sin(rho));
 		GLfloat crho = (GLfloat)(cos(rho));
-		GLfloat srhodrho = (GLfloat)(sin(rho + drho));
-		GLfloat crhodrho = (GLfloat)(cos(rho + drho));
-		
-        // Many sources of OpenGL sphere drawing code uses a triangle fan
-        // for the caps of the sphere. This however introduces texturing 
-        // artifacts at the poles on some OpenGL implementations
-		glBegin(GL_TRIANGLE_STRIP);
-        s = 0.0f;
-		for ( j = 0; j <= iSlices; j++) 
+		GLfloat t = 1.0f - (GLfloat)i * dt;
+
+		for(j = 0; j <= iSlices; j++)
 			{
-			GLfloat theta = (j == iSlices) ? 0.0f : j * dtheta;
-			GLfloat stheta = (GLfloat)(-sin(theta));
-			GLfloat ctheta = (GLfloat)(cos(theta));
-			
-			GLfloat x = stheta * srho;
-			GLfloat y = ctheta * srho;
+			GLfloat x = pSinTheta[j] * srho;
+			GLfloat y = pCosTheta[j] * srho;
 			GLfloat z = crho;
-            
-            glTexCoord2f(s, t);
-            glNormal3f(x, y, z);
-            glVertex3f(x * fRadius, y * fRadius, z * fRadius);
-			
-            x = stheta * srhodrho;
-			y = ctheta * srhodrho;
-			z = crhodrho;
-			glTexCoord2f(s, t - dt);
-            s += ds;
-            glNormal3f(x, y, z);
-            glVertex3f(x * fRadius, y * fRadius, z * fRadius);
+
+			*pVerts++ = (GLfloat)j * ds;
+			*pVerts++ = t;
+			*pVerts++ = x;
+			*pVerts++ = y;
+			*pVerts++ = z;
+			*pVerts++ = x * fRadius;
+			*pVerts++ = y * fRadius;
+			*pVerts++ = z * fRadius;
+			}
+		}
+
+	delete [] pSinTheta;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Torus vertices, one ring of the tube at a time around the major circle
+static void gltBuildTorusVertices(GLfloat *pVerts, GLfloat majorRadius, GLfloat minorRadius, GLint numMajor, GLint numMinor)
+	{
+	double majorStep = 2.0f*M3D_PI / numMajor;
+	double minorStep = 2.0f*M3D_PI / numMinor;
+	GLint i, j;
+
+	// The last entry of each table is the seam, make it match the first exactly
+	GLfloat *pTables = new GLfloat[(numMajor + 1) * 2 + (numMinor + 1) * 2];
+	GLfloat *pMajorSin = pTables;
+	GLfloat *pMajorCos = pMajorSin + numMajor + 1;
+	GLfloat *pMinorSin = pMajorCos + numMajor + 1;
+	GLfloat *pMinorCos = pMinorSin + numMinor + 1;
+
+	for(i = 0; i <= numMajor; i++)
+		{
+		double a = (i == numMajor) ? 0.0 : i * majorStep;
+		pMajorSin[i] = (GLfloat) sin(a);
+		pMajorCos[i] = (GLfloat) cos(a);
+		}
+
+	for(j = 0; j <= numMinor; j++)
+		{
+		double b = (j == numMinor) ? 0.0 : j * minorStep;
+		pMinorSin[j] = (GLfloat) sin(b);
+		pMinorCos[j] = (GLfloat) cos(b);
+		}
+
+	for(i = 0; i <= numMajor; i++)
+		{
+		GLfloat x0 = pMajorCos[i];
+		GLfloat y0 = pMajorSin[i];
+
+		for(j = 0; j <= numMinor; j++)
+			{
+			GLfloat c = pMinorCos[j];
+			GLfloat r = minorRadius * c + majorRadius;
+			GLfloat z = minorRadius * pMinorSin[j];
+
+			// The normal (x0*c, y0*c, sin(b)) is already unit length
+			*pVerts++ = (float)(i)/(float)(numMajor);
+			*pVerts++ = (float)(j)/(float)(numMinor);
+			*pVerts++ = x0*c;
+			*pVerts++ = y0*c;
+			*pVerts++ = pMinorSin[j];
+			*pVerts++ = x0*r;
+			*pVerts++ = y0*r;
+			*pVerts++ = z;
 			}
-        glEnd();
+		}
 
-        t -= dt;
-        }
-    }
+	delete [] pTables;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Find a shape in the cache, or build it. Returns NULL if the parameters
+// don't make a shape at all.
+static GLTPRIMITIVE *gltGetPrimitive(GLint nType, GLfloat f0, GLfloat f1, GLint i0, GLint i1)
+	{
+	GLTPRIMITIVE *pPrim;
+	GLint i;
+
+	if(i0 < 1 || i1 < 1)
+		return NULL;
+
+	nPrimitiveClock++;
+
+	for(i = 0; i < nNumPrimitives; i++)
+		{
+		pPrim = &primitiveCache[i];
+		if(pPrim->nType == nType && pPrim->fParams[0] == f0 && pPrim->fParams[1] == f1 &&
+		   pPrim->iParams[0] == i0 && pPrim->iParams[1] == i1)
+			{
+			nPrimitiveHits++;
+			pPrim->nLastUsed = nPrimitiveClock;
+			return pPrim;
+			}
+		}
+
+	nPrimitiveMisses++;
+
+	// Room for another, or throw out the one used longest ago
+	if(nNumPrimitives < GLT_PRIMITIVE_CACHE_SIZE)
+		{
+		pPrim = &primitiveCache[nNumPrimitives++];
+		glGenBuffers(2, pPrim->bufferObjects);
+		}
+	else
+		{
+		pPrim = &primitiveCache[0];
+		for(i = 1; i < GLT_PRIMITIVE_CACHE_SIZE; i++)
+			if(primitiveCache[i].nLastUsed < pPrim->nLastUsed)
+				pPrim = &primitiveCache[i];
+		}
+
+	pPrim->nType = nType;
+	pPrim->fParams[0] = f0;
+	pPrim->fParams[1] = f1;
+	pPrim->iParams[0] = i0;
+	pPrim->iParams[1] = i1;
+	pPrim->nLastUsed = nPrimitiveClock;
+
+	// Sphere slices go around, stacks go down. Torus minor steps go
+	// around the tube, major steps go around the ring.
+	GLint nColumns = (nType == GLT_PRIMITIVE_SPHERE) ? i0 : i1;
+	GLint nRows = (nType == GLT_PRIMITIVE_SPHERE) ? i1 : i0;
+	GLsizei nNumVerts = (nColumns + 1) * (nRows + 1);
+	GLfloat *pVerts = new GLfloat[nNumVerts * GLT_PRIMITIVE_VERTEX_SIZE];
+	void *pIndexes;
+
+	if(nType == GLT_PRIMITIVE_SPHERE)
+		gltBuildSphereVertices(pVerts, f0, i0, i1);
+	else
+		gltBuildTorusVertices(pVerts, f0, f1, i0, i1);
+
+	pPrim->nNumIndexes = gltBuildGridIndexes(nColumns, nRows, &pPrim->eIndexType, &pIndexes);
+
+	glBindBuffer(GL_ARRAY_BUFFER, pPrim->bufferObjects[0]);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * GLT_PRIMITIVE_VERTEX_SIZE * nNumVerts, pVerts, GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pPrim->bufferObjects[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+				 pPrim->nNumIndexes * ((pPrim->eIndexType == GL_UNSIGNED_SHORT) ? sizeof(GLushort) : sizeof(GLuint)),
+				 pIndexes, GL_STATIC_DRAW);
+
+	delete [] pVerts;
+	if(pPrim->eIndexType == GL_UNSIGNED_SHORT)
+		delete [] (GLushort *)pIndexes;
+	else
+		delete [] (GLuint *)pIndexes;
+
+	return pPrim;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw a cached shape. The client array state is saved and restored, so
+// callers see no difference from the old glBegin()/glEnd() code.
+static void gltDrawPrimitive(GLTPRIMITIVE *pPrim)
+	{
+	glPushClientAttrib(GL_CLIENT_VERTEX_ARRAY_BIT);
+
+	glBindBuffer(GL_ARRAY_BUFFER, pPrim->bufferObjects[0]);
+	glInterleavedArrays(GL_T2F_N3F_V3F, 0, 0);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, pPrim->bufferObjects[1]);
+	glDrawElements(GL_TRIANGLES, pPrim->nNumIndexes, pPrim->eIndexType, 0);
+
+	glPopClientAttrib();
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// How well is the cache doing? Either pointer may be NULL.
+void gltGetPrimitiveCacheStats(GLuint *pHits, GLuint *pMisses)
+	{
+	if(pHits != NULL)
+		*pHits = nPrimitiveHits;
+
+	if(pMisses != NULL)
+		*pMisses = nPrimitiveMisses;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Delete all the cached shapes, and zero the statistics. The buffers belong
+// to the current rendering context, so call this before it goes away.
+void gltFreePrimitiveCache(void)
+	{
+	for(GLint i = 0; i < nNumPrimitives; i++)
+		glDeleteBuffers(2, primitiveCache[i].bufferObjects);
+
+	nNumPrimitives = 0;
+	nPrimitiveClock = 0;
+	nPrimitiveHits = 0;
+	nPrimitiveMisses = 0;
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw a torus (doughnut)  at z = fZVal... torus is in xy plane
+// The mesh is built the first time these parameters are seen, and comes
+// from the primitive cache after that.
+void gltDrawTorus(GLfloat majorRadius, GLfloat minorRadius, GLint numMajor, GLint numMinor)
+	{
+	GLTPRIMITIVE *pPrim = gltGetPrimitive(GLT_PRIMITIVE_TORUS, majorRadius, minorRadius, numMajor, numMinor);
+
+	if(pPrim != NULL)
+		gltDrawPrimitive(pPrim);
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Draw a sphere at the origin
+// Many sources of OpenGL sphere drawing code uses a triangle fan
+// for the caps of the sphere. This however introduces texturing 
+// artifacts at the poles on some OpenGL implementations, so the poles
+// here are a row of vertices like any other.
+void gltDrawSphere(GLfloat fRadius, GLint iSlices, GLint iStacks)
+	{
+	GLTPRIMITIVE *pPrim = gltGetPrimitive(GLT_PRIMITIVE_SPHERE, fRadius, 0.0f, iSlices, iStacks);
+
+	if(pPrim != NULL)
+		gltDrawPrimitive(pPrim);
+	}
 
 
 // Define targa header. This is only used locally.
@@ -397,9 +639,15 @@ GLint gltWriteTGA(const char *szFileName)
     
     // Get the current read buffer setting and save it. Switch to
     // the front buffer and do the read operation. Finally, restore
-    // the read buffer state
+    // the read buffer state. A framebuffer object has no front buffer,
+    // so if one is bound just read whatever it has selected.
+    GLint iFramebuffer = 0;
+    if(GLEE_EXT_framebuffer_object)
+        glGetIntegerv(GL_FRAMEBUFFER_BINDING_EXT, &iFramebuffer);
+
     glGetIntegerv(GL_READ_BUFFER, (GLint *)&lastBuffer);
-    glReadBuffer(GL_FRONT);
+    if(iFramebuffer == 0)
+        glReadBuffer(GL_FRONT);
     glReadPixels(0, 0, iViewport[2], iViewport[3], GL_BGR_EXT, GL_UNSIGNED_BYTE, pBits);
     glReadBuffer(lastBuffer);
     
@@ -543,6 +791,384 @@ GLbyte* _cdecl gltLoadTGA(const char *szFileName, GLint *iWidth, GLint *iHeight,
 
 
 
+////////////////////////////////////////////////////////////////////
+// Map a file into the address space instead of reading it. Nothing is
+// copied up front, the OS pages the data in as it is touched, and pages
+// that are never written are shared with the file cache.
+// The mapping is private (copy-on-write), so the caller may modify the
+// data in place without changing the file.
+// Returns NULL on failure (this includes empty files). Release the
+// memory with gltUnmapFile(), never free() or delete.
+void* gltMapFile(const char *szFileName, unsigned long *pSize)
+	{
+	void *pData = NULL;
+	*pSize = 0;
+
+#ifdef WIN32
+	HANDLE hFile = CreateFileA(szFileName, GENERIC_READ, FILE_SHARE_READ, NULL,
+							   OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(hFile == INVALID_HANDLE_VALUE)
+		return NULL;
+
+	DWORD dwSize = GetFileSize(hFile, NULL);
+	if(dwSize == 0 || dwSize == INVALID_FILE_SIZE)
+		{
+		CloseHandle(hFile);
+		return NULL;
+		}
+
+	HANDLE hMapping = CreateFileMapping(hFile, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+	if(hMapping != NULL)
+		{
+		pData = MapViewOfFile(hMapping, FILE_MAP_COPY, 0, 0, 0);
+
+		// The view keeps the mapping alive, the handles are not needed
+		CloseHandle(hMapping);
+		}
+	CloseHandle(hFile);
+
+	if(pData == NULL)
+		return NULL;
+
+	*pSize = dwSize;
+#else
+	int hFile = open(szFileName, O_RDONLY);
+	if(hFile < 0)
+		return NULL;
+
+	struct stat fileInfo;
+	if(fstat(hFile, &fileInfo) != 0 || fileInfo.st_size == 0)
+		{
+		close(hFile);
+		return NULL;
+		}
+
+	pData = mmap(NULL, fileInfo.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, hFile, 0);
+
+	// The mapping holds its own reference to the file
+	close(hFile);
+
+	if(pData == MAP_FAILED)
+		return NULL;
+
+	*pSize = (unsigned long)fileInfo.st_size;
+#endif
+
+	return pData;
+	}
+
+////////////////////////////////////////////////////////////////////
+// Release memory returned by gltMapFile(). nSize is the size it returned.
+void gltUnmapFile(void *pData, unsigned long nSize)
+	{
+	if(pData == NULL)
+		return;
+
+#ifdef WIN32
+	UnmapViewOfFile(pData);
+#else
+	munmap(pData, nSize);
+#endif
+	}
+
+
+////////////////////////////////////////////////////////////////////
+// Fill nCount pixels of nPixelSize bytes with copies of one pixel. The
+// pixel is repeated into a 16 byte pattern (16, 5 or 4 whole pixels) that
+// is stored 16 bytes at a time, which any compiler worth having turns into
+// a single unaligned vector store. The last store may run on past the end
+// of the run, that's fine as long as it stays inside the image (pEnd), the
+// next packet writes over it.
+static void gltExpandRun(GLubyte *pDst, const GLubyte *pPixel, int nPixelSize, unsigned long nCount, const GLubyte *pEnd)
+	{
+	GLubyte pattern[16];
+	unsigned long nStep = (16 / nPixelSize) * nPixelSize;
+	GLubyte *pRunEnd = pDst + nCount * nPixelSize;
+	int i;
+
+	for(i = 0; i < 16; i++)
+		pattern[i] = pPixel[i % nPixelSize];
+
+	while(pDst < pRunEnd && pDst + 16 <= pEnd)
+		{
+		memcpy(pDst, pattern, 16);
+		pDst += nStep;
+		}
+
+	// Too close to the end of the image for whole stores
+	while(pDst < pRunEnd)
+		{
+		memcpy(pDst, pPixel, nPixelSize);
+		pDst += nPixelSize;
+		}
+	}
+
+////////////////////////////////////////////////////////////////////
+// Unpack Targa run length encoding. Each packet is a header byte, the low
+// seven bits one less than the number of pixels. With the top bit set, one
+// pixel follows, repeated that many times. Otherwise that many pixels
+// follow as they are. Packets may run across rows, but not off the end
+// of the image or the file.
+static bool gltDecodeTGARLE(GLubyte *pDst, unsigned long nPixels, int nPixelSize, const GLubyte *pSrc, const GLubyte *pSrcEnd)
+	{
+	const GLubyte *pEnd = pDst + nPixels * nPixelSize;
+
+	while(pDst < pEnd)
+		{
+		if(pSrc >= pSrcEnd)
+			return false;
+
+		GLubyte header = *pSrc++;
+		unsigned long nCount = (header & 0x7F) + 1;
+		unsigned long nBytes = nCount * nPixelSize;
+
+		if(nBytes > (unsigned long)(pEnd - pDst))
+			return false;
+
+		if(header & 0x80)
+			{
+			if(pSrcEnd - pSrc < nPixelSize)
+				return false;
+			gltExpandRun(pDst, pSrc, nPixelSize, nCount, pEnd);
+			pSrc += nPixelSize;
+			}
+		else
+			{
+			if((unsigned long)(pSrcEnd - pSrc) < nBytes)
+				return false;
+			memcpy(pDst, pSrc, nBytes);
+			pSrc += nBytes;
+			}
+
+		pDst += nBytes;
+		}
+
+	return true;
+	}
+
+////////////////////////////////////////////////////////////////////
+// Turn an image upside down, or mirror it left to right, in place
+static void gltFlipImageRows(GLubyte *pBits, GLint iWidth, GLint iHeight, int nPixelSize)
+	{
+	unsigned long nRowSize = iWidth * nPixelSize;
+	GLubyte *pTemp = new GLubyte[nRowSize];
+
+	for(GLint y = 0; y < iHeight / 2; y++)
+		{
+		GLubyte *pTop = pBits + y * nRowSize;
+		GLubyte *pBottom = pBits + (iHeight - 1 - y) * nRowSize;
+		memcpy(pTemp, pTop, nRowSize);
+		memcpy(pTop, pBottom, nRowSize);
+		memcpy(pBottom, pTemp, nRowSize);
+		}
+
+	delete [] pTemp;
+	}
+
+static void gltFlipImageColumns(GLubyte *pBits, GLint iWidth, GLint iHeight, int nPixelSize)
+	{
+	GLubyte temp[4];
+
+	for(GLint y = 0; y < iHeight; y++)
+		{
+		GLubyte *pLeft = pBits + y * iWidth * nPixelSize;
+		GLubyte *pRight = pLeft + (iWidth - 1) * nPixelSize;
+
+		for(; pLeft < pRight; pLeft += nPixelSize, pRight -= nPixelSize)
+			{
+			memcpy(temp, pLeft, nPixelSize);
+			memcpy(pLeft, pRight, nPixelSize);
+			memcpy(pRight, temp, nPixelSize);
+			}
+		}
+	}
+
+////////////////////////////////////////////////////////////////////
+// Load a Targa file through a file mapping. Image types 2 and 3 (true
+// color and grey scale) and 10 and 11 (the same, run length encoded) are
+// 8, 24 or 32 bits a pixel. Types 1 and 9 (color mapped, raw and RLE)
+// have 8 bit indexes into a 24 or 32 bit palette, and come out as true
+// color. Bit 5 of the descriptor says the first row is the top one, and
+// bit 4 that pixels go right to left, either way they are turned around
+// so the first pixel is the bottom left one, as OpenGL wants.
+// An uncompressed image that is already bottom up is not copied at all,
+// pBits points into the mapping. One that has to be turned around is done
+// in place, the mapping is copy-on-write.
+// Everything is checked against the size of the file before it is read,
+// a bad or truncated file fails rather than crashing.
+bool gltLoadTGAImage(const char *szFileName, GLTIMAGE *pImage)
+	{
+	TGAHEADER tgaHeader;
+	unsigned long nFileSize;
+
+	memset(pImage, 0, sizeof(GLTIMAGE));
+
+	GLubyte *pFile = (GLubyte *)gltMapFile(szFileName, &nFileSize);
+	if(pFile == NULL)
+		return false;
+
+	const GLubyte *pFileEnd = pFile + nFileSize;
+	if(nFileSize < 18)
+		{
+		gltUnmapFile(pFile, nFileSize);
+		return false;
+		}
+
+	memcpy(&tgaHeader, pFile, 18);
+#ifdef __APPLE__
+	LITTLE_ENDIAN_WORD(&tgaHeader.colorMapStart);
+	LITTLE_ENDIAN_WORD(&tgaHeader.colorMapLength);
+	LITTLE_ENDIAN_WORD(&tgaHeader.xstart);
+	LITTLE_ENDIAN_WORD(&tgaHeader.ystart);
+	LITTLE_ENDIAN_WORD(&tgaHeader.width);
+	LITTLE_ENDIAN_WORD(&tgaHeader.height);
+#endif
+
+	int nType = (GLubyte)tgaHeader.imageType;
+	int nBits = (GLubyte)tgaHeader.bits;
+	int nDescriptor = (GLubyte)tgaHeader.descriptor;
+	int nBaseType = nType & ~8;
+	bool bRLE = (nType & 8) != 0;
+	bool bMapped = (tgaHeader.colorMapType == 1);
+	int nMapEntrySize = (tgaHeader.colorMapBits + 7) / 8;
+	int nPixelSize = nBits / 8;             // As stored in the file
+	int nOutPixelSize = nPixelSize;         // As handed back
+
+	// Check everything in the header makes sense
+	bool bValid = (tgaHeader.width > 0 && tgaHeader.height > 0 && tgaHeader.colorMapType <= 1);
+	switch(nBaseType)
+		{
+		case 1:		// Color mapped
+			bValid = bValid && bMapped && nBits == 8 && (nMapEntrySize == 3 || nMapEntrySize == 4) &&
+					 tgaHeader.colorMapLength > 0;
+			nOutPixelSize = nMapEntrySize;
+			break;
+		case 2:		// True color (8 bits, as gltLoadTGA() allows, is grey)
+			bValid = bValid && (nBits == 8 || nBits == 24 || nBits == 32);
+			break;
+		case 3:		// Grey scale
+			bValid = bValid && nBits == 8;
+			break;
+		default:
+			bValid = false;
+			break;
+		}
+
+	// Where the pixels start, after the ID and any palette
+	unsigned long nPaletteSize = bMapped ? tgaHeader.colorMapLength * nMapEntrySize : 0;
+	unsigned long nDataOffset = 18 + (GLubyte)tgaHeader.identsize + nPaletteSize;
+	double dImageSize = double(tgaHeader.width) * double(tgaHeader.height) * double(nOutPixelSize);
+	if(nDataOffset > nFileSize || dImageSize > 2147483647.0)
+		bValid = false;
+
+	if(!bValid)
+		{
+		gltUnmapFile(pFile, nFileSize);
+		return false;
+		}
+
+	const GLubyte *pPalette = pFile + 18 + (GLubyte)tgaHeader.identsize;
+	const GLubyte *pData = pFile + nDataOffset;
+	unsigned long nPixels = (unsigned long)tgaHeader.width * tgaHeader.height;
+	unsigned long nImageSize = nPixels * nOutPixelSize;
+
+	pImage->iWidth = tgaHeader.width;
+	pImage->iHeight = tgaHeader.height;
+	switch(nOutPixelSize)
+		{
+		case 1:
+			pImage->eFormat = GL_LUMINANCE;
+			pImage->iComponents = GL_LUMINANCE8;
+			break;
+		case 3:
+			pImage->eFormat = GL_BGR_EXT;
+			pImage->iComponents = GL_RGB8;
+			break;
+		case 4:
+			pImage->eFormat = GL_BGRA_EXT;
+			pImage->iComponents = GL_RGBA8;
+			break;
+		}
+
+	if(!bRLE && nBaseType != 1)
+		{
+		// Use it right where it is
+		if((unsigned long)(pFileEnd - pData) < nImageSize)
+			{
+			gltUnmapFile(pFile, nFileSize);
+			return false;
+			}
+
+		pImage->pBits = (GLbyte *)pData;
+		pImage->bMapped = true;
+		pImage->pMapping = pFile;
+		pImage->nMappingSize = nFileSize;
+		}
+	else
+		{
+		GLubyte *pBits = (GLubyte *)malloc(nImageSize);
+		GLubyte *pIndexes = NULL;
+		bool bDecoded = (pBits != NULL);
+
+		if(bDecoded && nBaseType == 1)
+			{
+			// Indexes first, straight from the file or unpacked
+			if(bRLE)
+				{
+				pIndexes = new GLubyte[nPixels];
+				bDecoded = gltDecodeTGARLE(pIndexes, nPixels, 1, pData, pFileEnd);
+				}
+			else
+				bDecoded = ((unsigned long)(pFileEnd - pData) >= nPixels);
+
+			// Then look them up
+			const GLubyte *pIndex = (pIndexes != NULL) ? pIndexes : pData;
+			for(unsigned long i = 0; bDecoded && i < nPixels; i++)
+				{
+				int iEntry = int(pIndex[i]) - int(tgaHeader.colorMapStart);
+				if(iEntry < 0 || iEntry >= int(tgaHeader.colorMapLength))
+					bDecoded = false;
+				else
+					memcpy(pBits + i * nOutPixelSize, pPalette + iEntry * nMapEntrySize, nOutPixelSize);
+				}
+
+			delete [] pIndexes;
+			}
+		else if(bDecoded)
+			bDecoded = gltDecodeTGARLE(pBits, nPixels, nPixelSize, pData, pFileEnd);
+
+		gltUnmapFile(pFile, nFileSize);
+
+		if(!bDecoded)
+			{
+			free(pBits);
+			memset(pImage, 0, sizeof(GLTIMAGE));
+			return false;
+			}
+
+		pImage->pBits = (GLbyte *)pBits;
+		pImage->pAllocated = (GLbyte *)pBits;
+		}
+
+	// Bottom left first
+	if(nDescriptor & 0x20)
+		gltFlipImageRows((GLubyte *)pImage->pBits, pImage->iWidth, pImage->iHeight, nOutPixelSize);
+	if(nDescriptor & 0x10)
+		gltFlipImageColumns((GLubyte *)pImage->pBits, pImage->iWidth, pImage->iHeight, nOutPixelSize);
+
+	return true;
+	}
+
+////////////////////////////////////////////////////////////////////
+// Release an image from gltLoadTGAImage()
+void gltFreeImage(GLTIMAGE *pImage)
+	{
+	if(pImage->pMapping != NULL)
+		gltUnmapFile(pImage->pMapping, pImage->nMappingSize);
+	free(pImage->pAllocated);
+	memset(pImage, 0, sizeof(GLTIMAGE));
+	}
+
 
 // Rather than malloc/free a block everytime a shader must be loaded,
 // I will dedicate a single 4k page for reading in shaders. Thanks to
@@ -666,3 +1292,55 @@ GLhandleARB gltLoadShaderPair(const char *szVertexProg, const char *szFragmentPr
 	}   
 
 
+/////////////////////////////////////////////////////////////////
+// Same as gltLoadShaderPair(), but the shaders are passed in as strings
+// instead of file names. Handy for small shaders that belong to a piece of
+// code and shouldn't be lost from it. Returns 0 if either shader fails to
+// compile, or the pair fails to link.
+GLhandleARB gltLoadShaderPairSrc(const char *szVertexSrc, const char *szFragmentSrc)
+	{
+    GLhandleARB hVertexShader;
+    GLhandleARB hFragmentShader; 
+    GLhandleARB hReturn = 0;   
+    GLint testVal;
+	
+    // Create shader objects and load them
+    hVertexShader = glCreateShaderObjectARB(GL_VERTEX_SHADER_ARB);
+    hFragmentShader = glCreateShaderObjectARB(GL_FRAGMENT_SHADER_ARB);
+    glShaderSourceARB(hVertexShader, 1, (const GLcharARB **)&szVertexSrc, NULL);
+    glShaderSourceARB(hFragmentShader, 1, (const GLcharARB **)&szFragmentSrc, NULL);
+    
+    // Compile them, and check for errors
+    glCompileShaderARB(hVertexShader);
+    glCompileShaderARB(hFragmentShader);
+    
+    glGetObjectParameterivARB(hVertexShader, GL_OBJECT_COMPILE_STATUS_ARB, &testVal);
+    if(testVal != GL_FALSE)
+        glGetObjectParameterivARB(hFragmentShader, GL_OBJECT_COMPILE_STATUS_ARB, &testVal);
+
+    if(testVal == GL_FALSE)
+		{
+        glDeleteObjectARB(hVertexShader);
+        glDeleteObjectARB(hFragmentShader);
+        return 0;
+		}
+    
+    // Link them
+    hReturn = glCreateProgramObjectARB();
+    glAttachObjectARB(hReturn, hVertexShader);
+    glAttachObjectARB(hReturn, hFragmentShader);
+    glLinkProgramARB(hReturn);
+	
+    // These are no longer needed
+    glDeleteObjectARB(hVertexShader);
+    glDeleteObjectARB(hFragmentShader);  
+
+    glGetObjectParameterivARB(hReturn, GL_OBJECT_LINK_STATUS_ARB, &testVal);
+    if(testVal == GL_FALSE)
+		{
+        glDeleteObjectARB(hReturn);
+        return 0;
+		}
+    
+    return hReturn;  
+	}
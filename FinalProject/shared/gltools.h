@@ -75,6 +75,24 @@ typedef GLvoid (_stdcall *CallBack)();      // Visual C++ style
 // There is a static block allocated for loading shaders to prevent heap fragmentation
 #define MAX_SHADER_LENGTH   8192
 
+// Most shapes kept by gltDrawSphere() and gltDrawTorus()
+#define GLT_PRIMITIVE_CACHE_SIZE   16
+
+// An image loaded by gltLoadTGAImage(). pBits is ready for glTexImage2D(),
+// bottom row first and tightly packed (set GL_UNPACK_ALIGNMENT to 1). It
+// may point straight into the mapped file, so free it with gltFreeImage().
+typedef struct
+    {
+    GLint   iWidth, iHeight;
+    GLint   iComponents;        // Internal format, GL_RGB8, GL_RGBA8 or GL_LUMINANCE8
+    GLenum  eFormat;            // GL_BGR_EXT, GL_BGRA_EXT or GL_LUMINANCE
+    GLbyte  *pBits;
+    bool    bMapped;            // pBits is in the file mapping, nothing was copied
+    void    *pMapping;          // Leave these alone
+    unsigned long nMappingSize;
+    GLbyte  *pAllocated;
+    } GLTIMAGE;
+
     
 ///////////////////////////////////////////////////////
 // Macros for big/little endian happiness
@@ -132,6 +150,13 @@ extern "C" {
     // Load a .TGA file
     GLbyte* gltLoadTGA(const char* szFileName, GLint* iWidth, GLint* iHeight, GLint* iComponents, GLenum* eFormat);
 
+    // Load any .TGA file worth having: true color, grey scale or color
+    // mapped, raw or run length encoded, either origin. Uncompressed images
+    // stored bottom up are used in place in the mapped file. Returns false
+    // if the file is missing, truncated or not a Targa we understand.
+    bool gltLoadTGAImage(const char* szFileName, GLTIMAGE* pImage);
+    void gltFreeImage(GLTIMAGE* pImage);
+
     // Capute the frame buffer and write it as a .tga
     GLint gltWriteTGA(const char* szFileName);
 
@@ -141,12 +166,18 @@ extern "C" {
     // Just draw a simple sphere with normals and texture coordinates
     void gltDrawSphere(GLfloat fRadius, GLint iSlices, GLint iStacks);
 
+    // The sphere and torus are built once per set of parameters and kept in
+    // buffer objects. Free the cache before the rendering context goes away.
+    void gltGetPrimitiveCacheStats(GLuint* pHits, GLuint* pMisses);
+    void gltFreePrimitiveCache(void);
+
     // Draw a 3D unit Axis set
     void gltDrawUnitAxes(void);
 
     // Shader loading support
     bool bLoadShaderFile(const char* szFile, GLhandleARB shader);
     GLhandleARB gltLoadShaderPair(const char* szVertexProg, const char* szFragmentProg);
+    GLhandleARB gltLoadShaderPairSrc(const char* szVertexSrc, const char* szFragmentSrc);
 
     // Get the OpenGL version, returns fals on error
     bool gltGetOpenGLVersion(int& nMajor, int& nMinor);
@@ -157,6 +188,11 @@ extern "C" {
     // Get the function pointer for an extension
     void* gltGetExtensionPointer(const char* szFunctionName);
 
+    // Map a whole file into memory. The mapping is copy-on-write, you may
+    // scribble on it but the file never changes. Returns NULL on failure.
+    void* gltMapFile(const char* szFileName, unsigned long* pSize);
+    void gltUnmapFile(void* pData, unsigned long nSize);
+
 
 ///////////////////////////////////////////////////////////////////////////////
 // Win32 Only
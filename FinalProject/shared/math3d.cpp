@@ -6,6 +6,10 @@
 #include <math.h>
 #include "math3d.h"
 
+#ifdef M3D_USE_SSE
+#include <xmmintrin.h>
+#endif
+
 
 ////////////////////////////////////////////////////////////
 // LoadIdentity
@@ -94,8 +98,25 @@ double m3dGetDistanceSquared(const M3DVector3d u, const M3DVector3d v)
 
 ///////////////////////////////////////////////////////////////////////////////
 // Multiply two 4x4 matricies
+// The SSE version builds each column of the product as a sum of the columns of
+// a, scaled by the elements of the matching column of b. Either way product
+// may be the same matrix as a, but not b. Matricies need not be 16 byte aligned.
 void m3dMatrixMultiply44(M3DMatrix44f product, const M3DMatrix44f a, const M3DMatrix44f b )
 {
+#ifdef M3D_USE_SSE
+	__m128 a0 = _mm_loadu_ps(a);
+	__m128 a1 = _mm_loadu_ps(a + 4);
+	__m128 a2 = _mm_loadu_ps(a + 8);
+	__m128 a3 = _mm_loadu_ps(a + 12);
+
+	for (int j = 0; j < 4; j++) {
+		__m128 p = _mm_mul_ps(a0, _mm_set1_ps(b[(j<<2)]));
+		p = _mm_add_ps(p, _mm_mul_ps(a1, _mm_set1_ps(b[(j<<2)+1])));
+		p = _mm_add_ps(p, _mm_mul_ps(a2, _mm_set1_ps(b[(j<<2)+2])));
+		p = _mm_add_ps(p, _mm_mul_ps(a3, _mm_set1_ps(b[(j<<2)+3])));
+		_mm_storeu_ps(product + (j<<2), p);
+	}
+#else
 	for (int i = 0; i < 4; i++) {
 		float ai0=A(i,0),  ai1=A(i,1),  ai2=A(i,2),  ai3=A(i,3);
 		P(i,0) = ai0 * B(0,0) + ai1 * B(1,0) + ai2 * B(2,0) + ai3 * B(3,0);
@@ -103,6 +124,7 @@ void m3dMatrixMultiply44(M3DMatrix44f product, const M3DMatrix44f a, const M3DMa
 		P(i,2) = ai0 * B(0,2) + ai1 * B(1,2) + ai2 * B(2,2) + ai3 * B(3,2);
 		P(i,3) = ai0 * B(0,3) + ai1 * B(1,3) + ai2 * B(2,3) + ai3 * B(3,3);
 	}
+#endif
 }
 
 // Ditto above, but for doubles
@@ -152,6 +174,66 @@ void m3dMatrixMultiply44(M3DMatrix33d product, const M3DMatrix33d a, const M3DMa
 #undef B33
 #undef P33
 
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform an array of points (w = 1) by one matrix. Same as calling
+// m3dTransformVector3() on each, but the matrix columns stay in registers.
+void m3dTransformVectors3(M3DVector3f *pOut, const M3DVector3f *pIn, int nCount, const M3DMatrix44f m)
+	{
+#ifdef M3D_USE_SSE
+	__m128 m0 = _mm_loadu_ps(m);
+	__m128 m1 = _mm_loadu_ps(m + 4);
+	__m128 m2 = _mm_loadu_ps(m + 8);
+	__m128 m3 = _mm_loadu_ps(m + 12);
+
+	for(int i = 0; i < nCount; i++)
+		{
+		__m128 r = _mm_add_ps(_mm_mul_ps(m0, _mm_set1_ps(pIn[i][0])), m3);
+		r = _mm_add_ps(r, _mm_mul_ps(m1, _mm_set1_ps(pIn[i][1])));
+		r = _mm_add_ps(r, _mm_mul_ps(m2, _mm_set1_ps(pIn[i][2])));
+
+		// Only three floats to store, don't write past the end of the vector
+		_mm_storel_pi((__m64 *)pOut[i], r);
+		_mm_store_ss(&pOut[i][2], _mm_movehl_ps(r, r));
+		}
+#else
+	for(int i = 0; i < nCount; i++)
+		{
+		M3DVector3f v;
+		m3dCopyVector3(v, pIn[i]);
+		m3dTransformVector3(pOut[i], v, m);
+		}
+#endif
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Transform an array of 4 component vectors by one matrix.
+void m3dTransformVectors4(M3DVector4f *pOut, const M3DVector4f *pIn, int nCount, const M3DMatrix44f m)
+	{
+#ifdef M3D_USE_SSE
+	__m128 m0 = _mm_loadu_ps(m);
+	__m128 m1 = _mm_loadu_ps(m + 4);
+	__m128 m2 = _mm_loadu_ps(m + 8);
+	__m128 m3 = _mm_loadu_ps(m + 12);
+
+	for(int i = 0; i < nCount; i++)
+		{
+		__m128 r = _mm_mul_ps(m0, _mm_set1_ps(pIn[i][0]));
+		r = _mm_add_ps(r, _mm_mul_ps(m1, _mm_set1_ps(pIn[i][1])));
+		r = _mm_add_ps(r, _mm_mul_ps(m2, _mm_set1_ps(pIn[i][2])));
+		r = _mm_add_ps(r, _mm_mul_ps(m3, _mm_set1_ps(pIn[i][3])));
+		_mm_storeu_ps(pOut[i], r);
+		}
+#else
+	for(int i = 0; i < nCount; i++)
+		{
+		M3DVector4f v;
+		m3dCopyVector4(v, pIn[i]);
+		m3dTransformVector4(pOut[i], v, m);
+		}
+#endif
+	}
+
 #define M33(row,col)  m[col*3+row]
 
 ///////////////////////////////////////////////////////////////////////////////
@@ -9,6 +9,14 @@
 #include <math.h>
 #include <memory.h>
 
+// SSE versions of the matrix multiply and the batch transforms are used
+// whenever the compiler is targeting a CPU that has SSE (every x86-64 CPU
+// does). Define M3D_NO_SSE to force the plain C versions, which are also
+// the reference the SSE code must agree with.
+#if !defined(M3D_NO_SSE) && (defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1))
+#define M3D_USE_SSE
+#endif
+
 ///////////////////////////////////////////////////////////////////////////////
 // Data structures and containers
 // Much thought went into how these are declared. Many libraries declare these
@@ -445,6 +453,14 @@ __inline void m3dTransformVector4(M3DVector4d vOut, const M3DVector4d v, const M
 
 
 
+// Batch versions of the above, transform nCount points by the same matrix.
+// This is what you want for frustum corners, bounding boxes, and CPU skinning,
+// the matrix is only loaded once. pOut may be the same array as pIn.
+// Implemented in Math.cpp
+void m3dTransformVectors3(M3DVector3f *pOut, const M3DVector3f *pIn, int nCount, const M3DMatrix44f m);
+void m3dTransformVectors4(M3DVector4f *pOut, const M3DVector4f *pIn, int nCount, const M3DMatrix44f m);
+
+
 // Just do the rotation, not the translation... this is usually done with a 3x3
 // Matrix.
 __inline void m3dRotateVector(M3DVector3f vOut, const M3DVector3f p, const M3DMatrix33f m)
@@ -0,0 +1,367 @@
+// Math3dBatch.cpp
+// Implementation of the structure of arrays math3d functions
+// Each function does groups of four with SSE (when M3D_USE_SSE is defined,
+// see math3d.h), then finishes off the last few vectors with plain C. The
+// plain C loop does the whole job when SSE is not available.
+
+#include "math3dbatch.h"
+
+#ifdef M3D_USE_SSE
+#include <xmmintrin.h>
+
+// Number of vectors done by the SSE loop, the rest are done one at a time
+#define M3D_SSE_COUNT(n)	((n) & ~3)
+#else
+#define M3D_SSE_COUNT(n)	0
+#endif
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Split packed vectors up into a stream
+void m3dStreamFromVectors(M3DStream3f out, const M3DVector3f *pIn, int nCount)
+	{
+	for(int i = 0; i < nCount; i++)
+		{
+		out.x[i] = pIn[i][0];
+		out.y[i] = pIn[i][1];
+		out.z[i] = pIn[i][2];
+		}
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// And put them back together again
+void m3dStreamToVectors(M3DVector3f *pOut, M3DStream3f in, int nCount)
+	{
+	for(int i = 0; i < nCount; i++)
+		{
+		pOut[i][0] = in.x[i];
+		pOut[i][1] = in.y[i];
+		pOut[i][2] = in.z[i];
+		}
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Normalize a stream of vectors. Dividing by the length (rather than the
+// approximate reciprocal square root) keeps the results the same as
+// m3dNormalizeVector().
+void m3dStreamNormalize(M3DStream3f v, int nCount)
+	{
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	__m128 zero = _mm_setzero_ps();
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		__m128 x = _mm_loadu_ps(v.x + i);
+		__m128 y = _mm_loadu_ps(v.y + i);
+		__m128 z = _mm_loadu_ps(v.z + i);
+
+		__m128 len = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+		len = _mm_sqrt_ps(len);
+
+		// Zero length vectors get 0/1 instead of 0/0
+		__m128 bZero = _mm_cmpeq_ps(len, zero);
+		__m128 scale = _mm_div_ps(_mm_set1_ps(1.0f), _mm_or_ps(len, _mm_and_ps(bZero, _mm_set1_ps(1.0f))));
+
+		_mm_storeu_ps(v.x + i, _mm_mul_ps(x, scale));
+		_mm_storeu_ps(v.y + i, _mm_mul_ps(y, scale));
+		_mm_storeu_ps(v.z + i, _mm_mul_ps(z, scale));
+		}
+#endif
+
+	for(; i < nCount; i++)
+		{
+		float fLength = float(sqrt(double(v.x[i]*v.x[i] + v.y[i]*v.y[i] + v.z[i]*v.z[i])));
+		if(fLength == 0.0f)
+			continue;
+
+		float fScale = 1.0f / fLength;
+		v.x[i] *= fScale;
+		v.y[i] *= fScale;
+		v.z[i] *= fScale;
+		}
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Scale a stream of vectors
+void m3dStreamScale(M3DStream3f v, float fScale, int nCount)
+	{
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	__m128 scale = _mm_set1_ps(fScale);
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		_mm_storeu_ps(v.x + i, _mm_mul_ps(_mm_loadu_ps(v.x + i), scale));
+		_mm_storeu_ps(v.y + i, _mm_mul_ps(_mm_loadu_ps(v.y + i), scale));
+		_mm_storeu_ps(v.z + i, _mm_mul_ps(_mm_loadu_ps(v.z + i), scale));
+		}
+#endif
+
+	for(; i < nCount; i++)
+		{
+		v.x[i] *= fScale;
+		v.y[i] *= fScale;
+		v.z[i] *= fScale;
+		}
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Dot products of two streams
+void m3dStreamDotProduct(float *pOut, M3DStream3f u, M3DStream3f v, int nCount)
+	{
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		__m128 r = _mm_mul_ps(_mm_loadu_ps(u.x + i), _mm_loadu_ps(v.x + i));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(u.y + i), _mm_loadu_ps(v.y + i)));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(u.z + i), _mm_loadu_ps(v.z + i)));
+		_mm_storeu_ps(pOut + i, r);
+		}
+#endif
+
+	for(; i < nCount; i++)
+		pOut[i] = u.x[i]*v.x[i] + u.y[i]*v.y[i] + u.z[i]*v.z[i];
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Cross products of two streams. Everything is read before anything is
+// written, so result can be the same stream as u or v.
+void m3dStreamCrossProduct(M3DStream3f result, M3DStream3f u, M3DStream3f v, int nCount)
+	{
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		__m128 ux = _mm_loadu_ps(u.x + i);
+		__m128 uy = _mm_loadu_ps(u.y + i);
+		__m128 uz = _mm_loadu_ps(u.z + i);
+		__m128 vx = _mm_loadu_ps(v.x + i);
+		__m128 vy = _mm_loadu_ps(v.y + i);
+		__m128 vz = _mm_loadu_ps(v.z + i);
+
+		_mm_storeu_ps(result.x + i, _mm_sub_ps(_mm_mul_ps(uy, vz), _mm_mul_ps(vy, uz)));
+		_mm_storeu_ps(result.y + i, _mm_sub_ps(_mm_mul_ps(vx, uz), _mm_mul_ps(ux, vz)));
+		_mm_storeu_ps(result.z + i, _mm_sub_ps(_mm_mul_ps(ux, vy), _mm_mul_ps(vx, uy)));
+		}
+#endif
+
+	for(; i < nCount; i++)
+		{
+		M3DVector3f vU, vV, vResult;
+		m3dLoadVector3(vU, u.x[i], u.y[i], u.z[i]);
+		m3dLoadVector3(vV, v.x[i], v.y[i], v.z[i]);
+		m3dCrossProduct(vResult, vU, vV);
+		result.x[i] = vResult[0];
+		result.y[i] = vResult[1];
+		result.z[i] = vResult[2];
+		}
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Squared distances between matching points of two streams
+void m3dStreamDistanceSquared(float *pOut, M3DStream3f u, M3DStream3f v, int nCount)
+	{
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		__m128 x = _mm_sub_ps(_mm_loadu_ps(u.x + i), _mm_loadu_ps(v.x + i));
+		__m128 y = _mm_sub_ps(_mm_loadu_ps(u.y + i), _mm_loadu_ps(v.y + i));
+		__m128 z = _mm_sub_ps(_mm_loadu_ps(u.z + i), _mm_loadu_ps(v.z + i));
+		_mm_storeu_ps(pOut + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z)));
+		}
+#endif
+
+	for(; i < nCount; i++)
+		{
+		float x = u.x[i] - v.x[i];
+		float y = u.y[i] - v.y[i];
+		float z = u.z[i] - v.z[i];
+		pOut[i] = x*x + y*y + z*z;
+		}
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Signed distance of each point from one plane
+void m3dStreamDistanceToPlane(float *pOut, M3DStream3f point, const M3DVector4f plane, int nCount)
+	{
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	__m128 a = _mm_set1_ps(plane[0]);
+	__m128 b = _mm_set1_ps(plane[1]);
+	__m128 c = _mm_set1_ps(plane[2]);
+	__m128 d = _mm_set1_ps(plane[3]);
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		__m128 r = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(point.x + i), a), d);
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(point.y + i), b));
+		r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(point.z + i), c));
+		_mm_storeu_ps(pOut + i, r);
+		}
+#endif
+
+	for(; i < nCount; i++)
+		pOut[i] = point.x[i]*plane[0] + point.y[i]*plane[1] + point.z[i]*plane[2] + plane[3];
+	}
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Classify a stream of spheres against the planes. There are no early outs,
+// every sphere is tested against every plane, which is what lets four of them
+// go through at once. A sphere is outside if it is completely behind any one
+// plane, and inside if it is completely in front of all of them.
+int m3dStreamClassifySpheres(unsigned char *pResults, const M3DVector4f *pPlanes, int nPlanes,
+							 M3DStream3f center, const float *pRadius, int nCount)
+	{
+	int nVisible = 0;
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	__m128 zero = _mm_setzero_ps();
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		__m128 x = _mm_loadu_ps(center.x + i);
+		__m128 y = _mm_loadu_ps(center.y + i);
+		__m128 z = _mm_loadu_ps(center.z + i);
+		__m128 r = _mm_loadu_ps(pRadius + i);
+		__m128 bOutside = zero;
+		__m128 bCrossing = zero;
+
+		for(int p = 0; p < nPlanes; p++)
+			{
+			__m128 d = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(pPlanes[p][0])), _mm_set1_ps(pPlanes[p][3]));
+			d = _mm_add_ps(d, _mm_mul_ps(y, _mm_set1_ps(pPlanes[p][1])));
+			d = _mm_add_ps(d, _mm_mul_ps(z, _mm_set1_ps(pPlanes[p][2])));
+
+			bOutside = _mm_or_ps(bOutside, _mm_cmple_ps(_mm_add_ps(d, r), zero));
+			bCrossing = _mm_or_ps(bCrossing, _mm_cmplt_ps(_mm_sub_ps(d, r), zero));
+			}
+
+		// Outside counts as crossing too, so this comes out to 0, 1, or 2.
+		// With a radius of 0 it wouldn't otherwise (a point on a plane).
+		bCrossing = _mm_or_ps(bCrossing, bOutside);
+
+		int nOutside = _mm_movemask_ps(bOutside);
+		int nCrossing = _mm_movemask_ps(bCrossing);
+		for(int k = 0; k < 4; k++)
+			{
+			pResults[i + k] = (unsigned char)(M3D_INSIDE - ((nCrossing >> k) & 1) - ((nOutside >> k) & 1));
+			nVisible += ((nOutside >> k) & 1) ^ 1;
+			}
+		}
+#endif
+
+	for(; i < nCount; i++)
+		{
+		int nOutside = 0;
+		int nCrossing = 0;
+
+		for(int p = 0; p < nPlanes; p++)
+			{
+			float d = center.x[i]*pPlanes[p][0] + center.y[i]*pPlanes[p][1] + center.z[i]*pPlanes[p][2] + pPlanes[p][3];
+			nOutside |= (d + pRadius[i] <= 0.0f);
+			nCrossing |= (d - pRadius[i] < 0.0f);
+			}
+		nCrossing |= nOutside;
+
+		pResults[i] = (unsigned char)(M3D_INSIDE - nCrossing - nOutside);
+		nVisible += nOutside ^ 1;
+		}
+
+	return nVisible;
+	}
+
+///////////////////////////////////////////////////////////////////////////////
+// Classify a stream of axis aligned boxes against the planes. Each box is
+// treated as a center and half size. The furthest the box reaches along a
+// plane normal is |a|*hx + |b|*hy + |c|*hz, so that plays the part of the
+// sphere radius above, without having to test all eight corners.
+int m3dStreamClassifyBoxes(unsigned char *pResults, const M3DVector4f *pPlanes, int nPlanes,
+						   M3DStream3f vMin, M3DStream3f vMax, int nCount)
+	{
+	int nVisible = 0;
+	int i = 0;
+
+#ifdef M3D_USE_SSE
+	__m128 zero = _mm_setzero_ps();
+	__m128 half = _mm_set1_ps(0.5f);
+	for(; i < M3D_SSE_COUNT(nCount); i += 4)
+		{
+		__m128 x0 = _mm_loadu_ps(vMin.x + i);
+		__m128 y0 = _mm_loadu_ps(vMin.y + i);
+		__m128 z0 = _mm_loadu_ps(vMin.z + i);
+		__m128 x1 = _mm_loadu_ps(vMax.x + i);
+		__m128 y1 = _mm_loadu_ps(vMax.y + i);
+		__m128 z1 = _mm_loadu_ps(vMax.z + i);
+
+		__m128 cx = _mm_mul_ps(_mm_add_ps(x0, x1), half);
+		__m128 cy = _mm_mul_ps(_mm_add_ps(y0, y1), half);
+		__m128 cz = _mm_mul_ps(_mm_add_ps(z0, z1), half);
+		__m128 hx = _mm_mul_ps(_mm_sub_ps(x1, x0), half);
+		__m128 hy = _mm_mul_ps(_mm_sub_ps(y1, y0), half);
+		__m128 hz = _mm_mul_ps(_mm_sub_ps(z1, z0), half);
+		__m128 bOutside = zero;
+		__m128 bCrossing = zero;
+
+		for(int p = 0; p < nPlanes; p++)
+			{
+			__m128 d = _mm_add_ps(_mm_mul_ps(cx, _mm_set1_ps(pPlanes[p][0])), _mm_set1_ps(pPlanes[p][3]));
+			d = _mm_add_ps(d, _mm_mul_ps(cy, _mm_set1_ps(pPlanes[p][1])));
+			d = _mm_add_ps(d, _mm_mul_ps(cz, _mm_set1_ps(pPlanes[p][2])));
+
+			__m128 r = _mm_mul_ps(hx, _mm_set1_ps(float(fabs(pPlanes[p][0]))));
+			r = _mm_add_ps(r, _mm_mul_ps(hy, _mm_set1_ps(float(fabs(pPlanes[p][1])))));
+			r = _mm_add_ps(r, _mm_mul_ps(hz, _mm_set1_ps(float(fabs(pPlanes[p][2])))));
+
+			bOutside = _mm_or_ps(bOutside, _mm_cmple_ps(_mm_add_ps(d, r), zero));
+			bCrossing = _mm_or_ps(bCrossing, _mm_cmplt_ps(_mm_sub_ps(d, r), zero));
+			}
+
+		// Outside counts as crossing too, as for spheres (a box flat
+		// against a plane has no size along its normal)
+		bCrossing = _mm_or_ps(bCrossing, bOutside);
+
+		int nOutside = _mm_movemask_ps(bOutside);
+		int nCrossing = _mm_movemask_ps(bCrossing);
+		for(int k = 0; k < 4; k++)
+			{
+			pResults[i + k] = (unsigned char)(M3D_INSIDE - ((nCrossing >> k) & 1) - ((nOutside >> k) & 1));
+			nVisible += ((nOutside >> k) & 1) ^ 1;
+			}
+		}
+#endif
+
+	for(; i < nCount; i++)
+		{
+		int nOutside = 0;
+		int nCrossing = 0;
+
+		float cx = (vMin.x[i] + vMax.x[i]) * 0.5f;
+		float cy = (vMin.y[i] + vMax.y[i]) * 0.5f;
+		float cz = (vMin.z[i] + vMax.z[i]) * 0.5f;
+		float hx = (vMax.x[i] - vMin.x[i]) * 0.5f;
+		float hy = (vMax.y[i] - vMin.y[i]) * 0.5f;
+		float hz = (vMax.z[i] - vMin.z[i]) * 0.5f;
+
+		for(int p = 0; p < nPlanes; p++)
+			{
+			float d = cx*pPlanes[p][0] + cy*pPlanes[p][1] + cz*pPlanes[p][2] + pPlanes[p][3];
+			float r = hx*float(fabs(pPlanes[p][0])) + hy*float(fabs(pPlanes[p][1])) + hz*float(fabs(pPlanes[p][2]));
+			nOutside |= (d + r <= 0.0f);
+			nCrossing |= (d - r < 0.0f);
+			}
+		nCrossing |= nOutside;
+
+		pResults[i] = (unsigned char)(M3D_INSIDE - nCrossing - nOutside);
+		nVisible += nOutside ^ 1;
+		}
+
+	return nVisible;
+	}
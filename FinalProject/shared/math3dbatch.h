@@ -0,0 +1,79 @@
+// Math3dBatch.h
+// Structure of arrays (SoA) versions of the math3d vector functions.
+// The math3d routines work on one M3DVector3f at a time, which is fine for a
+// camera or a light, but not for every vertex in a mesh. These work on whole
+// streams of vectors, stored as three separate arrays of x, y, and z. With the
+// components split up, four vectors fit in an SSE register with no shuffling,
+// so the SSE versions do four vectors per instruction.
+//
+// Results agree with the single vector functions in math3d.h (to float
+// rounding). The arrays don't need any special alignment, and any count is
+// fine, the odd vectors at the end are done one at a time.
+#ifndef _MATH3D_BATCH_LIBRARY__
+#define _MATH3D_BATCH_LIBRARY__
+
+#include "math3d.h"
+
+///////////////////////////////////////////////////////////////////////////////
+// A stream of 3 component vectors, vector i is (x[i], y[i], z[i]). The
+// stream doesn't own the arrays, it just points at them.
+typedef struct
+	{
+	float *x;
+	float *y;
+	float *z;
+	} M3DStream3f;
+
+inline void m3dLoadStream3(M3DStream3f &s, float *x, float *y, float *z)
+	{ s.x = x; s.y = y; s.z = z; }
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Moving data between the usual packed (AoS) vectors and streams
+void m3dStreamFromVectors(M3DStream3f out, const M3DVector3f *pIn, int nCount);
+void m3dStreamToVectors(M3DVector3f *pOut, M3DStream3f in, int nCount);
+
+
+///////////////////////////////////////////////////////////////////////////////
+// The batch functions. Output streams may be the same as input streams.
+
+// Scale each vector to unit length. Zero length vectors are left at zero
+// (m3dNormalizeVector() would fill them with NaN's)
+void m3dStreamNormalize(M3DStream3f v, int nCount);
+
+// Multiply every vector by fScale
+void m3dStreamScale(M3DStream3f v, float fScale, int nCount);
+
+// pOut[i] = u[i] . v[i]
+void m3dStreamDotProduct(float *pOut, M3DStream3f u, M3DStream3f v, int nCount);
+
+// result[i] = u[i] x v[i]
+void m3dStreamCrossProduct(M3DStream3f result, M3DStream3f u, M3DStream3f v, int nCount);
+
+// pOut[i] = |u[i] - v[i]|^2
+void m3dStreamDistanceSquared(float *pOut, M3DStream3f u, M3DStream3f v, int nCount);
+
+// pOut[i] = signed distance of point[i] from the plane (see m3dGetDistanceToPlane())
+void m3dStreamDistanceToPlane(float *pOut, M3DStream3f point, const M3DVector4f plane, int nCount);
+
+
+///////////////////////////////////////////////////////////////////////////////
+// Culling. Test whole streams of bounding volumes against a set of planes
+// (normals pointing in, like the GLFrustum planes) and classify each one.
+// pResults[i] gets M3D_OUTSIDE, M3D_INTERSECT, or M3D_INSIDE, so it doubles as
+// a visibility mask (non zero means draw it). Both return the number of
+// volumes that are not outside. Touching a plane from outside counts as
+// outside, the same as GLFrustum::TestSphere().
+#define M3D_OUTSIDE		0
+#define M3D_INTERSECT	1
+#define M3D_INSIDE		2
+
+// Spheres, center[i] with radius pRadius[i]
+int m3dStreamClassifySpheres(unsigned char *pResults, const M3DVector4f *pPlanes, int nPlanes,
+							 M3DStream3f center, const float *pRadius, int nCount);
+
+// Axis aligned boxes, from vMin[i] to vMax[i]
+int m3dStreamClassifyBoxes(unsigned char *pResults, const M3DVector4f *pPlanes, int nPlanes,
+						   M3DStream3f vMin, M3DStream3f vMax, int nCount);
+
+#endif
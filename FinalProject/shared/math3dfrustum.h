@@ -0,0 +1,246 @@
+// Math3dFrustum.h
+// A view frustum with no OpenGL in it. It builds its own projection matrix
+// and finds its planes from the combined view-projection matrix, so culling
+// can be done on any thread, or with no GL context at all.
+// GLFrustum (glfrustum.h) is the OpenGL flavored version of this class.
+
+#ifndef __M3D_FRUSTUM_CLASS
+#define __M3D_FRUSTUM_CLASS
+
+#include "math3d.h"
+#include "math3dbatch.h"
+
+// Which plane is which in the planes array. Plane normals point into the
+// frustum, so points inside are at a positive distance from all six.
+#define M3D_PLANE_NEAR      0
+#define M3D_PLANE_FAR       1
+#define M3D_PLANE_LEFT      2
+#define M3D_PLANE_RIGHT     3
+#define M3D_PLANE_BOTTOM    4
+#define M3D_PLANE_TOP       5
+
+// And the corners
+#define M3D_CORNER_NEAR_UL  0
+#define M3D_CORNER_NEAR_LL  1
+#define M3D_CORNER_NEAR_UR  2
+#define M3D_CORNER_NEAR_LR  3
+#define M3D_CORNER_FAR_UL   4
+#define M3D_CORNER_FAR_LL   5
+#define M3D_CORNER_FAR_UR   6
+#define M3D_CORNER_FAR_LR   7
+
+
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+///////////////////////////////////////////////////////////////////////////////
+class M3DFrustum
+    {
+    public:
+        M3DFrustum(void)       // Set some Reasonable Defaults
+            { SetPerspective(30.0f, 1.0f, 1.0f, 10.0f); }
+
+        M3DFrustum(float fFov, float fAspect, float fNear, float fFar)
+            { SetPerspective(fFov, fAspect, fNear, fFar); }
+
+        // Calculates the corners of the Frustum and builds the same projection
+        // matrix gluPerspective() would. The frustum starts out at the origin
+        // looking down -Z, call Transform() to move it.
+        void SetPerspective(float fFov, float fAspect, float fNear, float fFar)
+            {
+            float xmin, xmax, ymin, ymax;       // Dimensions of near clipping plane
+            float xFmin, xFmax, yFmin, yFmax;   // Dimensions of far clipping plane
+
+            // Do the Math for the near clipping plane
+            ymax = fNear * float(tan( fFov * M3D_PI / 360.0 ));
+            ymin = -ymax;
+            xmin = ymin * fAspect;
+            xmax = -xmin;
+
+            // Do the Math for the far clipping plane
+            yFmax = fFar * float(tan(fFov * M3D_PI / 360.0));
+            yFmin = -yFmax;
+            xFmin = yFmin * fAspect;
+            xFmax = -xFmin;
+
+            // Same matrix as glFrustum(xmin, xmax, ymin, ymax, fNear, fFar)
+            m3dLoadIdentity44(projMatrix);
+            projMatrix[0] = (2.0f * fNear) / (xmax - xmin);
+            projMatrix[5] = (2.0f * fNear) / (ymax - ymin);
+            projMatrix[8] = (xmax + xmin) / (xmax - xmin);
+            projMatrix[9] = (ymax + ymin) / (ymax - ymin);
+            projMatrix[10] = -((fFar + fNear) / (fFar - fNear));
+            projMatrix[11] = -1.0f;
+            projMatrix[14] = -((2.0f * fFar * fNear) / (fFar - fNear));
+            projMatrix[15] = 0.0f;
+
+            // Fill in values for untransformed Frustum corners
+            m3dLoadVector4(corners[M3D_CORNER_NEAR_UL], xmin, ymax, -fNear, 1.0f);
+            m3dLoadVector4(corners[M3D_CORNER_NEAR_LL], xmin, ymin, -fNear, 1.0f);
+            m3dLoadVector4(corners[M3D_CORNER_NEAR_UR], xmax, ymax, -fNear, 1.0f);
+            m3dLoadVector4(corners[M3D_CORNER_NEAR_LR], xmax, ymin, -fNear, 1.0f);
+            m3dLoadVector4(corners[M3D_CORNER_FAR_UL], xFmin, yFmax, -fFar, 1.0f);
+            m3dLoadVector4(corners[M3D_CORNER_FAR_LL], xFmin, yFmin, -fFar, 1.0f);
+            m3dLoadVector4(corners[M3D_CORNER_FAR_UR], xFmax, yFmax, -fFar, 1.0f);
+            m3dLoadVector4(corners[M3D_CORNER_FAR_LR], xFmax, yFmin, -fFar, 1.0f);
+
+            // Until Transform() is called, the frustum is in eye space
+            M3DMatrix44f mIdentity;
+            m3dLoadIdentity44(mIdentity);
+            Transform(mIdentity);
+            }
+
+        // Place the frustum in the world. mCamera is the camera's own
+        // transformation (camera space to world space, looking down -Z), the
+        // inverse of the viewing matrix. The corners are moved with it, and
+        // the planes come from the combined view-projection matrix.
+        void Transform(const M3DMatrix44f mCamera)
+            {
+            M3DMatrix44f mView, mViewProj;
+
+            m3dTransformVectors4(cornersT, corners, 8, mCamera);
+
+            m3dInvertMatrix44(mView, mCamera);
+            m3dMatrixMultiply44(mViewProj, projMatrix, mView);
+            ExtractPlanes(mViewProj);
+            }
+
+        // Find the six planes of any projection (Gil Gribb and Klaus
+        // Hartmann's method). A point is inside the clip volume when
+        // -w <= x, y, z <= w, and each of those six inequalities is a plane
+        // made from two rows of the matrix. Pass a view-projection matrix to
+        // get world space planes, or a model-view-projection matrix to get
+        // them in object space. The far plane is the difference of two rows
+        // that are nearly the same, so it's only good to about far / near
+        // times float precision.
+        void ExtractPlanes(const M3DMatrix44f m)
+            {
+            for(int i = 0; i < 3; i++)
+                {
+                for(int j = 0; j < 4; j++)
+                    {
+                    // Row 3 plus and minus row i, column major
+                    planes[i*2][j] = m[j*4+3] + m[j*4+i];
+                    planes[i*2+1][j] = m[j*4+3] - m[j*4+i];
+                    }
+                }
+
+            // That came out left, right, bottom, top, near, far. Shuffle into
+            // plane order and scale so distances are real distances
+            M3DVector4f vTemp[6];
+            memcpy(vTemp, planes, sizeof(vTemp));
+            m3dCopyVector4(planes[M3D_PLANE_LEFT], vTemp[0]);
+            m3dCopyVector4(planes[M3D_PLANE_RIGHT], vTemp[1]);
+            m3dCopyVector4(planes[M3D_PLANE_BOTTOM], vTemp[2]);
+            m3dCopyVector4(planes[M3D_PLANE_TOP], vTemp[3]);
+            m3dCopyVector4(planes[M3D_PLANE_NEAR], vTemp[4]);
+            m3dCopyVector4(planes[M3D_PLANE_FAR], vTemp[5]);
+
+            for(int i = 0; i < 6; i++)
+                {
+                float fLength = float(sqrt(planes[i][0]*planes[i][0] + planes[i][1]*planes[i][1] + planes[i][2]*planes[i][2]));
+                if(fLength > 0.0f)
+                    m3dScaleVector4(planes[i], 1.0f / fLength);
+                }
+            }
+
+        // Accessors
+        inline void GetProjectionMatrix(M3DMatrix44f m) { m3dCopyMatrix44(m, projMatrix); }
+        inline void GetPlane(int iPlane, M3DVector4f vPlane) { m3dCopyVector4(vPlane, planes[iPlane]); }
+        inline void GetCorner(int iCorner, M3DVector3f vCorner) { m3dCopyVector3(vCorner, cornersT[iCorner]); }
+
+
+        // Allow expanded version of sphere test
+        bool TestSphere(float x, float y, float z, float fRadius)
+            {
+            M3DVector3f vPoint;
+            vPoint[0] = x;
+            vPoint[1] = y;
+            vPoint[2] = z;
+
+            return TestSphere(vPoint, fRadius);
+            }
+
+        // Test a point against all frustum planes. A negative distance for any
+        // single plane means it is outside the frustum. The radius value allows
+        // to test for a point (radius = 0), or a sphere.
+        // Returns false if it is not in the frustum, true if it intersects
+        // the Frustum.
+        bool TestSphere(const M3DVector3f vPoint, float fRadius)
+            {
+            for(int i = 0; i < 6; i++)
+                if(m3dGetDistanceToPlane(vPoint, planes[i]) + fRadius <= 0.0f)
+                    return false;
+
+            return true;
+            }
+
+        // Like TestSphere(), but also tells you if the sphere is entirely inside
+        // the frustum (so whatever it bounds needs no more testing).
+        // Returns M3D_OUTSIDE, M3D_INTERSECT, or M3D_INSIDE
+        int ClassifySphere(const M3DVector3f vPoint, float fRadius)
+            {
+            int nResult = M3D_INSIDE;
+
+            for(int i = 0; i < 6; i++)
+                {
+                float fDist = m3dGetDistanceToPlane(vPoint, planes[i]);
+                if(fDist + fRadius <= 0.0f)
+                    return M3D_OUTSIDE;
+
+                if(fDist - fRadius < 0.0f)
+                    nResult = M3D_INTERSECT;
+                }
+
+            return nResult;
+            }
+
+        // Same again for an axis aligned box. Only the corner furthest along
+        // each plane normal (and the one furthest against it) matter.
+        // Returns M3D_OUTSIDE, M3D_INTERSECT, or M3D_INSIDE
+        int ClassifyBox(const M3DVector3f vMin, const M3DVector3f vMax)
+            {
+            int nResult = M3D_INSIDE;
+            M3DVector3f vNear, vFar;
+
+            for(int i = 0; i < 6; i++)
+                {
+                for(int j = 0; j < 3; j++)
+                    {
+                    vFar[j] = (planes[i][j] >= 0.0f) ? vMax[j] : vMin[j];
+                    vNear[j] = (planes[i][j] >= 0.0f) ? vMin[j] : vMax[j];
+                    }
+
+                if(m3dGetDistanceToPlane(vFar, planes[i]) <= 0.0f)
+                    return M3D_OUTSIDE;
+
+                if(m3dGetDistanceToPlane(vNear, planes[i]) < 0.0f)
+                    nResult = M3D_INTERSECT;
+                }
+
+            return nResult;
+            }
+
+        bool TestBox(const M3DVector3f vMin, const M3DVector3f vMax)
+            { return ClassifyBox(vMin, vMax) != M3D_OUTSIDE; }
+
+        // Batch versions for when there are thousands of objects to cull. The
+        // spheres or boxes are given as streams (see math3dbatch.h), and go
+        // through the planes four at a time with no branches. pResults[i]
+        // receives the classification of object i, non zero means visible.
+        // Returns how many are visible.
+        int TestSpheres(unsigned char *pResults, M3DStream3f vCenters, const float *pRadii, int nCount)
+            { return m3dStreamClassifySpheres(pResults, planes, 6, vCenters, pRadii, nCount); }
+
+        int TestBoxes(unsigned char *pResults, M3DStream3f vMins, M3DStream3f vMaxs, int nCount)
+            { return m3dStreamClassifyBoxes(pResults, planes, 6, vMins, vMaxs, nCount); }
+
+    protected:
+        M3DMatrix44f projMatrix;    // The projection matrix
+
+        M3DVector4f corners[8];     // Untransformed corners of the frustum
+        M3DVector4f cornersT[8];    // Transformed corners of Frustum
+
+        M3DVector4f planes[6];      // Plane equations, in world space
+    };
+
+#endif
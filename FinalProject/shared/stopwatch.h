@@ -2,10 +2,12 @@
 // Stopwatch class for high resolution timing.
 // Code by Richard S. Wright Jr.
 // March 23, 1999
-// 
-// This function uses the High performance counter on Win32 and
-// gettimeofday on Mac OS X/Linux. gettimeofday is actually pretty
-// good on the Mac (about 10ms).
+//
+// This function uses the High performance counter on Win32,
+// mach_absolute_time on Mac OS X, and the monotonic clock
+// (clock_gettime) on Linux. All three count in nanoseconds or
+// better, and none of them jump when somebody sets the system
+// clock, which gettimeofday could.
 
 #ifndef STOPWATCH_HEADER
 #define STOPWATCH_HEADER
@@ -13,15 +15,21 @@
 #ifdef WIN32
 #include <windows.h>
 #else
-#include <sys/time.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#else
+#include <time.h>
+#endif
 #endif
 
 
 ///////////////////////////////////////////////////////////////////////////////
-// Simple Stopwatch class. Use this for high resolution timing 
+// Simple Stopwatch class. Use this for high resolution timing
 // purposes (or, even low resolution timings)
-// Pretty self-explanitory.... 
+// Pretty self-explanitory....
 // Reset(), or GetElapsedSeconds().
+// GetElapsedNanoseconds() is the one to use for profiling, a float
+// only has about a microsecond of precision after a few seconds.
 class CStopWatch
 	{
 	public:
@@ -29,48 +37,62 @@ class CStopWatch
 			{
 			#ifdef WIN32
 			QueryPerformanceFrequency(&m_CounterFrequency);
-			QueryPerformanceCounter(&m_LastCount);
-			#else
-            gettimeofday(&m_LastCount, 0);
 			#endif
+			#ifdef __APPLE__
+			mach_timebase_info(&m_Timebase);
+			#endif
+			m_LastCount = GetTimeNanoseconds();
 			}
 
 		// Resets timer (difference) to zero
-		inline void Reset(void) 
+		inline void Reset(void)
 			{
-			#ifdef WIN32
-			QueryPerformanceCounter(&m_LastCount);
-			#else
-			gettimeofday(&m_LastCount, 0);
-			#endif
-			}					
-		
+			m_LastCount = GetTimeNanoseconds();
+			}
+
 		// Get elapsed time in seconds
 		float GetElapsedSeconds(void)
 			{
-			// Get the current count
+			return float(double(GetElapsedNanoseconds()) * 0.000000001);
+			}
+
+		// Get elapsed time in nanoseconds
+		long long GetElapsedNanoseconds(void)
+			{
+			return GetTimeNanoseconds() - m_LastCount;
+			}
+
+		// The raw clock, in nanoseconds from some fixed point in the past
+		long long GetTimeNanoseconds(void)
+			{
 			#ifdef WIN32
 			LARGE_INTEGER lCurrent;
 			QueryPerformanceCounter(&lCurrent);
 
-			return float((lCurrent.QuadPart - m_LastCount.QuadPart) /
-										double(m_CounterFrequency.QuadPart));
+			// Split it up so the multiply doesn't overflow
+			long long nSeconds = lCurrent.QuadPart / m_CounterFrequency.QuadPart;
+			long long nRemainder = lCurrent.QuadPart % m_CounterFrequency.QuadPart;
+			return nSeconds * 1000000000LL + (nRemainder * 1000000000LL) / m_CounterFrequency.QuadPart;
 			#else
-            timeval lcurrent;
-            gettimeofday(&lcurrent, 0);
-            float fSeconds = (float)(lcurrent.tv_sec - m_LastCount.tv_sec);
-            float fFraction = (float)(lcurrent.tv_usec - m_LastCount.tv_usec) * 0.000001f;
-            return fSeconds + fFraction;
+			#ifdef __APPLE__
+			// Through a double, so a long uptime can't overflow the multiply
+			return (long long)(double(mach_absolute_time()) * m_Timebase.numer / m_Timebase.denom);
+			#else
+			timespec tCurrent;
+			clock_gettime(CLOCK_MONOTONIC, &tCurrent);
+			return (long long)tCurrent.tv_sec * 1000000000LL + tCurrent.tv_nsec;
+			#endif
 			#endif
-			}	
-	
+			}
+
 	protected:
 	#ifdef WIN32
 		LARGE_INTEGER m_CounterFrequency;
-		LARGE_INTEGER m_LastCount;
-	#else
-        timeval m_LastCount;
 	#endif
+	#ifdef __APPLE__
+		mach_timebase_info_data_t m_Timebase;
+	#endif
+		long long m_LastCount;
 	};
 
 
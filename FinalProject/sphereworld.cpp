@@ -9,24 +9,102 @@
 #include "shared/gltools.h"
 #include "shared/math3d.h"    // 3D Math Library
 #include "shared/glframe.h"
+#include "shared/math3dfrustum.h"
+#include "shared/math3dbatch.h"
+#include "shared/VBOMesh.h"
+#include "shared/InstancedMesh.h"
+#include "shared/stopwatch.h"
+#include "shared/Profiler.h"
+#include "shared/RenderQueue.h"
+#include "shared/TextureAtlas.h"
+#include "shared/JobSystem.h"
+#include "shared/TextureStream.h"
+#include "shared/MipChain.h"
+#include "shared/BlockCompress.h"
+#include "shared/ShadowMap.h"
+#include "shared/ActorBVH.h"
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+// Build with HEADLESS_EGL on Linux to render headless with no X server at
+// all (EGL surfaceless context, Mesa's llvmpipe is fine, run it with
+// EGL_PLATFORM=surfaceless). Otherwise headless mode renders through a hidden
+// GLUT window.
+#if defined(linux) && defined(HEADLESS_EGL)
+#include <EGL/egl.h>
+#endif
 
 int w1 = 0;
 int h1 = 0;
 
+// The spheres, NUM_SPHERES of them sitting still, or with -crowd <n>, n of
+// them wandering about. Only the ones in view are drawn, they are picked
+// out each frame (and in a crowd, moved each step) on all the cores.
 #define NUM_SPHERES      30
-GLFrame    spheres[NUM_SPHERES];
+#define SPHERE_RADIUS    0.3f
+GLFrame    *pSpheres = NULL;
+GLuint     nNumSpheres = NUM_SPHERES;
+bool       bCrowd = false;
+CInstancedMesh sphereMesh;      // Drawn once for every sphere
+M3DFrustum viewFrustum;         // The camera's, in world space
+CJobScheduler jobScheduler;
+
+// With -meshcache the sphere is only welded the first time, after that it
+// is mapped straight out of this file (see CTriangleMesh::LoadMesh()). The
+// name has the size in it, so a different sphere doesn't load an old one.
+#define SPHERE_MESH_FILE    "sphere-21x11.mesh"
+bool    bMeshCache = false;
 GLFrame    frameCamera;
 GLenum renderMode = GL_FILL;
 
+// Where the frame time goes
+CProfiler profiler;
+
+// Everything is drawn through the render queue, a pass at a time
+CRenderQueue renderQueue;
+#define PASS_SHADOW_MAP     0       // Casters into the shadow map, one pass per cascade
+#define PASS_DEPTH          (PASS_SHADOW_MAP + SHADOW_CASCADES)     // Depth pre-pass, everything opaque
+#define PASS_WORLD          (PASS_DEPTH + 1)    // Ground and room
+#define PASS_SHADOWS        (PASS_WORLD + 1)    // Planar shadows, blended over the world, no depth test
+#define PASS_INHABITANTS    (PASS_WORLD + 2)    // Over the top of the shadows
+int iZoneUpdate, iZoneQueue, iZoneDepth, iZoneWorld, iZoneShadows, iZoneInhabitants, iZoneTextures;
+
+// With the depth pre-pass (-prepass), the depth buffer is filled in first,
+// nearest things first, and the lit, textured (and shadow mapped) passes
+// after it only draw the fragment that ends up on screen. It pays where
+// fragments are dear and vertices cheap, which a software renderer isn't,
+// so it's off unless asked for. -overdraw counts how many times each pixel
+// gets drawn, in the stencil buffer.
+bool    bDepthPrepass = false;
+bool    bCountOverdraw = false;
+double  dOverdrawFragments = 0.0;       // Color writes, over all the counted frames
+double  dOverdrawPixels = 0.0;          // Pixels written at least once
+double  dOverdrawScreen = 0.0;          // Pixels in all
+
 // Light and material Data
 GLfloat fLightPos[4]   = { -100.0f, 100.0f, 50.0f, 1.0f };  // Point source
 GLfloat fNoLight[] = { 0.0f, 0.0f, 0.0f, 0.0f };
 GLfloat fLowLight[] = { 0.25f, 0.25f, 0.25f, 1.0f };
 GLfloat fBrightLight[] = { 1.0f, 1.0f, 1.0f, 1.0f };
 
+// Shadows are shadow mapped, so they fall on the walls and on each other
+// too. Without the extensions for it (or with -planarshadows) they are
+// squashed flat onto the floor with mShadowMatrix and blended over it,
+// as they always used to be.
+CShadowMap shadowMap;
+bool    bShadowMaps = true;
 M3DMatrix44f mShadowMatrix;
 
+// Everything that casts or catches a shadow is in here
+const M3DVector3f vSceneMin = { -20.0f, -2.0f, -20.0f };
+const M3DVector3f vSceneMax = { 21.0f, 3.0f, 20.0f };
+
+// The camera's projection
+#define CAMERA_FOV          35.0f
+#define CAMERA_NEAR         1.0f
+#define CAMERA_FAR          50.0f
+
 #define NUM_TEXTURES    12
 #define GROUND_TEXTURE  0
 #define CUBE_TEXTURE   1
@@ -44,11 +122,111 @@ GLuint  textureObjects[NUM_TEXTURES];
 
 const char *szTextureFiles[] = {"ground.tga", "apple.tga", "orb.tga", "wall.tga", "wallKoi.tga", "ceiling.tga","sofa1.tga","sofa2.tga" ,"sofa3.tga" ,"sofa4.tga", "foot.tga", "iron.tga" };
 
-void DrawCog(float r0, float r1, float r2, float w, int n)    // shaft/inner/outer radiuses, width, tooths
+//////////////////////////////////////////////////////////////////
+// The sofa's textures are packed into one atlas, and the room's into
+// another, so each of them can be drawn with a single texture binding.
+// textureBindings[] is what to bind for each texture, its own texture
+// object or its atlas, and textureRemaps[] is where in that it is.
+#define NUM_ATLASES     2
+#define SOFA_ATLAS      0
+#define ROOM_ATLAS      1
+const int atlasMembers[NUM_TEXTURES] = { -1, -1, -1, ROOM_ATLAS, ROOM_ATLAS, ROOM_ATLAS,
+                                         SOFA_ATLAS, SOFA_ATLAS, SOFA_ATLAS, SOFA_ATLAS, SOFA_ATLAS, -1 };
+GLuint  atlasObjects[NUM_ATLASES];
+GLuint  textureBindings[NUM_TEXTURES];
+GLfloat textureRemaps[NUM_TEXTURES][4];     // s * [0] + [2], t * [1] + [3]
+bool    bUseAtlases = true;
+
+// The atlases are packed on a texture loading thread, and the images'
+// remaps filled in when the atlas texture arrives
+CTextureAtlas atlases[NUM_ATLASES];
+const int atlasIndices[NUM_ATLASES] = { SOFA_ATLAS, ROOM_ATLAS };
+int     atlasImages[NUM_TEXTURES];
+
+//////////////////////////////////////////////////////////////////
+// Textures are loaded in the background, and appear as they arrive.
+// Until then they're plain white. With bStreamTextures off, they are
+// all loaded before the first frame, as they always used to be.
+CTextureStreamer textureStreamer;
+bool    bStreamTextures = true;
+bool    bTexturesReported = false;
+#define TEXTURE_UPLOAD_BUDGET   (2 * 1024 * 1024)   // Bytes per frame
+
+// How the mipmaps are made, see MipChain.h. Compressed unless the card
+// can't take it (or -nocompress).
+GLuint  nMipFlags = MIP_SRGB | MIP_COMPRESS;
+bool    bMipCache = false;
+
+// glTexCoord2f() for a coordinate on one of the textures above
+inline void TexCoordRemapped(int iTexture, GLfloat s, GLfloat t)
+{
+    const GLfloat *pRemap = textureRemaps[iTexture];
+    glTexCoord2f(s * pRemap[0] + pRemap[2], t * pRemap[1] + pRemap[3]);
+}
+
+//////////////////////////////////////////////////////////////////
+// Cogs used to be sent through glBegin/glEnd every frame, with a sin
+// and cos for every slice. Now each one is built once into a VBO mesh,
+// and drawing it is a single glDrawElements. Every different set of
+// cog parameters gets its own mesh, kept in this little cache.
+#define MAX_COG_MESHES  8
+struct COGMESH
+    {
+    float r0, r1, r2, w;
+    int n;
+    CVBOMesh *pMesh;
+    };
+COGMESH cogMeshes[MAX_COG_MESHES];
+int nCogMeshes = 0;
+int nNextCogMesh = 0;       // Who gets replaced when the cache is full
+
+// Meshes pushed out of the cache. Items already in the render queue may
+// still point at them, so they're kept until RenderScene() has flushed
+// everything, then FreeRetiredCogMeshes() deletes them.
+CVBOMesh **pRetiredCogMeshes = NULL;
+int nRetiredCogMeshes = 0;
+int nMaxRetiredCogMeshes = 0;
+
+// Add one quad (as two triangles) with a single normal and texture coordinate
+static void AddCogQuad(CVBOMesh *pMesh, float nx, float ny, float nz, const float t[2],
+                       const float *v0, const float *v1, const float *v2, const float *v3)
+    {
+    M3DVector3f vVerts[3], vNorms[3];
+    M3DVector2f vTex[3];
+    int i;
+
+    for(i = 0; i < 3; i++)
+        {
+        m3dLoadVector3(vNorms[i], nx, ny, nz);
+        vTex[i][0] = t[0]; vTex[i][1] = t[1];
+        }
+
+    m3dCopyVector3(vVerts[0], v0); m3dCopyVector3(vVerts[1], v1); m3dCopyVector3(vVerts[2], v2);
+    pMesh->AddTriangle(vVerts, vNorms, vTex);
+
+    // AddTriangle normalizes the normals in place, so set them again
+    for(i = 0; i < 3; i++)
+        m3dLoadVector3(vNorms[i], nx, ny, nz);
+
+    m3dCopyVector3(vVerts[0], v0); m3dCopyVector3(vVerts[1], v2); m3dCopyVector3(vVerts[2], v3);
+    pMesh->AddTriangle(vVerts, vNorms, vTex);
+    }
+
+// Build the cog geometry into a mesh. The same math and vertex order the
+// immediate mode version used, so it looks exactly the same. The tooth
+// faces never set a texture coordinate, so they kept the last one from
+// the gap before, (0, 0).
+void BuildCog(CVBOMesh *pMesh, float r0, float r1, float r2, float w, int n)    // shaft/inner/outer radiuses, width, tooths
 {
     int i;
     float a, da, x, y, c, s;
     float p[6][3], q[6][3];  // slice points
+    const float tTooth[2] = { 0.0f, 0.0f };
+    const float tGap[4][2] = { { 0.0f, 1.0f }, { 1.0f, 0.0f }, { 1.0f, 1.0f }, { 0.0f, 0.0f } };
+
+    // 10 quads (20 triangles) per slice
+    pMesh->BeginMesh((n + 1) * 60);
+
     // set z for slice points
     a = -0.5 * w; for (i = 0; i < 3; i++) { p[i][2] = a; q[i][2] = a; }
     a = +0.5 * w; for (i = 3; i < 6; i++) { p[i][2] = a; q[i][2] = a; }
@@ -61,7 +239,6 @@ void DrawCog(float r0, float r1, float r2, float w, int n)    // shaft/inner/out
     q[2][1] = 0.0; q[3][1] = 0.0;
     // divide circle to 2*n slices
     da = 2.0 * 3.1415f / float(4 * n);
-    glBegin(GL_QUADS);
     for (a = 0.0, i = 0; i <= n; i++)
     {
         // points on circles at angle a
@@ -72,38 +249,14 @@ void DrawCog(float r0, float r1, float r2, float w, int n)    // shaft/inner/out
         p[1][1] = y; p[4][1] = y;
         x = r2 * c; y = r2 * s; p[2][0] = x; p[3][0] = x;
         p[2][1] = y; p[3][1] = y;
-        // render tooth
+        // tooth
         c = cos(a); s = sin(a); a += da;
-        glNormal3f(0.0, 0.0, -1.0);   // -Z base
-        glVertex3fv(p[0]);
-        glVertex3fv(p[2]);
-        glVertex3fv(q[2]);
-        glVertex3fv(q[0]);
-        glNormal3f(0.0, 0.0, +1.0);   // +Z base
-        glVertex3fv(p[3]);
-        glVertex3fv(p[5]);
-        glVertex3fv(q[5]);
-        glVertex3fv(q[3]);
-        glNormal3f(-c, -s, 0.0);      // shaft circumference side
-        glVertex3fv(p[5]);
-        glVertex3fv(p[0]);
-        glVertex3fv(q[0]);
-        glVertex3fv(q[5]);
-        glNormal3f(c, s, 0.0);        // outter circumference side
-        glVertex3fv(p[2]);
-        glVertex3fv(p[3]);
-        glVertex3fv(q[3]);
-        glVertex3fv(q[2]);
-        glNormal3f(-s, c, 0.0);
-        glVertex3fv(p[4]);
-        glVertex3fv(p[3]);
-        glVertex3fv(p[2]);
-        glVertex3fv(p[1]);
-        glNormal3f(s, -c, 0.0);
-        glVertex3fv(q[1]);
-        glVertex3fv(q[2]);
-        glVertex3fv(q[3]);
-        glVertex3fv(q[4]);
+        AddCogQuad(pMesh, 0.0, 0.0, -1.0, tTooth, p[0], p[2], q[2], q[0]);     // -Z base
+        AddCogQuad(pMesh, 0.0, 0.0, +1.0, tTooth, p[3], p[5], q[5], q[3]);     // +Z base
+        AddCogQuad(pMesh, -c, -s, 0.0, tTooth, p[5], p[0], q[0], q[5]);        // shaft circumference side
+        AddCogQuad(pMesh, c, s, 0.0, tTooth, p[2], p[3], q[3], q[2]);          // outter circumference side
+        AddCogQuad(pMesh, -s, c, 0.0, tTooth, p[4], p[3], p[2], p[1]);
+        AddCogQuad(pMesh, s, -c, 0.0, tTooth, q[1], q[2], q[3], q[4]);
 
         // points on circles at angle a
         c = cos(a); s = sin(a); a += da;
@@ -113,86 +266,331 @@ void DrawCog(float r0, float r1, float r2, float w, int n)    // shaft/inner/out
         q[1][1] = y; q[4][1] = y;
         x = r2 * c; y = r2 * s; q[2][0] = x; q[3][0] = x;
         q[2][1] = y; q[3][1] = y;
-        // render gap
+        // gap
         c = cos(a); s = sin(a); a += da;
-        glNormal3f(0.0, 0.0, -1.0);   // -Z base
-        glTexCoord2f(0.0, 1.0);
-        glVertex3fv(q[0]);
-        glVertex3fv(q[1]);
-        glVertex3fv(p[1]);
-        glVertex3fv(p[0]);
-        glNormal3f(0.0, 0.0, +1.0);   // +Z base
-        glTexCoord2f(1.0, 0.0);
-        glVertex3fv(q[4]);
-        glVertex3fv(q[5]);
-        glVertex3fv(p[5]);
-        glVertex3fv(p[4]);
-        glNormal3f(-c, -s, 0.0);      // shaft circumference side
-        glTexCoord2f(1.0, 1.0);
-        glVertex3fv(q[5]);
-        glVertex3fv(q[0]);
-        glVertex3fv(p[0]);
-        glVertex3fv(p[5]);
-        glNormal3f(c, s, 0.0);        // outter circumference side
-        glTexCoord2f(0.0, 0.0);
-        glVertex3fv(q[1]);
-        glVertex3fv(q[4]);
-        glVertex3fv(p[4]);
-        glVertex3fv(p[1]);
+        AddCogQuad(pMesh, 0.0, 0.0, -1.0, tGap[0], q[0], q[1], p[1], p[0]);   // -Z base
+        AddCogQuad(pMesh, 0.0, 0.0, +1.0, tGap[1], q[4], q[5], p[5], p[4]);   // +Z base
+        AddCogQuad(pMesh, -c, -s, 0.0, tGap[2], q[5], q[0], p[0], p[5]);      // shaft circumference side
+        AddCogQuad(pMesh, c, s, 0.0, tGap[3], q[1], q[4], p[4], p[1]);        // outter circumference side
     }
-    glEnd();
+
+    pMesh->EndMesh(MESH_INTERLEAVED | MESH_OPTIMIZE);
 }
 
-void DrawRoom()
+// Nothing queued uses them any more
+void FreeRetiredCogMeshes(void)
 {
-    glPushMatrix();
-    glTranslatef(0.5f, -1.55f, -10.0f);
-    glBindTexture(GL_TEXTURE_2D, textureObjects[WALL_TEXTURE]);
-    glBegin(GL_QUADS);
-    glTexCoord2f(0.0, 1.0); glVertex3f(-5, 0, -5);
-    glTexCoord2f(1.0, 1.0); glVertex3f(4, 0, -5);
-    glTexCoord2f(1.0, 0.0); glVertex3f(4, 0, 4);
-    glTexCoord2f(0.0, 0.0); glVertex3f(-5, 0, 4);
-    glEnd();
+    for (int i = 0; i < nRetiredCogMeshes; i++)
+        delete pRetiredCogMeshes[i];
+    nRetiredCogMeshes = 0;
+}
 
-    glBindTexture(GL_TEXTURE_2D, textureObjects[WALL_FISH_TEXTURE]);
-    glBegin(GL_QUADS);
-    glTexCoord2f(0.0, 0.0); glVertex3f(-5, 0, -5);
-    glTexCoord2f(1.0, 0.0); glVertex3f(4, 0, -5);
-    glTexCoord2f(1.0, 1.0); glVertex3f(4, 4, -5);
-    glTexCoord2f(0.0, 1.0); glVertex3f(-5, 4, -5);
-    glEnd();
+void RetireCogMesh(CVBOMesh *pMesh)
+{
+    if (nRetiredCogMeshes == nMaxRetiredCogMeshes)
+    {
+        int nNewMax = (nMaxRetiredCogMeshes == 0) ? MAX_COG_MESHES : nMaxRetiredCogMeshes * 2;
+        CVBOMesh **pNew = new CVBOMesh *[nNewMax];
+        if (nRetiredCogMeshes > 0)
+            memcpy(pNew, pRetiredCogMeshes, sizeof(CVBOMesh *) * nRetiredCogMeshes);
+        delete [] pRetiredCogMeshes;
+        pRetiredCogMeshes = pNew;
+        nMaxRetiredCogMeshes = nNewMax;
+    }
 
-    glBindTexture(GL_TEXTURE_2D, textureObjects[WALL_TEXTURE]);
-    glBegin(GL_QUADS);
-    glTexCoord2f(0.0, 1.0); glVertex3f(-5, 0, 4);
-    glTexCoord2f(1.0, 1.0); glVertex3f(-5, 0, -5);
-    glTexCoord2f(1.0, 0.0); glVertex3f(-5, 4, -5);
-    glTexCoord2f(0.0, 0.0); glVertex3f(-5, 4, 4);
-    glEnd();
+    pRetiredCogMeshes[nRetiredCogMeshes++] = pMesh;
+}
 
-    glBindTexture(GL_TEXTURE_2D, textureObjects[WALL_TEXTURE]);
-    glBegin(GL_QUADS);
-    glTexCoord2f(0.0, 1.0); glVertex3f(4, 0, -5);
-    glTexCoord2f(1.0, 1.0); glVertex3f(4, 0, 4);
-    glTexCoord2f(1.0, 0.0); glVertex3f(4, 4, 4);
-    glTexCoord2f(0.0, 0.0); glVertex3f(4, 4, -5);
-    glEnd();
+// Find the mesh for these cog parameters, building it the first time
+CVBOMesh *GetCogMesh(float r0, float r1, float r2, float w, int n)
+{
+    int i;
+
+    for (i = 0; i < nCogMeshes; i++)
+        if (cogMeshes[i].r0 == r0 && cogMeshes[i].r1 == r1 && cogMeshes[i].r2 == r2 &&
+            cogMeshes[i].w == w && cogMeshes[i].n == n)
+            return cogMeshes[i].pMesh;
+
+    // Not built yet. If the cache is full, take the oldest slot. Its mesh
+    // may be queued to draw this frame, so it can't be deleted yet.
+    if (nCogMeshes < MAX_COG_MESHES)
+        i = nCogMeshes++;
+    else
+    {
+        i = nNextCogMesh;
+        nNextCogMesh = (nNextCogMesh + 1) % MAX_COG_MESHES;
+        RetireCogMesh(cogMeshes[i].pMesh);
+    }
+
+    cogMeshes[i].r0 = r0; cogMeshes[i].r1 = r1; cogMeshes[i].r2 = r2;
+    cogMeshes[i].w = w; cogMeshes[i].n = n;
+    cogMeshes[i].pMesh = new CVBOMesh;
+    BuildCog(cogMeshes[i].pMesh, r0, r1, r2, w, n);
+
+    return cogMeshes[i].pMesh;
+}
+
+// Render queue callback, pData is the cog's mesh from GetCogMesh()
+void DrawCog(const void *pData, GLint iParam)
+{
+    CVBOMesh *pMesh = (CVBOMesh *)pData;
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    pMesh->Draw();
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    // Leave the buffer bindings as the rest of the immediate mode code expects
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+// Build the same sphere gltDrawSphere() draws into a mesh, so it can be
+// drawn many times over with CInstancedMesh. nOptions go to EndMesh().
+void BuildSphere(CTriangleMesh *pMesh, GLfloat fRadius, GLint iSlices, GLint iStacks,
+                 GLuint nOptions = MESH_INTERLEAVED | MESH_OPTIMIZE)
+{
+    GLfloat drho = (GLfloat)(3.141592653589) / (GLfloat) iStacks;
+    GLfloat dtheta = 2.0f * (GLfloat)(3.141592653589) / (GLfloat) iSlices;
+    GLfloat ds = 1.0f / (GLfloat) iSlices;
+    GLfloat dt = 1.0f / (GLfloat) iStacks;
+    M3DVector3f vVerts[4], vNorms[4], vTri[3], vTriNorms[3];
+    M3DVector2f vTex[4], vTriTex[3];
+    GLint i, j, k;
+
+    pMesh->BeginMesh(iSlices * iStacks * 6);
+
+    for (i = 0; i < iStacks; i++)
+    {
+        for (j = 0; j < iSlices; j++)
+        {
+            // Corners of this patch, top left, bottom left, top right, bottom right
+            for (k = 0; k < 4; k++)
+            {
+                GLint iStack = i + (k & 1);
+                GLint iSlice = j + (k >> 1);
+                GLfloat rho = (GLfloat)iStack * drho;
+                GLfloat theta = (iSlice == iSlices) ? 0.0f : iSlice * dtheta;
+
+                vNorms[k][0] = (GLfloat)(-sin(theta)) * (GLfloat)(sin(rho));
+                vNorms[k][1] = (GLfloat)(cos(theta)) * (GLfloat)(sin(rho));
+                vNorms[k][2] = (GLfloat)(cos(rho));
+                m3dCopyVector3(vVerts[k], vNorms[k]);
+                m3dScaleVector3(vVerts[k], fRadius);
+                vTex[k][0] = (GLfloat)iSlice * ds;
+                vTex[k][1] = 1.0f - (GLfloat)iStack * dt;
+            }
+
+            // Two triangles, wound the way the triangle strip was
+            static const GLint iTris[2][3] = { { 0, 1, 2 }, { 2, 1, 3 } };
+            for (GLint t = 0; t < 2; t++)
+            {
+                for (k = 0; k < 3; k++)
+                {
+                    m3dCopyVector3(vTri[k], vVerts[iTris[t][k]]);
+                    m3dCopyVector3(vTriNorms[k], vNorms[iTris[t][k]]);
+                    vTriTex[k][0] = vTex[iTris[t][k]][0];
+                    vTriTex[k][1] = vTex[iTris[t][k]][1];
+                }
+                pMesh->AddTriangle(vTri, vTriNorms, vTriTex);
+            }
+        }
+    }
+
+    pMesh->EndMesh(nOptions);
+}
+
+// Render queue callback, a crowd of spheres in one go. pData is the array
+// of GLFrames to draw them at, iParam how many there are.
+void DrawSpheres(const void *pData, GLint iParam)
+{
+    sphereMesh.DrawInstances((GLFrame *)pData, iParam);
+}
+
+//////////////////////////////////////////////////////////////////
+// Per-actor work, spread over the cores with CJobScheduler. The actors are
+// split into fixed chunks of CROWD_CHUNK. Each chunk culls its actors
+// against the view frustum and writes the visible ones to its own part of
+// pVisible. Once every chunk has counted, GatherCrowd() works out where
+// each chunk's go, and they are copied out in order to the draw list (or
+// made into render queue items, see the job benchmark). So the list comes
+// out the same however many threads made it. A crowd of one chunk or less
+// (the usual thirty spheres) never leaves this thread: ParallelFor() runs
+// anything no bigger than its grain on the spot, and the workers are only
+// started for a bigger crowd.
+#define CROWD_CHUNK     1024
+
+struct CROWD
+    {
+    GLFrame     *pActors;
+    GLuint      nNumActors;
+    GLuint      nNumChunks;
+    float       fRadius;            // Of every actor, for the cull
+    M3DFrustum  *pFrustum;          // In world space
+    GLuint      *pVisible;          // CROWD_CHUNK entries per chunk
+    GLuint      *pChunkCounts;      // Visible actors in each chunk
+    GLuint      *pChunkStarts;      // Where each chunk's go in the draw list
+    GLFrame     *pDrawList;         // The visible actors, in order
+    GLuint      nNumVisible;
+    };
+
+void CrowdInit(CROWD *pCrowd, GLFrame *pActors, GLuint nNumActors, float fRadius, M3DFrustum *pFrustum)
+    {
+    pCrowd->pActors = pActors;
+    pCrowd->nNumActors = nNumActors;
+    pCrowd->nNumChunks = (nNumActors + CROWD_CHUNK - 1) / CROWD_CHUNK;
+    pCrowd->fRadius = fRadius;
+    pCrowd->pFrustum = pFrustum;
+    pCrowd->pVisible = new GLuint[pCrowd->nNumChunks * CROWD_CHUNK];
+    pCrowd->pChunkCounts = new GLuint[pCrowd->nNumChunks];
+    pCrowd->pChunkStarts = new GLuint[pCrowd->nNumChunks];
+    pCrowd->pDrawList = new GLFrame[nNumActors];
+    pCrowd->nNumVisible = 0;
+    }
+
+void CrowdFree(CROWD *pCrowd)
+    {
+    delete [] pCrowd->pVisible;
+    delete [] pCrowd->pChunkCounts;
+    delete [] pCrowd->pChunkStarts;
+    delete [] pCrowd->pDrawList;
+    pCrowd->pVisible = pCrowd->pChunkCounts = pCrowd->pChunkStarts = NULL;
+    pCrowd->pDrawList = NULL;
+    pCrowd->nNumActors = pCrowd->nNumChunks = pCrowd->nNumVisible = 0;
+    }
+
+// First and one past the last actor of a chunk
+inline void CrowdChunkRange(const CROWD *pCrowd, GLuint iChunk, GLuint &iFirst, GLuint &iEnd)
+    {
+    iFirst = iChunk * CROWD_CHUNK;
+    iEnd = iFirst + CROWD_CHUNK;
+    if(iEnd > pCrowd->nNumActors)
+        iEnd = pCrowd->nNumActors;
+    }
+
+// Every actor turns a little and walks on
+void MoveCrowdChunks(void *pData, GLuint nFirst, GLuint nLast)
+    {
+    CROWD *pCrowd = (CROWD *)pData;
+    GLuint iActor, iEnd;
+
+    for(GLuint iChunk = nFirst; iChunk < nLast; iChunk++)
+        for(CrowdChunkRange(pCrowd, iChunk, iActor, iEnd); iActor < iEnd; iActor++)
+            {
+            pCrowd->pActors[iActor].RotateLocalY(0.01f);
+            pCrowd->pActors[iActor].MoveForward(0.05f);
+            }
+    }
+
+void CullCrowdChunks(void *pData, GLuint nFirst, GLuint nLast)
+    {
+    CROWD *pCrowd = (CROWD *)pData;
+    GLuint iActor, iEnd;
+
+    for(GLuint iChunk = nFirst; iChunk < nLast; iChunk++)
+        {
+        GLuint *pList = &pCrowd->pVisible[iChunk * CROWD_CHUNK];
+        GLuint nVisible = 0;
+
+        for(CrowdChunkRange(pCrowd, iChunk, iActor, iEnd); iActor < iEnd; iActor++)
+            {
+            GLFrame *pActor = &pCrowd->pActors[iActor];
+            if(pCrowd->pFrustum->TestSphere(pActor->GetOriginX(), pActor->GetOriginY(), pActor->GetOriginZ(),
+                                            pCrowd->fRadius))
+                pList[nVisible++] = iActor;
+            }
+
+        pCrowd->pChunkCounts[iChunk] = nVisible;
+        }
+    }
+
+// Where each chunk's visible actors start in the draw list. Returns how many
+// there are altogether.
+GLuint GatherCrowd(CROWD *pCrowd)
+    {
+    GLuint nTotal = 0;
+    for(GLuint iChunk = 0; iChunk < pCrowd->nNumChunks; iChunk++)
+        {
+        pCrowd->pChunkStarts[iChunk] = nTotal;
+        nTotal += pCrowd->pChunkCounts[iChunk];
+        }
+
+    pCrowd->nNumVisible = nTotal;
+    return nTotal;
+    }
+
+void ListCrowdChunks(void *pData, GLuint nFirst, GLuint nLast)
+    {
+    CROWD *pCrowd = (CROWD *)pData;
+
+    for(GLuint iChunk = nFirst; iChunk < nLast; iChunk++)
+        {
+        const GLuint *pList = &pCrowd->pVisible[iChunk * CROWD_CHUNK];
+        GLFrame *pDraw = &pCrowd->pDrawList[pCrowd->pChunkStarts[iChunk]];
+        for(GLuint i = 0; i < pCrowd->pChunkCounts[iChunk]; i++)
+            pDraw[i] = pCrowd->pActors[pList[i]];
+        }
+    }
 
-    glBindTexture(GL_TEXTURE_2D, textureObjects[CEILING_TEXTURE]);
+CROWD sphereCrowd;
+
+// Cull the crowd and fill in pDrawList with what's left
+GLuint CullCrowd(CROWD *pCrowd, CJobScheduler *pJobs)
+    {
+    pJobs->ParallelFor(CullCrowdChunks, pCrowd, pCrowd->nNumChunks, 1);
+    GatherCrowd(pCrowd);
+    pJobs->ParallelFor(ListCrowdChunks, pCrowd, pCrowd->nNumChunks, 1);
+    return pCrowd->nNumVisible;
+    }
+
+// The walls, floor and ceiling of the room, one texture each. They have no
+// normals of their own, they always got the ground's straight up one.
+struct ROOMQUAD
+    {
+    int iTexture;
+    GLfloat fTexCoords[4][2];
+    GLfloat fVerts[4][3];
+    };
+
+#define NUM_ROOM_QUADS  5
+const ROOMQUAD roomQuads[NUM_ROOM_QUADS] = {
+    { WALL_TEXTURE,         { { 0, 1 }, { 1, 1 }, { 1, 0 }, { 0, 0 } },
+                            { { -5, 0, -5 }, { 4, 0, -5 }, { 4, 0, 4 }, { -5, 0, 4 } } },
+    { WALL_FISH_TEXTURE,    { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 } },
+                            { { -5, 0, -5 }, { 4, 0, -5 }, { 4, 4, -5 }, { -5, 4, -5 } } },
+    { WALL_TEXTURE,         { { 0, 1 }, { 1, 1 }, { 1, 0 }, { 0, 0 } },
+                            { { -5, 0, 4 }, { -5, 0, -5 }, { -5, 4, -5 }, { -5, 4, 4 } } },
+    { WALL_TEXTURE,         { { 0, 1 }, { 1, 1 }, { 1, 0 }, { 0, 0 } },
+                            { { 4, 0, -5 }, { 4, 0, 4 }, { 4, 4, 4 }, { 4, 4, -5 } } },
+    { CEILING_TEXTURE,      { { 0, 1 }, { 1, 1 }, { 1, 0 }, { 0, 0 } },
+                            { { -5, 4, -5 }, { 4, 4, -5 }, { 4, 4, 4 }, { -5, 4, 4 } } } };
+
+// Render queue callback, pData is the ROOMQUAD
+void DrawRoomQuad(const void *pData, GLint iParam)
+{
+    const ROOMQUAD *pQuad = (const ROOMQUAD *)pData;
+
+    glNormal3f(0.0f, 1.0f, 0.0f);
     glBegin(GL_QUADS);
-    glTexCoord2f(0.0, 1.0); glVertex3f(-5, 4, -5);
-    glTexCoord2f(1.0, 1.0); glVertex3f(4, 4, -5);
-    glTexCoord2f(1.0, 0.0); glVertex3f(4, 4, 4);
-    glTexCoord2f(0.0, 0.0); glVertex3f(-5, 4, 4);
+    for (int i = 0; i < 4; i++)
+    {
+        TexCoordRemapped(pQuad->iTexture, pQuad->fTexCoords[i][0], pQuad->fTexCoords[i][1]);
+        glVertex3fv(pQuad->fVerts[i]);
+    }
     glEnd();
-    glPopMatrix();
 }
 
-void DrawCube(double size)
+// Render queue callback, pData points to the size (a double)
+void DrawCube(const void *pData, GLint iParam)
 {
+    double size = *(const double *)pData;
+
     glPushMatrix();
-    glBindTexture(GL_TEXTURE_2D, textureObjects[CUBE_TEXTURE]);
     glBegin(GL_QUADS);
 
     // Bottom Face
@@ -255,197 +653,255 @@ void DrawCube(double size)
 
 }
 
-void DrawSofa(double s)
+// The sofa is drawn in parts, one for each of its textures
+#define SOFA_BACK           0
+#define SOFA_ARMS           1
+#define SOFA_SEAT           2
+#define SOFA_SEAT_SIDES     3
+#define SOFA_FEET           4
+#define NUM_SOFA_PARTS      5
+const int sofaTextures[NUM_SOFA_PARTS] = { SOFA1_TEXTURE, SOFA2_TEXTURE, SOFA3_TEXTURE, SOFA4_TEXTURE, FOOT_TEXTURE };
+
+// Render queue callback, pData points to the size (a double), iPart is one
+// of the SOFA_ parts
+void DrawSofaPart(const void *pData, GLint iPart)
 {
+    double s = *(const double *)pData;
+    int iTexture = sofaTextures[iPart];
+
     glPushMatrix();
     glTranslatef(0.0f, -0.1f, 0.0f);
-    glPushMatrix();
-    glBindTexture(GL_TEXTURE_2D, textureObjects[SOFA1_TEXTURE]);
     glBegin(GL_QUADS);
 
-    // Top face
-    glNormal3f(0.0f, 1.0f, 0.0f);
-    glTexCoord2f(0, 1); glVertex3f(-s*3, s, -s);
-    glTexCoord2f(0, 0); glVertex3f(-s*3, s, -s+(s/2));
-    glTexCoord2f(1, 0); glVertex3f(s*3, s, -s+(s/2));
-    glTexCoord2f(1, 1); glVertex3f(s*3, s, -s);
+    switch (iPart)
+    {
+    case SOFA_BACK:
+        // Top face
+        glNormal3f(0.0f, 1.0f, 0.0f);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s*3, s, -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s*3, s, -s+(s/2));
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s*3, s, -s+(s/2));
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s*3, s, -s);
 
-    // Far face
-    glNormal3f(0.0f, 0.0f, -1.0f);
-    glTexCoord2f(1, 0); glVertex3f(-s*3, -s, -s);
-    glTexCoord2f(1, 1); glVertex3f(-s*3, s, -s);
-    glTexCoord2f(0, 1); glVertex3f(s*3, s, -s);
-    glTexCoord2f(0, 0); glVertex3f(s*3, -s, -s);
+        // Far face
+        glNormal3f(0.0f, 0.0f, -1.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s*3, -s, -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s*3, s, -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s*3, s, -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s*3, -s, -s);
 
-    // Front face
-    glNormal3f(0.0f, 0.0f, 1.0f);
-    glTexCoord2f(0, 0); glVertex3f(-s*3, -s, -s+(s/2));
-    glTexCoord2f(1, 0); glVertex3f(s*3, -s, -s+(s/2));
-    glTexCoord2f(1, 1); glVertex3f(s*3, s, -s+(s/2));
-    glTexCoord2f(0, 1); glVertex3f(-s*3, s, -s+(s/2));
+        // Front face
+        glNormal3f(0.0f, 0.0f, 1.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s*3, -s, -s+(s/2));
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s*3, -s, -s+(s/2));
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s*3, s, -s+(s/2));
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s*3, s, -s+(s/2));
 
-    // Top face(sitting surface)
-    glNormal3f(0.0f, 1.0f, 0.0f);
-    glTexCoord2f(0, 1); glVertex3f(-s * 3, s - (s * 2), -s);
-    glTexCoord2f(0, 0); glVertex3f(-s * 3, s - (s * 2), s);
-    glTexCoord2f(1, 0); glVertex3f(s * 3, s - (s * 2), s);
-    glTexCoord2f(1, 1); glVertex3f(s * 3, s - (s * 2), -s);
+        // Top face(sitting surface)
+        glNormal3f(0.0f, 1.0f, 0.0f);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s * 3, s - (s * 2), -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s * 3, s - (s * 2), s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 3, s - (s * 2), s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 3, s - (s * 2), -s);
+        break;
 
-    glEnd();
-    glPopMatrix();
+    case SOFA_ARMS:
+        // Left Face
+        glNormal3f(-1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s*3, -s, -s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s*3, -s, -s+(s/2));
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s*3, s, -s+(s/2));
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s*3, s, -s);
 
-    glPushMatrix();
-    glBindTexture(GL_TEXTURE_2D, textureObjects[SOFA2_TEXTURE]);
-    glBegin(GL_QUADS);
+        // Right face
+        glNormal3f(1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 3, -s, -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 3, s, -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s * 3, s, -s + (s / 2));
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s * 3, -s, -s + (s / 2));
+        break;
 
-    // Left Face
-    glNormal3f(-1.0f, 0.0f, 0.0f);
-    glTexCoord2f(0, 0); glVertex3f(-s*3, -s, -s);
-    glTexCoord2f(1, 0); glVertex3f(-s*3, -s, -s+(s/2));
-    glTexCoord2f(1, 1); glVertex3f(-s*3, s, -s+(s/2));
-    glTexCoord2f(0, 1); glVertex3f(-s*3, s, -s);
+    case SOFA_SEAT:
+        // Bottom Face(sitting area)
+        glNormal3f(0.0f, -1.0f, 0.0f);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s * 3, -(s*2.5), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s*3, -(s*2.5), -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s*3, -(s*2.5), s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s*3, -(s*2.5), s);
 
-    // Right face
-    glNormal3f(1.0f, 0.0f, 0.0f);
-    glTexCoord2f(1, 0); glVertex3f(s * 3, -s, -s);
-    glTexCoord2f(1, 1); glVertex3f(s * 3, s, -s);
-    glTexCoord2f(0, 1); glVertex3f(s * 3, s, -s + (s / 2));
-    glTexCoord2f(0, 0); glVertex3f(s * 3, -s, -s + (s / 2));
+        // Far face(sitting area)
+        glNormal3f(0.0f, 0.0f, -1.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s*3, -(s*2.5), -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s*3, s - (s * 2), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s*3, s - (s * 2), -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s*3, -(s*2.5), -s);
 
-    glEnd();
-    glPopMatrix();
+        // Front face(sitting area)
+        glNormal3f(0.0f, 0.0f, 1.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s*3, -(s*2.5), s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s*3, -(s*2.5), s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s*3, s - (s * 2), s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s*3, s - (s * 2), s);
+        break;
 
-    glPushMatrix();
-    glBindTexture(GL_TEXTURE_2D, textureObjects[SOFA3_TEXTURE]);
-    glBegin(GL_QUADS);
+    case SOFA_SEAT_SIDES:
+        // Left Face(sitting area)
+        glNormal3f(-1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s*3, -(s*2.5), -s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s*3, -(s*2.5), s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s*3, s - (s * 2), s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s*3, s - (s * 2), -s);
 
-    // Bottom Face(sitting area)
-    glNormal3f(0.0f, -1.0f, 0.0f);
-    glTexCoord2f(1, 1); glVertex3f(-s * 3, -(s*2.5), -s);
-    glTexCoord2f(0, 1); glVertex3f(s*3, -(s*2.5), -s);
-    glTexCoord2f(0, 0); glVertex3f(s*3, -(s*2.5), s);
-    glTexCoord2f(1, 0); glVertex3f(-s*3, -(s*2.5), s);
+        // Right face(sitting area)
+        glNormal3f(1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 3, -(s * 2.5), -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 3, s - (s * 2), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s * 3, s - (s * 2), s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s * 3, -(s * 2.5), s);
+        break;
 
-    // Far face(sitting area)
-    glNormal3f(0.0f, 0.0f, -1.0f);
-    glTexCoord2f(1, 0); glVertex3f(-s*3, -(s*2.5), -s);
-    glTexCoord2f(1, 1); glVertex3f(-s*3, s - (s * 2), -s);
-    glTexCoord2f(0, 1); glVertex3f(s*3, s - (s * 2), -s);
-    glTexCoord2f(0, 0); glVertex3f(s*3, -(s*2.5), -s);
+    case SOFA_FEET:
+        // Far face(left foot)
+        glNormal3f(0.0f, 0.0f, -1.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s * 2.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s * 2.5, -(s * 2.5), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s * 1.5, -(s * 2.5), -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s * 1.5, -(s * 3.2), -s);
 
-    // Front face(sitting area)
-    glNormal3f(0.0f, 0.0f, 1.0f);
-    glTexCoord2f(0, 0); glVertex3f(-s*3, -(s*2.5), s);
-    glTexCoord2f(1, 0); glVertex3f(s*3, -(s*2.5), s);
-    glTexCoord2f(1, 1); glVertex3f(s*3, s - (s * 2), s);
-    glTexCoord2f(0, 1); glVertex3f(-s*3, s - (s * 2), s);
+        // Front face(left foot)
+        glNormal3f(0.0f, 0.0f, 1.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s * 2.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s * 1.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s * 1.5, -(s * 2.5), s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s * 2.5, -(s * 2.5), s);
 
-    glEnd();
-    glPopMatrix();
+        // Left Face(left foot)
+        glNormal3f(-1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s * 2.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s * 2.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s * 2.5, -(s * 2.5), s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s * 2.5, -(s * 2.5), -s);
 
-    glPushMatrix();
-    glBindTexture(GL_TEXTURE_2D, textureObjects[SOFA4_TEXTURE]);
-    glBegin(GL_QUADS);
+        // Right face(left foot)
+        glNormal3f(1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s * 1.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s * 1.5, -(s * 2.5), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s * 1.5, -(s * 2.5), s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s * 1.5, -(s * 3.2), s);
 
-    // Left Face(sitting area)
-    glNormal3f(-1.0f, 0.0f, 0.0f);
-    glTexCoord2f(0, 0); glVertex3f(-s*3, -(s*2.5), -s);
-    glTexCoord2f(1, 0); glVertex3f(-s*3, -(s*2.5), s);
-    glTexCoord2f(1, 1); glVertex3f(-s*3, s - (s * 2), s);
-    glTexCoord2f(0, 1); glVertex3f(-s*3, s - (s * 2), -s);
+        // Bottom Face(left foot)
+        glNormal3f(0.0f, -1.0f, 0.0f);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(-s * 2.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(-s * 1.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(-s * 1.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(-s * 2.5, -(s * 3.2), s);
 
-    // Right face(sitting area)
-    glNormal3f(1.0f, 0.0f, 0.0f);
-    glTexCoord2f(1, 0); glVertex3f(s * 3, -(s * 2.5), -s);
-    glTexCoord2f(1, 1); glVertex3f(s * 3, s - (s * 2), -s);
-    glTexCoord2f(0, 1); glVertex3f(s * 3, s - (s * 2), s);
-    glTexCoord2f(0, 0); glVertex3f(s * 3, -(s * 2.5), s);
+        // Far face(right foot)
+        glNormal3f(0.0f, 0.0f, -1.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 1.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 1.5, -(s * 2.5), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s * 2.5, -(s * 2.5), -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s * 2.5, -(s * 3.2), -s);
 
-    glEnd();
-    glPopMatrix();
+        // Front face(right foot)
+        glNormal3f(0.0f, 0.0f, 1.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s * 1.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 2.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 2.5, -(s * 2.5), s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s * 1.5, -(s * 2.5), s);
 
-    glPushMatrix();
-    glBindTexture(GL_TEXTURE_2D, textureObjects[FOOT_TEXTURE]);
-    glBegin(GL_QUADS);
+        // Left Face(right foot)
+        glNormal3f(-1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s * 1.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 1.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 1.5, -(s * 2.5), s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s * 1.5, -(s * 2.5), -s);
 
-    // Far face(left foot)
-    glNormal3f(0.0f, 0.0f, -1.0f);
-    glTexCoord2f(1, 0); glVertex3f(-s * 2.5, -(s * 3.2), -s);
-    glTexCoord2f(1, 1); glVertex3f(-s * 2.5, -(s * 2.5), -s);
-    glTexCoord2f(0, 1); glVertex3f(-s * 1.5, -(s * 2.5), -s);
-    glTexCoord2f(0, 0); glVertex3f(-s * 1.5, -(s * 3.2), -s);
+        // Right face(right foot)
+        glNormal3f(1.0f, 0.0f, 0.0f);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 2.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 2.5, -(s * 2.5), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s * 2.5, -(s * 2.5), s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s * 2.5, -(s * 3.2), s);
 
-    // Front face(left foot)
-    glNormal3f(0.0f, 0.0f, 1.0f);
-    glTexCoord2f(0, 0); glVertex3f(-s * 2.5, -(s * 3.2), s);
-    glTexCoord2f(1, 0); glVertex3f(-s * 1.5, -(s * 3.2), s);
-    glTexCoord2f(1, 1); glVertex3f(-s * 1.5, -(s * 2.5), s);
-    glTexCoord2f(0, 1); glVertex3f(-s * 2.5, -(s * 2.5), s);
+        // Bottom Face(right foot)
+        glNormal3f(0.0f, -1.0f, 0.0f);
+        TexCoordRemapped(iTexture, 1, 1); glVertex3f(s * 1.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 0, 1); glVertex3f(s * 2.5, -(s * 3.2), -s);
+        TexCoordRemapped(iTexture, 0, 0); glVertex3f(s * 2.5, -(s * 3.2), s);
+        TexCoordRemapped(iTexture, 1, 0); glVertex3f(s * 1.5, -(s * 3.2), s);
+        break;
+    }
 
-    // Left Face(left foot)
-    glNormal3f(-1.0f, 0.0f, 0.0f);
-    glTexCoord2f(0, 0); glVertex3f(-s * 2.5, -(s * 3.2), -s);
-    glTexCoord2f(1, 0); glVertex3f(-s * 2.5, -(s * 3.2), s);
-    glTexCoord2f(1, 1); glVertex3f(-s * 2.5, -(s * 2.5), s);
-    glTexCoord2f(0, 1); glVertex3f(-s * 2.5, -(s * 2.5), -s);
+    glEnd();
+    glPopMatrix();
+}
+        
+//////////////////////////////////////////////////////////////////
+// Pack one of the atlases, on a texture loading thread. The image
+// handed back is the atlas's own, it's freed in AtlasReady().
+bool LoadAtlas(void *pData, GLTIMAGE *pImage)
+    {
+    int iAtlas = *(const int *)pData;
+    CTextureAtlas *pAtlas = &atlases[iAtlas];
 
-    // Right face(left foot)
-    glNormal3f(1.0f, 0.0f, 0.0f);
-    glTexCoord2f(1, 0); glVertex3f(-s * 1.5, -(s * 3.2), -s);
-    glTexCoord2f(1, 1); glVertex3f(-s * 1.5, -(s * 2.5), -s);
-    glTexCoord2f(0, 1); glVertex3f(-s * 1.5, -(s * 2.5), s);
-    glTexCoord2f(0, 0); glVertex3f(-s * 1.5, -(s * 3.2), s);
+    for(int i = 0; i < NUM_TEXTURES; i++)
+        if(atlasMembers[i] == iAtlas)
+            atlasImages[i] = pAtlas->AddTGA(szTextureFiles[i]);
 
-    // Bottom Face(left foot)
-    glNormal3f(0.0f, -1.0f, 0.0f);
-    glTexCoord2f(1, 1); glVertex3f(-s * 2.5, -(s * 3.2), -s);
-    glTexCoord2f(0, 1); glVertex3f(-s * 1.5, -(s * 3.2), -s);
-    glTexCoord2f(0, 0); glVertex3f(-s * 1.5, -(s * 3.2), s);
-    glTexCoord2f(1, 0); glVertex3f(-s * 2.5, -(s * 3.2), s);
+    if(!pAtlas->Build())
+        return false;
 
+    pImage->iWidth = pAtlas->GetWidth();
+    pImage->iHeight = pAtlas->GetHeight();
+    pImage->iComponents = GL_RGBA8;
+    pImage->eFormat = GL_RGBA;
+    pImage->pBits = (GLbyte *)pAtlas->GetPixels();
+    return true;
+    }
 
+// The atlas is in its texture, point its images at their parts of it
+void AtlasReady(void *pData, GLuint nTexture)
+    {
+    int iAtlas = *(const int *)pData;
+    CTextureAtlas *pAtlas = &atlases[iAtlas];
 
-    // Far face(right foot)
-    glNormal3f(0.0f, 0.0f, -1.0f);
-    glTexCoord2f(1, 0); glVertex3f(s * 1.5, -(s * 3.2), -s);
-    glTexCoord2f(1, 1); glVertex3f(s * 1.5, -(s * 2.5), -s);
-    glTexCoord2f(0, 1); glVertex3f(s * 2.5, -(s * 2.5), -s);
-    glTexCoord2f(0, 0); glVertex3f(s * 2.5, -(s * 3.2), -s);
+    // Below this the images bleed into each other
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, pAtlas->GetMaxLevel());
 
-    // Front face(right foot)
-    glNormal3f(0.0f, 0.0f, 1.0f);
-    glTexCoord2f(0, 0); glVertex3f(s * 1.5, -(s * 3.2), s);
-    glTexCoord2f(1, 0); glVertex3f(s * 2.5, -(s * 3.2), s);
-    glTexCoord2f(1, 1); glVertex3f(s * 2.5, -(s * 2.5), s);
-    glTexCoord2f(0, 1); glVertex3f(s * 1.5, -(s * 2.5), s);
+    for(int i = 0; i < NUM_TEXTURES; i++)
+        if(atlasMembers[i] == iAtlas)
+            pAtlas->GetRemap(atlasImages[i], textureRemaps[i]);
 
-    // Left Face(right foot)
-    glNormal3f(-1.0f, 0.0f, 0.0f);
-    glTexCoord2f(0, 0); glVertex3f(s * 1.5, -(s * 3.2), -s);
-    glTexCoord2f(1, 0); glVertex3f(s * 1.5, -(s * 3.2), s);
-    glTexCoord2f(1, 1); glVertex3f(s * 1.5, -(s * 2.5), s);
-    glTexCoord2f(0, 1); glVertex3f(s * 1.5, -(s * 2.5), -s);
+    pAtlas->Free();
+    }
 
-    // Right face(right foot)
-    glNormal3f(1.0f, 0.0f, 0.0f);
-    glTexCoord2f(1, 0); glVertex3f(s * 2.5, -(s * 3.2), -s);
-    glTexCoord2f(1, 1); glVertex3f(s * 2.5, -(s * 2.5), -s);
-    glTexCoord2f(0, 1); glVertex3f(s * 2.5, -(s * 2.5), s);
-    glTexCoord2f(0, 0); glVertex3f(s * 2.5, -(s * 3.2), s);
+//////////////////////////////////////////////////////////////////
+// Upload whatever textures have arrived, and once they all have, say
+// how long each took
+void UpdateTextures(void)
+    {
+    profiler.BeginZone(iZoneTextures);
+    textureStreamer.Update(TEXTURE_UPLOAD_BUDGET);
+    profiler.EndZone(iZoneTextures);
 
-    // Bottom Face(right foot)
-    glNormal3f(0.0f, -1.0f, 0.0f);
-    glTexCoord2f(1, 1); glVertex3f(s * 1.5, -(s * 3.2), -s);
-    glTexCoord2f(0, 1); glVertex3f(s * 2.5, -(s * 3.2), -s);
-    glTexCoord2f(0, 0); glVertex3f(s * 2.5, -(s * 3.2), s);
-    glTexCoord2f(1, 0); glVertex3f(s * 1.5, -(s * 3.2), s);
+    if(bTexturesReported || textureStreamer.GetPendingCount() > 0)
+        return;
 
-    glEnd();
-    glPopMatrix();
-    glPopMatrix();
+    bTexturesReported = true;
+    printf("Texture                 KB   started   decoded     ready (ms after the request)\n");
+    for(int i = 0; i < textureStreamer.GetAssetCount(); i++)
+        {
+        STREAMINFO info;
+        textureStreamer.GetInfo(i, &info);
+        if(info.nState == STREAM_READY)
+            printf("%-16s %9.1f %9.2f %9.2f %9.2f\n", info.szName, float(info.nBytes) / 1024.0f,
+                   info.fStartMs, info.fDecodedMs, info.fReadyMs);
+        else
+            printf("%-16s    failed\n", info.szName);
+        }
+    }
 
-}
-        
 //////////////////////////////////////////////////////////////////
 // This function does any needed initialization on the rendering
 // context. 
@@ -492,16 +948,49 @@ void SetupRC()
     glEnable(GL_COLOR_MATERIAL);
     glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
     glPolygonMode(GL_FRONT_AND_BACK, renderMode);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, fBrightLight);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, fNoLight);   // The render queue turns it on when asked
     glMateriali(GL_FRONT, GL_SHININESS, 128);
+
+    // For the shadows
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if(bShadowMaps)
+        bShadowMaps = shadowMap.InitGL();
   
     
     // Randomly place the sphere inhabitants
-    for(iSphere = 0; iSphere < NUM_SPHERES; iSphere++)
+    pSpheres = new GLFrame[nNumSpheres];
+    for(iSphere = 0; iSphere < int(nNumSpheres); iSphere++)
         {
         // Pick a random location between -20 and 20 at .1 increments
-        spheres[iSphere].SetOrigin(((float)((rand() % 400) - 200) * 0.1f), 0.0, (float)((rand() % 400) - 200) * 0.1f);
+        pSpheres[iSphere].SetOrigin(((float)((rand() % 400) - 200) * 0.1f), 0.0, (float)((rand() % 400) - 200) * 0.1f);
+        }
+
+    // A crowd sets off every which way
+    if(bCrowd)
+        for(iSphere = 0; iSphere < int(nNumSpheres); iSphere++)
+            pSpheres[iSphere].RotateLocalY(float(rand() % 628) * 0.01f);
+
+    CrowdInit(&sphereCrowd, pSpheres, nNumSpheres, SPHERE_RADIUS, &viewFrustum);
+    if(sphereCrowd.nNumChunks > 1)
+        jobScheduler.Start();
+
+    // And what they look like
+    if(!bMeshCache || !sphereMesh.LoadMesh(SPHERE_MESH_FILE))
+        {
+        BuildSphere(&sphereMesh, SPHERE_RADIUS, 21, 11);
+        if(bMeshCache && !sphereMesh.SaveMesh(SPHERE_MESH_FILE))
+            fprintf(stderr, "Can't write %s\n", SPHERE_MESH_FILE);
         }
+
+    // Name the parts of the frame we want timed
+    profiler.InitGL();
+    iZoneUpdate = profiler.AddZone("update");
+    iZoneQueue = profiler.AddZone("queue");
+    iZoneDepth = profiler.AddZone("depth");
+    iZoneWorld = profiler.AddZone("world");
+    iZoneShadows = profiler.AddZone("shadows");
+    iZoneInhabitants = profiler.AddZone("inhabitants");
+    iZoneTextures = profiler.AddZone("textures");
       
     // Set up texture maps
     glEnable(GL_TEXTURE_2D);
@@ -509,39 +998,86 @@ void SetupRC()
     glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
     
     
+    textureStreamer.SetMipFlags(nMipFlags, bMipCache);
+    textureStreamer.Start(bStreamTextures ? 2 : 0);
+    bTexturesReported = false;
+
+    atlasObjects[SOFA_ATLAS] = atlasObjects[ROOM_ATLAS] = 0;
+    if(bUseAtlases)
+        glGenTextures(NUM_ATLASES, atlasObjects);
+
     for(i = 0; i < NUM_TEXTURES; i++)
         {
-        GLbyte *pBytes;
-        GLint iWidth, iHeight, iComponents;
-        GLenum eFormat;
-        
-        glBindTexture(GL_TEXTURE_2D, textureObjects[i]);
-        
-        // Load this texture map
-        pBytes = gltLoadTGA(szTextureFiles[i], &iWidth, &iHeight, &iComponents, &eFormat);
-        gluBuild2DMipmaps(GL_TEXTURE_2D, iComponents, iWidth, iHeight, eFormat, GL_UNSIGNED_BYTE, pBytes);
-        free(pBytes);
-        
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        // Its own texture, unless it goes in an atlas
+        textureRemaps[i][0] = textureRemaps[i][1] = 1.0f;
+        textureRemaps[i][2] = textureRemaps[i][3] = 0.0f;
+        if(bUseAtlases && atlasMembers[i] >= 0)
+            {
+            textureBindings[i] = atlasObjects[atlasMembers[i]];
+            continue;
+            }
+
+        // The ground tiles repeat, everything else is clamped
+        textureBindings[i] = textureObjects[i];
+        textureStreamer.Request(szTextureFiles[i], textureObjects[i], (i == GROUND_TEXTURE) ? GL_REPEAT : GL_CLAMP_TO_EDGE);
+        }
+
+    if(bUseAtlases)
+        {
+        // The gutters between the images are only good for a box filter, a
+        // wider one (or a 4x4 compressed block) reaches across them
+        GLuint nAtlasFlags = nMipFlags & ~(MIP_KAISER | MIP_COMPRESS);
+        textureStreamer.RequestCustom("sofa atlas", LoadAtlas, AtlasReady, (void *)&atlasIndices[SOFA_ATLAS],
+                                      atlasObjects[SOFA_ATLAS], GL_CLAMP_TO_EDGE, nAtlasFlags);
+        textureStreamer.RequestCustom("room atlas", LoadAtlas, AtlasReady, (void *)&atlasIndices[ROOM_ATLAS],
+                                      atlasObjects[ROOM_ATLAS], GL_CLAMP_TO_EDGE, nAtlasFlags);
         }
 
+    if(!bStreamTextures)
+        textureStreamer.Finish();
+
     }
 
 ////////////////////////////////////////////////////////////////////////
 // Do shutdown for the rendering context
 void ShutdownRC(void)
     {
+    // Nothing more arrives after this
+    textureStreamer.Stop();
+    jobScheduler.Stop();
+
+    CrowdFree(&sphereCrowd);
+    delete [] pSpheres;
+    pSpheres = NULL;
+    for(int i = 0; i < NUM_ATLASES; i++)
+        atlases[i].Free();
+
     // Delete the textures
     glDeleteTextures(NUM_TEXTURES, textureObjects);
+    glDeleteTextures(NUM_ATLASES, atlasObjects);
+
+    // And the cog meshes
+    for(int i = 0; i < nCogMeshes; i++)
+        delete cogMeshes[i].pMesh;
+    nCogMeshes = 0;
+    nNextCogMesh = 0;
+    FreeRetiredCogMeshes();
+    delete [] pRetiredCogMeshes;
+    pRetiredCogMeshes = NULL;
+    nMaxRetiredCogMeshes = 0;
+
+    // And the spheres and tori gltools has been keeping
+    gltFreePrimitiveCache();
+    sphereMesh.FreeGL();
+    profiler.FreeGL();
+    shadowMap.FreeGL();
     }
 
 
 ///////////////////////////////////////////////////////////
-// Draw the ground as a series of triangle strips
-void DrawGround(void)
+// Draw the ground as a series of triangle strips. Render queue
+// callback, there's only the one ground.
+void DrawGround(const void *pData, GLint iParam)
     {
     GLfloat fExtent = 20.0f;
     GLfloat fStep = 1.0f;
@@ -553,9 +1089,6 @@ void DrawGround(void)
 
     glPushMatrix();
     glTranslatef(0.0f, -1.5f, 0.0f);
-    glBindTexture(GL_TEXTURE_2D, textureObjects[GROUND_TEXTURE]);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
 
     for(iStrip = -fExtent; iStrip <= fExtent; iStrip += fStep)
         {
@@ -581,134 +1114,351 @@ void DrawGround(void)
     }
 
 ///////////////////////////////////////////////////////////////////////
-// Draw random inhabitants and the rotating torus/sphere duo
-void DrawInhabitants(GLint nShadow)
+// Everything that moves. The simulation steps this along at a fixed
+// rate (SIM_TIMESTEP) no matter how fast frames are being drawn, and each
+// frame draws somewhere between the last two steps. Used to be statics in
+// DrawInhabitants(), which moved things along on every draw, so the speed
+// depended on the frame rate (and the wandering cog, which moved on the
+// shadow pass too, went twice as fast as everything else).
+#define SIM_TIMESTEP        (1.0f / 60.0f)
+#define SIM_MAX_STEPS       10      // Don't try to catch up more than this per frame
+
+struct SCENESTATE
     {
-    static GLfloat yRot = 0.0f;         // Rotation angle for animation
-    GLint i;
+    float yRot;                     // Spinning sofa, cube and cogs
+    float x, y;                     // Wandering cog
+    bool isXUp, isYUp;
+    float yRotate;
+    };
 
-    if(nShadow == 0)
+SCENESTATE stateCurrent = { 0.0f, 0.0f, 0.0f, false, false, 0.0f };
+SCENESTATE statePrevious = stateCurrent;
+float fSimAccumulator = 0.0f;       // Time not yet simulated
+unsigned int nSimSteps = 0;         // Steps taken so far
+
+// Move everything along one step. The amounts are what used to happen
+// every frame, the wandering cog moving twice (once for each pass).
+void UpdateScene(SCENESTATE &state)
+    {
+    state.yRot += 0.5f;
+
+    for(int i = 0; i < 2; i++)
         {
-        yRot += 0.5f;
-        glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+        state.yRotate += 2.0f;
+        if (state.x <= -3.0f)
+            state.isXUp = true;
+        if (state.x >= 3.0f)
+            state.isXUp = false;
+        if (state.y <= -1.0f)
+            state.isYUp = true;
+        if (state.y >= 1.5f)
+            state.isYUp = false;
+        if (state.isXUp)
+            state.x += 0.01f;
+        else
+            state.x -= 0.01f;
+        if (state.isYUp)
+            state.y += 0.01f;
+        else
+            state.y -= 0.01f;
         }
-    else
-        glColor4f(0.00f, 0.00f, 0.00f, .6f);  // Shadow color
-  
-        
-    // Draw the randomly located spheres
-    /*glBindTexture(GL_TEXTURE_2D, textureObjects[SPHERE_TEXTURE]);
-    for(i = 0; i < NUM_SPHERES; i++)
-        {
-        glPushMatrix();
-        spheres[i].ApplyActorTransform();
-        gltDrawSphere(0.3f, 21, 11);
-        glPopMatrix();
-        }*/
+    }
 
-    glPushMatrix();
-        glTranslatef(0.0f, 0.0f, -2.5f);
-    
-        glPushMatrix();
-            glRotatef(-yRot * 2.0f, 0.0f, 1.0f, 0.0f);
-            glTranslatef(1.0f, 0.0f, 0.0f);
-            DrawCube(0.06f);
-        glPopMatrix();
-    
-        if(nShadow == 0)
-            {
-            // Torus alone will be specular
-            glMaterialfv(GL_FRONT, GL_SPECULAR, fBrightLight);
-            }
-        
-        glRotatef(yRot, 0.0f, 1.0f, 0.0f);
-        DrawSofa(0.1);
+// Run the simulation forward by fSeconds of real time, as however many
+// whole steps fit, then work out where things are for drawing, part way
+// between the last two steps.
+void AdvanceScene(float fSeconds, SCENESTATE &drawState)
+    {
+    fSimAccumulator += fSeconds;
 
-        glMaterialfv(GL_FRONT, GL_SPECULAR, fNoLight);
-    glPopMatrix();
+    // After a long stall (breakpoint, window drag) just drop the time,
+    // rather than spending ages catching up
+    if(fSimAccumulator > SIM_TIMESTEP * SIM_MAX_STEPS)
+        fSimAccumulator = SIM_TIMESTEP * SIM_MAX_STEPS;
 
-    glPushMatrix();
-        glTranslatef(-2.2f, 0.4f, -10.0f);
-        glRotatef(yRot, 0.0f, 0.0f, -1.0f);
-        glBindTexture(GL_TEXTURE_2D, textureObjects[IRON_TEXTURE]);
-        DrawCog(0.2, 0.5, 0.55, 0.05, 30);
-    glPopMatrix();
+    while(fSimAccumulator >= SIM_TIMESTEP)
+        {
+        statePrevious = stateCurrent;
+        UpdateScene(stateCurrent);
+        if(bCrowd)
+            jobScheduler.ParallelFor(MoveCrowdChunks, &sphereCrowd, sphereCrowd.nNumChunks, 1);
+        fSimAccumulator -= SIM_TIMESTEP;
+        nSimSteps++;
+        }
 
-    glPushMatrix();
-    glTranslatef(2.2f, 0.4f, -10.0f);
-    glRotatef(yRot, 0.0f, 0.0f, 1.0f);
-    glBindTexture(GL_TEXTURE_2D, textureObjects[IRON_TEXTURE]);
-    DrawCog(0.2, 0.5, 0.55, 0.05, 30);
-    glPopMatrix();
+    float fAlpha = fSimAccumulator / SIM_TIMESTEP;
+    drawState = stateCurrent;
+    drawState.yRot = statePrevious.yRot + (stateCurrent.yRot - statePrevious.yRot) * fAlpha;
+    drawState.x = statePrevious.x + (stateCurrent.x - statePrevious.x) * fAlpha;
+    drawState.y = statePrevious.y + (stateCurrent.y - statePrevious.y) * fAlpha;
+    drawState.yRotate = statePrevious.yRotate + (stateCurrent.yRotate - statePrevious.yRotate) * fAlpha;
+    }
 
-    glPushMatrix();
-    static float x = 0.0f;
-    static float y = 0.0f;
-    static bool isXUp = false;
-    static bool isYUp = false;
-    static float yRotate = 0.0f;
-    yRotate += 2.0f;
-    if (x <= -3.0f)
-        isXUp = true;
-    if (x >= 3.0f)
-        isXUp = false;
-    if (y <= -1.0f)
-        isYUp = true;
-    if (y >= 1.5f)
-        isYUp = false;
-    if (isXUp)
-        x += 0.01f;
+///////////////////////////////////////////////////////////////////////
+// glTranslatef() and glRotatef(), on a matrix of our own. The scene is
+// queued up with these, so building the draw list never touches the GL.
+void MatrixTranslate(M3DMatrix44f m, float x, float y, float z)
+    {
+    M3DMatrix44f mTranslate, mResult;
+    m3dTranslationMatrix44(mTranslate, x, y, z);
+    m3dMatrixMultiply44(mResult, m, mTranslate);
+    m3dCopyMatrix44(m, mResult);
+    }
+
+void MatrixRotate(M3DMatrix44f m, float fDegrees, float x, float y, float z)
+    {
+    M3DMatrix44f mRotate, mResult;
+    m3dRotationMatrix44(mRotate, float(m3dDegToRad(fDegrees)), x, y, z);
+    m3dMatrixMultiply44(mResult, m, mRotate);
+    m3dCopyMatrix44(m, mResult);
+    }
+
+///////////////////////////////////////////////////////////////////////
+// Queue up the random inhabitants and the rotating torus/sphere duo, in
+// one of the passes, under the view matrix mView. The planar shadow pass
+// is flat black and blended, mView has the shadow matrix in it. The shadow
+// map passes and the depth pre-pass are depth only.
+void SubmitInhabitants(GLuint nPass, const SCENESTATE &state, const M3DMatrix44f mView)
+    {
+    static const double cubeSize = 0.06;
+    static const double sofaSize = 0.1;
+    GLfloat yRot = state.yRot;          // Rotation angle for animation
+    RENDERSTATE drawState;
+    M3DMatrix44f mCenter, mModel;
+    int i;
+
+    drawState.nPass = nPass;
+    drawState.hShader = 0;
+    if(nPass < PASS_WORLD)
+        {
+        drawState.nFlags = RQ_DEPTH_TEST | RQ_DEPTH_ONLY;
+        drawState.fColor[0] = drawState.fColor[1] = drawState.fColor[2] = drawState.fColor[3] = 1.0f;
+        }
+    else if(nPass == PASS_SHADOWS)
+        {
+        drawState.nFlags = RQ_BLEND | RQ_STENCIL_TEST;
+        drawState.fColor[0] = drawState.fColor[1] = drawState.fColor[2] = 0.0f;
+        drawState.fColor[3] = 0.6f;     // Shadow color
+        }
     else
-        x -= 0.01f;
-    if (isYUp)
-        y += 0.01f;
+        {
+        drawState.nFlags = RQ_LIGHTING | RQ_TEXTURE | RQ_DEPTH_TEST;
+        if(bDepthPrepass)
+            drawState.nFlags |= RQ_DEPTH_LEQUAL;
+        drawState.fColor[0] = drawState.fColor[1] = drawState.fColor[2] = drawState.fColor[3] = 1.0f;
+        if(bShadowMaps)
+            drawState.hShader = shadowMap.GetProgram();
+        }
+  
+        
+    // Draw the randomly located spheres, all of them in one go. The ones
+    // the camera can't see may still cast shadows it can.
+    drawState.nTexture = textureBindings[SPHERE_TEXTURE];
+    if(nPass == PASS_DEPTH || nPass == PASS_INHABITANTS)
+        {
+        if(sphereCrowd.nNumVisible > 0)
+            renderQueue.Submit(drawState, mView, DrawSpheres, sphereCrowd.pDrawList, sphereCrowd.nNumVisible);
+        }
     else
-        y -= 0.01f;
-    glTranslatef(x, y, -8.5f);
-    glRotatef(yRotate, 0.0f, 0.0f, 1.0f);
-    glBindTexture(GL_TEXTURE_2D, textureObjects[IRON_TEXTURE]);
-    DrawCog(0.2, 0.4, 0.43, 0.05, 30);
-    glPopMatrix();
+        renderQueue.Submit(drawState, mView, DrawSpheres, pSpheres, nNumSpheres);
+
+    m3dCopyMatrix44(mCenter, mView);
+    MatrixTranslate(mCenter, 0.0f, 0.0f, -2.5f);
+
+    m3dCopyMatrix44(mModel, mCenter);
+    MatrixRotate(mModel, -yRot * 2.0f, 0.0f, 1.0f, 0.0f);
+    MatrixTranslate(mModel, 1.0f, 0.0f, 0.0f);
+    drawState.nTexture = textureBindings[CUBE_TEXTURE];
+    renderQueue.Submit(drawState, mModel, DrawCube, &cubeSize, 0);
+
+    // Sofa alone will be specular
+    RENDERSTATE sofaState = drawState;
+    if(nPass == PASS_INHABITANTS)
+        sofaState.nFlags |= RQ_SPECULAR;
+
+    MatrixRotate(mCenter, yRot, 0.0f, 1.0f, 0.0f);
+    for(i = 0; i < NUM_SOFA_PARTS; i++)
+        {
+        sofaState.nTexture = textureBindings[sofaTextures[i]];
+        renderQueue.Submit(sofaState, mCenter, DrawSofaPart, &sofaSize, i);
+        }
+
+    drawState.nTexture = textureBindings[IRON_TEXTURE];
+
+    m3dCopyMatrix44(mModel, mView);
+    MatrixTranslate(mModel, -2.2f, 0.4f, -10.0f);
+    MatrixRotate(mModel, yRot, 0.0f, 0.0f, -1.0f);
+    renderQueue.Submit(drawState, mModel, DrawCog, GetCogMesh(0.2, 0.5, 0.55, 0.05, 30), 0);
+
+    m3dCopyMatrix44(mModel, mView);
+    MatrixTranslate(mModel, 2.2f, 0.4f, -10.0f);
+    MatrixRotate(mModel, yRot, 0.0f, 0.0f, 1.0f);
+    renderQueue.Submit(drawState, mModel, DrawCog, GetCogMesh(0.2, 0.5, 0.55, 0.05, 30), 0);
+
+    m3dCopyMatrix44(mModel, mView);
+    MatrixTranslate(mModel, state.x, state.y, -8.5f);
+    MatrixRotate(mModel, state.yRotate, 0.0f, 0.0f, 1.0f);
+    renderQueue.Submit(drawState, mModel, DrawCog, GetCogMesh(0.2, 0.4, 0.43, 0.05, 30), 0);
+    }
+
+///////////////////////////////////////////////////////////////////////
+// The ground and the room, lit and textured or (for the depth pre-pass)
+// depth only, under the view matrix mView
+void SubmitWorld(GLuint nPass, const M3DMatrix44f mView)
+    {
+    RENDERSTATE drawState;
+    M3DMatrix44f mRoom;
+
+    drawState.nPass = nPass;
+    if(nPass == PASS_DEPTH)
+        {
+        drawState.hShader = 0;
+        drawState.nFlags = RQ_DEPTH_TEST | RQ_DEPTH_ONLY;
+        }
+    else
+        {
+        drawState.hShader = bShadowMaps ? shadowMap.GetProgram() : 0;
+        drawState.nFlags = RQ_LIGHTING | RQ_TEXTURE | RQ_DEPTH_TEST;
+        if(bDepthPrepass)
+            drawState.nFlags |= RQ_DEPTH_LEQUAL;
+        }
+    drawState.fColor[0] = drawState.fColor[1] = drawState.fColor[2] = drawState.fColor[3] = 1.0f;
+
+    drawState.nTexture = textureBindings[GROUND_TEXTURE];
+    renderQueue.Submit(drawState, mView, DrawGround, NULL, 0);
+
+    m3dCopyMatrix44(mRoom, mView);
+    MatrixTranslate(mRoom, 0.5f, -1.55f, -10.0f);
+    for(int i = 0; i < NUM_ROOM_QUADS; i++)
+        {
+        drawState.nTexture = textureBindings[roomQuads[i].iTexture];
+        renderQueue.Submit(drawState, mRoom, DrawRoomQuad, &roomQuads[i], 0);
+        }
     }
 
         
-// Called to draw scene
-void RenderScene(void)
+// Called to draw scene. Everything is queued up first, then drawn a pass
+// at a time, sorted by texture within each pass.
+void RenderScene(const SCENESTATE &state)
     {
+    M3DMatrix44f mCamera, mShadowView;
+    int i;
+
     // Clear the window with current clearing color
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+
+    // The view, worked out here rather than read back from the GL
+    frameCamera.GetCameraOrientation(mCamera);
+    MatrixTranslate(mCamera, -frameCamera.GetOriginX(), -frameCamera.GetOriginY(), -frameCamera.GetOriginZ());
+
+    // Which spheres are in view. The frustum points down its -Z, the same
+    // turn around GLFrustum::Transform() makes.
+    M3DMatrix44f mFrustum;
+    frameCamera.GetMatrix(mFrustum);
+    for(i = 0; i < 3; i++)
+        {
+        mFrustum[i] = -mFrustum[i];
+        mFrustum[8 + i] = -mFrustum[8 + i];
+        }
+    viewFrustum.Transform(mFrustum);
+    CullCrowd(&sphereCrowd, &jobScheduler);
         
     glPushMatrix();
-        frameCamera.ApplyCameraTransform();
+        glLoadMatrixf(mCamera);
         // Position light before any other transformations
         glLightfv(GL_LIGHT0, GL_POSITION, fLightPos);
         
-        // Draw the ground
-        glColor3f(1.0f, 1.0f, 1.0f);
-        DrawGround();
-        DrawRoom();
+        profiler.BeginZone(iZoneQueue);
+        if(bShadowMaps)
+            {
+            // The casters once for each cascade, from the light
+            shadowMap.Fit(mCamera, CAMERA_FOV, GLfloat(w1) / GLfloat(h1), CAMERA_NEAR, CAMERA_FAR, fLightPos,
+                          vSceneMin, vSceneMax);
+            for(i = 0; i < SHADOW_CASCADES; i++)
+                SubmitInhabitants(PASS_SHADOW_MAP + i, state, shadowMap.GetLightView());
+            }
+        if(bDepthPrepass)
+            {
+            SubmitWorld(PASS_DEPTH, mCamera);
+            SubmitInhabitants(PASS_DEPTH, state, mCamera);
+            }
+        SubmitWorld(PASS_WORLD, mCamera);
+        if(!bShadowMaps)
+            {
+            m3dMatrixMultiply44(mShadowView, mCamera, mShadowMatrix);
+            SubmitInhabitants(PASS_SHADOWS, state, mShadowView);
+            }
+        SubmitInhabitants(PASS_INHABITANTS, state, mCamera);
+        profiler.EndZone(iZoneQueue);
+
+        // Shadow maps before anything that looks them up
+        if(bShadowMaps)
+            {
+            profiler.BeginZone(iZoneShadows);
+            shadowMap.Begin();
+            for(i = 0; i < SHADOW_CASCADES; i++)
+                {
+                shadowMap.SetCascade(i);
+                renderQueue.Flush(PASS_SHADOW_MAP + i);
+                }
+            shadowMap.End();
+            shadowMap.Bind();
+            profiler.EndZone(iZoneShadows);
+            }
+
+        if(bDepthPrepass)
+            {
+            profiler.BeginZone(iZoneDepth);
+            renderQueue.Flush(PASS_DEPTH);
+            profiler.EndZone(iZoneDepth);
+            }
+
+        profiler.BeginZone(iZoneWorld);
+        renderQueue.Flush(PASS_WORLD);
+        profiler.EndZone(iZoneWorld);
         
-        // Draw shadows first
-        glDisable(GL_DEPTH_TEST);
-        glDisable(GL_LIGHTING);
-        glDisable(GL_TEXTURE_2D);
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glEnable(GL_STENCIL_TEST);
-        glPushMatrix();
-            glMultMatrixf(mShadowMatrix);
-            DrawInhabitants(1);
-        glPopMatrix();
-        glDisable(GL_STENCIL_TEST);
-        glDisable(GL_BLEND);
-        glEnable(GL_LIGHTING);
-        glEnable(GL_TEXTURE_2D);
-        glEnable(GL_DEPTH_TEST);
+        // Planar shadows go over the world, then the inhabitants over the top
+        if(!bShadowMaps)
+            {
+            profiler.BeginZone(iZoneShadows);
+            renderQueue.Flush(PASS_SHADOWS);
+            profiler.EndZone(iZoneShadows);
+            }
         
-        // Draw inhabitants normally
-        DrawInhabitants(0);
+        profiler.BeginZone(iZoneInhabitants);
+        renderQueue.Flush(PASS_INHABITANTS);
+        profiler.EndZone(iZoneInhabitants);
 
     glPopMatrix();
+
+    // The queue is empty, so no one is left pointing at these
+    FreeRetiredCogMeshes();
+    }
+
+///////////////////////////////////////////////////////////////////////
+// Called by GLUT to draw a frame. The simulation catches up with the
+// real time that has passed, then the scene is drawn.
+CStopWatch frameClock;
+int nFrameInterval = -1;            // Milliseconds between frames, 0 for as fast as we can
+#define FRAME_WAIT          3       // With no rate asked for, wait this long after each frame
+
+void DrawFrame(void)
+    {
+    SCENESTATE drawState;
+    float fSeconds = frameClock.GetElapsedSeconds();
+    frameClock.Reset();
+
+    profiler.BeginFrame();
+    UpdateTextures();
+
+    profiler.BeginZone(iZoneUpdate);
+    AdvanceScene(fSeconds, drawState);
+    profiler.EndZone(iZoneUpdate);
+
+    RenderScene(drawState);
+
+    // The swap waits for the vertical blank, don't count that
+    profiler.EndFrame();
         
     // Do the buffer Swap
     glutSwapBuffers();
@@ -742,7 +1492,18 @@ void TimerFunction(int value)
     {
     // Redraw the scene with new coordinates
     glutPostRedisplay();
-    glutTimerFunc(3,TimerFunction, 1);
+
+    // As it always was, unless asked for a rate
+    if(nFrameInterval < 0)
+        {
+        glutTimerFunc(FRAME_WAIT, TimerFunction, 1);
+        return;
+        }
+
+    // Take the time the last frame took out of the wait, so the frame rate
+    // doesn't drop as the frames get harder to draw
+    int nElapsed = int(frameClock.GetElapsedSeconds() * 1000.0f);
+    glutTimerFunc((nElapsed < nFrameInterval) ? nFrameInterval - nElapsed : 0, TimerFunction, 1);
     }
 
 void ChangeSize(int w, int h)
@@ -759,29 +1520,2609 @@ void ChangeSize(int w, int h)
     glViewport(0, 0, w, h);
         
     fAspect = (GLfloat)w / (GLfloat)h;
+    viewFrustum.SetPerspective(CAMERA_FOV, fAspect, CAMERA_NEAR, CAMERA_FAR);
 
     // Reset the coordinate system before modifyingMaps
     glMatrixMode(GL_PROJECTION);
     glLoadIdentity();
 	
     // Set the clipping volume
-    gluPerspective(35.0f, fAspect, 1.0f, 50.0f);
+    gluPerspective(CAMERA_FOV, fAspect, CAMERA_NEAR, CAMERA_FAR);
         
     glMatrixMode(GL_MODELVIEW);
     glLoadIdentity();    
     }
 
-int main(int argc, char* argv[])
+///////////////////////////////////////////////////////////////////////////////
+// Headless mode, for running benchmarks and regression tests on machines
+// with no display (or no GPU). The scene is drawn a fixed number of times
+// into a framebuffer object, with the camera following a fixed path and
+// time stepping a fixed amount per frame, so every run draws exactly the
+// same frames. Run it with
+//
+//      sphereworld -headless <frames> [-size <width> <height>] [-fps <rate>]
+//                  [-timings <file.csv>] [-profile <file.csv|file.json>]
+//                  [-dump <prefix>]
+//
+// -fps sets how much time each frame stands for (60 by default), the
+// simulation still steps at SIM_TIMESTEP. -timings writes how long each
+// frame took, -profile writes the profiler's percentiles for each part of
+// the frame (JSON if the name ends in .json, otherwise CSV), and -dump saves
+// every frame as <prefix>0000.tga, <prefix>0001.tga...
+//
+// Without -headless, -fps caps the frame rate of the window, as does
+// -rate <fps>. -rate 0 draws as fast as it can (a core stays busy).
+float fHeadlessTimestep = 1.0f / 60.0f;
+
+GLuint headlessFBO = 0;
+GLuint headlessBuffers[2] = { 0, 0 };   // Color, depth/stencil
+
+#if defined(linux) && defined(HEADLESS_EGL)
+EGLDisplay eglDisplay = EGL_NO_DISPLAY;
+EGLContext eglContext = EGL_NO_CONTEXT;
+#endif
+
+// Get a rendering context with no window showing. Returns false on failure.
+bool CreateHeadlessContext(int *pArgc, char *argv[])
+    {
+#if defined(linux) && defined(HEADLESS_EGL)
+    EGLint configAttribs[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig eglConfig;
+    EGLint nConfigs;
+
+    eglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if(eglDisplay == EGL_NO_DISPLAY || !eglInitialize(eglDisplay, NULL, NULL))
+        return false;
+
+    // We want the full compatibility profile, not GL ES
+    eglBindAPI(EGL_OPENGL_API);
+    if(!eglChooseConfig(eglDisplay, configAttribs, &eglConfig, 1, &nConfigs) || nConfigs == 0)
+        return false;
+
+    eglContext = eglCreateContext(eglDisplay, eglConfig, EGL_NO_CONTEXT, NULL);
+    if(eglContext == EGL_NO_CONTEXT)
+        return false;
+
+    // No surface at all, everything goes to the framebuffer object
+    return eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, eglContext) == EGL_TRUE;
+#else
+    glutInit(pArgc, argv);
+    glutInitDisplayMode(GLUT_RGB | GLUT_DEPTH | GLUT_STENCIL);
+    glutInitWindowSize(64, 64);
+    glutCreateWindow("OpenGL SphereWorld Demo (headless)");
+    glutHideWindow();
+    return true;
+#endif
+    }
+
+void DestroyHeadlessContext(void)
+    {
+#if defined(linux) && defined(HEADLESS_EGL)
+    eglMakeCurrent(eglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(eglDisplay, eglContext);
+    eglTerminate(eglDisplay);
+#endif
+    }
+
+// Make the offscreen framebuffer and draw into it from now on. The scene
+// needs a stencil buffer for the shadows, so ask for packed depth/stencil
+// if we can get it. Returns false if there are no framebuffer objects.
+bool CreateHeadlessBuffer(int w, int h)
+    {
+    if(!GLEE_EXT_framebuffer_object)
+        return false;
+
+    glGenFramebuffersEXT(1, &headlessFBO);
+    glGenRenderbuffersEXT(2, headlessBuffers);
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, headlessFBO);
+
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, headlessBuffers[0]);
+    glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_RGBA8, w, h);
+    glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_RENDERBUFFER_EXT, headlessBuffers[0]);
+
+    glBindRenderbufferEXT(GL_RENDERBUFFER_EXT, headlessBuffers[1]);
+    if(GLEE_EXT_packed_depth_stencil)
+        {
+        glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH24_STENCIL8_EXT, w, h);
+        glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, headlessBuffers[1]);
+        glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_STENCIL_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, headlessBuffers[1]);
+        }
+    else
+        {
+        // Shadows will double up where they overlap, but it will run
+        glRenderbufferStorageEXT(GL_RENDERBUFFER_EXT, GL_DEPTH_COMPONENT24, w, h);
+        glFramebufferRenderbufferEXT(GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, headlessBuffers[1]);
+        }
+
+    glDrawBuffer(GL_COLOR_ATTACHMENT0_EXT);
+    glReadBuffer(GL_COLOR_ATTACHMENT0_EXT);
+
+    return glCheckFramebufferStatusEXT(GL_FRAMEBUFFER_EXT) == GL_FRAMEBUFFER_COMPLETE_EXT;
+    }
+
+void DestroyHeadlessBuffer(void)
+    {
+    glBindFramebufferEXT(GL_FRAMEBUFFER_EXT, 0);
+    glDeleteFramebuffersEXT(1, &headlessFBO);
+    glDeleteRenderbuffersEXT(2, headlessBuffers);
+    }
+
+// The fixed camera path. Drift from side to side across the room while
+// slowly moving in and back out, turning the head a little as we go.
+void SetCameraPath(float fTime)
+    {
+    float fYaw = 0.3f * float(sin(fTime * 0.4f));
+
+    frameCamera.SetOrigin(1.5f * float(sin(fTime * 0.5f)), 0.0f, -1.5f * (1.0f - float(cos(fTime * 0.25f))));
+    frameCamera.SetForwardVector(-float(sin(fYaw)), 0.0f, -float(cos(fYaw)));
+    frameCamera.SetUpVector(0.0f, 1.0f, 0.0f);
+    }
+
+CStopWatch startupClock;
+
+// With -overdraw, the stencil buffer holds how many times each pixel was
+// drawn this frame. Add it up.
+void CountOverdraw(void)
+    {
+    GLint nPixels = w1 * h1;
+    GLubyte *pCounts = new GLubyte[nPixels];
+
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, w1, h1, GL_STENCIL_INDEX, GL_UNSIGNED_BYTE, pCounts);
+    for(GLint i = 0; i < nPixels; i++)
+        {
+        dOverdrawFragments += pCounts[i];
+        if(pCounts[i] != 0)
+            dOverdrawPixels += 1.0;
+        }
+    dOverdrawScreen += nPixels;
+
+    delete [] pCounts;
+    }
+
+// Draw nFrames frames as fast as possible. The frame time includes a
+// glFinish(), so it is the time the GL really took, not just how long it
+// took to queue the commands up. Returns the program's exit code.
+int RunHeadless(int nFrames, const char *szTimings, const char *szDumpPrefix)
+    {
+    CStopWatch frameTimer;
+    SCENESTATE drawState;
+    FILE *pTimings = NULL;
+    char szFileName[512];
+    float fTotal = 0.0f;
+    RENDERSTATS renderStats;
+
+    renderQueue.ResetStats();
+
+    if(szTimings != NULL)
+        {
+        pTimings = fopen(szTimings, "w");
+        if(pTimings == NULL)
+            {
+            fprintf(stderr, "Can't write %s\n", szTimings);
+            return 1;
+            }
+        fprintf(pTimings, "frame,time,ms\n");
+        }
+
+    for(int iFrame = 0; iFrame < nFrames; iFrame++)
+        {
+        float fTime = iFrame * fHeadlessTimestep;
+        SetCameraPath(fTime);
+
+        frameTimer.Reset();
+        profiler.BeginFrame();
+        UpdateTextures();
+        profiler.BeginZone(iZoneUpdate);
+        AdvanceScene(fHeadlessTimestep, drawState);
+        profiler.EndZone(iZoneUpdate);
+        RenderScene(drawState);
+        profiler.EndFrame();
+        glFinish();
+        float fSeconds = frameTimer.GetElapsedSeconds();
+        fTotal += fSeconds;
+        if(bCountOverdraw)
+            CountOverdraw();
+        if(iFrame == 0)
+            printf("First frame done %.3f ms after setup started\n", startupClock.GetElapsedSeconds() * 1000.0f);
+
+        if(pTimings != NULL)
+            fprintf(pTimings, "%d,%.4f,%.3f\n", iFrame, fTime, fSeconds * 1000.0f);
+
+        if(szDumpPrefix != NULL)
+            {
+            sprintf(szFileName, "%s%04d.tga", szDumpPrefix, iFrame);
+            if(gltWriteTGA(szFileName) == 0)
+                fprintf(stderr, "Can't write %s\n", szFileName);
+            }
+        }
+
+    if(pTimings != NULL)
+        fclose(pTimings);
+
+    printf("%d frames, %.3f ms per frame\n", nFrames, (nFrames > 0) ? fTotal * 1000.0f / nFrames : 0.0f);
+
+    // What the render queue saved
+    renderQueue.GetStats(&renderStats);
+    if(nFrames > 0)
+        printf("Per frame: %u draws, %u texture binds, %u shader binds, %u state changes, %u skipped\n",
+               renderStats.nDraws / nFrames, renderStats.nTextureBinds / nFrames, renderStats.nShaderBinds / nFrames,
+               renderStats.nStateChanges / nFrames, renderStats.nSkipped / nFrames);
+
+    // Anything drawn with gltDrawSphere() or gltDrawTorus()
+    GLuint nPrimitiveHits, nPrimitiveMisses;
+    gltGetPrimitiveCacheStats(&nPrimitiveHits, &nPrimitiveMisses);
+    printf("Primitive cache: %u hits, %u misses\n", nPrimitiveHits, nPrimitiveMisses);
+
+    // One means every pixel that was drawn at all was drawn exactly once
+    if(bCountOverdraw && dOverdrawPixels > 0.0)
+        printf("Overdraw: %.3f fragments per pixel drawn, %.3f per pixel on screen\n",
+               dOverdrawFragments / dOverdrawPixels, dOverdrawFragments / dOverdrawScreen);
+    return 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Instancing benchmark and check. Draws a crowd of nActors spheres three
+// ways: CInstancedMesh's single draw call, its CPU fallback, and the old
+// push/ApplyActorTransform/draw for each one. Prints the time per frame
+// for each, and how many bytes of each picture differ (by more than a
+// little rounding) from the one drawn the old way. Run with
+//
+//      sphereworld -instbench <actors> [-size <width> <height>]
+#define INSTBENCH_FRAMES    10
+#define INSTBENCH_PER_ACTOR 2       // The third way, one draw per actor
+
+int RunInstanceBenchmark(int nActors, int nWidth, int nHeight)
+    {
+    static const char *szNames[3] = { "instanced", "CPU batches", "one draw per actor" };
+    GLFrame *pActors = new GLFrame[nActors];
+    CInstancedMesh meshes[2];
+    GLint nBytes = nWidth * nHeight * 4;
+    GLubyte *pImages[3];
+    CStopWatch timer;
+    int i, iWay;
+
+    // Spread out in a block in front of the camera, facing every which way
+    srand(1);
+    for(i = 0; i < nActors; i++)
+        {
+        pActors[i].SetOrigin(float(rand() % 600 - 300) * 0.1f, float(rand() % 300 - 150) * 0.1f,
+                             -20.0f - float(rand() % 800) * 0.1f);
+        pActors[i].RotateLocalY(float(rand() % 628) * 0.01f);
+        }
+
+    BuildSphere(&meshes[0], 0.3f, 21, 11);
+    BuildSphere(&meshes[1], 0.3f, 21, 11);
+    meshes[1].ForceFallback(true);
+
+    glViewport(0, 0, nWidth, nHeight);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    gluPerspective(CAMERA_FOV, GLfloat(nWidth) / GLfloat(nHeight), CAMERA_NEAR, 200.0f);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+
+    glClearColor(fLowLight[0], fLowLight[1], fLowLight[2], fLowLight[3]);
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_CULL_FACE);
+    glLightModelfv(GL_LIGHT_MODEL_AMBIENT, fNoLight);
+    glLightfv(GL_LIGHT0, GL_AMBIENT, fLowLight);
+    glLightfv(GL_LIGHT0, GL_DIFFUSE, fBrightLight);
+    glLightfv(GL_LIGHT0, GL_POSITION, fLightPos);
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);
+    glEnable(GL_COLOR_MATERIAL);
+    glColorMaterial(GL_FRONT, GL_AMBIENT_AND_DIFFUSE);
+    glColor3ub(200, 160, 60);
+
+    printf("%d actors\n", nActors);
+    printf("%-20s %10s\n", "", "ms/frame");
+
+    for(iWay = 0; iWay < 3; iWay++)
+        {
+        // One frame to set everything up and keep, then the timed ones
+        for(int iFrame = 0; iFrame <= INSTBENCH_FRAMES; iFrame++)
+            {
+            if(iFrame == 1)
+                {
+                pImages[iWay] = new GLubyte[nBytes];
+                glPixelStorei(GL_PACK_ALIGNMENT, 1);
+                glReadPixels(0, 0, nWidth, nHeight, GL_RGBA, GL_UNSIGNED_BYTE, pImages[iWay]);
+                timer.Reset();
+                }
+
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            if(iWay == INSTBENCH_PER_ACTOR)
+                {
+                glEnableClientState(GL_VERTEX_ARRAY);
+                glEnableClientState(GL_NORMAL_ARRAY);
+                glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+                for(i = 0; i < nActors; i++)
+                    {
+                    glPushMatrix();
+                        pActors[i].ApplyActorTransform();
+                        meshes[0].Draw();
+                    glPopMatrix();
+                    }
+                glDisableClientState(GL_VERTEX_ARRAY);
+                glDisableClientState(GL_NORMAL_ARRAY);
+                glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+                }
+            else
+                meshes[iWay].DrawInstances(pActors, nActors);
+            glFinish();
+            }
+        double dMilliseconds = timer.GetElapsedSeconds() * 1000.0 / INSTBENCH_FRAMES;
+
+        printf("%-20s %10.2f\n", szNames[iWay], dMilliseconds);
+        }
+
+    // The program is only made on the first draw
+    if(!meshes[0].IsHardwareInstanced())
+        printf("No hardware instancing, the first two were both the CPU path\n");
+
+    // Against the old way
+    int nResult = 0;
+    for(iWay = 0; iWay < INSTBENCH_PER_ACTOR; iWay++)
+        {
+        GLint nDiffer = 0;
+        for(i = 0; i < nBytes; i++)
+            if(abs(int(pImages[iWay][i]) - int(pImages[INSTBENCH_PER_ACTOR][i])) > 2)
+                nDiffer++;
+
+        printf("%-20s %d of %d bytes differ\n", szNames[iWay], nDiffer, nBytes);
+        if(nDiffer > nBytes / 1000)
+            nResult = 1;
+        }
+
+    if(glGetError() != GL_NO_ERROR)
+        {
+        printf("GL error\n");
+        nResult = 1;
+        }
+
+    meshes[0].FreeGL();
+    meshes[1].FreeGL();
+    for(iWay = 0; iWay < 3; iWay++)
+        delete [] pImages[iWay];
+    delete [] pActors;
+    return nResult;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Primitive cache check. gltDrawSphere() and gltDrawTorus() keep their
+// meshes in buffer objects (see gltGetPrimitive() in gltools.cpp). Drawing
+// a shape again has to be a hit, and drawing more different shapes than
+// GLT_PRIMITIVE_CACHE_SIZE has to throw out the one used longest ago, so
+// going back to it is a miss. The cached meshes also have to be made of the
+// same triangles as the triangle strips they replaced, which are kept here
+// to compare against. GL's feedback mode hands back every triangle that
+// would be drawn, once with the texture coordinates and once with the
+// normals (through GL_NORMAL_MAP texture generation), and both lists have
+// to match, in any order. Returns 1 if anything doesn't.
+//
+//      sphereworld -primtest
+//
+#define PRIMTEST_FEEDBACK   11      // Floats per vertex from GL_3D_COLOR_TEXTURE
+#define PRIMTEST_TOLERANCE  0.001f
+
+struct PRIMTEST_SHAPE
+    {
+    const char *szName;
+    bool bTorus;
+    GLfloat f0, f1;
+    GLint i0, i1;
+    };
+
+// One triangle from the feedback buffer, window position and texture
+// coordinates of each corner
+typedef GLfloat PRIMTEST_TRIANGLE[3][6];
+
+// The old gltDrawSphere()
+void PrimTestStripSphere(GLfloat fRadius, GLint iSlices, GLint iStacks)
+    {
+    GLfloat drho = (GLfloat)(3.141592653589) / (GLfloat) iStacks;
+    GLfloat dtheta = 2.0f * (GLfloat)(3.141592653589) / (GLfloat) iSlices;
+    GLfloat ds = 1.0f / (GLfloat) iSlices;
+    GLfloat dt = 1.0f / (GLfloat) iStacks;
+    GLfloat t = 1.0f;
+    GLfloat s = 0.0f;
+
+    for(GLint i = 0; i < iStacks; i++)
+        {
+        GLfloat rho = (GLfloat)i * drho;
+        GLfloat srho = (GLfloat)(sin(rho));
+        GLfloat crho = (GLfloat)(cos(rho));
+        GLfloat srhodrho = (GLfloat)(sin(rho + drho));
+        GLfloat crhodrho = (GLfloat)(cos(rho + drho));
+
+        glBegin(GL_TRIANGLE_STRIP);
+        s = 0.0f;
+        for(GLint j = 0; j <= iSlices; j++)
+            {
+            GLfloat theta = (j == iSlices) ? 0.0f : j * dtheta;
+            GLfloat stheta = (GLfloat)(-sin(theta));
+            GLfloat ctheta = (GLfloat)(cos(theta));
+
+            GLfloat x = stheta * srho;
+            GLfloat y = ctheta * srho;
+            GLfloat z = crho;
+            glTexCoord2f(s, t);
+            glNormal3f(x, y, z);
+            glVertex3f(x * fRadius, y * fRadius, z * fRadius);
+
+            x = stheta * srhodrho;
+            y = ctheta * srhodrho;
+            z = crhodrho;
+            glTexCoord2f(s, t - dt);
+            s += ds;
+            glNormal3f(x, y, z);
+            glVertex3f(x * fRadius, y * fRadius, z * fRadius);
+            }
+        glEnd();
+
+        t -= dt;
+        }
+    }
+
+// The old gltDrawTorus()
+void PrimTestStripTorus(GLfloat majorRadius, GLfloat minorRadius, GLint numMajor, GLint numMinor)
+    {
+    M3DVector3f vNormal;
+    double majorStep = 2.0f*M3D_PI / numMajor;
+    double minorStep = 2.0f*M3D_PI / numMinor;
+
+    for(GLint i = 0; i < numMajor; i++)
+        {
+        double a0 = i * majorStep;
+        double a1 = a0 + majorStep;
+        GLfloat x0 = (GLfloat) cos(a0);
+        GLfloat y0 = (GLfloat) sin(a0);
+        GLfloat x1 = (GLfloat) cos(a1);
+        GLfloat y1 = (GLfloat) sin(a1);
+
+        glBegin(GL_TRIANGLE_STRIP);
+        for(GLint j = 0; j <= numMinor; j++)
+            {
+            double b = j * minorStep;
+            GLfloat c = (GLfloat) cos(b);
+            GLfloat r = minorRadius * c + majorRadius;
+            GLfloat z = minorRadius * (GLfloat) sin(b);
+
+            glTexCoord2f((float)(i)/(float)(numMajor), (float)(j)/(float)(numMinor));
+            vNormal[0] = x0*c;
+            vNormal[1] = y0*c;
+            vNormal[2] = z/minorRadius;
+            m3dNormalizeVector(vNormal);
+            glNormal3fv(vNormal);
+            glVertex3f(x0*r, y0*r, z);
+
+            glTexCoord2f((float)(i+1)/(float)(numMajor), (float)(j)/(float)(numMinor));
+            vNormal[0] = x1*c;
+            vNormal[1] = y1*c;
+            vNormal[2] = z/minorRadius;
+            m3dNormalizeVector(vNormal);
+            glNormal3fv(vNormal);
+            glVertex3f(x1*r, y1*r, z);
+            }
+        glEnd();
+        }
+    }
+
+// Draw the shape in feedback mode, and collect the triangles that aren't
+// just lines or points (the poles of a sphere make some of those). Each
+// one is turned so its lowest corner comes first, which keeps the winding.
+// Returns how many there were, or -1 if the buffer wasn't big enough.
+int PrimTestFeedback(const PRIMTEST_SHAPE &shape, bool bStrips, GLfloat *pFeedback, GLint nFeedbackSize,
+                     PRIMTEST_TRIANGLE *pTriangles)
+    {
+    glFeedbackBuffer(nFeedbackSize, GL_3D_COLOR_TEXTURE, pFeedback);
+    glRenderMode(GL_FEEDBACK);
+    if(shape.bTorus)
+        {
+        if(bStrips)
+            PrimTestStripTorus(shape.f0, shape.f1, shape.i0, shape.i1);
+        else
+            gltDrawTorus(shape.f0, shape.f1, shape.i0, shape.i1);
+        }
+    else
+        {
+        if(bStrips)
+            PrimTestStripSphere(shape.f0, shape.i0, shape.i1);
+        else
+            gltDrawSphere(shape.f0, shape.i0, shape.i1);
+        }
+    GLint nValues = glRenderMode(GL_RENDER);
+    if(nValues < 0)
+        return -1;
+
+    int nTriangles = 0;
+    GLint i = 0;
+    while(i < nValues)
+        {
+        GLint nToken = GLint(pFeedback[i++]);
+        if(nToken != GL_POLYGON_TOKEN)
+            {
+            // Nothing else should come out, but skip it if it does
+            i += (nToken == GL_PASS_THROUGH_TOKEN) ? 1 : PRIMTEST_FEEDBACK;
+            continue;
+            }
+
+        GLint nCorners = GLint(pFeedback[i++]);
+        const GLfloat *pCorners = &pFeedback[i];
+        i += nCorners * PRIMTEST_FEEDBACK;
+        if(nCorners != 3)
+            continue;
+
+        float fArea = (pCorners[11] - pCorners[0]) * (pCorners[23] - pCorners[1]) -
+                      (pCorners[22] - pCorners[0]) * (pCorners[12] - pCorners[1]);
+        if(float(fabs(fArea)) < 0.01f)
+            continue;
+
+        int iFirst = 0;
+        for(int k = 1; k < 3; k++)
+            {
+            const GLfloat *a = &pCorners[k * PRIMTEST_FEEDBACK];
+            const GLfloat *b = &pCorners[iFirst * PRIMTEST_FEEDBACK];
+            if(a[0] < b[0] || (a[0] == b[0] && a[1] < b[1]))
+                iFirst = k;
+            }
+
+        for(int k = 0; k < 3; k++)
+            {
+            const GLfloat *pCorner = &pCorners[((iFirst + k) % 3) * PRIMTEST_FEEDBACK];
+            for(int j = 0; j < 3; j++)
+                {
+                pTriangles[nTriangles][k][j] = pCorner[j];          // x, y, z
+                pTriangles[nTriangles][k][3 + j] = pCorner[7 + j];  // s, t, r
+                }
+            }
+        nTriangles++;
+        }
+
+    return nTriangles;
+    }
+
+// Is every triangle in one list in the other? Same count, so one each way
+// is enough.
+bool PrimTestSameTriangles(const PRIMTEST_TRIANGLE *pFirst, const PRIMTEST_TRIANGLE *pSecond, int nTriangles)
     {
+    bool *pUsed = new bool[nTriangles];
+    bool bSame = true;
+    memset(pUsed, 0, sizeof(bool) * nTriangles);
+
+    for(int i = 0; i < nTriangles && bSame; i++)
+        {
+        bSame = false;
+        for(int j = 0; j < nTriangles && !bSame; j++)
+            {
+            if(pUsed[j])
+                continue;
+
+            bool bMatch = true;
+            const GLfloat *a = &pFirst[i][0][0];
+            const GLfloat *b = &pSecond[j][0][0];
+            for(int k = 0; k < 18 && bMatch; k++)
+                bMatch = m3dCloseEnough(a[k], b[k], PRIMTEST_TOLERANCE);
+
+            if(bMatch)
+                {
+                pUsed[j] = true;
+                bSame = true;
+                }
+            }
+        }
+
+    delete [] pUsed;
+    return bSame;
+    }
+
+int RunPrimitiveTest(void)
+    {
+    static const PRIMTEST_SHAPE shapes[] = { { "Sphere", false, 1.0f, 0.0f, 24, 12 },
+                                             { "Small sphere", false, 0.75f, 0.0f, 5, 3 },
+                                             { "Torus", true, 0.85f, 0.3f, 40, 20 } };
+    int nFailures = 0;
+    GLuint nHits, nMisses;
+
+    // Hits and misses
+    gltFreePrimitiveCache();
+    gltDrawSphere(1.0f, 24, 12);
+    for(int i = 0; i < 3; i++)
+        gltDrawSphere(1.0f, 24, 12);
+    gltGetPrimitiveCacheStats(&nHits, &nMisses);
+    bool bPassed = (nHits == 3 && nMisses == 1);
+    printf("%-36s %u hits, %u misses  %s\n", "Same sphere 4 times", nHits, nMisses, bPassed ? "ok" : "FAILED");
+    nFailures += bPassed ? 0 : 1;
+
+    // Enough others to push the first one out, it's the oldest
+    for(int i = 0; i < GLT_PRIMITIVE_CACHE_SIZE; i++)
+        gltDrawTorus(1.0f, 0.25f, 8 + i, 8);
+    gltDrawSphere(1.0f, 24, 12);
+    gltDrawTorus(1.0f, 0.25f, 8 + GLT_PRIMITIVE_CACHE_SIZE - 1, 8);
+    gltGetPrimitiveCacheStats(&nHits, &nMisses);
+    bPassed = (nHits == 4 && nMisses == GLT_PRIMITIVE_CACHE_SIZE + 2);
+    printf("%-36s %u hits, %u misses  %s\n", "Past GLT_PRIMITIVE_CACHE_SIZE", nHits, nMisses, bPassed ? "ok" : "FAILED");
+    nFailures += bPassed ? 0 : 1;
+
+    // Triangles, in window coordinates. Nothing is culled.
+    glViewport(0, 0, 256, 256);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(-1.5, 1.5, -1.5, 1.5, -1.5, 1.5);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glRotatef(30.0f, 1.0f, 0.5f, 0.0f);
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_LIGHTING);
+
+    // Some drivers only hand back texture coordinates (generated ones
+    // anyway) for a unit with a complete texture on it
+    GLuint nTexture;
+    GLubyte bWhite[4] = { 255, 255, 255, 255 };
+    glGenTextures(1, &nTexture);
+    glBindTexture(GL_TEXTURE_2D, nTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, 1, 1, 0, GL_RGBA, GL_UNSIGNED_BYTE, bWhite);
+    glEnable(GL_TEXTURE_2D);
+
+    for(int iShape = 0; iShape < int(sizeof(shapes) / sizeof(shapes[0])); iShape++)
+        {
+        const PRIMTEST_SHAPE &shape = shapes[iShape];
+        int nMaxTriangles = 2 * (shape.i0 + 1) * (shape.i1 + 1);
+        GLint nFeedbackSize = nMaxTriangles * (2 + 3 * PRIMTEST_FEEDBACK);
+        GLfloat *pFeedback = new GLfloat[nFeedbackSize];
+        PRIMTEST_TRIANGLE *pStrips = new PRIMTEST_TRIANGLE[nMaxTriangles];
+        PRIMTEST_TRIANGLE *pCached = new PRIMTEST_TRIANGLE[nMaxTriangles];
+
+        // Texture coordinates as given, then the normals in their place
+        for(int iPass = 0; iPass < 2; iPass++)
+            {
+            if(iPass == 1)
+                {
+                glTexGeni(GL_S, GL_TEXTURE_GEN_MODE, GL_NORMAL_MAP);
+                glTexGeni(GL_T, GL_TEXTURE_GEN_MODE, GL_NORMAL_MAP);
+                glTexGeni(GL_R, GL_TEXTURE_GEN_MODE, GL_NORMAL_MAP);
+                glEnable(GL_TEXTURE_GEN_S);
+                glEnable(GL_TEXTURE_GEN_T);
+                glEnable(GL_TEXTURE_GEN_R);
+                }
+
+            int nStrips = PrimTestFeedback(shape, true, pFeedback, nFeedbackSize, pStrips);
+            int nCached = PrimTestFeedback(shape, false, pFeedback, nFeedbackSize, pCached);
+            bPassed = (nStrips > 0 && nStrips == nCached && PrimTestSameTriangles(pStrips, pCached, nStrips));
+
+            char szName[64];
+            sprintf(szName, "%s, %s", shape.szName, (iPass == 0) ? "texture coordinates" : "normals");
+            printf("%-36s %d and %d triangles  %s\n", szName, nStrips, nCached, bPassed ? "ok" : "FAILED");
+            nFailures += bPassed ? 0 : 1;
+            }
+
+        glDisable(GL_TEXTURE_GEN_S);
+        glDisable(GL_TEXTURE_GEN_T);
+        glDisable(GL_TEXTURE_GEN_R);
+        delete [] pCached;
+        delete [] pStrips;
+        delete [] pFeedback;
+        }
+
+    glDisable(GL_TEXTURE_2D);
+    glDeleteTextures(1, &nTexture);
+    gltFreePrimitiveCache();
+    if(glGetError() != GL_NO_ERROR)
+        {
+        printf("GL error\n");
+        nFailures++;
+        }
+
+    if(nFailures != 0)
+        printf("%d checks FAILED\n", nFailures);
+    return (nFailures != 0) ? 1 : 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Math self check. The SSE versions of the math3d functions (see math3d.h
+// and math3dbatch.h) against plain C, on random data, and from addresses that
+// aren't 16 byte aligned. Prints each check and how far off the worst
+// result was, and returns 1 if any of them is out of tolerance. Run with
+//
+//      sphereworld -mathtest
+#define MATHTEST_COUNT      1001    // Not a multiple of four
+#define MATHTEST_TOLERANCE  1e-4f   // Relative, floats summed in a different order
+
+int nMathTestFailures = 0;
+
+float MathTestRandom(void)
+    {
+    return float(rand() % 20001 - 10000) * 0.001f;
+    }
+
+// Relative difference, near zero it's absolute
+float MathTestError(float fResult, float fExpected)
+    {
+    float fScale = float(fabs(fExpected));
+    return float(fabs(fResult - fExpected)) / ((fScale > 1.0f) ? fScale : 1.0f);
+    }
+
+void MathTestReport(const char *szName, float fWorst)
+    {
+    bool bPassed = (fWorst <= MATHTEST_TOLERANCE);
+    printf("%-36s %12g  %s\n", szName, fWorst, bPassed ? "ok" : "FAILED");
+    if(!bPassed)
+        nMathTestFailures++;
+    }
+
+// Plain C m3dMatrixMultiply44(), in double
+void MathTestMultiply(double dProduct[16], const float *a, const float *b)
+    {
+    for(int j = 0; j < 4; j++)
+        for(int i = 0; i < 4; i++)
+            {
+            dProduct[j * 4 + i] = 0.0;
+            for(int k = 0; k < 4; k++)
+                dProduct[j * 4 + i] += double(a[k * 4 + i]) * double(b[j * 4 + k]);
+            }
+    }
+
+void RunMatrixTests(void)
+    {
+    // One float past an aligned new[], so nothing is on a 16 byte boundary
+    float *pBuffer = new float[MATHTEST_COUNT * 4 * 3 + 48 + 1];
+    float *a = pBuffer + 1;
+    float *b = a + 16;
+    float *p = b + 16;
+    double dExpected[16];
+    float fWorst;
+    int i, j;
+
+    fWorst = 0.0f;
+    for(int iTest = 0; iTest < 1000; iTest++)
+        {
+        for(i = 0; i < 16; i++)
+            {
+            a[i] = MathTestRandom();
+            b[i] = MathTestRandom();
+            }
+        m3dMatrixMultiply44(p, a, b);
+        MathTestMultiply(dExpected, a, b);
+        for(i = 0; i < 16; i++)
+            {
+            float fError = MathTestError(p[i], float(dExpected[i]));
+            if(fError > fWorst)
+                fWorst = fError;
+            }
+
+        // The product may be a as well
+        m3dMatrixMultiply44(a, a, b);
+        for(i = 0; i < 16; i++)
+            {
+            float fError = MathTestError(a[i], float(dExpected[i]));
+            if(fError > fWorst)
+                fWorst = fError;
+            }
+        }
+    MathTestReport("m3dMatrixMultiply44", fWorst);
+
+    // One matrix, lots of points, against the single vector versions
+    M3DVector3f *pIn3 = (M3DVector3f *)(p + 16);
+    M3DVector3f *pOut3 = pIn3 + MATHTEST_COUNT;
+    for(i = 0; i < 16; i++)
+        a[i] = MathTestRandom();
+    for(i = 0; i < MATHTEST_COUNT; i++)
+        for(j = 0; j < 3; j++)
+            pIn3[i][j] = MathTestRandom();
+
+    fWorst = 0.0f;
+    for(int nCount = 0; nCount <= 7; nCount++)
+        {
+        int n = (nCount == 7) ? MATHTEST_COUNT : nCount;
+        m3dTransformVectors3(pOut3, pIn3, n, a);
+        for(i = 0; i < n; i++)
+            {
+            M3DVector3f vExpected;
+            m3dTransformVector3(vExpected, pIn3[i], a);
+            for(j = 0; j < 3; j++)
+                {
+                float fError = MathTestError(pOut3[i][j], vExpected[j]);
+                if(fError > fWorst)
+                    fWorst = fError;
+                }
+            }
+        }
+    MathTestReport("m3dTransformVectors3", fWorst);
+
+    M3DVector4f *pIn4 = (M3DVector4f *)(p + 16);
+    M3DVector4f *pOut4 = pIn4 + MATHTEST_COUNT;
+    for(i = 0; i < MATHTEST_COUNT; i++)
+        for(j = 0; j < 4; j++)
+            pIn4[i][j] = MathTestRandom();
+
+    fWorst = 0.0f;
+    for(int nCount = 0; nCount <= 7; nCount++)
+        {
+        int n = (nCount == 7) ? MATHTEST_COUNT : nCount;
+        m3dTransformVectors4(pOut4, pIn4, n, a);
+        for(i = 0; i < n; i++)
+            {
+            M3DVector4f vExpected;
+            m3dTransformVector4(vExpected, pIn4[i], a);
+            for(j = 0; j < 4; j++)
+                {
+                float fError = MathTestError(pOut4[i][j], vExpected[j]);
+                if(fError > fWorst)
+                    fWorst = fError;
+                }
+            }
+        }
+    MathTestReport("m3dTransformVectors4", fWorst);
+
+    // In place, pOut the same as pIn
+    fWorst = 0.0f;
+    M3DVector4f *pCopy = new M3DVector4f[MATHTEST_COUNT];
+    memcpy(pCopy, pIn4, sizeof(M3DVector4f) * MATHTEST_COUNT);
+    m3dTransformVectors4(pIn4, pIn4, MATHTEST_COUNT, a);
+    for(i = 0; i < MATHTEST_COUNT; i++)
+        {
+        M3DVector4f vExpected;
+        m3dTransformVector4(vExpected, pCopy[i], a);
+        for(j = 0; j < 4; j++)
+            {
+            float fError = MathTestError(pIn4[i][j], vExpected[j]);
+            if(fError > fWorst)
+                fWorst = fError;
+            }
+        }
+    MathTestReport("m3dTransformVectors4, in place", fWorst);
+
+    delete [] pCopy;
+    delete [] pBuffer;
+    }
+
+// The structure of arrays functions (see math3dbatch.h) against the single
+// vector functions they stand in for, at counts that leave the SSE loops
+// with 1, 2 and 3 vectors over. Culling is checked against the same volume
+// classified on its own, which never gets to the SSE loop.
+#define STREAMTEST_NORMALIZE    0
+#define STREAMTEST_SCALE        1
+#define STREAMTEST_DOT          2
+#define STREAMTEST_CROSS        3
+#define STREAMTEST_DISTANCE     4
+#define STREAMTEST_PLANE        5
+#define STREAMTEST_SPHERES      6
+#define STREAMTEST_BOXES        7
+#define STREAMTEST_PACKING      8
+#define STREAMTEST_COUNT        9
+
+void RunStreamTests(void)
+    {
+    static const char *szNames[STREAMTEST_COUNT] = { "m3dStreamNormalize", "m3dStreamScale", "m3dStreamDotProduct",
+        "m3dStreamCrossProduct", "m3dStreamDistanceSquared", "m3dStreamDistanceToPlane", "m3dStreamClassifySpheres",
+        "m3dStreamClassifyBoxes", "m3dStreamFrom/ToVectors" };
+    static const int nCounts[] = { 0, 1, 2, 3, 5, 6, 7, 13, MATHTEST_COUNT };
+    float fWorst[STREAMTEST_COUNT];
+    int i, j;
+
+    // Nine streams and a result array, each one float off 16 byte alignment
+    float *pBuffer = new float[(MATHTEST_COUNT + 4) * 10];
+    float *pStreams[10];
+    for(i = 0; i < 10; i++)
+        pStreams[i] = pBuffer + (MATHTEST_COUNT + 4) * i + 1;
+    M3DStream3f u, v, w;
+    m3dLoadStream3(u, pStreams[0], pStreams[1], pStreams[2]);
+    m3dLoadStream3(v, pStreams[3], pStreams[4], pStreams[5]);
+    m3dLoadStream3(w, pStreams[6], pStreams[7], pStreams[8]);
+    float *pResult = pStreams[9];
+
+    M3DVector3f *pU = new M3DVector3f[MATHTEST_COUNT];     // The same as packed vectors
+    M3DVector3f *pV = new M3DVector3f[MATHTEST_COUNT];
+    M3DVector3f *pPacked = new M3DVector3f[MATHTEST_COUNT];
+    unsigned char *pClasses = new unsigned char[MATHTEST_COUNT];
+    float *pRadius = new float[MATHTEST_COUNT];
+
+    // A box of planes, normals in, for the culling
+    M3DVector4f vPlanes[6] = { { 1, 0, 0, 5 }, { -1, 0, 0, 5 }, { 0, 1, 0, 5 },
+                               { 0, -1, 0, 5 }, { 0, 0, 1, 5 }, { 0, 0, -1, 5 } };
+    M3DVector4f vPlane = { 0.48f, -0.6f, 0.64f, 1.5f };
+
+    memset(fWorst, 0, sizeof(fWorst));
+    for(int iCount = 0; iCount < int(sizeof(nCounts) / sizeof(nCounts[0])); iCount++)
+        {
+        int n = nCounts[iCount];
+
+        // Every seventh u is zero length, for normalizing
+        for(i = 0; i < n; i++)
+            {
+            for(j = 0; j < 3; j++)
+                {
+                pU[i][j] = (i % 7 == 3) ? 0.0f : MathTestRandom();
+                pV[i][j] = MathTestRandom();
+                }
+            pRadius[i] = float(fabs(MathTestRandom())) * 0.5f;
+            }
+
+        m3dStreamFromVectors(u, pU, n);
+        m3dStreamFromVectors(v, pV, n);
+        m3dStreamToVectors(pPacked, u, n);
+        for(i = 0; i < n; i++)
+            for(j = 0; j < 3; j++)
+                if(pPacked[i][j] != pU[i][j])
+                    fWorst[STREAMTEST_PACKING] = 1.0f;
+
+        // Plain math3d for each of them
+        m3dStreamDotProduct(pResult, u, v, n);
+        for(i = 0; i < n; i++)
+            {
+            float fError = MathTestError(pResult[i], m3dDotProduct(pU[i], pV[i]));
+            if(fError > fWorst[STREAMTEST_DOT])
+                fWorst[STREAMTEST_DOT] = fError;
+            }
+
+        m3dStreamDistanceSquared(pResult, u, v, n);
+        for(i = 0; i < n; i++)
+            {
+            float fError = MathTestError(pResult[i], m3dGetDistanceSquared(pU[i], pV[i]));
+            if(fError > fWorst[STREAMTEST_DISTANCE])
+                fWorst[STREAMTEST_DISTANCE] = fError;
+            }
+
+        m3dStreamDistanceToPlane(pResult, v, vPlane, n);
+        for(i = 0; i < n; i++)
+            {
+            float fError = MathTestError(pResult[i], m3dGetDistanceToPlane(pV[i], vPlane));
+            if(fError > fWorst[STREAMTEST_PLANE])
+                fWorst[STREAMTEST_PLANE] = fError;
+            }
+
+        m3dStreamCrossProduct(w, u, v, n);
+        m3dStreamToVectors(pPacked, w, n);
+        for(i = 0; i < n; i++)
+            {
+            M3DVector3f vExpected;
+            m3dCrossProduct(vExpected, pU[i], pV[i]);
+            for(j = 0; j < 3; j++)
+                {
+                float fError = MathTestError(pPacked[i][j], vExpected[j]);
+                if(fError > fWorst[STREAMTEST_CROSS])
+                    fWorst[STREAMTEST_CROSS] = fError;
+                }
+            }
+
+        // Spheres around v, and boxes from v to v + |u|
+        m3dStreamClassifySpheres(pClasses, vPlanes, 6, v, pRadius, n);
+        for(i = 0; i < n; i++)
+            {
+            M3DStream3f one;
+            unsigned char nClass;
+            m3dLoadStream3(one, v.x + i, v.y + i, v.z + i);
+            m3dStreamClassifySpheres(&nClass, vPlanes, 6, one, pRadius + i, 1);
+            if(nClass != pClasses[i])
+                fWorst[STREAMTEST_SPHERES] = 1.0f;
+            }
+
+        for(i = 0; i < n; i++)
+            {
+            w.x[i] = v.x[i] + float(fabs(u.x[i]));
+            w.y[i] = v.y[i] + float(fabs(u.y[i]));
+            w.z[i] = v.z[i] + float(fabs(u.z[i]));
+            }
+        m3dStreamClassifyBoxes(pClasses, vPlanes, 6, v, w, n);
+        for(i = 0; i < n; i++)
+            {
+            M3DStream3f oneMin, oneMax;
+            unsigned char nClass;
+            m3dLoadStream3(oneMin, v.x + i, v.y + i, v.z + i);
+            m3dLoadStream3(oneMax, w.x + i, w.y + i, w.z + i);
+            m3dStreamClassifyBoxes(&nClass, vPlanes, 6, oneMin, oneMax, 1);
+            if(nClass != pClasses[i])
+                fWorst[STREAMTEST_BOXES] = 1.0f;
+            }
+
+        // These two change u, so they go last
+        m3dStreamScale(u, 2.5f, n);
+        for(i = 0; i < n; i++)
+            {
+            M3DVector3f vExpected;
+            m3dCopyVector3(vExpected, pU[i]);
+            m3dScaleVector3(vExpected, 2.5f);
+            float fError = MathTestError(u.x[i], vExpected[0]) + MathTestError(u.y[i], vExpected[1]) +
+                           MathTestError(u.z[i], vExpected[2]);
+            if(fError > fWorst[STREAMTEST_SCALE])
+                fWorst[STREAMTEST_SCALE] = fError;
+            }
+
+        m3dStreamNormalize(u, n);
+        for(i = 0; i < n; i++)
+            {
+            // Zero length ones stay zero, m3dNormalizeVector() would NaN them
+            M3DVector3f vExpected;
+            m3dCopyVector3(vExpected, pU[i]);
+            if(m3dGetVectorLength(vExpected) != 0.0f)
+                m3dNormalizeVector(vExpected);
+            float fError = MathTestError(u.x[i], vExpected[0]) + MathTestError(u.y[i], vExpected[1]) +
+                           MathTestError(u.z[i], vExpected[2]);
+            if(!(fError <= fWorst[STREAMTEST_NORMALIZE]))      // NaN too
+                fWorst[STREAMTEST_NORMALIZE] = (fError == fError) ? fError : 1.0f;
+            }
+        }
+
+    for(i = 0; i < STREAMTEST_COUNT; i++)
+        MathTestReport(szNames[i], fWorst[i]);
+
+    delete [] pRadius;
+    delete [] pClasses;
+    delete [] pPacked;
+    delete [] pV;
+    delete [] pU;
+    delete [] pBuffer;
+    }
+
+// M3DFrustum's own projection and planes. The matrix SetPerspective() makes
+// has to be the one glFrustum() would load (worked out here in double, from
+// the formula in its man page), and the planes ExtractPlanes() pulls out of
+// the view-projection matrix have to be the ones GLFrustum used to build
+// through the transformed corners, three at a time. Points are classified
+// against both sets too, leaving out any too close to a plane to call. The
+// far plane only comes out of a float matrix to within about far / near
+// times float precision, so it's allowed that much more.
+void RunFrustumTests(void)
+    {
+    static const float fSetups[4][4] = { { 35.0f, 1.0f, 1.0f, 10.0f }, { 50.0f, 16.0f / 9.0f, 0.5f, 100.0f },
+                                         { 90.0f, 0.75f, 0.1f, 1000.0f }, { 20.0f, 2.5f, 3.0f, 40.0f } };
+    float fMatrixWorst = 0.0f, fPlaneWorst = 0.0f, fPointsWorst = 0.0f;
+    int i, j;
+
+    for(int iSetup = 0; iSetup < 4; iSetup++)
+        {
+        double dFov = fSetups[iSetup][0], dAspect = fSetups[iSetup][1];
+        double n = fSetups[iSetup][2], f = fSetups[iSetup][3];
+        M3DFrustum frustum(fSetups[iSetup][0], fSetups[iSetup][1], fSetups[iSetup][2], fSetups[iSetup][3]);
+
+        // glFrustum(l, r, b, t, n, f), with the edges gluPerspective() works out
+        double t = n * tan(dFov * M3D_PI / 360.0), b = -t;
+        double r = t * dAspect, l = -r;
+        double dExpected[16] = { 2.0 * n / (r - l), 0.0, 0.0, 0.0,
+                                 0.0, 2.0 * n / (t - b), 0.0, 0.0,
+                                 (r + l) / (r - l), (t + b) / (t - b), -(f + n) / (f - n), -1.0,
+                                 0.0, 0.0, -2.0 * f * n / (f - n), 0.0 };
+        M3DMatrix44f mProjection;
+        frustum.GetProjectionMatrix(mProjection);
+        for(i = 0; i < 16; i++)
+            {
+            float fError = MathTestError(mProjection[i], float(dExpected[i]));
+            if(fError > fMatrixWorst)
+                fMatrixWorst = fError;
+            }
+
+        // Somewhere else, looking some other way
+        M3DMatrix44f mCamera, mTranslate;
+        m3dRotationMatrix44(mCamera, float(iSetup) * 0.7f + 0.2f, 0.3f, 1.0f, -0.4f);
+        m3dTranslationMatrix44(mTranslate, MathTestRandom(), MathTestRandom(), MathTestRandom());
+        m3dMatrixMultiply44(mCamera, mTranslate, mCamera);
+        frustum.Transform(mCamera);
+
+        // The old way, counter clockwise so the normals point in
+        static const int nCorners[6][3] = {
+            { M3D_CORNER_NEAR_UL, M3D_CORNER_NEAR_LL, M3D_CORNER_NEAR_LR },     // M3D_PLANE_NEAR
+            { M3D_CORNER_FAR_UL, M3D_CORNER_FAR_UR, M3D_CORNER_FAR_LR },        // M3D_PLANE_FAR
+            { M3D_CORNER_NEAR_LL, M3D_CORNER_NEAR_UL, M3D_CORNER_FAR_UL },      // M3D_PLANE_LEFT
+            { M3D_CORNER_NEAR_LR, M3D_CORNER_FAR_LR, M3D_CORNER_FAR_UR },       // M3D_PLANE_RIGHT
+            { M3D_CORNER_NEAR_LL, M3D_CORNER_FAR_LL, M3D_CORNER_FAR_LR },       // M3D_PLANE_BOTTOM
+            { M3D_CORNER_NEAR_UL, M3D_CORNER_NEAR_UR, M3D_CORNER_FAR_UR } };    // M3D_PLANE_TOP
+        M3DVector4f vPlanes[6], vCornerPlanes[6];
+        float fScale[6];
+        for(i = 0; i < 6; i++)
+            {
+            M3DVector3f v1, v2, v3;
+            frustum.GetCorner(nCorners[i][0], v1);
+            frustum.GetCorner(nCorners[i][1], v2);
+            frustum.GetCorner(nCorners[i][2], v3);
+            m3dGetPlaneEquation(vCornerPlanes[i], v1, v2, v3);
+            frustum.GetPlane(i, vPlanes[i]);
+
+            // Distances get bigger with the far plane, so that's the scale
+            fScale[i] = float((i == M3D_PLANE_FAR) ? f * f / n : f);
+            for(j = 0; j < 4; j++)
+                {
+                float fError = float(fabs(vPlanes[i][j] - vCornerPlanes[i][j])) / fScale[i];
+                if(fError > fPlaneWorst)
+                    fPlaneWorst = fError;
+                }
+            }
+
+        for(int iPoint = 0; iPoint < 1000; iPoint++)
+            {
+            // Out to a bit past the far plane
+            M3DVector3f vPoint;
+            float fSpread = fSetups[iSetup][3] * 0.12f;
+            for(j = 0; j < 3; j++)
+                vPoint[j] = MathTestRandom() * fSpread + mCamera[12 + j];
+
+            for(i = 0; i < 6; i++)
+                {
+                float fDistance = m3dGetDistanceToPlane(vPoint, vPlanes[i]);
+                float fCornerDistance = m3dGetDistanceToPlane(vPoint, vCornerPlanes[i]);
+                if(float(fabs(fCornerDistance)) > MATHTEST_TOLERANCE * fScale[i] &&
+                   (fDistance < 0.0f) != (fCornerDistance < 0.0f))
+                    fPointsWorst = 1.0f;
+                }
+            }
+        }
+    MathTestReport("M3DFrustum::SetPerspective", fMatrixWorst);
+    MathTestReport("M3DFrustum::ExtractPlanes", fPlaneWorst);
+    MathTestReport("M3DFrustum::ExtractPlanes, points", fPointsWorst);
+    }
+
+// M3DFrustum's batch culling (TestSpheres() and TestBoxes()) against its
+// ClassifySphere() and ClassifyBox(), one at a time. The sums are done in a
+// different order, so anything within MATHTEST_TOLERANCE of a plane could
+// honestly go either way and isn't counted. Then the edges, which can't be
+// left to chance: touching a plane from inside is inside, touching from
+// outside is outside, and so is a point (or a flat box) right on a plane.
+// Those are checked in a batch and one at a time, against the known answers.
+#define CULLTEST_EDGES      9
+
+struct CULLTEST_SPHERE
+    {
+    float x, y, z, r;
+    int nClass;
+    };
+
+struct CULLTEST_BOX
+    {
+    float x0, y0, z0, x1, y1, z1;
+    int nClass;
+    };
+
+// How close the sphere or box gets to being classified differently
+float CullTestMargin(M3DFrustum &frustum, const M3DVector3f vMin, const M3DVector3f vMax, float fRadius)
+    {
+    float fMargin = 1e30f;
+
+    for(int i = 0; i < 6; i++)
+        {
+        M3DVector4f vPlane;
+        M3DVector3f vNear, vFar;
+        frustum.GetPlane(i, vPlane);
+        for(int j = 0; j < 3; j++)
+            {
+            vFar[j] = (vPlane[j] >= 0.0f) ? vMax[j] : vMin[j];
+            vNear[j] = (vPlane[j] >= 0.0f) ? vMin[j] : vMax[j];
+            }
+
+        float fFar = float(fabs(m3dGetDistanceToPlane(vFar, vPlane) + fRadius));
+        float fNear = float(fabs(m3dGetDistanceToPlane(vNear, vPlane) - fRadius));
+        if(fFar < fMargin)
+            fMargin = fFar;
+        if(fNear < fMargin)
+            fMargin = fNear;
+        }
+
+    return fMargin;
+    }
+
+void RunCullTests(void)
+    {
+    static const int nCounts[] = { 1, 2, 3, 5, 6, 7, 13, MATHTEST_COUNT };
+    float fSpheresWorst = 0.0f, fBoxesWorst = 0.0f;
+    int i, j;
+
+    // Somewhere off the origin, turned a bit
+    M3DFrustum frustum(50.0f, 16.0f / 9.0f, 1.0f, 15.0f);
+    M3DMatrix44f mCamera, mTranslate;
+    m3dRotationMatrix44(mCamera, 0.6f, 0.3f, 1.0f, 0.2f);
+    m3dTranslationMatrix44(mTranslate, 1.5f, -0.5f, 4.0f);
+    m3dMatrixMultiply44(mCamera, mTranslate, mCamera);
+    frustum.Transform(mCamera);
+
+    // Six streams, one float off 16 byte alignment
+    float *pBuffer = new float[(MATHTEST_COUNT + 4) * 7];
+    float *pStreams[7];
+    for(i = 0; i < 7; i++)
+        pStreams[i] = pBuffer + (MATHTEST_COUNT + 4) * i + 1;
+    M3DStream3f vMins, vMaxs;
+    m3dLoadStream3(vMins, pStreams[0], pStreams[1], pStreams[2]);
+    m3dLoadStream3(vMaxs, pStreams[3], pStreams[4], pStreams[5]);
+    float *pRadius = pStreams[6];
+    unsigned char *pClasses = new unsigned char[MATHTEST_COUNT];
+
+    for(int iCount = 0; iCount < int(sizeof(nCounts) / sizeof(nCounts[0])); iCount++)
+        {
+        int n = nCounts[iCount];
+
+        for(i = 0; i < n; i++)
+            {
+            vMins.x[i] = MathTestRandom();
+            vMins.y[i] = MathTestRandom();
+            vMins.z[i] = MathTestRandom();
+            vMaxs.x[i] = vMins.x[i] + float(fabs(MathTestRandom())) * 0.3f;
+            vMaxs.y[i] = vMins.y[i] + float(fabs(MathTestRandom())) * 0.3f;
+            vMaxs.z[i] = vMins.z[i] + float(fabs(MathTestRandom())) * 0.3f;
+            pRadius[i] = float(fabs(MathTestRandom())) * 0.3f;
+            }
+
+        // Spheres around the box minimums
+        int nVisible = frustum.TestSpheres(pClasses, vMins, pRadius, n);
+        int nExpected = 0;
+        for(i = 0; i < n; i++)
+            {
+            M3DVector3f vCenter;
+            m3dLoadVector3(vCenter, vMins.x[i], vMins.y[i], vMins.z[i]);
+            int nClass = frustum.ClassifySphere(vCenter, pRadius[i]);
+            nExpected += (pClasses[i] != M3D_OUTSIDE);
+            if(nClass != pClasses[i] && CullTestMargin(frustum, vCenter, vCenter, pRadius[i]) > MATHTEST_TOLERANCE)
+                fSpheresWorst = 1.0f;
+            }
+        if(nVisible != nExpected)
+            fSpheresWorst = 1.0f;
+
+        nVisible = frustum.TestBoxes(pClasses, vMins, vMaxs, n);
+        nExpected = 0;
+        for(i = 0; i < n; i++)
+            {
+            M3DVector3f vMin, vMax;
+            m3dLoadVector3(vMin, vMins.x[i], vMins.y[i], vMins.z[i]);
+            m3dLoadVector3(vMax, vMaxs.x[i], vMaxs.y[i], vMaxs.z[i]);
+            int nClass = frustum.ClassifyBox(vMin, vMax);
+            nExpected += (pClasses[i] != M3D_OUTSIDE);
+            if(nClass != pClasses[i] && CullTestMargin(frustum, vMin, vMax, 0.0f) > MATHTEST_TOLERANCE)
+                fBoxesWorst = 1.0f;
+            }
+        if(nVisible != nExpected)
+            fBoxesWorst = 1.0f;
+        }
+    MathTestReport("M3DFrustum::TestSpheres", fSpheresWorst);
+    MathTestReport("M3DFrustum::TestBoxes", fBoxesWorst);
+
+    // The edges, against a box of planes from -5 to 5
+    static const M3DVector4f vPlanes[6] = { { 1, 0, 0, 5 }, { -1, 0, 0, 5 }, { 0, 1, 0, 5 },
+                                            { 0, -1, 0, 5 }, { 0, 0, 1, 5 }, { 0, 0, -1, 5 } };
+    static const CULLTEST_SPHERE spheres[CULLTEST_EDGES] = {
+        { 0.0f, 0.0f, 0.0f, 1.0f, M3D_INSIDE },
+        { 3.0f, 0.0f, 0.0f, 2.0f, M3D_INSIDE },         // Touching from inside
+        { 3.0f, 0.0f, 0.0f, 2.5f, M3D_INTERSECT },
+        { 7.0f, 0.0f, 0.0f, 2.0f, M3D_OUTSIDE },        // Touching from outside
+        { 7.0f, 0.0f, 0.0f, 2.5f, M3D_INTERSECT },
+        { 5.0f, 0.0f, 0.0f, 0.0f, M3D_OUTSIDE },        // A point on the plane
+        { 4.5f, 0.0f, 0.0f, 0.0f, M3D_INSIDE },
+        { 0.0f, 0.0f, -5.5f, 0.25f, M3D_OUTSIDE },
+        { 0.0f, 0.0f, 0.0f, 6.0f, M3D_INTERSECT } };    // Bigger than the box
+    static const CULLTEST_BOX boxes[CULLTEST_EDGES] = {
+        { -1.0f, -1.0f, -1.0f, 1.0f, 1.0f, 1.0f, M3D_INSIDE },
+        { 1.0f, -1.0f, -1.0f, 5.0f, 1.0f, 1.0f, M3D_INSIDE },      // Touching from inside
+        { 4.0f, -1.0f, -1.0f, 6.0f, 1.0f, 1.0f, M3D_INTERSECT },
+        { 5.0f, -1.0f, -1.0f, 7.0f, 1.0f, 1.0f, M3D_OUTSIDE },     // Touching from outside
+        { 5.0f, 0.0f, 0.0f, 5.0f, 0.0f, 0.0f, M3D_OUTSIDE },       // A point on the plane
+        { 5.0f, -1.0f, -1.0f, 5.0f, 1.0f, 1.0f, M3D_OUTSIDE },     // Flat, in the plane
+        { 4.5f, -1.0f, -1.0f, 4.5f, 1.0f, 1.0f, M3D_INSIDE },
+        { -1.0f, -1.0f, 6.0f, 1.0f, 1.0f, 8.0f, M3D_OUTSIDE },
+        { -6.0f, -6.0f, -6.0f, 6.0f, 6.0f, 6.0f, M3D_INTERSECT } };
+
+    fSpheresWorst = fBoxesWorst = 0.0f;
+    for(i = 0; i < CULLTEST_EDGES; i++)
+        {
+        vMins.x[i] = spheres[i].x;
+        vMins.y[i] = spheres[i].y;
+        vMins.z[i] = spheres[i].z;
+        pRadius[i] = spheres[i].r;
+        }
+
+    // All at once (two lots of four through SSE, and one over), then one at a time
+    m3dStreamClassifySpheres(pClasses, vPlanes, 6, vMins, pRadius, CULLTEST_EDGES);
+    for(i = 0; i < CULLTEST_EDGES; i++)
+        {
+        M3DStream3f one;
+        unsigned char nClass;
+        m3dLoadStream3(one, vMins.x + i, vMins.y + i, vMins.z + i);
+        m3dStreamClassifySpheres(&nClass, vPlanes, 6, one, pRadius + i, 1);
+        if(pClasses[i] != spheres[i].nClass || nClass != spheres[i].nClass)
+            fSpheresWorst = 1.0f;
+        }
+
+    for(i = 0; i < CULLTEST_EDGES; i++)
+        {
+        vMins.x[i] = boxes[i].x0;
+        vMins.y[i] = boxes[i].y0;
+        vMins.z[i] = boxes[i].z0;
+        vMaxs.x[i] = boxes[i].x1;
+        vMaxs.y[i] = boxes[i].y1;
+        vMaxs.z[i] = boxes[i].z1;
+        }
+
+    m3dStreamClassifyBoxes(pClasses, vPlanes, 6, vMins, vMaxs, CULLTEST_EDGES);
+    for(i = 0; i < CULLTEST_EDGES; i++)
+        {
+        M3DStream3f oneMin, oneMax;
+        unsigned char nClass;
+        m3dLoadStream3(oneMin, vMins.x + i, vMins.y + i, vMins.z + i);
+        m3dLoadStream3(oneMax, vMaxs.x + i, vMaxs.y + i, vMaxs.z + i);
+        m3dStreamClassifyBoxes(&nClass, vPlanes, 6, oneMin, oneMax, 1);
+        if(pClasses[i] != boxes[i].nClass || nClass != boxes[i].nClass)
+            fBoxesWorst = 1.0f;
+        }
+    MathTestReport("m3dStreamClassifySpheres, edges", fSpheresWorst);
+    MathTestReport("m3dStreamClassifyBoxes, edges", fBoxesWorst);
+
+    delete [] pClasses;
+    delete [] pBuffer;
+    }
+
+int RunMathTest(void)
+    {
+#ifdef M3D_USE_SSE
+    printf("math3d with SSE\n");
+#else
+    printf("math3d without SSE (plain C against plain C)\n");
+#endif
+    printf("%-36s %12s\n", "", "worst error");
+
+    srand(1);
+    RunMatrixTests();
+    RunStreamTests();
+    RunFrustumTests();
+    RunCullTests();
+
+    if(nMathTestFailures != 0)
+        printf("%d checks FAILED\n", nMathTestFailures);
+    return (nMathTestFailures != 0) ? 1 : 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Cog benchmark and check. Builds each cog nLoops times through BuildCog(),
+// the same as GetCogMesh() does the first time it sees a set of parameters,
+// and shows how long a build takes and what it came out as. Every cog has
+// 20 triangles per slice whatever happens to the vertices, and the cogs the
+// scene draws have to weld down to the vertex counts they always have. If
+// any count is off it says so and returns 1.
+//
+//      sphereworld -cogbench <loops>
+//
+int RunCogBenchmark(int nLoops)
+    {
+    CStopWatch timer;
+    int nFailures = 0;
+
+    struct
+        {
+        float   r0, r1, r2, w;
+        int     n;
+        GLuint  nExpectedVerts;         // 0 for not checked
+        } cogs[] = { { 0.2f, 0.5f, 0.55f, 0.05f, 30, 1232 },
+                     { 0.2f, 0.4f, 0.43f, 0.05f, 30, 1232 },
+                     { 0.2f, 0.5f, 0.55f, 0.05f, 8, 0 },
+                     { 0.2f, 0.5f, 0.55f, 0.05f, 120, 0 },
+                     { 0.2f, 0.5f, 0.55f, 0.05f, 500, 0 } };
+
+    printf("%-28s %10s %8s %10s\n", "", "ms/build", "verts", "triangles");
+    for(int iCog = 0; iCog < int(sizeof(cogs) / sizeof(cogs[0])); iCog++)
+        {
+        GLuint nVerts = 0, nTriangles = 0;
+        char szName[64];
+
+        sprintf(szName, "%.2f %.2f %.2f %.2f, %d", cogs[iCog].r0, cogs[iCog].r1, cogs[iCog].r2,
+                cogs[iCog].w, cogs[iCog].n);
+
+        timer.Reset();
+        for(int iLoop = 0; iLoop < nLoops; iLoop++)
+            {
+            CVBOMesh mesh;
+            BuildCog(&mesh, cogs[iCog].r0, cogs[iCog].r1, cogs[iCog].r2, cogs[iCog].w, cogs[iCog].n);
+            nVerts = mesh.GetVertexCount();
+            nTriangles = mesh.GetIndexCount() / 3;
+            }
+        float fMilliseconds = float(double(timer.GetElapsedNanoseconds()) * 0.000001 / nLoops);
+
+        printf("%-28s %10.3f %8u %10u\n", szName, fMilliseconds, nVerts, nTriangles);
+
+        if(nTriangles != GLuint(20 * (cogs[iCog].n + 1)))
+            {
+            printf("    FAILED: expected %d triangles\n", 20 * (cogs[iCog].n + 1));
+            nFailures++;
+            }
+        if(cogs[iCog].nExpectedVerts != 0 && nVerts != cogs[iCog].nExpectedVerts)
+            {
+            printf("    FAILED: expected %u vertices\n", cogs[iCog].nExpectedVerts);
+            nFailures++;
+            }
+        }
+
+    if(nFailures != 0)
+        printf("%d checks FAILED\n", nFailures);
+    return (nFailures != 0) ? 1 : 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Vertex welding benchmark, no GL needed. A bumpy grid of quads is welded by
+// CTriangleMesh, which looks for duplicates through a spatial hash, and by
+// the search through every vertex so far that AddTriangle() used to do,
+// which is kept here to compare against. Both have to come out with the
+// same indexes, if they don't it says so and returns 1.
+//
+//      sphereworld -weldbench
+//
+#define WELDBENCH_SIZES     4
+
+// Height of the grid at (x, y), and its normal
+void WeldBenchPoint(int x, int y, int nSize, M3DVector3f vVert, M3DVector3f vNorm, M3DVector2f vTex)
+    {
+    float fx = float(x) * 0.3f, fy = float(y) * 0.2f;
+
+    m3dLoadVector3(vVert, float(x), float(y), 4.0f * sin(fx) * cos(fy));
+    m3dLoadVector3(vNorm, -1.2f * cos(fx) * cos(fy), 0.8f * sin(fx) * sin(fy), 1.0f);
+    m3dNormalizeVector(vNorm);
+    vTex[0] = float(x) / float(nSize);
+    vTex[1] = float(y) / float(nSize);
+    }
+
+// The old way, every vertex is compared with every one added before it
+GLuint WeldBenchLinear(const M3DVector3f *pSoupVerts, const M3DVector3f *pSoupNorms, const M3DVector2f *pSoupTex,
+                       GLuint nSoupVerts, GLuint *pIndexes, M3DVector3f *pVerts, M3DVector3f *pNorms, M3DVector2f *pTex)
+    {
+    const float e = MESH_WELD_EPSILON;
+    GLuint nNumVerts = 0;
+
+    for(GLuint i = 0; i < nSoupVerts; i++)
+        {
+        GLuint iMatch;
+        for(iMatch = 0; iMatch < nNumVerts; iMatch++)
+            if(m3dCloseEnough(pVerts[iMatch][0], pSoupVerts[i][0], e) &&
+               m3dCloseEnough(pVerts[iMatch][1], pSoupVerts[i][1], e) &&
+               m3dCloseEnough(pVerts[iMatch][2], pSoupVerts[i][2], e) &&
+               m3dCloseEnough(pNorms[iMatch][0], pSoupNorms[i][0], e) &&
+               m3dCloseEnough(pNorms[iMatch][1], pSoupNorms[i][1], e) &&
+               m3dCloseEnough(pNorms[iMatch][2], pSoupNorms[i][2], e) &&
+               m3dCloseEnough(pTex[iMatch][0], pSoupTex[i][0], e) &&
+               m3dCloseEnough(pTex[iMatch][1], pSoupTex[i][1], e))
+                break;
+
+        if(iMatch == nNumVerts)
+            {
+            m3dCopyVector3(pVerts[nNumVerts], pSoupVerts[i]);
+            m3dCopyVector3(pNorms[nNumVerts], pSoupNorms[i]);
+            pTex[nNumVerts][0] = pSoupTex[i][0];
+            pTex[nNumVerts][1] = pSoupTex[i][1];
+            nNumVerts++;
+            }
+        pIndexes[i] = iMatch;
+        }
+
+    return nNumVerts;
+    }
+
+int RunWeldBenchmark(void)
+    {
+    CStopWatch timer;
+    int nFailures = 0;
+    const int nSizes[WELDBENCH_SIZES] = { 16, 50, 100, 160 };      // 160 x 160 is 51,200 triangles
+
+    printf("%-10s %8s %12s %12s\n", "triangles", "verts", "hash ms", "linear ms");
+    for(int iTest = 0; iTest < WELDBENCH_SIZES; iTest++)
+        {
+        int nSize = nSizes[iTest];
+        GLuint nSoupVerts = GLuint(nSize * nSize * 6);
+        M3DVector3f *pSoupVerts = new M3DVector3f[nSoupVerts];
+        M3DVector3f *pSoupNorms = new M3DVector3f[nSoupVerts];
+        M3DVector2f *pSoupTex = new M3DVector2f[nSoupVerts];
+        GLuint i = 0;
+        int x, y, k;
+
+        // Two triangles per quad, the way a model file would list them
+        static const int iCorners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+        for(y = 0; y < nSize; y++)
+            for(x = 0; x < nSize; x++)
+                for(k = 0; k < 6; k++, i++)
+                    WeldBenchPoint(x + iCorners[k][0], y + iCorners[k][1], nSize, pSoupVerts[i], pSoupNorms[i], pSoupTex[i]);
+
+        // Through the hash
+        CTriangleMesh mesh;
+        timer.Reset();
+        mesh.BeginMesh(nSoupVerts);
+        for(i = 0; i < nSoupVerts; i += 3)
+            {
+            // AddTriangle() normalizes the normals in place, give it copies
+            M3DVector3f vVerts[3], vNorms[3];
+            M3DVector2f vTex[3];
+            for(k = 0; k < 3; k++)
+                {
+                m3dCopyVector3(vVerts[k], pSoupVerts[i + k]);
+                m3dCopyVector3(vNorms[k], pSoupNorms[i + k]);
+                vTex[k][0] = pSoupTex[i + k][0];
+                vTex[k][1] = pSoupTex[i + k][1];
+                }
+            mesh.AddTriangle(vVerts, vNorms, vTex);
+            }
+        mesh.EndMesh();
+        float fHashMs = float(double(timer.GetElapsedNanoseconds()) * 0.000001);
+
+        // Searching every vertex
+        GLuint *pIndexes = new GLuint[nSoupVerts];
+        M3DVector3f *pVerts = new M3DVector3f[nSoupVerts];
+        M3DVector3f *pNorms = new M3DVector3f[nSoupVerts];
+        M3DVector2f *pTex = new M3DVector2f[nSoupVerts];
+        timer.Reset();
+        GLuint nLinearVerts = WeldBenchLinear(pSoupVerts, pSoupNorms, pSoupTex, nSoupVerts, pIndexes, pVerts, pNorms, pTex);
+        float fLinearMs = float(double(timer.GetElapsedNanoseconds()) * 0.000001);
+
+        printf("%-10u %8u %12.2f %12.2f\n", nSoupVerts / 3, mesh.GetVertexCount(), fHashMs, fLinearMs);
+
+        // Same vertices, same indexes
+        GLuint nDifferent = 0;
+        const GLvoid *pMeshIndexes = mesh.GetIndexPointer();
+        for(i = 0; i < nSoupVerts && i < mesh.GetIndexCount(); i++)
+            {
+            GLuint iIndex = (mesh.GetIndexType() == GL_UNSIGNED_SHORT) ? ((const GLushort *)pMeshIndexes)[i] :
+                                                                          ((const GLuint *)pMeshIndexes)[i];
+            if(iIndex != pIndexes[i])
+                nDifferent++;
+            }
+        if(mesh.GetVertexCount() != nLinearVerts || mesh.GetIndexCount() != nSoupVerts || nDifferent != 0)
+            {
+            printf("    FAILED: the linear search found %u vertices, %u indexes differ\n", nLinearVerts, nDifferent);
+            nFailures++;
+            }
+
+        delete [] pSoupVerts;
+        delete [] pSoupNorms;
+        delete [] pSoupTex;
+        delete [] pIndexes;
+        delete [] pVerts;
+        delete [] pNorms;
+        delete [] pTex;
+        }
+
+    if(nFailures != 0)
+        printf("%d checks FAILED\n", nFailures);
+    return (nFailures != 0) ? 1 : 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Vertex cache report, no GL needed. Builds the scene's sphere, a finer one
+// and a grid twice, once with the triangles left in the order they were
+// added and once through EndMesh()'s optimizer, and prints the ACMR and
+// ATVR of each (see meshGetCacheStats(), with a MESH_CACHE_SIZE entry
+// cache). Returns 1 if the optimizer made any of them worse.
+//
+//      sphereworld -acmr
+//
+#define ACMR_GRID           100
+
+int RunCacheReport(void)
+    {
+    int nFailures = 0;
+
+    printf("%-20s %8s %10s %8s %10s %8s %10s\n", "", "verts", "triangles", "ACMR", "optimized", "ATVR", "optimized");
+    for(int iMesh = 0; iMesh < 3; iMesh++)
+        {
+        static const char *szNames[3] = { "sphere, 21 x 11", "sphere, 64 x 32", "grid, 100 x 100" };
+        CTriangleMesh meshes[2];
+        GLfloat fACMR[2], fATVR[2];
+
+        for(int iPass = 0; iPass < 2; iPass++)
+            {
+            GLuint nOptions = (iPass == 0) ? 0 : MESH_OPTIMIZE;
+            if(iMesh == 0)
+                BuildSphere(&meshes[iPass], 0.3f, 21, 11, nOptions);
+            else if(iMesh == 1)
+                BuildSphere(&meshes[iPass], 0.3f, 64, 32, nOptions);
+            else
+                {
+                static const int iCorners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+                meshes[iPass].BeginMesh(ACMR_GRID * ACMR_GRID * 6);
+                for(int y = 0; y < ACMR_GRID; y++)
+                    for(int x = 0; x < ACMR_GRID; x++)
+                        for(int k = 0; k < 6; k += 3)
+                            {
+                            M3DVector3f vVerts[3], vNorms[3];
+                            M3DVector2f vTex[3];
+                            for(int j = 0; j < 3; j++)
+                                WeldBenchPoint(x + iCorners[k + j][0], y + iCorners[k + j][1], ACMR_GRID,
+                                               vVerts[j], vNorms[j], vTex[j]);
+                            meshes[iPass].AddTriangle(vVerts, vNorms, vTex);
+                            }
+                meshes[iPass].EndMesh(nOptions);
+                }
+            fACMR[iPass] = meshes[iPass].GetCacheStats(&fATVR[iPass]);
+            }
+
+        printf("%-20s %8u %10u %8.3f %10.3f %8.3f %10.3f\n", szNames[iMesh], meshes[1].GetVertexCount(),
+               meshes[1].GetIndexCount() / 3, fACMR[0], fACMR[1], fATVR[0], fATVR[1]);
+        if(fACMR[1] > fACMR[0])
+            {
+            printf("    FAILED: optimizing made the ACMR worse\n");
+            nFailures++;
+            }
+        }
+
+    if(nFailures != 0)
+        printf("%d checks FAILED\n", nFailures);
+    return (nFailures != 0) ? 1 : 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Bounding volume hierarchy check, no GL needed. A CActorBVH is built over
+// a field of spheres, then asked which are in a number of frustums and
+// which is the first hit by a number of rays. A loop over every sphere
+// answers the same questions, and the answers have to match. Then the
+// spheres all move, the tree is Refit(), and it's done again. Prints how
+// long each way took, and returns 1 if any answer was different.
+//
+//      sphereworld -bvhtest
+//
+#define BVHTEST_ACTORS      30000
+#define BVHTEST_QUERIES     200
+#define BVHTEST_FIELD       200         // Actors are spread over this many units
+
+// Aim a frustum or a ray from somewhere in the field, in some direction
+void BVHTestCamera(GLFrame &frame)
+    {
+    frame.SetOrigin(float(rand() % BVHTEST_FIELD - BVHTEST_FIELD / 2), float(rand() % 20 - 10),
+                    float(rand() % BVHTEST_FIELD - BVHTEST_FIELD / 2));
+    frame.SetForwardVector(0.0f, 0.0f, -1.0f);
+    frame.SetUpVector(0.0f, 1.0f, 0.0f);
+    frame.RotateLocalY(float(rand() % 628) * 0.01f);
+    frame.RotateLocalX(float(rand() % 100 - 50) * 0.01f);
+    }
+
+// Runs every query both ways, and returns how many came out different
+int BVHTestQueries(CActorBVH &bvh, GLFrame *pActors, const GLfloat *pRadii, GLuint nActors,
+                   const char *szWhen, unsigned int nSeed)
+    {
+    CStopWatch timer;
+    M3DFrustum frustum(50.0f, 16.0f / 9.0f, 1.0f, 100.0f);
+    GLuint *pResults = new GLuint[nActors];
+    bool *pInBVH = new bool[nActors];
+    int nFailures = 0;
+    float fTreeTime = 0.0f, fLoopTime = 0.0f;
+    GLuint nTotalFound = 0;
+
+    // Frustums
+    srand(nSeed);
+    for(int iQuery = 0; iQuery < BVHTEST_QUERIES; iQuery++)
+        {
+        GLFrame camera;
+        M3DMatrix44f mFrustum;
+        BVHTestCamera(camera);
+
+        // Looking down -Z, the same as RenderScene()
+        camera.GetMatrix(mFrustum);
+        for(int i = 0; i < 3; i++)
+            {
+            mFrustum[i] = -mFrustum[i];
+            mFrustum[8 + i] = -mFrustum[8 + i];
+            }
+        frustum.Transform(mFrustum);
+
+        timer.Reset();
+        GLuint nFound = bvh.QueryFrustum(frustum, pResults, nActors);
+        fTreeTime += timer.GetElapsedSeconds();
+
+        memset(pInBVH, 0, sizeof(bool) * nActors);
+        for(GLuint i = 0; i < nFound; i++)
+            pInBVH[pResults[i]] = true;
+
+        timer.Reset();
+        GLuint nLoopFound = 0;
+        for(GLuint i = 0; i < nActors; i++)
+            {
+            M3DVector3f vCenter;
+            pActors[i].GetOrigin(vCenter);
+            if(frustum.TestSphere(vCenter, pRadii[i]))
+                {
+                pResults[nLoopFound++] = i;
+                }
+            }
+        fLoopTime += timer.GetElapsedSeconds();
+
+        // Same count, and everything the loop found the tree found too
+        bool bSame = (nFound == nLoopFound);
+        for(GLuint i = 0; i < nLoopFound && bSame; i++)
+            bSame = pInBVH[pResults[i]];
+        if(!bSame)
+            {
+            printf("%s frustum %d: tree found %u, loop found %u\n", szWhen, iQuery, nFound, nLoopFound);
+            nFailures++;
+            }
+        nTotalFound += nLoopFound;
+        }
+    printf("%-8s frustum %6u found  %10.4f ms  %10.4f ms  %6.1fx\n", szWhen, nTotalFound / BVHTEST_QUERIES,
+           fTreeTime * 1000.0f / BVHTEST_QUERIES, fLoopTime * 1000.0f / BVHTEST_QUERIES,
+           (fTreeTime > 0.0f) ? fLoopTime / fTreeTime : 0.0f);
+
+    // Rays
+    fTreeTime = fLoopTime = 0.0f;
+    GLuint nHits = 0;
+    for(int iQuery = 0; iQuery < BVHTEST_QUERIES; iQuery++)
+        {
+        GLFrame ray;
+        M3DVector3f vOrigin, vDirection;
+        BVHTestCamera(ray);
+        ray.GetOrigin(vOrigin);
+        ray.GetForwardVector(vDirection);
+        m3dNormalizeVector(vDirection);
+
+        timer.Reset();
+        GLfloat fTreeDistance = 0.0f;
+        GLuint iTreeHit = bvh.PickRay(vOrigin, vDirection, &fTreeDistance);
+        fTreeTime += timer.GetElapsedSeconds();
+
+        // The closest real hit, see PickRay()
+        timer.Reset();
+        GLuint iLoopHit = BVH_NO_HIT;
+        GLfloat fLoopDistance = 0.0f;
+        for(GLuint i = 0; i < nActors; i++)
+            {
+            M3DVector3f vCenter;
+            pActors[i].GetOrigin(vCenter);
+            GLfloat fDistance = m3dRaySphereTest(vOrigin, vDirection, vCenter, pRadii[i]);
+            if(fDistance > 0.0f && (iLoopHit == BVH_NO_HIT || fDistance < fLoopDistance))
+                {
+                fLoopDistance = fDistance;
+                iLoopHit = i;
+                }
+            }
+        fLoopTime += timer.GetElapsedSeconds();
+
+        if(iTreeHit != iLoopHit)
+            {
+            printf("%s ray %d: tree hit %d, loop hit %d\n", szWhen, iQuery, int(iTreeHit), int(iLoopHit));
+            nFailures++;
+            }
+        else if(iLoopHit != BVH_NO_HIT)
+            {
+            nHits++;
+            if(!m3dCloseEnough(fTreeDistance, fLoopDistance, 0.0001f))
+                {
+                printf("%s ray %d: tree distance %f, loop distance %f\n", szWhen, iQuery, fTreeDistance, fLoopDistance);
+                nFailures++;
+                }
+            }
+        }
+    printf("%-8s ray     %6u hits   %10.4f ms  %10.4f ms  %6.1fx\n", szWhen, nHits,
+           fTreeTime * 1000.0f / BVHTEST_QUERIES, fLoopTime * 1000.0f / BVHTEST_QUERIES,
+           (fTreeTime > 0.0f) ? fLoopTime / fTreeTime : 0.0f);
+
+    delete [] pInBVH;
+    delete [] pResults;
+    return nFailures;
+    }
+
+int RunBVHTest(void)
+    {
+    GLFrame *pActors = new GLFrame[BVHTEST_ACTORS];
+    GLfloat *pRadii = new GLfloat[BVHTEST_ACTORS];
+    CActorBVH bvh;
+    CStopWatch timer;
+    int nFailures = 0;
+
+    srand(0);
+    for(GLuint i = 0; i < BVHTEST_ACTORS; i++)
+        {
+        pActors[i].SetOrigin(float(rand() % (BVHTEST_FIELD * 10) - BVHTEST_FIELD * 5) * 0.1f,
+                             float(rand() % 200 - 100) * 0.1f,
+                             float(rand() % (BVHTEST_FIELD * 10) - BVHTEST_FIELD * 5) * 0.1f);
+        pActors[i].RotateLocalY(float(rand() % 628) * 0.01f);
+        pRadii[i] = float(rand() % 90 + 10) * 0.01f;
+        }
+
+    timer.Reset();
+    bvh.Build(pActors, pRadii, BVHTEST_ACTORS);
+    printf("%d actors, %u nodes, built in %.3f ms\n", BVHTEST_ACTORS, bvh.GetNodeCount(),
+           timer.GetElapsedSeconds() * 1000.0f);
+    printf("%-8s %-7s %13s %14s %14s %9s\n", "", "query", "average", "tree", "loop", "speedup");
+    nFailures += BVHTestQueries(bvh, pActors, pRadii, BVHTEST_ACTORS, "built", 1);
+
+    // Everybody wanders off a bit
+    for(GLuint i = 0; i < BVHTEST_ACTORS; i++)
+        pActors[i].MoveForward(float(rand() % 50) * 0.1f);
+
+    timer.Reset();
+    bvh.Refit();
+    printf("Refit in %.3f ms\n", timer.GetElapsedSeconds() * 1000.0f);
+    nFailures += BVHTestQueries(bvh, pActors, pRadii, BVHTEST_ACTORS, "refit", 2);
+
+    delete [] pRadii;
+    delete [] pActors;
+
+    if(nFailures == 0)
+        printf("All queries match\n");
+    else
+        printf("%d queries FAILED\n", nFailures);
+    return (nFailures != 0) ? 1 : 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Vertex layout benchmark. First, without GL, a grid of a million vertices
+// is walked in index order the way a vertex shader would, reading the
+// position, normal and texture coordinate of each vertex, from separate
+// arrays and then from one interleaved array. Then the same sort of grid,
+// smaller, goes into two CVBOMeshes, one of each layout, and each is drawn
+// a number of times. In a small viewport, so it's mostly the vertices that
+// are timed. Returns 1 if the two walks don't add up to the same thing, or
+// there's a GL error.
+//
+//      sphereworld -vbobench
+//
+#define VBOBENCH_WALK_GRID  1023        // Quads along a side, a million vertices
+#define VBOBENCH_DRAW_GRID  255
+#define VBOBENCH_WALKS      5
+#define VBOBENCH_FRAMES     20
+
+// A shader's worth of work for one vertex, the same whichever layout it came from
+inline float VBOBenchShade(const M3DMatrix44f m, const float *pVert, const float *pNorm, const float *pTex)
+    {
+    M3DVector3f vEye;
+    m3dTransformVector3(vEye, pVert, m);
+    return vEye[2] + m3dDotProduct(pNorm, fLightPos) * pTex[0] + pTex[1];
+    }
+
+int RunVBOBenchmark(void)
+    {
+    CStopWatch timer;
+    M3DMatrix44f mModelView;
+    int x, y, k, nResult = 0;
+    GLuint i;
+
+    static const int iCorners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+    m3dRotationMatrix44(mModelView, 0.5f, 0.0f, 1.0f, 0.0f);
+
+    // The grid, one vertex per grid point
+    const int nSide = VBOBENCH_WALK_GRID + 1;
+    GLuint nNumVerts = GLuint(nSide * nSide);
+    GLuint nNumIndexes = VBOBENCH_WALK_GRID * VBOBENCH_WALK_GRID * 6;
+    M3DVector3f *pVerts = new M3DVector3f[nNumVerts];
+    M3DVector3f *pNorms = new M3DVector3f[nNumVerts];
+    M3DVector2f *pTexCoords = new M3DVector2f[nNumVerts];
+    GLfloat *pInterleaved = new GLfloat[nNumVerts * MESH_VERTEX_FLOATS];
+    GLuint *pIndexes = new GLuint[nNumIndexes];
+
+    for(y = 0; y < nSide; y++)
+        for(x = 0; x < nSide; x++)
+            WeldBenchPoint(x, y, VBOBENCH_WALK_GRID, pVerts[y * nSide + x], pNorms[y * nSide + x], pTexCoords[y * nSide + x]);
+    meshInterleave(pInterleaved, pVerts, pNorms, pTexCoords, nNumVerts);
+
+    i = 0;
+    for(y = 0; y < VBOBENCH_WALK_GRID; y++)
+        for(x = 0; x < VBOBENCH_WALK_GRID; x++)
+            for(k = 0; k < 6; k++)
+                pIndexes[i++] = GLuint((y + iCorners[k][1]) * nSide + x + iCorners[k][0]);
+
+    printf("%u vertices, %u triangles\n", nNumVerts, nNumIndexes / 3);
+    printf("%-24s %10s\n", "", "ms");
+
+    float fSums[2] = { 0.0f, 0.0f };
+    for(int iLayout = 0; iLayout < 2; iLayout++)
+        {
+        timer.Reset();
+        for(int iWalk = 0; iWalk < VBOBENCH_WALKS; iWalk++)
+            {
+            float fSum = 0.0f;
+            if(iLayout == 0)
+                {
+                for(i = 0; i < nNumIndexes; i++)
+                    fSum += VBOBenchShade(mModelView, pVerts[pIndexes[i]], pNorms[pIndexes[i]], pTexCoords[pIndexes[i]]);
+                }
+            else
+                {
+                for(i = 0; i < nNumIndexes; i++)
+                    {
+                    const GLfloat *pVertex = &pInterleaved[pIndexes[i] * MESH_VERTEX_FLOATS];
+                    fSum += VBOBenchShade(mModelView, pVertex, pVertex + MESH_NORMAL_OFFSET, pVertex + MESH_TEXCOORD_OFFSET);
+                    }
+                }
+            fSums[iLayout] = fSum;
+            }
+        printf("%-24s %10.2f\n", (iLayout == 0) ? "walk, separate" : "walk, interleaved",
+               timer.GetElapsedSeconds() * 1000.0f / VBOBENCH_WALKS);
+        }
+
+    if(fSums[0] != fSums[1])
+        {
+        printf("    FAILED: the walks came to %f and %f\n", fSums[0], fSums[1]);
+        nResult = 1;
+        }
+
+    delete [] pVerts;
+    delete [] pNorms;
+    delete [] pTexCoords;
+    delete [] pInterleaved;
+    delete [] pIndexes;
+
+    // Now through GL
+    CVBOMesh meshes[2];
+    for(int iLayout = 0; iLayout < 2; iLayout++)
+        {
+        meshes[iLayout].BeginMesh(VBOBENCH_DRAW_GRID * VBOBENCH_DRAW_GRID * 6);
+        for(y = 0; y < VBOBENCH_DRAW_GRID; y++)
+            for(x = 0; x < VBOBENCH_DRAW_GRID; x++)
+                for(k = 0; k < 6; k += 3)
+                    {
+                    M3DVector3f vVerts[3], vNorms[3];
+                    M3DVector2f vTex[3];
+                    for(int j = 0; j < 3; j++)
+                        WeldBenchPoint(x + iCorners[k + j][0], y + iCorners[k + j][1], VBOBENCH_DRAW_GRID,
+                                       vVerts[j], vNorms[j], vTex[j]);
+                    meshes[iLayout].AddTriangle(vVerts, vNorms, vTex);
+                    }
+        meshes[iLayout].EndMesh((iLayout == 0) ? MESH_OPTIMIZE : (MESH_INTERLEAVED | MESH_OPTIMIZE));
+        }
+
+    glViewport(0, 0, 64, 64);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0.0, VBOBENCH_DRAW_GRID, 0.0, VBOBENCH_DRAW_GRID, -10.0, 10.0);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+
+    for(int iLayout = 0; iLayout < 2; iLayout++)
+        {
+        // One to get going, then the timed ones
+        for(int iFrame = 0; iFrame <= VBOBENCH_FRAMES; iFrame++)
+            {
+            if(iFrame == 1)
+                timer.Reset();
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            meshes[iLayout].Draw();
+            glFinish();
+            }
+        printf("%-24s %10.2f\n", (iLayout == 0) ? "draw, separate" : "draw, interleaved",
+               timer.GetElapsedSeconds() * 1000.0f / VBOBENCH_FRAMES);
+        }
+
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    if(glGetError() != GL_NO_ERROR)
+        {
+        printf("GL error\n");
+        nResult = 1;
+        }
+
+    return nResult;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Job system benchmark. Times the per-frame CPU work for a crowd of actors,
+// spread over 1, 2, ... N threads: move every actor, cull it against the
+// view frustum, and queue up a draw in a CRenderQueue for each one in view,
+// with its own modelview matrix. It's the same chunked crowd the spheres
+// use (see CROWD), only the queue items are made on the worker threads
+// too: Reserve() makes room for every visible actor once they are counted,
+// then each chunk fills in its own with SubmitAt(). No GL is involved, the
+// queue is never flushed, only the render thread would ever do that.
+#define JOBBENCH_FRAMES     20      // Timed frames per test
+
+struct JOBBENCH
+    {
+    CROWD           *pCrowd;
+    CRenderQueue    *pQueue;
+    GLuint          iFirstItem;     // From Reserve()
+    RENDERSTATE     state;
+    M3DMatrix44f    mView;
+    };
+
+// Render queue callback for one sphere on its own, the actor's transform
+// is already in the modelview matrix
+void DrawSphere(const void *pData, GLint iParam)
+    {
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+    sphereMesh.Draw();
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+    }
+
+void QueueCrowdChunks(void *pData, GLuint nFirst, GLuint nLast)
+    {
+    JOBBENCH *pBench = (JOBBENCH *)pData;
+    CROWD *pCrowd = pBench->pCrowd;
+    M3DMatrix44f mActor, mModelView;
+
+    for(GLuint iChunk = nFirst; iChunk < nLast; iChunk++)
+        {
+        const GLuint *pList = &pCrowd->pVisible[iChunk * CROWD_CHUNK];
+        GLuint iItem = pBench->iFirstItem + pCrowd->pChunkStarts[iChunk];
+
+        for(GLuint i = 0; i < pCrowd->pChunkCounts[iChunk]; i++)
+            {
+            GLFrame *pActor = &pCrowd->pActors[pList[i]];
+            pActor->GetMatrix(mActor);
+            m3dMatrixMultiply44(mModelView, pBench->mView, mActor);
+            pBench->pQueue->SubmitAt(iItem + i, pBench->state, mModelView, DrawSphere, pActor, 0);
+            }
+        }
+    }
+
+// Prints a table of milliseconds per frame, and the speed up over one thread
+int RunJobBenchmark(int nMaxThreads)
+    {
+    static const GLuint nActorCounts[] = { 10000, 100000, 1000000 };
+    CJobScheduler jobs;
+    CStopWatch benchTimer;
+    M3DFrustum frustum(50.0f, 16.0f / 9.0f, 1.0f, 100.0f);
+
+    if(nMaxThreads <= 0)
+        nMaxThreads = CJobScheduler::GetCoreCount();
+    if(nMaxThreads > JOB_MAX_THREADS)
+        nMaxThreads = JOB_MAX_THREADS;
+
+    printf("%d cores\n", CJobScheduler::GetCoreCount());
+    printf("actors   threads  ms/frame  speedup  queued   steals\n");
+
+    for(int iTest = 0; iTest < 3; iTest++)
+        {
+        GLuint nNumActors = nActorCounts[iTest];
+        GLFrame *pActors = new GLFrame[nNumActors];
+        CROWD crowd;
+        CRenderQueue queue;
+        JOBBENCH bench;
+        float fOneThread = 0.0f;
+
+        CrowdInit(&crowd, pActors, nNumActors, 0.1f, &frustum);
+        bench.pCrowd = &crowd;
+        bench.pQueue = &queue;
+        bench.state.nPass = PASS_INHABITANTS;
+        bench.state.hShader = 0;
+        bench.state.nTexture = 0;
+        bench.state.nFlags = RQ_LIGHTING | RQ_DEPTH_TEST;
+        bench.state.fColor[0] = bench.state.fColor[1] = bench.state.fColor[2] = bench.state.fColor[3] = 1.0f;
+        m3dLoadIdentity44(bench.mView);
+
+        for(int nThreads = 1; nThreads <= nMaxThreads; nThreads++)
+            {
+            // Same crowd every time
+            srand(0);
+            for(GLuint i = 0; i < nNumActors; i++)
+                {
+                pActors[i].SetOrigin(float(rand() % 2000 - 1000) * 0.1f, float(rand() % 200 - 100) * 0.1f,
+                                     float(rand() % 2000 - 1000) * 0.1f);
+                pActors[i].SetForwardVector(0.0f, 0.0f, -1.0f);
+                pActors[i].SetUpVector(0.0f, 1.0f, 0.0f);
+                pActors[i].RotateLocalY(float(rand() % 628) * 0.01f);
+                }
+
+            jobs.Start(nThreads);
+
+            // One to warm up, then the timed frames
+            GLuint nQueued = 0;
+            for(int iFrame = 0; iFrame <= JOBBENCH_FRAMES; iFrame++)
+                {
+                if(iFrame == 1)
+                    benchTimer.Reset();
+
+                queue.Clear();
+                jobs.ParallelFor(MoveCrowdChunks, &crowd, crowd.nNumChunks, 1);
+                jobs.ParallelFor(CullCrowdChunks, &crowd, crowd.nNumChunks, 1);
+                bench.iFirstItem = queue.Reserve(GatherCrowd(&crowd));
+                jobs.ParallelFor(QueueCrowdChunks, &bench, crowd.nNumChunks, 1);
+
+                // This is where the render thread would Flush()
+                nQueued = queue.GetItemCount();
+                }
+            float fMilliseconds = benchTimer.GetElapsedSeconds() * 1000.0f / JOBBENCH_FRAMES;
+
+            if(nThreads == 1)
+                fOneThread = fMilliseconds;
+
+            printf("%-8u %-8d %-9.3f %-8.2f %-8u %ld\n", nNumActors, jobs.GetThreadCount(), fMilliseconds,
+                   (fMilliseconds > 0.0f) ? fOneThread / fMilliseconds : 0.0f, nQueued, jobs.GetStealCount());
+            jobs.Stop();
+            }
+
+        queue.Clear();
+        CrowdFree(&crowd);
+        delete [] pActors;
+        }
+
+    return 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Image loading benchmark. Loads each of the scene's textures nLoops times,
+// with gltLoadTGA() and with gltLoadTGAImage(), and reads every byte of
+// every image (as uploading it would, the mapped loader hasn't touched
+// them yet). Throughput is image bytes delivered per second. Files that
+// are missing are skipped.
+int RunTGABenchmark(int nLoops)
+    {
+    CStopWatch loadTimer;
+    double dSeconds[2] = { 0.0, 0.0 };
+    double dBytes[2] = { 0.0, 0.0 };
+    unsigned long nChecksums[2] = { 0, 0 };
+
+    for(int iLoader = 0; iLoader < 2; iLoader++)
+        {
+        loadTimer.Reset();
+        for(int iLoop = 0; iLoop < nLoops; iLoop++)
+            for(int i = 0; i < NUM_TEXTURES; i++)
+                {
+                GLint iWidth, iHeight, iComponents;
+                GLenum eFormat;
+                GLTIMAGE image;
+                GLbyte *pBits;
+
+                if(iLoader == 0)
+                    pBits = gltLoadTGA(szTextureFiles[i], &iWidth, &iHeight, &iComponents, &eFormat);
+                else
+                    {
+                    pBits = gltLoadTGAImage(szTextureFiles[i], &image) ? image.pBits : NULL;
+                    iWidth = image.iWidth;
+                    iHeight = image.iHeight;
+                    eFormat = image.eFormat;
+                    }
+
+                if(pBits == NULL)
+                    continue;
+
+                unsigned long nSize = iWidth * iHeight * ((eFormat == GL_LUMINANCE) ? 1 : ((eFormat == GL_BGRA_EXT) ? 4 : 3));
+                const GLubyte *pBytes = (const GLubyte *)pBits;
+                unsigned long nSum = 0;
+                for(unsigned long j = 0; j < nSize; j++)
+                    nSum += pBytes[j];
+                nChecksums[iLoader] += nSum;
+                dBytes[iLoader] += double(nSize);
+
+                if(iLoader == 0)
+                    free(pBits);
+                else
+                    gltFreeImage(&image);
+                }
+        dSeconds[iLoader] = double(loadTimer.GetElapsedNanoseconds()) * 0.000000001;
+        }
+
+    for(int iLoader = 0; iLoader < 2; iLoader++)
+        printf("%-16s %8.1f MB in %7.3f s, %8.1f MB/s\n", (iLoader == 0) ? "gltLoadTGA" : "gltLoadTGAImage",
+               dBytes[iLoader] / 1048576.0, dSeconds[iLoader],
+               (dSeconds[iLoader] > 0.0) ? dBytes[iLoader] / 1048576.0 / dSeconds[iLoader] : 0.0);
+
+    if(nChecksums[0] != nChecksums[1])
+        printf("The loaders don't agree on the pixels\n");
+
+    return 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Mipmap benchmark. Builds and uploads the mipmaps for each of the scene's
+// textures nLoops times, with gluBuild2DMipmaps() and then with CMipChain
+// in its various modes. GLU does both at once, so that's the time to
+// compare. For CMipChain the time spent building the chain is shown too.
+// The last row reads the chains back from .mip files, which are deleted
+// again afterwards.
+#define MIPBENCH_GLU        -1
+#define MIPBENCH_CACHED     -2
+
+// The benchmark's own .mip files, so it leaves the real ones alone
+void GetBenchCacheName(const char *szFileName, char *szCacheName, int nMaxLength)
+    {
+    CMipChain::GetCacheName(szFileName, szCacheName, nMaxLength - 6);
+    if(szCacheName[0] != '\0')
+        strcat(szCacheName, ".bench");
+    }
+
+int RunMipBenchmark(int nLoops)
+    {
+    GLTIMAGE images[NUM_TEXTURES];
+    CJobScheduler jobs;
+    CStopWatch timer;
+    GLuint nTexture;
+    char szCacheName[512];
+    int i;
+
+    struct
+        {
+        const char  *szName;
+        int         nFlags;             // Or MIPBENCH_GLU/MIPBENCH_CACHED
+        bool        bThreads;
+        } tests[] = { { "gluBuild2DMipmaps", MIPBENCH_GLU, false },
+                      { "box", 0, false },
+                      { "box, sRGB", MIP_SRGB, false },
+                      { "Kaiser, sRGB", MIP_KAISER | MIP_SRGB, false },
+                      { "box, sRGB, threads", MIP_SRGB, true },
+                      { "Kaiser, sRGB, threads", MIP_KAISER | MIP_SRGB, true },
+                      { ".mip files", MIPBENCH_CACHED, false } };
+
+    GLuint nPowerOfTwo = GLEE_ARB_texture_non_power_of_two ? 0 : MIP_POWER_OF_TWO;
+    double dMegaTexels = 0.0;
+    for(i = 0; i < NUM_TEXTURES; i++)
+        if(gltLoadTGAImage(szTextureFiles[i], &images[i]))
+            dMegaTexels += double(images[i].iWidth) * double(images[i].iHeight) / 1000000.0;
+
+    jobs.Start();
+    glGenTextures(1, &nTexture);
+    glBindTexture(GL_TEXTURE_2D, nTexture);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+    // Get any one time driver costs out of the way
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGBA8, 4, 4, GL_RGBA, GL_UNSIGNED_BYTE, images[0].pBits ? images[0].pBits : (GLbyte *)fLowLight);
+
+    printf("%.2f megatexels, %d threads\n", dMegaTexels, jobs.GetThreadCount());
+    printf("%-24s %10s %10s\n", "", "total ms", "build ms");
+    for(int iTest = 0; iTest < int(sizeof(tests) / sizeof(tests[0])); iTest++)
+        {
+        double dTotal = 0.0, dBuild = 0.0;
+        GLuint nFlags = GLuint(tests[iTest].nFlags) | nPowerOfTwo;
+
+        // Write the .mip files first
+        if(tests[iTest].nFlags == MIPBENCH_CACHED)
+            {
+            nFlags = MIP_KAISER | MIP_SRGB | nPowerOfTwo;
+            for(i = 0; i < NUM_TEXTURES; i++)
+                {
+                CMipChain mips;
+                GetBenchCacheName(szTextureFiles[i], szCacheName, sizeof(szCacheName));
+                if(szCacheName[0] != '\0' && mips.BuildFromTGA(szTextureFiles[i], nFlags, false))
+                    mips.Save(szCacheName, szTextureFiles[i]);
+                }
+            }
+
+        for(int iLoop = 0; iLoop < nLoops; iLoop++)
+            for(i = 0; i < NUM_TEXTURES; i++)
+                {
+                GLTIMAGE *pImage = &images[i];
+                if(pImage->pBits == NULL)
+                    continue;
+
+                timer.Reset();
+                if(tests[iTest].nFlags == MIPBENCH_GLU)
+                    gluBuild2DMipmaps(GL_TEXTURE_2D, pImage->iComponents, pImage->iWidth, pImage->iHeight,
+                                      pImage->eFormat, GL_UNSIGNED_BYTE, pImage->pBits);
+                else
+                    {
+                    CMipChain mips;
+                    if(tests[iTest].nFlags == MIPBENCH_CACHED)
+                        {
+                        // What BuildFromTGA() does with a cache
+                        GetBenchCacheName(szTextureFiles[i], szCacheName, sizeof(szCacheName));
+                        if(!mips.Load(szCacheName, szTextureFiles[i], nFlags))
+                            mips.BuildFromTGA(szTextureFiles[i], nFlags, false);
+                        }
+                    else
+                        mips.Build(pImage->pBits, pImage->iWidth, pImage->iHeight, pImage->eFormat, nFlags,
+                                   tests[iTest].bThreads ? &jobs : NULL);
+                    dBuild += double(timer.GetElapsedNanoseconds()) * 0.000001;
+                    mips.Upload();
+                    }
+                glFinish();
+                dTotal += double(timer.GetElapsedNanoseconds()) * 0.000001;
+                }
+
+        if(tests[iTest].nFlags == MIPBENCH_GLU)
+            printf("%-24s %10.2f %10s\n", tests[iTest].szName, dTotal / nLoops, "-");
+        else
+            printf("%-24s %10.2f %10.2f\n", tests[iTest].szName, dTotal / nLoops, dBuild / nLoops);
+        }
+
+    // Tidy up the benchmark's cache files
+    for(i = 0; i < NUM_TEXTURES; i++)
+        {
+        GetBenchCacheName(szTextureFiles[i], szCacheName, sizeof(szCacheName));
+        if(images[i].pBits != NULL && szCacheName[0] != '\0')
+            remove(szCacheName);
+        gltFreeImage(&images[i]);
+        }
+
+    glDeleteTextures(1, &nTexture);
+    jobs.Stop();
+    return 0;
+    }
+
+///////////////////////////////////////////////////////////////////////////////
+// Block compression benchmark, no GL needed. Each of the scene's textures
+// has its mipmap chain built, then every level is compressed nLoops times,
+// on this thread alone and then shared out between all the cores. Shows
+// how much memory compression saves against the uncompressed chain as the
+// card keeps it (GL_RGB8 is padded out to four bytes a texel just like
+// GL_RGBA8 by just about every driver), and the top level's PSNR after a
+// round trip, to see what it cost.
+int RunCompressBenchmark(int nLoops)
+    {
+    CJobScheduler jobs;
+    CStopWatch timer;
+    double dTotalRaw = 0.0, dTotalCompressed = 0.0, dTotalTexels = 0.0;
+    double dTotalMs = 0.0, dTotalThreadMs = 0.0;
+
+    jobs.Start();
+    printf("%d threads\n", jobs.GetThreadCount());
+    printf("%-12s %10s %4s %9s %9s %6s %9s %9s %7s\n", "Texture", "size", "", "raw KB", "BC KB", "saved",
+           "Mtex/s", "threaded", "PSNR");
+
+    for(int i = 0; i < NUM_TEXTURES; i++)
+        {
+        GLTIMAGE image;
+        CMipChain mips;
+        int iLevel;
+
+        if(!gltLoadTGAImage(szTextureFiles[i], &image))
+            continue;
+        mips.Build(image.pBits, image.iWidth, image.iHeight, image.eFormat, MIP_SRGB);
+        gltFreeImage(&image);
+
+        GLenum eFormat = mips.GetFormat();
+        GLenum eCompressed = bcChooseFormat(mips.GetLevel(0), mips.GetWidth(0), mips.GetHeight(0), eFormat);
+        GLuint nTexelBytes = (eFormat == GL_LUMINANCE) ? 1 : 4;
+        double dTexels = 0.0, dRaw = 0.0, dCompressed = 0.0;
+        GLuint nOffsets[MIP_MAX_LEVELS];
+        GLuint nBlockBytes = 0;
+
+        for(iLevel = 0; iLevel < mips.GetLevelCount(); iLevel++)
+            {
+            GLint w = mips.GetWidth(iLevel), h = mips.GetHeight(iLevel);
+            dTexels += double(w) * double(h);
+            dRaw += double(w) * double(h) * nTexelBytes;
+            nOffsets[iLevel] = nBlockBytes;
+            nBlockBytes += bcGetCompressedSize(w, h, eCompressed);
+            }
+        dCompressed = double(nBlockBytes);
+        GLubyte *pBlocks = new GLubyte[nBlockBytes];
+
+        double dMs[2];
+        for(int iThreads = 0; iThreads < 2; iThreads++)
+            {
+            timer.Reset();
+            for(int iLoop = 0; iLoop < nLoops; iLoop++)
+                for(iLevel = 0; iLevel < mips.GetLevelCount(); iLevel++)
+                    bcCompressImage(mips.GetLevel(iLevel), mips.GetWidth(iLevel), mips.GetHeight(iLevel), eFormat,
+                                    eCompressed, pBlocks + nOffsets[iLevel], iThreads ? &jobs : NULL);
+            dMs[iThreads] = double(timer.GetElapsedNanoseconds()) * 0.000001 / nLoops;
+            }
+
+        // Decode the top level again and compare, color channels only
+        GLint nWidth = mips.GetWidth(0), nHeight = mips.GetHeight(0);
+        GLint nPixelSize = (eFormat == GL_LUMINANCE) ? 1 : ((eFormat == GL_RGB || eFormat == GL_BGR_EXT) ? 3 : 4);
+        bool bBGR = (eFormat == GL_BGR_EXT || eFormat == GL_BGRA_EXT);
+        GLubyte *pDecoded = new GLubyte[nWidth * nHeight * 4];
+        bcDecompressImage(pBlocks, nWidth, nHeight, eCompressed, pDecoded);
+
+        const GLubyte *pSource = mips.GetLevel(0);
+        double dSquares = 0.0;
+        for(GLint t = 0; t < nWidth * nHeight; t++)
+            for(int c = 0; c < 3; c++)
+                {
+                int iSource = (nPixelSize == 1) ? 0 : ((bBGR && c != 1) ? 2 - c : c);
+                double d = double(pDecoded[t * 4 + c]) - double(pSource[t * nPixelSize + iSource]);
+                dSquares += d * d;
+                }
+        double dMSE = dSquares / (double(nWidth) * double(nHeight) * 3.0);
+        double dPSNR = (dMSE > 0.0) ? 10.0 * log10(255.0 * 255.0 / dMSE) : 99.0;
+
+        char szSize[32];
+        sprintf(szSize, "%dx%d", nWidth, nHeight);
+        printf("%-12s %10s %4s %9.1f %9.1f %5.1f%% %9.2f %9.2f %7.2f\n", szTextureFiles[i], szSize,
+               (eCompressed == GL_COMPRESSED_RGB_S3TC_DXT1_EXT) ? "BC1" : "BC3", dRaw / 1024.0, dCompressed / 1024.0,
+               100.0 * (1.0 - dCompressed / dRaw), dTexels / (dMs[0] * 1000.0), dTexels / (dMs[1] * 1000.0), dPSNR);
+
+        dTotalRaw += dRaw;
+        dTotalCompressed += dCompressed;
+        dTotalTexels += dTexels;
+        dTotalMs += dMs[0];
+        dTotalThreadMs += dMs[1];
+        delete [] pDecoded;
+        delete [] pBlocks;
+        }
+
+    if(dTotalTexels > 0.0)
+        printf("%-12s %10s %4s %9.1f %9.1f %5.1f%% %9.2f %9.2f\n", "all", "", "", dTotalRaw / 1024.0,
+               dTotalCompressed / 1024.0, 100.0 * (1.0 - dTotalCompressed / dTotalRaw),
+               dTotalTexels / (dTotalMs * 1000.0), dTotalTexels / (dTotalThreadMs * 1000.0));
+
+    jobs.Stop();
+    return 0;
+    }
+
+int main(int argc, char* argv[])
+    {
+    int nHeadlessFrames = 0;
+    int nWidth = 1280, nHeight = 720;
+    const char *szTimings = NULL;
+    const char *szDumpPrefix = NULL;
+    const char *szProfile = NULL;
+    int nJobBenchThreads = -1;
+    int nTGABenchLoops = 0;
+    int nMipBenchLoops = 0;
+    int nBCBenchLoops = 0;
+    int nCogBenchLoops = 0;
+    bool bWeldBench = false;
+    bool bVBOBench = false;
+    bool bPrimTest = false;
+    bool bCacheReport = false;
+    bool bBVHTest = false;
+    bool bMathTest = false;
+    int nInstBenchActors = 0;
+
+    for(int i = 1; i < argc; i++)
+        {
+        if(strcmp(argv[i], "-headless") == 0 && i + 1 < argc)
+            nHeadlessFrames = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-size") == 0 && i + 2 < argc)
+            {
+            nWidth = atoi(argv[++i]);
+            nHeight = atoi(argv[++i]);
+            }
+        else if(strcmp(argv[i], "-timings") == 0 && i + 1 < argc)
+            szTimings = argv[++i];
+        else if(strcmp(argv[i], "-dump") == 0 && i + 1 < argc)
+            szDumpPrefix = argv[++i];
+        else if(strcmp(argv[i], "-fps") == 0 && i + 1 < argc)
+            {
+            int nRate = atoi(argv[++i]);
+            if(nRate > 0)
+                {
+                fHeadlessTimestep = 1.0f / float(nRate);
+                nFrameInterval = 1000 / nRate;
+                }
+            }
+        else if(strcmp(argv[i], "-rate") == 0 && i + 1 < argc)
+            {
+            int nRate = atoi(argv[++i]);
+            nFrameInterval = (nRate > 0) ? 1000 / nRate : 0;
+            }
+        else if(strcmp(argv[i], "-profile") == 0 && i + 1 < argc)
+            szProfile = argv[++i];
+        else if(strcmp(argv[i], "-noatlas") == 0)
+            bUseAtlases = false;
+        else if(strcmp(argv[i], "-nostream") == 0)
+            bStreamTextures = false;
+        else if(strcmp(argv[i], "-nosort") == 0)
+            renderQueue.SetSorting(false);
+        else if(strcmp(argv[i], "-mipfilter") == 0 && i + 1 < argc)
+            {
+            i++;
+            if(strcmp(argv[i], "kaiser") == 0)
+                nMipFlags |= MIP_KAISER;
+            else
+                nMipFlags &= ~MIP_KAISER;
+            }
+        else if(strcmp(argv[i], "-nosrgbmips") == 0)
+            nMipFlags &= ~MIP_SRGB;
+        else if(strcmp(argv[i], "-crowd") == 0 && i + 1 < argc)
+            {
+            int nCrowd = atoi(argv[++i]);
+            if(nCrowd > 0)
+                {
+                nNumSpheres = GLuint(nCrowd);
+                bCrowd = true;
+                }
+            }
+        else if(strcmp(argv[i], "-planarshadows") == 0)
+            bShadowMaps = false;
+        else if(strcmp(argv[i], "-prepass") == 0)
+            bDepthPrepass = true;
+        else if(strcmp(argv[i], "-overdraw") == 0)
+            {
+            bCountOverdraw = true;
+            renderQueue.SetOverdrawCounting(true);
+            }
+        else if(strcmp(argv[i], "-nocompress") == 0)
+            nMipFlags &= ~MIP_COMPRESS;
+        else if(strcmp(argv[i], "-mipcache") == 0)
+            bMipCache = true;
+        else if(strcmp(argv[i], "-meshcache") == 0)
+            bMeshCache = true;
+        else if(strcmp(argv[i], "-mipbench") == 0 && i + 1 < argc)
+            nMipBenchLoops = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-bcbench") == 0 && i + 1 < argc)
+            nBCBenchLoops = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-cogbench") == 0 && i + 1 < argc)
+            nCogBenchLoops = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-weldbench") == 0)
+            bWeldBench = true;
+        else if(strcmp(argv[i], "-vbobench") == 0)
+            bVBOBench = true;
+        else if(strcmp(argv[i], "-primtest") == 0)
+            bPrimTest = true;
+        else if(strcmp(argv[i], "-acmr") == 0)
+            bCacheReport = true;
+        else if(strcmp(argv[i], "-bvhtest") == 0)
+            bBVHTest = true;
+        else if(strcmp(argv[i], "-instbench") == 0 && i + 1 < argc)
+            nInstBenchActors = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-mathtest") == 0)
+            bMathTest = true;
+        else if(strcmp(argv[i], "-tgabench") == 0 && i + 1 < argc)
+            nTGABenchLoops = atoi(argv[++i]);
+        else if(strcmp(argv[i], "-jobbench") == 0)
+            {
+            // Optional thread count, otherwise all the cores
+            nJobBenchThreads = 0;
+            if(i + 1 < argc && argv[i + 1][0] != '-')
+                nJobBenchThreads = atoi(argv[++i]);
+            }
+        }
+
+    if(bMathTest)
+        return RunMathTest();
+    if(nJobBenchThreads >= 0)
+        return RunJobBenchmark(nJobBenchThreads);
+    if(nTGABenchLoops > 0)
+        return RunTGABenchmark(nTGABenchLoops);
+    if(nBCBenchLoops > 0)
+        return RunCompressBenchmark(nBCBenchLoops);
+    if(bWeldBench)
+        return RunWeldBenchmark();
+    if(bCacheReport)
+        return RunCacheReport();
+    if(bBVHTest)
+        return RunBVHTest();
+
+    // GLU needs somewhere to put its mipmaps, and the cogs their buffer objects
+    if(nMipBenchLoops > 0 || nCogBenchLoops > 0)
+        {
+        if(!CreateHeadlessContext(&argc, argv))
+            {
+            fprintf(stderr, "Can't create an offscreen rendering context\n");
+            return 1;
+            }
+        int nResult = (nMipBenchLoops > 0) ? RunMipBenchmark(nMipBenchLoops) : RunCogBenchmark(nCogBenchLoops);
+        DestroyHeadlessContext();
+        return nResult;
+        }
+
+    if(nInstBenchActors > 0 || bVBOBench || bPrimTest || nHeadlessFrames > 0)
+        {
+        if(!CreateHeadlessContext(&argc, argv))
+            {
+            fprintf(stderr, "Can't create an offscreen rendering context\n");
+            return 1;
+            }
+
+        if(!CreateHeadlessBuffer(nWidth, nHeight))
+            {
+            fprintf(stderr, "Can't create an offscreen framebuffer\n");
+            DestroyHeadlessContext();
+            return 1;
+            }
+
+        if(nInstBenchActors > 0 || bVBOBench || bPrimTest)
+            {
+            int nResult;
+            if(bPrimTest)
+                nResult = RunPrimitiveTest();
+            else
+                nResult = bVBOBench ? RunVBOBenchmark() : RunInstanceBenchmark(nInstBenchActors, nWidth, nHeight);
+            DestroyHeadlessBuffer();
+            DestroyHeadlessContext();
+            return nResult;
+            }
+
+        startupClock.Reset();
+        SetupRC();
+        ChangeSize(nWidth, nHeight);
+        int nResult = RunHeadless(nHeadlessFrames, szTimings, szDumpPrefix);
+        if(szProfile != NULL)
+            {
+            size_t nLength = strlen(szProfile);
+            bool bJSON = (nLength > 5 && strcmp(szProfile + nLength - 5, ".json") == 0);
+            if(!(bJSON ? profiler.WriteJSON(szProfile) : profiler.WriteCSV(szProfile)))
+                {
+                fprintf(stderr, "Can't write %s\n", szProfile);
+                nResult = 1;
+                }
+            }
+        ShutdownRC();
+
+        DestroyHeadlessBuffer();
+        DestroyHeadlessContext();
+        return nResult;
+        }
+
     glutInit(&argc, argv);
     glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_STENCIL);
     glutInitWindowSize(1280,720);
     glutCreateWindow("OpenGL SphereWorld Demo + Texture ");
     glutReshapeFunc(ChangeSize);
-    glutDisplayFunc(RenderScene);
+    glutDisplayFunc(DrawFrame);
     glutSpecialFunc(SpecialKeys);
 
     SetupRC();
+    frameClock.Reset();
     glutTimerFunc(33, TimerFunction, 1);
 
     glutMainLoop();